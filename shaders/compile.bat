@@ -3,9 +3,14 @@
 "C:/Program Files/Vulkan/Bin/glslc.exe" skybox.vert -o skyboxVert.spv
 "C:/Program Files/Vulkan/Bin/glslc.exe" skybox.frag -o skyboxFrag.spv
 "C:/Program Files/Vulkan/Bin/glslc.exe" meshPBR.frag -o meshPBRFrag.spv
-"C:/Program Files/Vulkan/Bin/glslc.exe" depthMap.vert -o depthMapVert.spv
-"C:/Program Files/Vulkan/Bin/glslc.exe" depthMap.geom -o depthMapGeom.spv
-"C:/Program Files/Vulkan/Bin/glslc.exe" depthMap.frag -o depthMapFrag.spv
+"C:/Program Files/Vulkan/Bin/glslc.exe" -DWEIGHTED_BLENDED meshPBR.frag -o meshPBRTransparentFrag.spv
+"C:/Program Files/Vulkan/Bin/glslc.exe" --target-env=vulkan1.2 depthMap.vert -o depthMapVert.spv
 "C:/Program Files/Vulkan/Bin/glslc.exe" particle.vert -o particleVert.spv
 "C:/Program Files/Vulkan/Bin/glslc.exe" particle.frag -o particleFrag.spv
+"C:/Program Files/Vulkan/Bin/glslc.exe" cull.comp -o cullComp.spv
+"C:/Program Files/Vulkan/Bin/glslc.exe" cluster.comp -o clusterComp.spv
+"C:/Program Files/Vulkan/Bin/glslc.exe" particle_sim.comp -o particleSimComp.spv
+"C:/Program Files/Vulkan/Bin/glslc.exe" particle_sort.comp -o particleSortComp.spv
+"C:/Program Files/Vulkan/Bin/glslc.exe" transparent_composite.vert -o transparentCompositeVert.spv
+"C:/Program Files/Vulkan/Bin/glslc.exe" transparent_composite.frag -o transparentCompositeFrag.spv
 pause
\ No newline at end of file
@@ -1,5 +1,6 @@
 #version 450
 #extension GL_EXT_buffer_reference : require
+#extension GL_ARB_shader_viewport_layer_array : require
 
 struct Vertex {
 
@@ -14,12 +15,18 @@ layout(buffer_reference, std430) readonly buffer VertexBuffer{
 	Vertex vertices[];
 };
 
+layout(set = 0, binding = 0) uniform ShadowMatricies
+{   
+	mat4 matricies[6];
+} shadowMatricies;
+
 //push constants block
 layout( push_constant ) uniform constants
 {	
 	mat4 world_matrix;
 	vec4 lightPosition;
-    float shadowFarPlane;
+	float shadowFarPlane;
+	uint faces; // 3 bits per instance, the cube face that instance renders into
 	VertexBuffer vertexBuffer;
 } PushConstants;
 
@@ -28,6 +35,15 @@ void main()
 	//load vertex data from device adress
 	Vertex v = PushConstants.vertexBuffer.vertices[gl_VertexIndex];
 
-	//output data
-	gl_Position = PushConstants.world_matrix * vec4(v.position, 1.0f);
+	uint face = (PushConstants.faces >> (3 * gl_InstanceIndex)) & 7;
+
+	vec4 worldPosition = PushConstants.world_matrix * vec4(v.position, 1.0f);
+
+	gl_Position = shadowMatricies.matricies[face] * worldPosition;
+	gl_Layer = int(face);
+
+	// store the distance to the light mapped to [0;1] as hardware depth instead of writing gl_FragDepth,
+	// it is interpolated linearly across the triangle, the shadow bias absorbs the difference on large triangles
+	float lightDistance = length(worldPosition.xyz - PushConstants.lightPosition.xyz) / PushConstants.shadowFarPlane;
+	gl_Position.z = lightDistance * gl_Position.w;
 }
\ No newline at end of file
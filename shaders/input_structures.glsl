@@ -10,20 +10,92 @@ layout(set = 0, binding = 0) uniform  SceneData
 	float shadowFarPlane;
 	float attenuationFallOff;
 	float shadowBias;
-	int shadowAASamples;
+	uint padding; // the pcf sample count is a specialization constant of meshPBR.frag
 	float gridSamplingDiskModifier;
+	uvec4 clusterGrid; // xyz cluster counts, w list stride
+	vec4 clusterParams; // tile size in pixels, log depth scale and bias
 } sceneData;
 
-layout(set = 0, binding = 1) uniform samplerCube depthMap;
+// one cube array per shadow resolution tier, see ShadowAtlas in vk_shadows.h
+layout(set = 0, binding = 1) uniform samplerCubeArray shadowAtlas[4];
 
-layout(set = 1, binding = 0) uniform GLTFMaterialData
-{   
+// matches GPUPointLight in vk_shadows.h
+struct PointLight
+{
+	vec4 positionPower; // w power
+	vec4 colorRadius; // w shadow radius
+	int shadowTier; // -1 without a shadow
+	uint shadowCube;
+	uint padding[2];
+};
+
+layout(set = 0, binding = 2) uniform LightData
+{
+	uint lightCount;
+	uint padding[3];
+	PointLight lights[64];
+} lightData;
+
+// matches GPUClusterLight in vk_clusters.h
+struct ClusterLight
+{
+	vec4 positionRadius; // w range
+	vec4 colorIntensity;
+	vec4 viewPositionRadius;
+};
+
+layout(set = 0, binding = 3) readonly buffer ClusterLightBuffer
+{
+	ClusterLight lights[];
+} clusterLights;
+
+// per cluster a count followed by the light indices, written by cluster.comp
+layout(set = 0, binding = 4) readonly buffer ClusterListBuffer
+{
+	uint lists[];
+} clusterLists;
+
+// offset of the count of the froxel holding a fragment, the slice comes from the log of its view depth
+uint ClusterListStart(vec2 fragCoord, vec3 worldPosition)
+{
+	float viewDepth = -(sceneData.view * vec4(worldPosition, 1.0)).z;
+	uvec3 grid = sceneData.clusterGrid.xyz;
+
+	uvec3 cluster;
+	cluster.xy = min(uvec2(fragCoord / sceneData.clusterParams.xy), grid.xy - 1);
+	cluster.z = uint(clamp(log(max(viewDepth, 1e-4)) * sceneData.clusterParams.z + sceneData.clusterParams.w, 0.0, float(grid.z - 1)));
+
+	return (cluster.x + grid.x * (cluster.y + grid.y * cluster.z)) * sceneData.clusterGrid.w;
+}
+
+// matches GPUMaterialData in vk_bindless.h, shaders including this file need GL_EXT_nonuniform_qualifier
+struct MaterialData
+{
 	vec4 colorFactors;
 	vec4 metalRoughFactors;
-} materialData;
+	uint textures[5];
+	uint samplers[5];
+	uint padding[2];
+};
+
+layout(set = 1, binding = 0) readonly buffer MaterialBuffer
+{
+	MaterialData materials[];
+} materialBuffer;
+
+layout(set = 1, binding = 1) uniform texture2D textures[];
+layout(set = 1, binding = 2) uniform sampler samplers[];
+
+#define COLOR_TEXTURE 0
+#define METAL_ROUGH_TEXTURE 1
+#define NORMAL_TEXTURE 2
+#define OCCLUSION_TEXTURE 3
+#define EMISSION_TEXTURE 4
 
-layout(set = 1, binding = 1) uniform sampler2D colorTex;
-layout(set = 1, binding = 2) uniform sampler2D metalRoughTex;
-layout(set = 1, binding = 3) uniform sampler2D normalTex; 
-layout(set = 1, binding = 4) uniform sampler2D occlusionTex; 
-layout(set = 1, binding = 5) uniform sampler2D emissionTex; 
\ No newline at end of file
+// merged draws can mix materials inside a subgroup, so the indices are not uniform
+vec4 SampleMaterialTexture(uint materialIndex, uint slot, vec2 uv)
+{
+	uint textureIndex = materialBuffer.materials[materialIndex].textures[slot];
+	uint samplerIndex = materialBuffer.materials[materialIndex].samplers[slot];
+	return texture(sampler2D(textures[nonuniformEXT(textureIndex)], samplers[nonuniformEXT(samplerIndex)]), uv);
+}
\ No newline at end of file
@@ -2,45 +2,37 @@
 
 #extension GL_GOOGLE_include_directive : require
 #extension GL_EXT_buffer_reference : require
+#extension GL_EXT_nonuniform_qualifier : require
 
 #include "input_structures.glsl"
+#include "object_data.glsl"
 
 layout (location = 0) out vec3 outWorldPos;
 layout (location = 1) out vec3 outNormal;
 layout (location = 2) out vec3 outColor;
 layout (location = 3) out vec2 outUV;
-
-struct Vertex {
-
-	vec3 position;
-	float uv_x;
-	vec3 normal;
-	float uv_y;
-	vec4 color;
-}; 
-
-layout(buffer_reference, std430) readonly buffer VertexBuffer{ 
-	Vertex vertices[];
-};
+layout (location = 4) flat out uint outMaterialIndex;
 
 //push constants block
 layout( push_constant ) uniform constants
 {
-	mat4 renderMatrix;
-	VertexBuffer vertexBuffer;
+	ObjectBuffer objectBuffer;
 } PushConstants;
 
 void main() 
 {
-	Vertex v = PushConstants.vertexBuffer.vertices[gl_VertexIndex];
+	// firstInstance of every draw is the surface's slot in the pass's object records, written by cull.comp or the transparent draw loop
+	ObjectData object = PushConstants.objectBuffer.objects[gl_InstanceIndex];
+	Vertex v = object.vertexBuffer.vertices[gl_VertexIndex];
 	
 	vec4 position = vec4(v.position, 1.0f);
 
-	gl_Position =  sceneData.viewproj * PushConstants.renderMatrix *position;	
+	gl_Position =  sceneData.viewproj * object.transform *position;	
 
-	outWorldPos = vec4(PushConstants.renderMatrix * position).xyz;
-	outNormal = (PushConstants.renderMatrix * vec4(v.normal, 0.f)).xyz;
-	outColor = v.color.xyz * materialData.colorFactors.xyz;	
+	outWorldPos = vec4(object.transform * position).xyz;
+	outNormal = (object.transform * vec4(v.normal, 0.f)).xyz;
+	outColor = v.color.xyz * materialBuffer.materials[object.materialIndex].colorFactors.xyz;	
 	outUV.x = v.uv_x;
 	outUV.y = v.uv_y;
+	outMaterialIndex = object.materialIndex;
 }
\ No newline at end of file
@@ -1,18 +1,20 @@
 #version 450
 
 #extension GL_GOOGLE_include_directive : require
+#extension GL_EXT_nonuniform_qualifier : require
 #include "input_structures.glsl"
 
 layout (location = 0) in vec3 inFragPos;
 layout (location = 1) in vec3 inNormal;
 layout (location = 2) in vec3 inColor;
 layout (location = 3) in vec2 inUV;
+layout (location = 4) flat in uint inMaterialIndex;
 
 layout (location = 0) out vec4 outFragColor;
 
 void main() 
 {
-	vec3 color = inColor * texture(colorTex,inUV).xyz;
+	vec3 color = inColor * SampleMaterialTexture(inMaterialIndex, COLOR_TEXTURE, inUV).xyz;
 
 	vec3 ambient = color *  sceneData.ambientColor.xyz;
 
@@ -1,19 +1,31 @@
 #version 450
 
 #extension GL_GOOGLE_include_directive : require
+#extension GL_EXT_nonuniform_qualifier : require
 #include "input_structures.glsl"
 
 layout (location = 0) in vec3 inWorldPos;
 layout (location = 1) in vec3 inNormal;
 layout (location = 2) in vec3 inColor;
 layout (location = 3) in vec2 inUV;
+layout (location = 4) flat in uint inMaterialIndex;
 
-
+// compiled a second time with WEIGHTED_BLENDED for transparent materials
+#ifdef WEIGHTED_BLENDED
+#include "weighted_blended.glsl"
+#else
 layout (location = 0) out vec4 outFragColor;
+#endif
+
+// set per pipeline by GLTFMetallicRoughness, a feature switched off is compiled out along with its texture fetch
+layout (constant_id = 0) const int SHADOW_SAMPLES = 20; // 1 to 20 taps from gridSamplingDisk
+layout (constant_id = 1) const bool SHADOWS = true;
+layout (constant_id = 2) const bool NORMAL_MAP = true;
+layout (constant_id = 3) const bool EMISSION = true;
 
 const float PI = 3.14159265359;
 
-vec3 gridSamplingDisk[20] = vec3[]
+const vec3 gridSamplingDisk[20] = vec3[]
 (
    vec3(1, 1,  1), vec3( 1, -1,  1), vec3(-1, -1,  1), vec3(-1, 1,  1), 
    vec3(1, 1, -1), vec3( 1, -1, -1), vec3(-1, -1, -1), vec3(-1, 1, -1),
@@ -24,25 +36,32 @@ vec3 gridSamplingDisk[20] = vec3[]
 
 // ----------------------------------------------------------------------------
 
-float ShadowCalculation(vec3 worldPosition)
+float ShadowCalculation(PointLight light, vec3 worldPosition)
 {
-    vec3 fragToLight = worldPosition - sceneData.lightPosition.xyz;;
+    if (light.shadowTier < 0)
+        return 0.0;
+
+    vec3 fragToLight = worldPosition - light.positionPower.xyz;
+    float radius = light.colorRadius.w;
 
     float currentDepth = length(fragToLight);
+    if (currentDepth > radius)
+        return 0.0;
 
     float shadow = 0.0;
     float bias = sceneData.shadowBias;
-    int samples = sceneData.shadowAASamples;
     float viewDistance = length(sceneData.viewPosition - worldPosition);
-    float diskRadius = (1.0 + (viewDistance / sceneData.shadowFarPlane)) / 25.0; // first 25 is far plane for shadow;
-    for(int i = 0; i < samples; ++i)
+    float diskRadius = (1.0 + (viewDistance / radius)) / radius;
+    for(int i = 0; i < SHADOW_SAMPLES; ++i)
     {
-        float closestDepth = texture(depthMap, fragToLight + (gridSamplingDisk[i] * sceneData.gridSamplingDiskModifier) * diskRadius).r;
-        closestDepth *= sceneData.shadowFarPlane;   // 25 is far plane for shadow
+        // the tier is the same for the whole draw at each loop iteration, so a dynamically uniform index is enough
+        vec3 direction = fragToLight + (gridSamplingDisk[i] * sceneData.gridSamplingDiskModifier) * diskRadius;
+        float closestDepth = texture(shadowAtlas[light.shadowTier], vec4(direction, float(light.shadowCube))).r;
+        closestDepth *= radius;   // depth is stored as distance over the light radius
         if(currentDepth - bias > closestDepth)
             shadow += 1.0;
     }
-    shadow /= float(samples);
+    shadow /= float(SHADOW_SAMPLES);
         
     return shadow;
 }
@@ -50,7 +69,7 @@ float ShadowCalculation(vec3 worldPosition)
 // ----------------------------------------------------------------------------
 vec3 getNormalFromMap()
 {
-    vec3 tangentNormal = texture(normalTex, inUV).rgb * 2.0 - 1.0;
+    vec3 tangentNormal = SampleMaterialTexture(inMaterialIndex, NORMAL_TEXTURE, inUV).rgb * 2.0 - 1.0;
 
     vec3 Q1  = dFdx(inWorldPos);
     vec3 Q2  = dFdy(inWorldPos);
@@ -105,61 +124,94 @@ vec3 fresnelSchlick(float cosTheta, vec3 F0)
     return F0 + (1.0 - F0) * pow(clamp(1.0 - cosTheta, 0.0, 1.0), 5.0);
 }
 
+// ----------------------------------------------------------------------------
+// Cook-Torrance BRDF for one light, radiance already attenuated
+vec3 EvaluateLight(vec3 N, vec3 V, vec3 L, vec3 radiance, vec3 albedo, float metallic, float roughness, vec3 F0)
+{
+    vec3 H = normalize(V + L);
+
+    float NDF = DistributionGGX(N, H, roughness);
+    float G = GeometrySmith(N, V, L, roughness);
+    vec3 F = fresnelSchlick(max(dot(H, V), 0.0), F0);
+
+    vec3 numerator = NDF * G * F;
+    float denominator = 1.0 * max(dot(N, V), 0.0) * max(dot(N,L), 0.0) + 0.0001;
+    vec3 specular = numerator / denominator;
+
+    vec3 kS = F;
+    vec3 kD = vec3(1.0) - kS;
+    kD *= 1.0 - metallic;
+
+    float NdotL = max(dot(N, L), 0.0);
+
+    return (kD * albedo / PI + specular) * radiance * NdotL;
+}
+
 // ----------------------------------------------------------------------------
 
 void main() 
 {
-    vec4 colorTexture = texture(colorTex,inUV);
+    MaterialData material = materialBuffer.materials[inMaterialIndex];
+
+    vec4 colorTexture = SampleMaterialTexture(inMaterialIndex, COLOR_TEXTURE, inUV);
     if (colorTexture.a < 0.1)
         discard;
 
-    vec3 albedo = pow(colorTexture.rgb, vec3(2.2)) * materialData.colorFactors.xyz;
-    float metallic = texture(metalRoughTex, inUV).b * materialData.metalRoughFactors.x;
-    float roughness = texture(metalRoughTex, inUV).g * materialData.metalRoughFactors.y;
-    float ao = texture(occlusionTex, inUV).r;
+    vec4 metalRough = SampleMaterialTexture(inMaterialIndex, METAL_ROUGH_TEXTURE, inUV);
 
-    vec3 N = getNormalFromMap();
+    vec3 albedo = pow(colorTexture.rgb, vec3(2.2)) * material.colorFactors.xyz;
+    float metallic = metalRough.b * material.metalRoughFactors.x;
+    float roughness = metalRough.g * material.metalRoughFactors.y;
+    float ao = SampleMaterialTexture(inMaterialIndex, OCCLUSION_TEXTURE, inUV).r;
+
+    vec3 N = NORMAL_MAP ? getNormalFromMap() : normalize(inNormal);
     vec3 V = normalize(sceneData.viewPosition.xyz - inWorldPos);
 
     vec3 F0 = vec3(0.04);
     F0 = mix(F0, albedo, metallic);
 
     vec3 Lo = vec3(0.0);
-    // if multiple lights start loop here
-    // light radiance
-    vec3 L = normalize(sceneData.lightPosition.xyz - inWorldPos);
-    vec3 H = normalize(V + L);
-    float lightDistance = length(sceneData.lightPosition.xyz - inWorldPos);
-    float attenuation = 1.0 / pow(lightDistance, sceneData.attenuationFallOff);
-    vec3 radiance = sceneData.lightColor.xyz * attenuation * sceneData.lightPosition.w; // w holds power
+    for (uint lightIndex = 0; lightIndex < lightData.lightCount; lightIndex++)
+    {
+        PointLight light = lightData.lights[lightIndex];
 
-    // Cook-Torrance BRDF
-    float NDF = DistributionGGX(N, H, roughness);
-    float G = GeometrySmith(N, V, L, roughness);
-    vec3 F = fresnelSchlick(max(dot(H, V), 0.0), F0);
+        // light radiance
+        vec3 L = normalize(light.positionPower.xyz - inWorldPos);
+        float lightDistance = length(light.positionPower.xyz - inWorldPos);
+        float attenuation = 1.0 / pow(lightDistance, sceneData.attenuationFallOff);
+        vec3 radiance = light.colorRadius.xyz * attenuation * light.positionPower.w; // w holds power
 
-    vec3 numerator = NDF * G * F;
-    float denominator = 1.0 * max(dot(N, V), 0.0) * max(dot(N,L), 0.0) + 0.0001;
-    vec3 specular = numerator / denominator;
+        float shadow = SHADOWS ? ShadowCalculation(light, inWorldPos) : 0.0;
 
-    vec3 kS = F;
-    vec3 kD = vec3(1.0) - kS;
-    kD *= 1.0 - metallic;
+        Lo += (1.0 - shadow) * EvaluateLight(N, V, L, radiance, albedo, metallic, roughness, F0);
+    }
 
-    float NdotL = max(dot(N, L), 0.0);
+    // unshadowed local lights, only the ones cluster.comp binned into this fragment's froxel
+    uint listStart = ClusterListStart(gl_FragCoord.xy, inWorldPos);
+    uint clusterLightCount = clusterLists.lists[listStart];
+    for (uint i = 0; i < clusterLightCount; i++)
+    {
+        ClusterLight light = clusterLights.lights[clusterLists.lists[listStart + 1 + i]];
 
-    Lo += (kD * albedo / PI + specular) * radiance * NdotL;
+        vec3 toLight = light.positionRadius.xyz - inWorldPos;
+        float distanceSquared = dot(toLight, toLight);
+        float radiusSquared = light.positionRadius.w * light.positionRadius.w;
+        if (distanceSquared >= radiusSquared)
+            continue;
 
-    // end loop for multiple lights
+        // inverse square falloff windowed to reach zero at the radius, so the cut at the cluster bounds is invisible
+        float window = clamp(1.0 - (distanceSquared * distanceSquared) / (radiusSquared * radiusSquared), 0.0, 1.0);
+        float attenuation = window * window / max(distanceSquared, 1e-4);
+        vec3 radiance = light.colorIntensity.rgb * light.colorIntensity.w * attenuation;
 
-    vec3 ambient = sceneData.ambientColor.xyz * albedo * ao;
+        Lo += EvaluateLight(N, V, toLight * inversesqrt(distanceSquared), radiance, albedo, metallic, roughness, F0);
+    }
 
-    vec3 emission = texture(emissionTex, inUV).rgb;
+    vec3 ambient = sceneData.ambientColor.xyz * albedo * ao;
 
-    float shadow = ShadowCalculation(inWorldPos);    
+    vec3 emission = EMISSION ? SampleMaterialTexture(inMaterialIndex, EMISSION_TEXTURE, inUV).rgb : vec3(0.0);
 
-    //vec3 color = ambient + Lo + emission;
-    vec3 color = ambient + (1.0 - shadow) * (Lo + emission);
+    vec3 color = ambient + Lo + emission;
 
     // HDR tonemapping
     color = color / (color + vec3(1.0));
@@ -167,7 +219,9 @@ void main()
     // gamma correct
     color = pow(color, vec3(1.0/2.2));
     
+#ifdef WEIGHTED_BLENDED
+    WriteWeightedBlended(color, colorTexture.a * material.colorFactors.a);
+#else
     outFragColor = vec4(color, 1.0);
-    //outFragColor = texture(depthMap, inWorldPos);
-    //outFragColor = vec4(shadow, shadow, shadow, 1.0f);
+#endif
 }
\ No newline at end of file
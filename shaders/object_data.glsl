@@ -0,0 +1,31 @@
+struct Vertex {
+
+	vec3 position;
+	float uv_x;
+	vec3 normal;
+	float uv_y;
+	vec4 color;
+}; 
+
+layout(buffer_reference, std430) readonly buffer VertexBuffer{ 
+	Vertex vertices[];
+};
+
+// matches GPUObjectData in vk_culling.h
+struct ObjectData {
+
+	mat4 transform;
+	vec4 sphereBounds; // xyz local origin, w local radius
+	vec4 extents;
+	uint indexCount;
+	uint firstIndex;
+	uint padding0;
+	uint padding1;
+	VertexBuffer vertexBuffer;
+	uint materialIndex;
+	int vertexOffset;
+};
+
+layout(buffer_reference, std430) readonly buffer ObjectBuffer{ 
+	ObjectData objects[];
+};
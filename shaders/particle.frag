@@ -1,12 +1,17 @@
 #version 450
 
+#extension GL_GOOGLE_include_directive : require
+#include "weighted_blended.glsl"
+
 layout (location = 0) in vec2 inTexCoords;
 
 layout (location = 1) in float inLifetime;
 
 layout (location = 2) in float inAliveTime;
 
-layout (location = 0) out vec4 outFragColor;
+layout (location = 3) flat in uint inFirstLayer;
+
+layout (location = 4) flat in uint inLayerCount;
 
 layout(binding = 0) uniform  ParticleData
 {   
@@ -20,7 +25,9 @@ layout (binding = 1) uniform sampler2DArray particleTex;
 
 void main() 
 {
-    int texNumber = int(((inLifetime - inAliveTime) / inLifetime) * particleData.textureArraySize);
+    // plays through the emitter's layers, clamped to the layers the array has
+    int texNumber = int(inFirstLayer) + int(((inLifetime - inAliveTime) / inLifetime) * inLayerCount);
+    texNumber = min(texNumber, min(int(inFirstLayer + inLayerCount), particleData.textureArraySize) - 1);
 
     vec3 textureCoordinate = vec3(inTexCoords, texNumber); 
 
@@ -28,6 +35,6 @@ void main()
     
     color.a = color.a * ((inLifetime - inAliveTime) / inLifetime);
 
-    outFragColor = color;
+    WriteWeightedBlended(color.rgb, color.a);
 
 }
\ No newline at end of file
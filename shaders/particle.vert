@@ -18,18 +18,40 @@ struct ParticlePosition
 	vec3 particlePosition;
 	float lifetime;
 	float aliveTime;
+	uint emitter;
 };
 
 layout(buffer_reference, std430) readonly buffer PositionBuffer{ 
 	ParticlePosition positions[];
 };
 
+// matches GPUParticleEmitterData in vk_particles.h
+struct ParticleEmitter
+{
+	vec4 positionLowerLife;
+	vec4 dimensionsUpperLife;
+	vec4 movementSizeStart;
+	float sizeEnd;
+	float sizeExponent;
+	uint firstLayer;
+	uint layerCount;
+	uint arenaOffset;
+	uint liveStart;
+	uint particleCount;
+	uint reset;
+};
+
+layout(buffer_reference, std430) readonly buffer EmitterBuffer{ 
+	ParticleEmitter emitters[];
+};
+
 //push constants block
 layout( push_constant ) uniform constants
 {	
 	mat4 renderMatrix;
 	VertexBuffer vertexBuffer;
 	PositionBuffer positionBuffer;
+	EmitterBuffer emitterBuffer;
 } PushConstants;
 
 layout(location = 0) out vec2 outTexCoords;
@@ -38,6 +60,10 @@ layout(location = 1) out float outLifetime;
 
 layout(location = 2) out float outAliveTime;
 
+layout(location = 3) flat out uint outFirstLayer;
+
+layout(location = 4) flat out uint outLayerCount;
+
 layout(binding = 0) uniform  ParticleData
 {   
 	mat4 view;
@@ -51,13 +77,18 @@ void main()
 {
 	Vertex v = PushConstants.vertexBuffer.vertices[gl_VertexIndex];
 	ParticlePosition p = PushConstants.positionBuffer.positions[gl_InstanceIndex];
+	ParticleEmitter emitter = PushConstants.emitterBuffer.emitters[p.emitter];
 
 	vec4 position_viewspace = particleData.view * vec4( p.particlePosition.xyz, 1 ); // ,movement handled by (movement * dt * position.w (AliveTime)
 
-   position_viewspace.xy += (particleData.particleSize * (p.aliveTime / p.lifetime)) * (v.position.xy - vec2(0.5));
+   // the emitter's size curve over the particle's age
+   float size = mix(emitter.movementSizeStart.w, emitter.sizeEnd, pow(p.aliveTime / p.lifetime, emitter.sizeExponent));
+   position_viewspace.xy += (particleData.particleSize * size) * (v.position.xy - vec2(0.5));
 
    outLifetime = p.lifetime;
    outAliveTime = p.aliveTime;
+   outFirstLayer = emitter.firstLayer;
+   outLayerCount = emitter.layerCount;
    outTexCoords = vec2(v.uvX, v.uvY);
    gl_Position = particleData.projection * position_viewspace;
 }
\ No newline at end of file
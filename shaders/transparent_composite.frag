@@ -0,0 +1,24 @@
+#version 450
+
+// resolved targets of the weighted blended pass, see weighted_blended.glsl
+layout (set = 0, binding = 0) uniform sampler2D accumulationTexture;
+layout (set = 0, binding = 1) uniform sampler2D revealageTexture;
+
+layout (location = 0) out vec4 outFragColor;
+
+void main()
+{
+	ivec2 coord = ivec2(gl_FragCoord.xy);
+
+	float revealage = texelFetch(revealageTexture, coord, 0).r;
+	if (revealage >= 1.0)
+	{
+		discard;
+	}
+
+	// the weighted average color, blended over the opaque color by the total coverage
+	vec4 accumulation = texelFetch(accumulationTexture, coord, 0);
+	vec3 averageColor = accumulation.rgb / clamp(accumulation.a, 1e-4, 5e4);
+
+	outFragColor = vec4(averageColor, 1.0 - revealage);
+}
@@ -0,0 +1,21 @@
+// weighted blended order independent transparency (McGuire and Bavoil 2013). every transparent fragment adds its weighted
+// premultiplied color to the accumulation target and multiplies its coverage into the revealage target, so draw order
+// does not matter. transparent_composite.frag lays the result over the opaque color
+
+layout (location = 0) out vec4 outAccumulation;
+layout (location = 1) out vec4 outRevealage;
+
+// favours nearer fragments, clamped so a few hundred overlapping layers stay inside half float range
+float WeightedBlendedWeight(float viewDepth)
+{
+	return clamp(10.0 / (1e-5 + pow(viewDepth / 5.0, 2.0) + pow(viewDepth / 200.0, 6.0)), 1e-2, 3e3);
+}
+
+void WriteWeightedBlended(vec3 color, float alpha)
+{
+	// w of a perspective projection is the view depth
+	float weight = WeightedBlendedWeight(1.0 / gl_FragCoord.w);
+
+	outAccumulation = vec4(color * alpha, alpha) * weight;
+	outRevealage = vec4(alpha);
+}
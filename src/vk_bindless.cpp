@@ -0,0 +1,209 @@
+#include "vk_bindless.h"
+#include "vk_engine.h"
+#include "vk_descriptors.h"
+
+#include <algorithm>
+
+static_assert(sizeof(GPUMaterialData) == 80, "GPUMaterialData must match the std430 MaterialData layout");
+
+bool BindlessMaterials::SlotTable::Acquire(uint64_t handle, uint32_t& outIndex)
+{
+	auto it = slots.find(handle);
+	if (it != slots.end())
+	{
+		it->second.references++;
+		outIndex = it->second.index;
+		return false;
+	}
+
+	if (!freeSlots.empty())
+	{
+		outIndex = freeSlots.back();
+		freeSlots.pop_back();
+	}
+	else
+	{
+		if (nextSlot >= capacity)
+		{
+			fmt::println("Bindless descriptor array is full ({} slots)", capacity);
+			abort();
+		}
+		outIndex = nextSlot++;
+	}
+
+	slots[handle] = Slot{ outIndex, 1 };
+	return true;
+}
+
+bool BindlessMaterials::SlotTable::Release(uint64_t handle, uint32_t& outIndex)
+{
+	auto it = slots.find(handle);
+	if (it == slots.end() || --it->second.references != 0)
+	{
+		return false;
+	}
+
+	// the descriptor is left as is, partially bound lets it go stale until the slot is written again
+	outIndex = it->second.index;
+	slots.erase(it);
+	return true;
+}
+
+void BindlessMaterials::Init(VulkanEngine* engine, uint32_t textureCapacity, uint32_t samplerCapacity, uint32_t materialCapacity)
+{
+	this->engine = engine;
+	this->materialCapacity = materialCapacity;
+	textureSlots.capacity = textureCapacity;
+	samplerSlots.capacity = samplerCapacity;
+
+	// slots are written while earlier frames are still executing, only the ones a pending frame can reach must stay untouched
+	VkDescriptorBindingFlags arrayFlags = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT;
+
+	DescriptorLayoutBuilder builder;
+	builder.AddBinding(0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+	builder.AddBinding(1, VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, textureCapacity, arrayFlags);
+	builder.AddBinding(2, VK_DESCRIPTOR_TYPE_SAMPLER, samplerCapacity, arrayFlags);
+	layout = builder.Build(engine->device, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT);
+
+	VkDescriptorPoolSize poolSizes[] =
+	{
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1 },
+		{ VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, textureCapacity },
+		{ VK_DESCRIPTOR_TYPE_SAMPLER, samplerCapacity },
+	};
+
+	VkDescriptorPoolCreateInfo poolInfo = { .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
+	poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
+	poolInfo.maxSets = 1;
+	poolInfo.poolSizeCount = 3;
+	poolInfo.pPoolSizes = poolSizes;
+
+	VK_CHECK(vkCreateDescriptorPool(engine->device, &poolInfo, nullptr, &pool));
+
+	VkDescriptorSetAllocateInfo allocInfo = { .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
+	allocInfo.descriptorPool = pool;
+	allocInfo.descriptorSetCount = 1;
+	allocInfo.pSetLayouts = &layout;
+
+	VK_CHECK(vkAllocateDescriptorSets(engine->device, &allocInfo, &set));
+
+	// written in place from the cpu, new materials only ever land in slots no submitted draw references
+	materialBuffer = engine->CreateBuffer(sizeof(GPUMaterialData) * materialCapacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+	materialData = (GPUMaterialData*)materialBuffer.info.pMappedData;
+
+	DescriptorWriter writer;
+	writer.WriteBuffer(0, materialBuffer.buffer, VK_WHOLE_SIZE, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+	writer.UpdateSet(engine->device, set);
+}
+
+void BindlessMaterials::Destroy()
+{
+	engine->DestroyBuffer(materialBuffer);
+	vkDestroyDescriptorPool(engine->device, pool, nullptr);
+	vkDestroyDescriptorSetLayout(engine->device, layout, nullptr);
+
+	textureSlots = SlotTable{};
+	samplerSlots = SlotTable{};
+	materials.clear();
+	freeMaterials.clear();
+	retired.clear();
+}
+
+void BindlessMaterials::ReclaimRetired()
+{
+	// frames up to the one the material was removed in may still read it. the last of them has had its fence waited on
+	// once FRAME_OVERLAP more frames were drawn, so from the frame after that the slots can be written again
+	while (!retired.empty() && engine->frameNumber > retired.front().frame + (int)FRAME_OVERLAP)
+	{
+		RetiredMaterial& material = retired.front();
+
+		freeMaterials.push_back(material.materialIndex);
+		textureSlots.freeSlots.insert(textureSlots.freeSlots.end(), material.textures.begin(), material.textures.end());
+		samplerSlots.freeSlots.insert(samplerSlots.freeSlots.end(), material.samplers.begin(), material.samplers.end());
+
+		retired.pop_front();
+	}
+}
+
+uint32_t BindlessMaterials::AddMaterial(const BindlessMaterialDesc& desc)
+{
+	ReclaimRetired();
+
+	uint32_t materialIndex;
+	if (!freeMaterials.empty())
+	{
+		materialIndex = freeMaterials.back();
+		freeMaterials.pop_back();
+	}
+	else
+	{
+		if (materials.size() >= materialCapacity)
+		{
+			fmt::println("Bindless material buffer is full ({} materials)", materialCapacity);
+			abort();
+		}
+		materialIndex = (uint32_t)materials.size();
+		materials.emplace_back();
+	}
+
+	GPUMaterialData data{};
+	data.colorFactors = desc.colorFactors;
+	data.metalRoughFactors = desc.metalRoughFactors;
+
+	DescriptorWriter writer;
+	for (uint32_t i = 0; i < MATERIAL_TEXTURE_COUNT; i++)
+	{
+		if (textureSlots.Acquire((uint64_t)desc.images[i], data.textures[i]))
+		{
+			writer.WriteImage(1, desc.images[i], VK_NULL_HANDLE, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, data.textures[i]);
+		}
+
+		if (samplerSlots.Acquire((uint64_t)desc.samplers[i], data.samplers[i]))
+		{
+			writer.WriteImage(2, VK_NULL_HANDLE, desc.samplers[i], VK_IMAGE_LAYOUT_UNDEFINED, VK_DESCRIPTOR_TYPE_SAMPLER, data.samplers[i]);
+		}
+	}
+
+	if (!writer.writes.empty())
+	{
+		writer.UpdateSet(engine->device, set);
+	}
+
+	materialData[materialIndex] = data;
+
+	MaterialRecord& record = materials[materialIndex];
+	std::copy(std::begin(desc.images), std::end(desc.images), record.images);
+	std::copy(std::begin(desc.samplers), std::end(desc.samplers), record.samplers);
+
+	materialCount++;
+	textureCount = (uint32_t)textureSlots.slots.size();
+	samplerCount = (uint32_t)samplerSlots.slots.size();
+
+	return materialIndex;
+}
+
+void BindlessMaterials::RemoveMaterial(uint32_t materialIndex)
+{
+	RetiredMaterial material{ engine->frameNumber, materialIndex };
+
+	MaterialRecord& record = materials[materialIndex];
+	for (uint32_t i = 0; i < MATERIAL_TEXTURE_COUNT; i++)
+	{
+		uint32_t slot;
+		if (textureSlots.Release((uint64_t)record.images[i], slot))
+		{
+			material.textures.push_back(slot);
+		}
+		if (samplerSlots.Release((uint64_t)record.samplers[i], slot))
+		{
+			material.samplers.push_back(slot);
+		}
+	}
+
+	record = MaterialRecord{};
+	retired.push_back(std::move(material));
+
+	materialCount--;
+	textureCount = (uint32_t)textureSlots.slots.size();
+	samplerCount = (uint32_t)samplerSlots.slots.size();
+}
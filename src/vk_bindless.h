@@ -0,0 +1,104 @@
+#pragma once
+
+#include "vk_types.h"
+
+#include <deque>
+#include <unordered_map>
+
+class VulkanEngine;
+
+// color, metallic roughness, normal, occlusion, emission
+constexpr uint32_t MATERIAL_TEXTURE_COUNT = 5;
+
+// one entry of the material storage buffer, matches MaterialData in input_structures.glsl
+struct GPUMaterialData
+{
+	glm::vec4 colorFactors;
+	glm::vec4 metalRoughFactors;
+	uint32_t textures[MATERIAL_TEXTURE_COUNT]; // index into the global texture array
+	uint32_t samplers[MATERIAL_TEXTURE_COUNT]; // index into the global sampler array
+	uint32_t padding[2];
+};
+
+struct BindlessMaterialDesc
+{
+	glm::vec4 colorFactors;
+	glm::vec4 metalRoughFactors;
+	VkImageView images[MATERIAL_TEXTURE_COUNT];
+	VkSampler samplers[MATERIAL_TEXTURE_COUNT];
+};
+
+// a single update after bind descriptor set holding every material texture and sampler plus a storage buffer of material constants.
+// shaders index it with the material index stored per object, so a material change never needs a descriptor bind
+class BindlessMaterials
+{
+public:
+	void Init(VulkanEngine* engine, uint32_t textureCapacity, uint32_t samplerCapacity, uint32_t materialCapacity);
+	void Destroy();
+
+	// textures and samplers are shared between materials and released when the last material using them is removed.
+	// the slots a removed material frees are only handed out again once the frames in flight can no longer read them
+	uint32_t AddMaterial(const BindlessMaterialDesc& desc);
+	void RemoveMaterial(uint32_t materialIndex);
+
+	VkDescriptorSetLayout layout{ VK_NULL_HANDLE };
+	VkDescriptorSet set{ VK_NULL_HANDLE };
+
+	uint32_t materialCount{ 0 };
+	uint32_t textureCount{ 0 };
+	uint32_t samplerCount{ 0 };
+
+private:
+	// hands out array slots for a resource handle, reference counted so shared resources keep one slot
+	struct SlotTable
+	{
+		struct Slot
+		{
+			uint32_t index;
+			uint32_t references;
+		};
+
+		std::unordered_map<uint64_t, Slot> slots;
+		std::vector<uint32_t> freeSlots;
+		uint32_t nextSlot{ 0 };
+		uint32_t capacity{ 0 };
+
+		// returns true when the handle got a new slot that still has to be written
+		bool Acquire(uint64_t handle, uint32_t& outIndex);
+		// returns true when the last reference went away, the slot goes back to freeSlots through RetiredMaterial
+		bool Release(uint64_t handle, uint32_t& outIndex);
+	};
+
+	// what a removed material held, kept out of the free lists until the frames that could read it have finished
+	struct RetiredMaterial
+	{
+		int frame; // frameNumber when it was removed
+		uint32_t materialIndex;
+		std::vector<uint32_t> textures;
+		std::vector<uint32_t> samplers;
+	};
+
+	struct MaterialRecord
+	{
+		VkImageView images[MATERIAL_TEXTURE_COUNT];
+		VkSampler samplers[MATERIAL_TEXTURE_COUNT];
+	};
+
+	VulkanEngine* engine{ nullptr };
+
+	VkDescriptorPool pool{ VK_NULL_HANDLE };
+
+	AllocatedBuffer materialBuffer;
+	GPUMaterialData* materialData{ nullptr };
+
+	SlotTable textureSlots;
+	SlotTable samplerSlots;
+
+	std::vector<MaterialRecord> materials;
+	std::vector<uint32_t> freeMaterials;
+	uint32_t materialCapacity{ 0 };
+
+	std::deque<RetiredMaterial> retired;
+
+	void ReclaimRetired();
+};
@@ -0,0 +1,137 @@
+#include "vk_buffers.h"
+#include "vk_engine.h"
+
+#include <algorithm>
+
+VkDeviceAddress vkutil::GetBufferAddress(VkDevice device, VkBuffer buffer)
+{
+	VkBufferDeviceAddressInfo addressInfo{ .sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO, .buffer = buffer };
+	return vkGetBufferDeviceAddress(device, &addressInfo);
+}
+
+void vkutil::GlobalBarrier(VkCommandBuffer cmd, VkPipelineStageFlags2 srcStage, VkAccessFlags2 srcAccess, VkPipelineStageFlags2 dstStage, VkAccessFlags2 dstAccess)
+{
+	VkMemoryBarrier2 barrier{ .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2, .pNext = nullptr };
+	barrier.srcStageMask = srcStage;
+	barrier.srcAccessMask = srcAccess;
+	barrier.dstStageMask = dstStage;
+	barrier.dstAccessMask = dstAccess;
+
+	VkDependencyInfo depInfo{ .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO, .pNext = nullptr };
+	depInfo.memoryBarrierCount = 1;
+	depInfo.pMemoryBarriers = &barrier;
+
+	vkCmdPipelineBarrier2(cmd, &depInfo);
+}
+
+void UniformAllocator::Init(VulkanEngine* engine, size_t size, size_t minAlignment)
+{
+	buffer = engine->CreateBuffer(size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+	mappedData = (uint8_t*)buffer.info.pMappedData;
+	capacity = size;
+	alignment = std::max<size_t>(minAlignment, 16);
+	head = 0;
+}
+
+void UniformAllocator::Destroy(VulkanEngine* engine)
+{
+	engine->DestroyBuffer(buffer);
+	mappedData = nullptr;
+	capacity = 0;
+	head = 0;
+}
+
+void UniformAllocator::Reset()
+{
+	head = 0;
+}
+
+uint32_t UniformAllocator::Push(const void* data, size_t size)
+{
+	size_t offset = (head + alignment - 1) & ~(alignment - 1);
+
+	if (offset + size > capacity)
+	{
+		fmt::println("Frame uniform buffer exhausted ({} of {} bytes)", offset + size, capacity);
+		abort();
+	}
+
+	memcpy(mappedData + offset, data, size);
+	head = offset + size;
+
+	return (uint32_t)offset;
+}
+
+void DynamicBuffer::Init(VulkanEngine* engine, size_t size, VkBufferUsageFlags usage, uint32_t regions)
+{
+	const VkPhysicalDeviceLimits& limits = engine->physicalDeviceProperties.limits;
+	size_t alignment = std::max<size_t>({ 16, limits.minStorageBufferOffsetAlignment, limits.nonCoherentAtomSize });
+
+	regionSize = (std::max<size_t>(size, 1) + alignment - 1) & ~(alignment - 1);
+	regionCount = regions;
+	size_t totalSize = regionSize * regionCount;
+
+	// look for a memory type that is both device local and host visible with a heap large enough that this buffer cannot crowd
+	// out the rest, the 256MB bar window without resizable bar is left to the driver
+	const VkPhysicalDeviceMemoryProperties* memoryProperties;
+	vmaGetMemoryProperties(engine->allocator, &memoryProperties);
+
+	VkMemoryPropertyFlags fastFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	uint32_t fastTypeBits = 0;
+	for (uint32_t i = 0; i < memoryProperties->memoryTypeCount; i++)
+	{
+		const VkMemoryType& type = memoryProperties->memoryTypes[i];
+		if ((type.propertyFlags & fastFlags) == fastFlags && memoryProperties->memoryHeaps[type.heapIndex].size >= std::max<VkDeviceSize>(totalSize * 8, 512ull * 1024 * 1024))
+		{
+			fastTypeBits |= 1u << i;
+		}
+	}
+
+	VkBufferCreateInfo bufferInfo = { .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+	bufferInfo.size = totalSize;
+	bufferInfo.usage = usage | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+
+	VmaAllocationCreateInfo allocInfo = {};
+	allocInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+	allocInfo.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+	if (fastTypeBits != 0)
+	{
+		allocInfo.usage = VMA_MEMORY_USAGE_UNKNOWN;
+		allocInfo.requiredFlags = fastFlags;
+		allocInfo.memoryTypeBits = fastTypeBits;
+	}
+
+	// the fast heap may still be full, fall back to system memory rather than failing
+	VkResult result = vmaCreateBuffer(engine->allocator, &bufferInfo, &allocInfo, &buffer.buffer, &buffer.allocation, &buffer.info);
+	if (result != VK_SUCCESS && fastTypeBits != 0)
+	{
+		allocInfo = {};
+		allocInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+		allocInfo.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+		result = vmaCreateBuffer(engine->allocator, &bufferInfo, &allocInfo, &buffer.buffer, &buffer.allocation, &buffer.info);
+	}
+	VK_CHECK(result);
+
+	VkMemoryPropertyFlags flags;
+	vmaGetAllocationMemoryProperties(engine->allocator, buffer.allocation, &flags);
+	deviceLocal = (flags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) != 0;
+	coherent = (flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) != 0;
+
+	mappedData = (uint8_t*)buffer.info.pMappedData;
+	address = vkutil::GetBufferAddress(engine->device, buffer.buffer);
+}
+
+void DynamicBuffer::Destroy(VulkanEngine* engine)
+{
+	engine->DestroyBuffer(buffer);
+	mappedData = nullptr;
+	address = 0;
+}
+
+void DynamicBuffer::Flush(VulkanEngine* engine, uint32_t frame, size_t size) const
+{
+	if (!coherent && size > 0)
+	{
+		vmaFlushAllocation(engine->allocator, buffer.allocation, Offset(frame), std::min(size, regionSize));
+	}
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "vk_types.h"
+
+class VulkanEngine;
+
+namespace vkutil {
+	VkDeviceAddress GetBufferAddress(VkDevice device, VkBuffer buffer);
+	// memory barrier over every resource, for buffers reached through device addresses
+	void GlobalBarrier(VkCommandBuffer cmd, VkPipelineStageFlags2 srcStage, VkAccessFlags2 srcAccess, VkPipelineStageFlags2 dstStage, VkAccessFlags2 dstAccess);
+};
+
+// linear allocator over one persistently mapped uniform buffer, owned by a FrameData and reset once its fence has signalled
+struct UniformAllocator
+{
+	AllocatedBuffer buffer;
+	uint8_t* mappedData{ nullptr };
+	size_t capacity{ 0 };
+	size_t alignment{ 0 };
+	size_t head{ 0 };
+
+	void Init(VulkanEngine* engine, size_t size, size_t minAlignment);
+	void Destroy(VulkanEngine* engine);
+
+	void Reset();
+
+	// copies the data into the next aligned sub-range and returns its offset, used as the dynamic offset when binding
+	uint32_t Push(const void* data, size_t size);
+
+	template<typename T>
+	uint32_t Push(const T& data) { return Push(&data, sizeof(T)); }
+};
+
+// one persistently mapped buffer split into a region per frame in flight, for data the cpu rewrites every frame. a frame only
+// writes its own region after waiting on its fence, so the gpu is never stalled and nothing is copied. placed in device local
+// host visible memory when the device has enough of it (resizable bar or unified memory), otherwise in system memory
+struct DynamicBuffer
+{
+	AllocatedBuffer buffer;
+	uint8_t* mappedData{ nullptr };
+	VkDeviceAddress address{ 0 };
+	size_t regionSize{ 0 }; // aligned, the stride between regions
+	uint32_t regionCount{ 0 };
+	bool deviceLocal{ false };
+	bool coherent{ true };
+
+	// usage gets the device address bit added
+	void Init(VulkanEngine* engine, size_t size, VkBufferUsageFlags usage, uint32_t regions);
+	void Destroy(VulkanEngine* engine);
+
+	uint8_t* WritePointer(uint32_t frame) const { return mappedData + Offset(frame); }
+	VkDeviceAddress DeviceAddress(uint32_t frame) const { return address + Offset(frame); }
+	VkDeviceSize Offset(uint32_t frame) const { return (VkDeviceSize)(frame % regionCount) * regionSize; }
+
+	// makes the written bytes visible to the gpu, only does work on non coherent memory
+	void Flush(VulkanEngine* engine, uint32_t frame, size_t size) const;
+};
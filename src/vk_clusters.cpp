@@ -0,0 +1,170 @@
+#include "vk_clusters.h"
+#include "vk_engine.h"
+#include "vk_descriptors.h"
+
+#include <algorithm>
+#include <cfloat>
+
+void ClusteredLightBuffers::Init(VulkanEngine* engine, const ClusterGridSettings& settings)
+{
+	this->engine = engine;
+	this->settings = settings;
+
+	clusterCount = settings.sizeX * settings.sizeY * settings.sizeZ;
+	uint32_t listStride = settings.maxLightsPerCluster + 1;
+
+	boundsBuffer = engine->CreateBuffer(clusterCount * 2 * sizeof(glm::vec4), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+	lightBuffer = engine->CreateBuffer(std::max(settings.lightCapacity, 1u) * sizeof(GPUClusterLight), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+	clusterBuffer = engine->CreateBuffer(clusterCount * listStride * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+	statsBuffer = engine->CreateBuffer(4 * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU);
+
+	boundsBufferAddress = vkutil::GetBufferAddress(engine->device, boundsBuffer.buffer);
+	lightBufferAddress = vkutil::GetBufferAddress(engine->device, lightBuffer.buffer);
+	clusterBufferAddress = vkutil::GetBufferAddress(engine->device, clusterBuffer.buffer);
+	statsBufferAddress = vkutil::GetBufferAddress(engine->device, statsBuffer.buffer);
+
+	gridInfo = glm::uvec4(settings.sizeX, settings.sizeY, settings.sizeZ, listStride);
+	boundsExtent = { 0, 0 };
+	readbackPending = false;
+}
+
+void ClusteredLightBuffers::Destroy()
+{
+	engine->DestroyBuffer(boundsBuffer);
+	engine->DestroyBuffer(lightBuffer);
+	engine->DestroyBuffer(clusterBuffer);
+	engine->DestroyBuffer(statsBuffer);
+}
+
+void ClusteredLightBuffers::Prepare(std::span<const ClusterLight> lights, const glm::mat4& view, const glm::mat4& projection, float nearPlane, float farPlane, VkExtent2D extent)
+{
+	// the fence for this frame has been waited on, so the counters written last time are visible
+	if (readbackPending)
+	{
+		vmaInvalidateAllocation(engine->allocator, statsBuffer.allocation, 0, VK_WHOLE_SIZE);
+		uint32_t* counters = (uint32_t*)statsBuffer.info.pMappedData;
+
+		lastStats.lightCount = lightCount;
+		lastStats.lightReferences = counters[0];
+		lastStats.maxLightsInCluster = counters[1];
+		lastStats.overflowingClusters = counters[2];
+		lastStats.occupiedClusters = counters[3];
+		lastStats.clusterCount = clusterCount;
+		readbackPending = false;
+	}
+
+	if (extent.width != boundsExtent.width || extent.height != boundsExtent.height || projection != boundsProjection)
+	{
+		BuildBounds(projection, nearPlane, farPlane, extent);
+	}
+
+	lightCount = std::min((uint32_t)lights.size(), settings.lightCapacity);
+
+	GPUClusterLight* gpuLights = (GPUClusterLight*)lightBuffer.info.pMappedData;
+	for (uint32_t i = 0; i < lightCount; i++)
+	{
+		const ClusterLight& light = lights[i];
+		glm::vec3 viewPosition = glm::vec3(view * glm::vec4(light.position, 1.0f));
+
+		gpuLights[i].positionRadius = glm::vec4(light.position, light.radius);
+		gpuLights[i].colorIntensity = glm::vec4(light.color, light.intensity);
+		gpuLights[i].viewPositionRadius = glm::vec4(viewPosition, light.radius);
+	}
+}
+
+void ClusteredLightBuffers::BuildBounds(const glm::mat4& projection, float nearPlane, float farPlane, VkExtent2D extent)
+{
+	boundsProjection = projection;
+	boundsExtent = extent;
+
+	uint32_t tileWidth = std::max((extent.width + settings.sizeX - 1) / settings.sizeX, 1u);
+	uint32_t tileHeight = std::max((extent.height + settings.sizeY - 1) / settings.sizeY, 1u);
+
+	// slice k covers view depths near * (far / near)^(k / sizeZ) to the next slice, so a slice is found with one log
+	float logRatio = std::log(farPlane / nearPlane);
+	gridParams.x = (float)tileWidth;
+	gridParams.y = (float)tileHeight;
+	gridParams.z = (float)settings.sizeZ / logRatio;
+	gridParams.w = -(float)settings.sizeZ * std::log(nearPlane) / logRatio;
+
+	glm::mat4 inverseProjection = glm::inverse(projection);
+
+	// a point on the view ray through a pixel, scaled to lie at a view depth
+	auto corner = [&](float px, float py, float depth)
+	{
+		glm::vec2 ndc = glm::vec2(px / extent.width, py / extent.height) * 2.0f - 1.0f;
+		glm::vec4 p = inverseProjection * glm::vec4(ndc, 0.0f, 1.0f);
+		glm::vec3 ray = glm::vec3(p) / p.w;
+		return ray * (depth / -ray.z);
+	};
+
+	glm::vec4* bounds = (glm::vec4*)boundsBuffer.info.pMappedData;
+
+	for (uint32_t z = 0; z < settings.sizeZ; z++)
+	{
+		float sliceNear = nearPlane * std::pow(farPlane / nearPlane, (float)z / settings.sizeZ);
+		float sliceFar = nearPlane * std::pow(farPlane / nearPlane, (float)(z + 1) / settings.sizeZ);
+
+		for (uint32_t y = 0; y < settings.sizeY; y++)
+		{
+			float minY = (float)std::min(y * tileHeight, extent.height);
+			float maxY = (float)std::min((y + 1) * tileHeight, extent.height);
+
+			for (uint32_t x = 0; x < settings.sizeX; x++)
+			{
+				float minX = (float)std::min(x * tileWidth, extent.width);
+				float maxX = (float)std::min((x + 1) * tileWidth, extent.width);
+
+				glm::vec3 minCorner(FLT_MAX);
+				glm::vec3 maxCorner(-FLT_MAX);
+
+				for (float depth : { sliceNear, sliceFar })
+				{
+					for (glm::vec3 c : { corner(minX, minY, depth), corner(maxX, minY, depth), corner(minX, maxY, depth), corner(maxX, maxY, depth) })
+					{
+						minCorner = glm::min(minCorner, c);
+						maxCorner = glm::max(maxCorner, c);
+					}
+				}
+
+				uint32_t index = x + settings.sizeX * (y + settings.sizeY * z);
+				bounds[index * 2 + 0] = glm::vec4(minCorner, 0.0f);
+				bounds[index * 2 + 1] = glm::vec4(maxCorner, 0.0f);
+			}
+		}
+	}
+}
+
+void ClusteredLightBuffers::RecordBuild(VkCommandBuffer cmd, VkPipeline pipeline, VkPipelineLayout layout)
+{
+	vkCmdFillBuffer(cmd, statsBuffer.buffer, 0, 4 * sizeof(uint32_t), 0);
+
+	vkutil::GlobalBarrier(cmd, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+
+	GPUClusterPushConstants pushConstants;
+	pushConstants.boundsBuffer = boundsBufferAddress;
+	pushConstants.lightBuffer = lightBufferAddress;
+	pushConstants.clusterBuffer = clusterBufferAddress;
+	pushConstants.statsBuffer = statsBufferAddress;
+	pushConstants.clusterCount = clusterCount;
+	pushConstants.lightCount = lightCount;
+	pushConstants.maxLightsPerCluster = settings.maxLightsPerCluster;
+	pushConstants.padding = 0;
+
+	// every cluster is written even with no lights, so its count is reset
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+	vkCmdPushConstants(cmd, layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(GPUClusterPushConstants), &pushConstants);
+	vkCmdDispatch(cmd, (clusterCount + 63) / 64, 1, 1);
+
+	vkutil::GlobalBarrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_HOST_READ_BIT);
+
+	readbackPending = true;
+}
+
+void ClusteredLightBuffers::WriteDescriptors(DescriptorWriter& writer, uint32_t lightBinding, uint32_t clusterBinding) const
+{
+	writer.WriteBuffer(lightBinding, lightBuffer.buffer, VK_WHOLE_SIZE, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+	writer.WriteBuffer(clusterBinding, clusterBuffer.buffer, VK_WHOLE_SIZE, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "vk_types.h"
+
+class VulkanEngine;
+struct DescriptorWriter;
+
+// unshadowed point light with a finite range
+struct ClusterLight
+{
+	glm::vec3 position;
+	float radius; // the falloff reaches zero here
+	glm::vec3 color;
+	float intensity;
+};
+
+// matches ClusterLight in input_structures.glsl and cluster.comp
+struct GPUClusterLight
+{
+	glm::vec4 positionRadius; // world space
+	glm::vec4 colorIntensity;
+	glm::vec4 viewPositionRadius; // view space, only read when binning
+};
+
+struct ClusterGridSettings
+{
+	uint32_t sizeX{ 16 };
+	uint32_t sizeY{ 9 };
+	uint32_t sizeZ{ 24 };
+	uint32_t maxLightsPerCluster{ 128 }; // lights past this are dropped from the cluster and counted as overflow
+	uint32_t lightCapacity{ 8192 };
+};
+
+struct GPUClusterPushConstants
+{
+	VkDeviceAddress boundsBuffer;
+	VkDeviceAddress lightBuffer;
+	VkDeviceAddress clusterBuffer;
+	VkDeviceAddress statsBuffer;
+	uint32_t clusterCount;
+	uint32_t lightCount;
+	uint32_t maxLightsPerCluster;
+	uint32_t padding;
+};
+
+struct ClusterStats
+{
+	uint32_t lightCount;
+	uint32_t lightReferences; // summed over every cluster
+	uint32_t maxLightsInCluster;
+	uint32_t overflowingClusters;
+	uint32_t occupiedClusters;
+	uint32_t clusterCount;
+};
+
+// per frame buffers for clustered forward lighting. the view frustum is split into froxels, screen tiles cut into exponential
+// depth slices, and cluster.comp writes the lights touching each froxel into a fixed size list. the fragment shader finds its
+// froxel from gl_FragCoord and view depth and only walks that list, so its cost follows lights per cluster instead of the total
+class ClusteredLightBuffers
+{
+public:
+	void Init(VulkanEngine* engine, const ClusterGridSettings& settings);
+	void Destroy();
+
+	// must be called after the frame fence. writes the lights with their view space positions and rebuilds the froxel bounds
+	// when the projection or extent changed. lights past the capacity are ignored
+	void Prepare(std::span<const ClusterLight> lights, const glm::mat4& view, const glm::mat4& projection, float nearPlane, float farPlane, VkExtent2D extent);
+
+	// bins the lights into the clusters, the lists can be read by fragment shaders afterwards
+	void RecordBuild(VkCommandBuffer cmd, VkPipeline pipeline, VkPipelineLayout layout);
+
+	void WriteDescriptors(DescriptorWriter& writer, uint32_t lightBinding, uint32_t clusterBinding) const;
+
+	// for GPUSceneData. x, y, z cluster counts and the list stride
+	glm::uvec4 gridInfo{ 0 };
+	// tile width and height in pixels, log depth scale and bias mapping view depth to a slice
+	glm::vec4 gridParams{ 0.0f };
+
+	// read back from the last time this frame's buffers were submitted
+	ClusterStats lastStats{};
+
+private:
+	void BuildBounds(const glm::mat4& projection, float nearPlane, float farPlane, VkExtent2D extent);
+
+	VulkanEngine* engine{ nullptr };
+	ClusterGridSettings settings;
+	uint32_t clusterCount{ 0 };
+	uint32_t lightCount{ 0 };
+
+	AllocatedBuffer boundsBuffer; // view space min and max corner per cluster
+	AllocatedBuffer lightBuffer;
+	AllocatedBuffer clusterBuffer; // per cluster a count followed by maxLightsPerCluster indices
+	AllocatedBuffer statsBuffer;
+
+	VkDeviceAddress boundsBufferAddress{ 0 };
+	VkDeviceAddress lightBufferAddress{ 0 };
+	VkDeviceAddress clusterBufferAddress{ 0 };
+	VkDeviceAddress statsBufferAddress{ 0 };
+
+	// what the bounds were built for
+	glm::mat4 boundsProjection{ 0.0f };
+	VkExtent2D boundsExtent{ 0, 0 };
+
+	bool readbackPending{ false };
+};
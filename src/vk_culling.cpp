@@ -0,0 +1,569 @@
+#include "vk_culling.h"
+#include "vk_engine.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+
+#if defined(__AVX__)
+#define CULL_USE_AVX
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CULL_USE_SSE
+#include <immintrin.h>
+#endif
+
+static_assert(sizeof(GPUObjectData) == 128, "GPUObjectData must match the std430 ObjectData layout");
+static_assert(sizeof(GPUCullHeader) == 112 && sizeof(GPUCullDraw) == 16, "the draw list must match the std430 DrawList layout");
+static_assert(sizeof(GPUCullPushConstants) <= 128, "cull push constants must fit the guaranteed push constant size");
+
+Frustum Frustum::FromViewProjection(const glm::mat4& viewProjection)
+{
+	glm::vec4 rows[4];
+	for (int i = 0; i < 4; i++)
+	{
+		rows[i] = glm::vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+	}
+
+	Frustum frustum;
+	frustum.planes[0] = rows[3] + rows[0];
+	frustum.planes[1] = rows[3] - rows[0];
+	frustum.planes[2] = rows[3] + rows[1];
+	frustum.planes[3] = rows[3] - rows[1];
+	frustum.planes[4] = rows[2]; // vulkan clips to 0 <= z, not -w <= z
+	frustum.planes[5] = rows[3] - rows[2];
+
+	for (glm::vec4& plane : frustum.planes)
+	{
+		plane /= glm::length(glm::vec3(plane));
+	}
+
+	return frustum;
+}
+
+// objects gathered into world space bounds per lane, one array per component so each plane test is a handful of vector ops
+constexpr uint32_t CullLanes = 8;
+
+struct alignas(32) BoundsBatch
+{
+	float centerX[CullLanes];
+	float centerY[CullLanes];
+	float centerZ[CullLanes];
+	float radius[CullLanes];
+	float extentX[CullLanes];
+	float extentY[CullLanes];
+	float extentZ[CullLanes];
+};
+
+static void GatherBounds(const RenderObject* objects, uint32_t start, uint32_t count, BoundsBatch& batch)
+{
+	for (uint32_t lane = 0; lane < CullLanes; lane++)
+	{
+		if (lane >= count)
+		{
+			// unused lanes are tested but never written back
+			batch.centerX[lane] = batch.centerY[lane] = batch.centerZ[lane] = 0.0f;
+			batch.radius[lane] = batch.extentX[lane] = batch.extentY[lane] = batch.extentZ[lane] = 0.0f;
+			continue;
+		}
+
+		const RenderObject& r = objects[start + lane];
+		const glm::mat4& m = r.transform;
+
+		glm::vec3 center = glm::vec3(m * glm::vec4(r.bounds.origin, 1.0f));
+
+		// world aabb enclosing the transformed box
+		glm::vec3 extent = glm::abs(glm::vec3(m[0])) * r.bounds.extents.x
+			+ glm::abs(glm::vec3(m[1])) * r.bounds.extents.y
+			+ glm::abs(glm::vec3(m[2])) * r.bounds.extents.z;
+
+		float scale = std::max(glm::length(glm::vec3(m[0])), std::max(glm::length(glm::vec3(m[1])), glm::length(glm::vec3(m[2]))));
+
+		batch.centerX[lane] = center.x;
+		batch.centerY[lane] = center.y;
+		batch.centerZ[lane] = center.z;
+		batch.radius[lane] = r.bounds.sphereRadius * scale;
+		batch.extentX[lane] = extent.x;
+		batch.extentY[lane] = extent.y;
+		batch.extentZ[lane] = extent.z;
+	}
+}
+
+// an object is culled when it is fully behind one plane. the sphere and the box both bound it,
+// so it is outside as soon as the smaller of the two projected radii is
+static uint32_t TestBatchScalar(const Frustum& frustum, const BoundsBatch& batch)
+{
+	uint32_t mask = 0;
+
+	for (uint32_t lane = 0; lane < CullLanes; lane++)
+	{
+		bool visible = true;
+
+		for (const glm::vec4& plane : frustum.planes)
+		{
+			float distance = plane.x * batch.centerX[lane] + plane.y * batch.centerY[lane] + plane.z * batch.centerZ[lane] + plane.w;
+			float boxRadius = std::abs(plane.x) * batch.extentX[lane] + std::abs(plane.y) * batch.extentY[lane] + std::abs(plane.z) * batch.extentZ[lane];
+
+			if (distance + std::min(batch.radius[lane], boxRadius) < 0.0f)
+			{
+				visible = false;
+				break;
+			}
+		}
+
+		mask |= visible ? (1u << lane) : 0u;
+	}
+
+	return mask;
+}
+
+#if defined(CULL_USE_AVX)
+static uint32_t TestBatchSimd(const Frustum& frustum, const BoundsBatch& batch)
+{
+	__m256 centerX = _mm256_load_ps(batch.centerX);
+	__m256 centerY = _mm256_load_ps(batch.centerY);
+	__m256 centerZ = _mm256_load_ps(batch.centerZ);
+	__m256 radius = _mm256_load_ps(batch.radius);
+	__m256 extentX = _mm256_load_ps(batch.extentX);
+	__m256 extentY = _mm256_load_ps(batch.extentY);
+	__m256 extentZ = _mm256_load_ps(batch.extentZ);
+	__m256 zero = _mm256_setzero_ps();
+
+	__m256 visible = _mm256_cmp_ps(zero, zero, _CMP_EQ_OQ);
+
+	for (const glm::vec4& plane : frustum.planes)
+	{
+		__m256 distance = _mm256_add_ps(
+			_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(plane.x), centerX), _mm256_mul_ps(_mm256_set1_ps(plane.y), centerY)),
+			_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(plane.z), centerZ), _mm256_set1_ps(plane.w)));
+
+		__m256 boxRadius = _mm256_add_ps(
+			_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(std::abs(plane.x)), extentX), _mm256_mul_ps(_mm256_set1_ps(std::abs(plane.y)), extentY)),
+			_mm256_mul_ps(_mm256_set1_ps(std::abs(plane.z)), extentZ));
+
+		__m256 inside = _mm256_cmp_ps(_mm256_add_ps(distance, _mm256_min_ps(radius, boxRadius)), zero, _CMP_GE_OQ);
+		visible = _mm256_and_ps(visible, inside);
+	}
+
+	return (uint32_t)_mm256_movemask_ps(visible);
+}
+#elif defined(CULL_USE_SSE)
+static uint32_t TestBatchSimd(const Frustum& frustum, const BoundsBatch& batch)
+{
+	uint32_t mask = 0;
+
+	for (uint32_t half = 0; half < CullLanes; half += 4)
+	{
+		__m128 centerX = _mm_load_ps(batch.centerX + half);
+		__m128 centerY = _mm_load_ps(batch.centerY + half);
+		__m128 centerZ = _mm_load_ps(batch.centerZ + half);
+		__m128 radius = _mm_load_ps(batch.radius + half);
+		__m128 extentX = _mm_load_ps(batch.extentX + half);
+		__m128 extentY = _mm_load_ps(batch.extentY + half);
+		__m128 extentZ = _mm_load_ps(batch.extentZ + half);
+		__m128 zero = _mm_setzero_ps();
+
+		__m128 visible = _mm_cmpeq_ps(zero, zero);
+
+		for (const glm::vec4& plane : frustum.planes)
+		{
+			__m128 distance = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.x), centerX), _mm_mul_ps(_mm_set1_ps(plane.y), centerY)),
+				_mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.z), centerZ), _mm_set1_ps(plane.w)));
+
+			__m128 boxRadius = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(_mm_set1_ps(std::abs(plane.x)), extentX), _mm_mul_ps(_mm_set1_ps(std::abs(plane.y)), extentY)),
+				_mm_mul_ps(_mm_set1_ps(std::abs(plane.z)), extentZ));
+
+			__m128 inside = _mm_cmpge_ps(_mm_add_ps(distance, _mm_min_ps(radius, boxRadius)), zero);
+			visible = _mm_and_ps(visible, inside);
+		}
+
+		mask |= (uint32_t)_mm_movemask_ps(visible) << half;
+	}
+
+	return mask;
+}
+#else
+static uint32_t TestBatchSimd(const Frustum& frustum, const BoundsBatch& batch)
+{
+	return TestBatchScalar(frustum, batch);
+}
+#endif
+
+template<uint32_t(*TestBatch)(const Frustum&, const BoundsBatch&)>
+static void CullObjects(const Frustum& frustum, const RenderObject* objects, uint32_t start, uint32_t end, uint8_t* visibility)
+{
+	BoundsBatch batch;
+
+	for (uint32_t first = start; first < end; first += CullLanes)
+	{
+		uint32_t count = std::min(CullLanes, end - first);
+
+		GatherBounds(objects, first, count, batch);
+		uint32_t mask = TestBatch(frustum, batch);
+
+		for (uint32_t lane = 0; lane < count; lane++)
+		{
+			visibility[first + lane] = (mask >> lane) & 1;
+		}
+	}
+}
+
+void FrustumCuller::SetViewProjection(const glm::mat4& viewProjection)
+{
+	frustum = Frustum::FromViewProjection(viewProjection);
+}
+
+void FrustumCuller::Cull(const RenderObject* objects, uint32_t count, std::vector<uint32_t>& outVisible, JobSystem* jobSystem)
+{
+	visibility.resize(count);
+
+	if (jobSystem)
+	{
+		// keep every range a whole number of batches so no batch straddles two threads
+		uint32_t rangeSize = std::max(batchSize / CullLanes, 1u) * CullLanes;
+		jobSystem->ParallelFor(count, rangeSize, [&](uint32_t start, uint32_t end)
+			{
+				CullRange(objects, start, end, visibility.data());
+			});
+	}
+	else
+	{
+		CullRange(objects, 0, count, visibility.data());
+	}
+
+	outVisible.clear();
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (visibility[i])
+		{
+			outVisible.push_back(i);
+		}
+	}
+}
+
+void FrustumCuller::CullRange(const RenderObject* objects, uint32_t start, uint32_t end, uint8_t* outVisibility) const
+{
+	CullObjects<TestBatchSimd>(frustum, objects, start, end, outVisibility);
+}
+
+void FrustumCuller::CullRangeScalar(const RenderObject* objects, uint32_t start, uint32_t end, uint8_t* outVisibility) const
+{
+	CullObjects<TestBatchScalar>(frustum, objects, start, end, outVisibility);
+}
+
+void CubeShadowCuller::SetLight(const glm::vec3& position, float radius, const glm::mat4 faceViewProjections[6])
+{
+	lightPosition = position;
+	lightRadius = radius;
+
+	for (int i = 0; i < 6; i++)
+	{
+		faces[i] = Frustum::FromViewProjection(faceViewProjections[i]);
+	}
+}
+
+void CubeShadowCuller::Cull(const RenderObject* objects, uint32_t count, std::vector<uint8_t>& outFaceMasks) const
+{
+	outFaceMasks.resize(count);
+
+	BoundsBatch batch;
+
+	for (uint32_t first = 0; first < count; first += CullLanes)
+	{
+		uint32_t laneCount = std::min(CullLanes, count - first);
+
+		GatherBounds(objects, first, laneCount, batch);
+
+		// bounding sphere against the light's sphere of influence first, most casters in a large scene fail here
+		uint32_t inRange = 0;
+		for (uint32_t lane = 0; lane < laneCount; lane++)
+		{
+			glm::vec3 toLight = glm::vec3(batch.centerX[lane], batch.centerY[lane], batch.centerZ[lane]) - lightPosition;
+			float reach = lightRadius + batch.radius[lane];
+
+			inRange |= glm::dot(toLight, toLight) <= reach * reach ? (1u << lane) : 0u;
+		}
+
+		uint8_t masks[CullLanes] = {};
+		if (inRange != 0)
+		{
+			for (uint32_t face = 0; face < 6; face++)
+			{
+				uint32_t visible = TestBatchSimd(faces[face], batch) & inRange;
+
+				for (uint32_t lane = 0; lane < laneCount; lane++)
+				{
+					masks[lane] |= ((visible >> lane) & 1) << face;
+				}
+			}
+		}
+
+		for (uint32_t lane = 0; lane < laneCount; lane++)
+		{
+			outFaceMasks[first + lane] = masks[lane];
+		}
+	}
+}
+
+const char* FrustumCuller::SimdPath()
+{
+#if defined(CULL_USE_AVX)
+	return "AVX";
+#elif defined(CULL_USE_SSE)
+	return "SSE";
+#else
+	return "Scalar";
+#endif
+}
+
+static GPUObjectData MakeObjectData(const RenderObject& r)
+{
+	GPUObjectData object = {};
+	object.transform = r.transform;
+	object.sphereBounds = glm::vec4(r.bounds.origin, r.bounds.sphereRadius);
+	object.extents = glm::vec4(r.bounds.extents, 0.0f);
+	object.indexCount = r.indexCount;
+	object.firstIndex = r.firstIndex;
+	object.vertexBuffer = r.vertexBufferAddress;
+	object.materialIndex = r.material->materialIndex;
+	object.vertexOffset = r.vertexOffset;
+	return object;
+}
+
+void ObjectRecordBuffer::Init(VulkanEngine* engine, uint32_t capacity)
+{
+	this->engine = engine;
+	CreateBuffer(capacity);
+}
+
+void ObjectRecordBuffer::Destroy()
+{
+	engine->DestroyBuffer(buffer);
+}
+
+void ObjectRecordBuffer::CreateBuffer(uint32_t newCapacity)
+{
+	capacity = std::max(newCapacity, 1u);
+
+	buffer = engine->CreateBuffer(capacity * sizeof(GPUObjectData), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+	address = vkutil::GetBufferAddress(engine->device, buffer.buffer);
+}
+
+void ObjectRecordBuffer::Sync(const std::vector<RenderObject>& surfaces, std::span<const uint32_t> dirtySlots, DeletionQueue& retired)
+{
+	uint32_t count = (uint32_t)surfaces.size();
+
+	slots.clear();
+
+	if (count > capacity)
+	{
+		// frames still in flight read the old records, it is destroyed once they are done
+		AllocatedBuffer old = buffer;
+		retired.PushFunction([engine = engine, old]() { engine->DestroyBuffer(old); });
+
+		CreateBuffer(std::max(count, capacity * 2));
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			slots.push_back(i);
+		}
+	}
+	else
+	{
+		for (uint32_t slot : dirtySlots)
+		{
+			// slots past the end were removed after being written
+			if (slot < count)
+			{
+				slots.push_back(slot);
+			}
+		}
+
+		std::sort(slots.begin(), slots.end());
+		slots.erase(std::unique(slots.begin(), slots.end()), slots.end());
+	}
+
+	// one buffer update per run of neighbouring slots
+	size_t first = 0;
+	while (first < slots.size())
+	{
+		size_t last = first + 1;
+		while (last < slots.size() && slots[last] == slots[last - 1] + 1)
+		{
+			last++;
+		}
+
+		staging.clear();
+		for (size_t i = first; i < last; i++)
+		{
+			staging.push_back(MakeObjectData(surfaces[slots[i]]));
+		}
+
+		engine->uploadManager.UpdateBuffer(buffer.buffer, staging.data(), staging.size() * sizeof(GPUObjectData), slots[first] * sizeof(GPUObjectData));
+		first = last;
+	}
+}
+
+void IndirectDrawBuffers::Init(VulkanEngine* engine, uint32_t objectCapacity, uint32_t batchCapacity)
+{
+	this->engine = engine;
+	CreateBuffers(objectCapacity, batchCapacity);
+}
+
+void IndirectDrawBuffers::Destroy()
+{
+	DestroyBuffers();
+	batches.clear();
+	batchLookup.clear();
+}
+
+void IndirectDrawBuffers::CreateBuffers(uint32_t newObjectCapacity, uint32_t newBatchCapacity)
+{
+	objectCapacity = std::max(newObjectCapacity, 1u);
+	batchCapacity = std::max(newBatchCapacity, 1u);
+
+	drawListBuffer = engine->CreateBuffer(sizeof(GPUCullHeader) + objectCapacity * sizeof(GPUCullDraw), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+	commandBuffer = engine->CreateBuffer(objectCapacity * sizeof(VkDrawIndexedIndirectCommand), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+	countBuffer = engine->CreateBuffer((batchCapacity + 2) * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+	readbackBuffer = engine->CreateBuffer(2 * sizeof(uint32_t), VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU);
+
+	drawListAddress = vkutil::GetBufferAddress(engine->device, drawListBuffer.buffer);
+	commandBufferAddress = vkutil::GetBufferAddress(engine->device, commandBuffer.buffer);
+	countBufferAddress = vkutil::GetBufferAddress(engine->device, countBuffer.buffer);
+
+	readbackPending = false;
+	preparedVersion = UINT64_MAX;
+}
+
+void IndirectDrawBuffers::DestroyBuffers()
+{
+	engine->DestroyBuffer(drawListBuffer);
+	engine->DestroyBuffer(commandBuffer);
+	engine->DestroyBuffer(countBuffer);
+	engine->DestroyBuffer(readbackBuffer);
+}
+
+void IndirectDrawBuffers::Prepare(const DrawContext& context, std::span<const uint32_t> opaqueDraws, uint64_t surfacesVersion)
+{
+	// the fence for this frame has been waited on, so the copy recorded last time is visible
+	if (readbackPending)
+	{
+		vmaInvalidateAllocation(engine->allocator, readbackBuffer.allocation, 0, VK_WHOLE_SIZE);
+		const uint32_t* visible = (const uint32_t*)readbackBuffer.info.pMappedData;
+		lastVisibleCount = visible[0];
+		lastVisibleTriangles = visible[1];
+		readbackPending = false;
+	}
+
+	// the object records live in their own buffer, so an unchanged list leaves nothing to write
+	if (surfacesVersion == preparedVersion && std::equal(opaqueDraws.begin(), opaqueDraws.end(), preparedDraws.begin(), preparedDraws.end()))
+	{
+		return;
+	}
+
+	opaqueCount = (uint32_t)opaqueDraws.size();
+
+	// group the opaque surfaces, each batch gets a contiguous range of command slots sized for all of its objects
+	batches.clear();
+	batchLookup.clear();
+	drawBatches.resize(opaqueCount);
+
+	for (uint32_t i = 0; i < opaqueCount; i++)
+	{
+		const RenderObject& r = context.OpaqueSurfaces[opaqueDraws[i]];
+
+		auto [it, inserted] = batchLookup.try_emplace(r.material->pipeline, (uint32_t)batches.size());
+		if (inserted)
+		{
+			batches.push_back(IndirectBatch{ r.material->pipeline, 0, 0, 0 });
+		}
+
+		IndirectBatch& batch = batches[it->second];
+		batch.objectCount++;
+		batch.triangleCount += r.indexCount / 3;
+		drawBatches[i] = it->second;
+	}
+
+	uint32_t nextCommandOffset = 0;
+	for (IndirectBatch& batch : batches)
+	{
+		batch.commandOffset = nextCommandOffset;
+		nextCommandOffset += batch.objectCount;
+	}
+
+	if (opaqueCount > objectCapacity || batches.size() > batchCapacity)
+	{
+		uint32_t newObjectCapacity = std::max(opaqueCount, objectCapacity * 2);
+		uint32_t newBatchCapacity = std::max((uint32_t)batches.size(), batchCapacity * 2);
+
+		DestroyBuffers();
+		CreateBuffers(newObjectCapacity, newBatchCapacity);
+	}
+
+	GPUCullDraw* draws = (GPUCullDraw*)((uint8_t*)drawListBuffer.info.pMappedData + sizeof(GPUCullHeader));
+
+	for (uint32_t i = 0; i < opaqueCount; i++)
+	{
+		draws[i] = GPUCullDraw{ opaqueDraws[i], drawBatches[i], batches[drawBatches[i]].commandOffset, 0 };
+	}
+
+	preparedDraws.assign(opaqueDraws.begin(), opaqueDraws.end());
+	preparedVersion = surfacesVersion;
+}
+
+void IndirectDrawBuffers::RecordCull(VkCommandBuffer cmd, VkPipeline pipeline, VkPipelineLayout layout, const Frustum& frustum, VkDeviceAddress objectRecords)
+{
+	if (opaqueCount == 0)
+	{
+		// nothing was submitted, show zero instead of what the last culled frame read back
+		lastVisibleCount = 0;
+		lastVisibleTriangles = 0;
+		return;
+	}
+
+	// the planes change every frame, the list behind them only when Prepare wrote it
+	GPUCullHeader* header = (GPUCullHeader*)drawListBuffer.info.pMappedData;
+	for (int i = 0; i < 6; i++)
+	{
+		header->frustumPlanes[i] = frustum.planes[i];
+	}
+	header->drawCount = opaqueCount;
+
+	vkCmdFillBuffer(cmd, countBuffer.buffer, 0, (batches.size() + 2) * sizeof(uint32_t), 0);
+
+	vkutil::GlobalBarrier(cmd, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+
+	GPUCullPushConstants pushConstants;
+	pushConstants.objectBuffer = objectRecords;
+	pushConstants.drawList = drawListAddress;
+	pushConstants.commandBuffer = commandBufferAddress;
+	pushConstants.countBuffer = countBufferAddress;
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+	vkCmdPushConstants(cmd, layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(GPUCullPushConstants), &pushConstants);
+	vkCmdDispatch(cmd, (opaqueCount + 63) / 64, 1, 1);
+
+	vkutil::GlobalBarrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_2_TRANSFER_READ_BIT);
+
+	// only the totals are read back, they land in host memory once this frame's fence signals
+	VkBufferCopy copy{ 0, 0, 2 * sizeof(uint32_t) };
+	vkCmdCopyBuffer(cmd, countBuffer.buffer, readbackBuffer.buffer, 1, &copy);
+
+	vkutil::GlobalBarrier(cmd, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_HOST_READ_BIT);
+
+	readbackPending = true;
+}
+
+void IndirectDrawBuffers::DrawBatch(VkCommandBuffer cmd, uint32_t batchIndex)
+{
+	const IndirectBatch& batch = batches[batchIndex];
+
+	vkCmdDrawIndexedIndirectCount(cmd,
+		commandBuffer.buffer, batch.commandOffset * sizeof(VkDrawIndexedIndirectCommand),
+		countBuffer.buffer, (batchIndex + 2) * sizeof(uint32_t),
+		batch.objectCount, sizeof(VkDrawIndexedIndirectCommand));
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include "vk_types.h"
+
+#include <unordered_map>
+
+class VulkanEngine;
+class JobSystem;
+struct RenderObject;
+struct DeletionQueue;
+
+// six planes pointing inwards, a point p is inside a plane when dot(plane.xyz, p) + plane.w >= 0
+struct Frustum
+{
+	glm::vec4 planes[6];
+
+	// left, right, bottom, top, near, far extracted from the rows of a view projection matrix
+	static Frustum FromViewProjection(const glm::mat4& viewProjection);
+};
+
+// cpu frustum culling, world space spheres and boxes are tested against the planes in SoA batches using AVX or SSE when available
+class FrustumCuller
+{
+public:
+	void SetViewProjection(const glm::mat4& viewProjection);
+
+	// writes the indices of the visible objects, lists longer than batchSize are split across the job system
+	void Cull(const RenderObject* objects, uint32_t count, std::vector<uint32_t>& outVisible, JobSystem* jobSystem = nullptr);
+
+	// writes 1 for visible and 0 for culled into visibility[start, end)
+	void CullRange(const RenderObject* objects, uint32_t start, uint32_t end, uint8_t* outVisibility) const;
+	void CullRangeScalar(const RenderObject* objects, uint32_t start, uint32_t end, uint8_t* outVisibility) const;
+
+	// instruction set CullRange was compiled for
+	static const char* SimdPath();
+
+	Frustum frustum;
+	uint32_t batchSize{ 1024 };
+
+private:
+	std::vector<uint8_t> visibility;
+};
+
+// point light shadow culling, each caster is tested against the light radius and the frustum of every cube face
+class CubeShadowCuller
+{
+public:
+	void SetLight(const glm::vec3& position, float radius, const glm::mat4 faceViewProjections[6]);
+
+	// writes a 6 bit mask per object of the faces it can cast into, 0 when it is outside the light radius
+	void Cull(const RenderObject* objects, uint32_t count, std::vector<uint8_t>& outFaceMasks) const;
+
+	Frustum faces[6];
+	glm::vec3 lightPosition;
+	float lightRadius;
+};
+
+// per object data read by cull.comp and mesh.vert, laid out to match std430
+struct GPUObjectData
+{
+	glm::mat4 transform;
+	glm::vec4 sphereBounds; // xyz local origin, w local radius
+	glm::vec4 extents;
+	uint32_t indexCount;
+	uint32_t firstIndex;
+	uint32_t padding[2];
+	VkDeviceAddress vertexBuffer;
+	uint32_t materialIndex;
+	int32_t vertexOffset;
+};
+
+// start of the per frame draw list, followed by drawCount GPUCullDraw
+struct GPUCullHeader
+{
+	glm::vec4 frustumPlanes[6];
+	uint32_t drawCount;
+	uint32_t padding[3];
+};
+
+// one opaque surface the gpu cull tests this frame
+struct GPUCullDraw
+{
+	uint32_t objectIndex; // slot in the opaque object records
+	uint32_t batchId;
+	uint32_t commandOffset;
+	uint32_t padding;
+};
+
+struct GPUCullPushConstants
+{
+	VkDeviceAddress objectBuffer;
+	VkDeviceAddress drawList;
+	VkDeviceAddress commandBuffer;
+	VkDeviceAddress countBuffer;
+};
+
+// device local GPUObjectData for every surface of one pass, indexed like the pass's array in the draw context. the
+// records outlive the frame, only the slots the proxy registry rewrote are copied again
+class ObjectRecordBuffer
+{
+public:
+	void Init(VulkanEngine* engine, uint32_t capacity);
+	void Destroy();
+
+	// stages the listed slots through the upload manager, so this has to run before the frame's RecordGraphicsWork.
+	// a buffer outgrown by the surfaces is replaced and filled completely, the old one goes into retired
+	void Sync(const std::vector<RenderObject>& surfaces, std::span<const uint32_t> dirtySlots, DeletionQueue& retired);
+
+	VkDeviceAddress address{ 0 };
+
+private:
+	void CreateBuffer(uint32_t newCapacity);
+
+	VulkanEngine* engine{ nullptr };
+
+	AllocatedBuffer buffer;
+	uint32_t capacity{ 0 };
+
+	std::vector<uint32_t> slots;
+	std::vector<GPUObjectData> staging;
+};
+
+// opaque surfaces sharing a pipeline, drawn with one indirect count call. materials are bindless and all meshes share the
+// geometry arena's index buffer, so nothing else splits a batch
+struct IndirectBatch
+{
+	MaterialPipeline* pipeline;
+	uint32_t commandOffset; // first command slot reserved for the batch
+	uint32_t objectCount; // slots reserved, the gpu writes how many of them are used
+	uint32_t triangleCount;
+};
+
+// per frame buffers for the gpu culling pass. the cpu lists the opaque surfaces to test by their object record,
+// cull.comp compacts the visible ones into each batch's range of the command buffer
+class IndirectDrawBuffers
+{
+public:
+	void Init(VulkanEngine* engine, uint32_t objectCapacity, uint32_t batchCapacity);
+	void Destroy();
+
+	// writes the draw list and builds the batches in the order the opaque surfaces are listed. both are kept when the
+	// list and surfacesVersion match what this frame's buffers were last prepared with. must be called after the frame
+	// fence, the buffers are regrown here if the scene outgrew them
+	void Prepare(const DrawContext& context, std::span<const uint32_t> opaqueDraws, uint64_t surfacesVersion);
+
+	// clears the counts, dispatches the cull shader over the opaque object records and copies the visible totals for readback
+	void RecordCull(VkCommandBuffer cmd, VkPipeline pipeline, VkPipelineLayout layout, const Frustum& frustum, VkDeviceAddress objectRecords);
+
+	// draws a batch from the compacted commands, the pipeline, descriptors and index buffer must already be bound
+	void DrawBatch(VkCommandBuffer cmd, uint32_t batchIndex);
+
+	std::vector<IndirectBatch> batches;
+	uint32_t opaqueCount{ 0 };
+
+	// visible opaque objects and their triangles from the last time this frame's buffers were submitted
+	uint32_t lastVisibleCount{ 0 };
+	uint32_t lastVisibleTriangles{ 0 };
+
+private:
+	void CreateBuffers(uint32_t newObjectCapacity, uint32_t newBatchCapacity);
+	void DestroyBuffers();
+
+	VulkanEngine* engine{ nullptr };
+
+	AllocatedBuffer drawListBuffer; // GPUCullHeader then GPUCullDraw per listed surface
+	AllocatedBuffer commandBuffer;
+	AllocatedBuffer countBuffer; // [0] visible objects, [1] visible triangles, [2 + batch] per batch draw count
+	AllocatedBuffer readbackBuffer;
+
+	VkDeviceAddress drawListAddress{ 0 };
+	VkDeviceAddress commandBufferAddress{ 0 };
+	VkDeviceAddress countBufferAddress{ 0 };
+
+	uint32_t objectCapacity{ 0 };
+	uint32_t batchCapacity{ 0 };
+	bool readbackPending{ false };
+
+	std::unordered_map<MaterialPipeline*, uint32_t> batchLookup;
+	std::vector<uint32_t> drawBatches;
+	std::vector<uint32_t> preparedDraws;
+	uint64_t preparedVersion{ UINT64_MAX };
+};
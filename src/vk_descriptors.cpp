@@ -1,21 +1,23 @@
 ﻿#include "vk_descriptors.h"
 
-void DescriptorLayoutBuilder::AddBinding(uint32_t binding, VkDescriptorType type)
+void DescriptorLayoutBuilder::AddBinding(uint32_t binding, VkDescriptorType type, uint32_t count, VkDescriptorBindingFlags flags)
 {
 	VkDescriptorSetLayoutBinding newBind{};
 	newBind.binding = binding;
-	newBind.descriptorCount = 1;
+	newBind.descriptorCount = count;
 	newBind.descriptorType = type;
 
 	bindings.push_back(newBind);
+	bindingFlags.push_back(flags);
 }
 
 void DescriptorLayoutBuilder::Clear()
 {
 	bindings.clear();
+	bindingFlags.clear();
 }
 
-VkDescriptorSetLayout DescriptorLayoutBuilder::Build(VkDevice device, VkShaderStageFlags shaderStages)
+VkDescriptorSetLayout DescriptorLayoutBuilder::Build(VkDevice device, VkShaderStageFlags shaderStages, VkDescriptorSetLayoutCreateFlags layoutFlags)
 {
 	for (auto& bind : bindings)
 	{
@@ -27,7 +29,21 @@ VkDescriptorSetLayout DescriptorLayoutBuilder::Build(VkDevice device, VkShaderSt
 
 	info.pBindings = bindings.data();
 	info.bindingCount = (uint32_t)bindings.size();
-	info.flags = 0;
+	info.flags = layoutFlags;
+
+	// binding flags are only chained when a binding uses them (partially bound, update after bind)
+	VkDescriptorSetLayoutBindingFlagsCreateInfo flagsInfo = { .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO };
+	flagsInfo.bindingCount = (uint32_t)bindingFlags.size();
+	flagsInfo.pBindingFlags = bindingFlags.data();
+
+	for (VkDescriptorBindingFlags flags : bindingFlags)
+	{
+		if (flags != 0)
+		{
+			info.pNext = &flagsInfo;
+			break;
+		}
+	}
 
 	VkDescriptorSetLayout set;
 	VK_CHECK(vkCreateDescriptorSetLayout(device, &info, nullptr, &set));
@@ -221,7 +237,7 @@ void DescriptorWriter::WriteBuffer(int binding, VkBuffer buffer, size_t size, si
 	writes.push_back(write);
 }
 
-void DescriptorWriter::WriteImage(int binding, VkImageView image, VkSampler sampler, VkImageLayout layout, VkDescriptorType type)
+void DescriptorWriter::WriteImage(int binding, VkImageView image, VkSampler sampler, VkImageLayout layout, VkDescriptorType type, uint32_t arrayElement)
 {
 	VkDescriptorImageInfo& info = imageInfos.emplace_back(VkDescriptorImageInfo
 		{
@@ -234,6 +250,7 @@ void DescriptorWriter::WriteImage(int binding, VkImageView image, VkSampler samp
 
 	write.dstBinding = binding;
 	write.dstSet = VK_NULL_HANDLE; // left empty until we need to write to it
+	write.dstArrayElement = arrayElement;
 	write.descriptorCount = 1;
 	write.descriptorType = type;
 	write.pImageInfo = &info;
@@ -256,4 +273,139 @@ void DescriptorWriter::UpdateSet(VkDevice device, VkDescriptorSet set)
 	}
 
 	vkUpdateDescriptorSets(device, (uint32_t)writes.size(), writes.data(), 0, nullptr);
-}
\ No newline at end of file
+}
+
+size_t DescriptorSetKeyHash::operator()(const DescriptorSetKey& key) const
+{
+	size_t result = std::hash<uint64_t>{}((uint64_t)key.layout);
+
+	auto combine = [&](uint64_t value)
+	{
+		result ^= std::hash<uint64_t>{}(value) + 0x9e3779b97f4a7c15ull + (result << 6) + (result >> 2);
+	};
+
+	for (const DescriptorSetKey::Binding& b : key.bindings)
+	{
+		combine(((uint64_t)b.binding << 32) | (uint64_t)b.type);
+		combine(b.resource);
+		combine(b.sampler);
+		combine(b.offset);
+		combine(b.range);
+	}
+
+	return result;
+}
+
+void DescriptorSetCache::Init(VkDevice device, uint32_t initialSets, std::span<DescriptorAllocatorGrowable::PoolSizeRatio> poolRatios, uint32_t framesInFlight)
+{
+	this->framesInFlight = framesInFlight;
+	allocator.InitPools(device, initialSets, poolRatios);
+}
+
+void DescriptorSetCache::Destroy(VkDevice device)
+{
+	sets.clear();
+	retired.clear();
+	freeSets.clear();
+	allocator.DestroyPools(device);
+}
+
+void DescriptorSetCache::BeginFrame(int frameNumber)
+{
+	currentFrame = frameNumber;
+
+	// the last command buffer that could bind a set was recorded in the frame it was invalidated, its fence has been
+	// waited on once framesInFlight more frames were started
+	while (!retired.empty() && currentFrame > retired.front().frame + (int)framesInFlight)
+	{
+		freeSets[retired.front().layout].push_back(retired.front().set);
+		retired.pop_front();
+	}
+}
+
+VkDescriptorSet DescriptorSetCache::Get(VkDevice device, VkDescriptorSetLayout layout, DescriptorWriter& writer)
+{
+	DescriptorSetKey key;
+	key.layout = layout;
+	key.bindings.reserve(writer.writes.size());
+
+	for (const VkWriteDescriptorSet& write : writer.writes)
+	{
+		DescriptorSetKey::Binding b{};
+		b.binding = write.dstBinding;
+		b.type = write.descriptorType;
+
+		if (write.pBufferInfo)
+		{
+			b.resource = (uint64_t)write.pBufferInfo->buffer;
+			b.offset = write.pBufferInfo->offset;
+			b.range = write.pBufferInfo->range;
+		}
+		else if (write.pImageInfo)
+		{
+			b.resource = (uint64_t)write.pImageInfo->imageView;
+			b.sampler = (uint64_t)write.pImageInfo->sampler;
+			b.range = write.pImageInfo->imageLayout;
+		}
+
+		key.bindings.push_back(b);
+	}
+
+	auto it = sets.find(key);
+	if (it != sets.end())
+	{
+		hits++;
+		return it->second;
+	}
+
+	misses++;
+
+	VkDescriptorSet set;
+
+	std::vector<VkDescriptorSet>& reusable = freeSets[layout];
+	if (!reusable.empty())
+	{
+		set = reusable.back();
+		reusable.pop_back();
+	}
+	else
+	{
+		set = allocator.Allocate(device, layout);
+	}
+
+	writer.UpdateSet(device, set);
+
+	sets.emplace(std::move(key), set);
+	return set;
+}
+
+void DescriptorSetCache::InvalidateImageView(VkImageView imageView)
+{
+	Invalidate((uint64_t)imageView);
+}
+
+void DescriptorSetCache::InvalidateBuffer(VkBuffer buffer)
+{
+	Invalidate((uint64_t)buffer);
+}
+
+void DescriptorSetCache::Invalidate(uint64_t resource)
+{
+	if (resource == 0)
+	{
+		return;
+	}
+
+	std::erase_if(sets, [&](const auto& entry)
+		{
+			for (const DescriptorSetKey::Binding& b : entry.first.bindings)
+			{
+				if (b.resource == resource)
+				{
+					retired.push_back(RetiredSet{ entry.first.layout, entry.second, currentFrame });
+					return true;
+				}
+			}
+			return false;
+		});
+}
@@ -2,13 +2,16 @@
 
 #include "vk_types.h"
 
+#include <unordered_map>
+
 struct DescriptorLayoutBuilder
 {
 	std::vector<VkDescriptorSetLayoutBinding> bindings;
+	std::vector<VkDescriptorBindingFlags> bindingFlags;
 
-	void AddBinding(uint32_t binding, VkDescriptorType type);
+	void AddBinding(uint32_t binding, VkDescriptorType type, uint32_t count = 1, VkDescriptorBindingFlags flags = 0);
 	void Clear();
-	VkDescriptorSetLayout Build(VkDevice device, VkShaderStageFlags shaderStages);
+	VkDescriptorSetLayout Build(VkDevice device, VkShaderStageFlags shaderStages, VkDescriptorSetLayoutCreateFlags layoutFlags = 0);
 };
 
 struct DescriptorAllocator
@@ -60,9 +63,75 @@ struct DescriptorWriter
 	std::deque<VkDescriptorBufferInfo> bufferInfos;
 	std::vector<VkWriteDescriptorSet> writes;
 
-	void WriteImage(int binding, VkImageView image, VkSampler sampler, VkImageLayout layout, VkDescriptorType type);
+	void WriteImage(int binding, VkImageView image, VkSampler sampler, VkImageLayout layout, VkDescriptorType type, uint32_t arrayElement = 0);
 	void WriteBuffer(int binding, VkBuffer buffer, size_t size, size_t offset, VkDescriptorType type);
 
 	void clear();
 	void UpdateSet(VkDevice device, VkDescriptorSet set);
+};
+
+// identifies a descriptor set by its layout and the resources written into each binding
+struct DescriptorSetKey
+{
+	struct Binding
+	{
+		uint32_t binding;
+		VkDescriptorType type;
+		uint64_t resource; // buffer or image view
+		uint64_t sampler;
+		uint64_t offset;
+		uint64_t range; // buffer range or image layout
+
+		bool operator==(const Binding& other) const = default;
+	};
+
+	VkDescriptorSetLayout layout;
+	std::vector<Binding> bindings;
+
+	bool operator==(const DescriptorSetKey& other) const = default;
+};
+
+struct DescriptorSetKeyHash
+{
+	size_t operator()(const DescriptorSetKey& key) const;
+};
+
+// hands out the same descriptor set for as long as the layout and writes are unchanged, so static sets are only allocated and written once
+class DescriptorSetCache
+{
+public:
+	void Init(VkDevice device, uint32_t initialSets, std::span<DescriptorAllocatorGrowable::PoolSizeRatio> poolRatios, uint32_t framesInFlight);
+	void Destroy(VkDevice device);
+
+	// call after the frame's fence, sets invalidated more than framesInFlight frames ago can be written again
+	void BeginFrame(int frameNumber);
+
+	VkDescriptorSet Get(VkDevice device, VkDescriptorSetLayout layout, DescriptorWriter& writer);
+
+	// drop every set referencing a resource that is about to be destroyed, its handle may be reused afterwards
+	void InvalidateImageView(VkImageView imageView);
+	void InvalidateBuffer(VkBuffer buffer);
+
+	uint32_t hits{ 0 };
+	uint32_t misses{ 0 };
+
+private:
+	struct RetiredSet
+	{
+		VkDescriptorSetLayout layout;
+		VkDescriptorSet set;
+		int frame; // frameNumber when it was invalidated
+	};
+
+	void Invalidate(uint64_t resource);
+
+	// sets are never freed to the pools, an invalidated one is reused for the next miss with the same layout
+	// once no frame in flight can still be reading it
+	DescriptorAllocatorGrowable allocator;
+	std::unordered_map<DescriptorSetKey, VkDescriptorSet, DescriptorSetKeyHash> sets;
+	std::deque<RetiredSet> retired;
+	std::unordered_map<VkDescriptorSetLayout, std::vector<VkDescriptorSet>> freeSets;
+
+	uint32_t framesInFlight{ 0 };
+	int currentFrame{ 0 };
 };
\ No newline at end of file
@@ -27,6 +27,8 @@
 #include "vk_images.h"
 #include "vk_pipelines.h"
 
+#include <algorithm>
+#include <cfloat>
 #include <chrono>
 #include <thread>
 
@@ -54,6 +56,8 @@ void VulkanEngine::Init()
         windowExtent.height,
         window_flags);
 
+    jobSystem.Init();
+
     InitVulkan();
 
     InitSwapchain();
@@ -92,6 +96,11 @@ void VulkanEngine::Init()
     assert(cubeFile.has_value());
 
     loadedScenes["cube"] = *cubeFile;
+
+    // surfaces are registered once, UpdateScene only rewrites what changed
+    renderProxies.Init(&mainDrawContext);
+    structureScene = renderProxies.AddScene(loadedScenes["structure"], glm::mat4{ 1.0f });
+    cubeScene = renderProxies.AddScene(loadedScenes["cube"], glm::mat4{ 1.0f }, false); // light marker, kept out of the shadow map
 }
 
 void VulkanEngine::Cleanup()
@@ -99,10 +108,23 @@ void VulkanEngine::Cleanup()
     if (isInitialized) {
         vkDeviceWaitIdle(device);
 
+        renderProxies.Clear();
         loadedScenes.clear();
 
+        // resources retired during the last frames, before the allocator goes away with the main queue
+        for (int i = 0; i < FRAME_OVERLAP; i++)
+        {
+            frames[i].deletionQueue.Flush();
+        }
+
         mainDeletionQueue.Flush();
 
+        // written after every pipeline of the run went through it
+        pipelineCache.Save();
+        pipelineCache.Destroy();
+
+        jobSystem.Shutdown();
+
         for (int i = 0; i < FRAME_OVERLAP; i++)
         {
             vkDestroyCommandPool(device, frames[i].commandPool, nullptr);
@@ -140,6 +162,13 @@ void VulkanEngine::Draw()
 
     GetCurrentFrame().deletionQueue.Flush();
     GetCurrentFrame().frameDescriptors.ClearPools(device);
+    GetCurrentFrame().uniformAllocator.Reset();
+    descriptorSetCache.BeginFrame(frameNumber);
+
+    // surfaces the registry wrote since the last frame, the copies are recorded by RecordGraphicsWork before the cull reads them
+    opaqueObjects.Sync(mainDrawContext.OpaqueSurfaces, renderProxies.DirtySlots(false), GetCurrentFrame().deletionQueue);
+    transparentObjects.Sync(mainDrawContext.TransparentSurfaces, renderProxies.DirtySlots(true), GetCurrentFrame().deletionQueue);
+    renderProxies.ClearDirtySlots();
 
     VK_CHECK(vkResetFences(device, 1, &GetCurrentFrame().renderFence));
 
@@ -159,6 +188,12 @@ void VulkanEngine::Draw()
 
     VK_CHECK(vkBeginCommandBuffer(cmd, &cmdBeginInfo));
 
+    // reads back the timings this frame slot recorded FRAME_OVERLAP frames ago
+    gpuProfiler.BeginFrame(cmd, frameNumber % FRAME_OVERLAP, frameNumber);
+
+    // take ownership of finished uploads and apply streamed buffer updates before anything reads them
+    UploadToken uploadWaitValue = uploadManager.RecordGraphicsWork(cmd);
+
     // transition draw image into general layoutn to write into it
 
     vkutil::TransititionImage(cmd, colorImage.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
@@ -168,52 +203,116 @@ void VulkanEngine::Draw()
     vkutil::TransititionImage(cmd, drawImage.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
     vkutil::TransititionImage(cmd, colorImage.image, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
     vkutil::TransititionImage(cmd, depthImage.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL);
-    vkutil::TransititionImage(cmd, depthCubemapImage.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL);
+    vkutil::TransititionImage(cmd, accumulationImage.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+    vkutil::TransititionImage(cmd, revealageImage.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+    if (engineSettings.msaaSamples != VK_SAMPLE_COUNT_1_BIT)
+    {
+        vkutil::TransititionImage(cmd, accumulationResolveImage.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+        vkutil::TransititionImage(cmd, revealageResolveImage.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+    }
+
+    // gpu particles never leave the gpu, they are simulated for this frame before any rendering.
+    // the cpu backend writes straight into this frame's mapped buffer, which is free again after the fence. both draw
+    // with the settings in the emitter table
+    if (engineSettings.drawParticles)
+    {
+        particleSystem.Prepare(frameNumber % FRAME_OVERLAP);
+    }
 
-    DrawDepthMap(cmd);
+    if (engineSettings.drawParticles && engineSettings.cpuParticles)
+    {
+        ParticleGPUData* particleData = (ParticleGPUData*)cpuParticleBuffer.WritePointer(frameNumber % FRAME_OVERLAP);
+        cpuParticleEmitter.Update(glm::vec3(0.0f, 1.0f, 0.0f), stats.frameTime / 1000.0f, mainCamera.position, particleData, &jobSystem);
+        cpuParticleBuffer.Flush(this, frameNumber % FRAME_OVERLAP, cpuParticleEmitter.particleCount * sizeof(ParticleGPUData));
+    }
+    else if (engineSettings.drawParticles)
+    {
+        GpuProfileScope scope(gpuProfiler, cmd, "Particle Simulation");
+        particleSystem.RecordUpdate(cmd, particleSimPipeline, particleSortPipeline, particleComputeLayout, frameNumber % FRAME_OVERLAP, stats.frameTime / 1000.0f, mainCamera.position);
+    }
 
-    UpdateSceneNonShadow();
+    // leaves the shadow atlas in depth read only layout
+    {
+        GpuProfileScope scope(gpuProfiler, cmd, "Depth Map");
+        DrawDepthMap(cmd);
+    }
 
-    DrawSkybox(cmd);
+    {
+        GpuProfileScope scope(gpuProfiler, cmd, "Skybox");
+        DrawSkybox(cmd);
+    }
 
-    vkutil::TransititionImage(cmd, depthCubemapImage.image, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL);
+    // opaque surfaces, then transparent surfaces and particles into the weighted blended targets
+    {
+        GpuProfileScope scope(gpuProfiler, cmd, "Geometry");
+        DrawGeometry(cmd);
+    }
 
-    DrawGeometry(cmd);
+    {
+        GpuProfileScope scope(gpuProfiler, cmd, "Transparent Composite");
+        DrawTransparentComposite(cmd);
+    }
 
-    //DrawParticles(cmd);
+    stats.uniformBytesStreamed = GetCurrentFrame().uniformAllocator.head;
+    stats.descriptorCacheHits = descriptorSetCache.hits;
+    stats.descriptorCacheMisses = descriptorSetCache.misses;
+    descriptorSetCache.hits = 0;
+    descriptorSetCache.misses = 0;
+    stats.geometry = geometryArena.GetStats();
 
     vkutil::TransititionImage(cmd, colorImage.image, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
 
-    if (engineSettings.msaaSamples == VK_SAMPLE_COUNT_1_BIT)
     {
-        vkutil::CopyImageToImage(cmd, colorImage.image, drawImage.image, drawExtent, drawExtent);
-    }
-    else
-    {
-        vkutil::ResolveImage(cmd, colorImage.image, drawImage.image, drawImage.imageExtent);
+        GpuProfileScope scope(gpuProfiler, cmd, "Resolve");
+        if (engineSettings.msaaSamples == VK_SAMPLE_COUNT_1_BIT)
+        {
+            vkutil::CopyImageToImage(cmd, colorImage.image, drawImage.image, drawExtent, drawExtent);
+        }
+        else
+        {
+            vkutil::ResolveImage(cmd, colorImage.image, drawImage.image, drawImage.imageExtent);
+        }
     }
 
     // transition draw image and swapchain image into correct transfer layouts
-    vkutil::TransititionImage(cmd, drawImage.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
-    vkutil::TransititionImage(cmd, swapchainImages[swapchainImageIndex], VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-    vkutil::CopyImageToImage(cmd, drawImage.image, swapchainImages[swapchainImageIndex], drawExtent, swapchainExtent);
+    {
+        GpuProfileScope scope(gpuProfiler, cmd, "Blit");
+        vkutil::TransititionImage(cmd, drawImage.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+        vkutil::TransititionImage(cmd, swapchainImages[swapchainImageIndex], VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+        vkutil::CopyImageToImage(cmd, drawImage.image, swapchainImages[swapchainImageIndex], drawExtent, swapchainExtent);
+    }
 
     vkutil::TransititionImage(cmd, swapchainImages[swapchainImageIndex], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
 
-    DrawImGui(cmd, swapchainImageViews[swapchainImageIndex]);
+    {
+        GpuProfileScope scope(gpuProfiler, cmd, "ImGui");
+        DrawImGui(cmd, swapchainImageViews[swapchainImageIndex]);
+    }
 
     vkutil::TransititionImage(cmd, swapchainImages[swapchainImageIndex], VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
 
+    gpuProfiler.EndFrame(cmd);
+
     // finalize command buffer
     VK_CHECK(vkEndCommandBuffer(cmd));
     //
 
     VkCommandBufferSubmitInfo cmdinfo = vkinit::command_buffer_submit_info(cmd);
 
-    VkSemaphoreSubmitInfo waitInfo = vkinit::semaphore_submit_info(VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR, GetCurrentFrame().swapchainSemaphore);
-    VkSemaphoreSubmitInfo signalInfo = vkinit::semaphore_submit_info(VK_PIPELINE_STAGE_2_ALL_GRAPHICS_BIT, GetCurrentFrame().renderSemaphore);
+    VkSemaphoreSubmitInfo waitInfos[2];
+    waitInfos[0] = vkinit::semaphore_submit_info(VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR, GetCurrentFrame().swapchainSemaphore);
+    waitInfos[1] = vkinit::semaphore_submit_info(VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, uploadManager.uploadTimeline);
+    waitInfos[1].value = uploadWaitValue;
+
+    VkSemaphoreSubmitInfo signalInfos[2];
+    signalInfos[0] = vkinit::semaphore_submit_info(VK_PIPELINE_STAGE_2_ALL_GRAPHICS_BIT, GetCurrentFrame().renderSemaphore);
+    signalInfos[1] = vkinit::semaphore_submit_info(VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, uploadManager.graphicsTimeline);
+    signalInfos[1].value = uploadManager.NextGraphicsValue();
 
-    VkSubmitInfo2 submit = vkinit::submit_info(&cmdinfo, &signalInfo, &waitInfo);
+    VkSubmitInfo2 submit = vkinit::submit_info(&cmdinfo, signalInfos, waitInfos);
+    // only the first frame after an upload waits on the transfer queue
+    submit.waitSemaphoreInfoCount = uploadWaitValue != 0 ? 2 : 1;
+    submit.signalSemaphoreInfoCount = 2;
 
     VK_CHECK(vkQueueSubmit2(graphicsQueue, 1, &submit, GetCurrentFrame().renderFence));
 
@@ -308,9 +407,98 @@ void VulkanEngine::Run()
                 ImGui::Text("Framerate %f fps", stats.framesPerSecond);
                 ImGui::Text("Frametime %f ms", stats.frameTime);
                 ImGui::Text("Draw Time %f ms", stats.meshDrawTime);
+
+                // measured on the gpu, FRAME_OVERLAP frames behind. last, then average, min and max over the history
+                if (gpuProfiler.Supported())
+                {
+                    for (const GpuScopeStats& scope : gpuProfiler.scopes)
+                    {
+                        ImGui::Text("GPU %s %.3f ms (avg %.3f, min %.3f, max %.3f)", scope.name.c_str(), scope.last, scope.average, scope.min, scope.max);
+                    }
+
+                    bool logging = gpuProfiler.IsLoggingCsv();
+                    if (ImGui::Checkbox("Log GPU Timings To CSV", &logging))
+                    {
+                        if (logging)
+                        {
+                            gpuProfiler.StartCsv(engineSettings.gpuTimingsCsvPath);
+                        }
+                        else
+                        {
+                            gpuProfiler.StopCsv();
+                        }
+                    }
+                }
+                else
+                {
+                    ImGui::Text("GPU timings unsupported, the graphics queue has no timestamp bits");
+                }
                 ImGui::Text("Update Time %f ms", stats.sceneUpdateTime);
-                ImGui::Text("Triangles %i", stats.triangleCount);
+                ImGui::Text("Triangles Submitted %i, Opaque Visible %i", stats.triangleCount, stats.trianglesVisible);
                 ImGui::Text("Draws %i", stats.drawcallCount);
+                ImGui::Text("CPU Cull %f ms, %i / %i objects", stats.cullTime, stats.objectsSubmitted, stats.opaqueObjects);
+                ImGui::Text("Objects Visible %i / %i", stats.objectsVisible, stats.objectsSubmitted);
+                ImGui::Text("Render Proxies %i (%i rewritten)", stats.proxyCount, stats.proxiesUpdated);
+                ImGui::Text("Sort %f ms%s", stats.sortTime, stats.sortSkipped ? " (skipped)" : "");
+                ImGui::Text("Binds: Pipeline %i Descriptor %i Index %i", stats.pipelineBinds, stats.descriptorBinds, stats.indexBufferBinds);
+                ImGui::Text("Bindless: Materials %i Textures %i Samplers %i", bindlessMaterials.materialCount, bindlessMaterials.textureCount, bindlessMaterials.samplerCount);
+                ImGui::Text("Shadow Casters %i, Face Draws %i", stats.shadowCasters, stats.shadowFaceDraws);
+                ImGui::Text("Shadow Faces: Skipped %i Partial %i Full %i Deferred %i", stats.shadowAtlas.facesSkipped, stats.shadowAtlas.facesPartial, stats.shadowAtlas.facesFull, stats.shadowAtlas.facesDeferred);
+                ImGui::Text("Shadow Faces Total: Skipped %llu Partial %llu Full %llu Deferred %llu", (unsigned long long)shadowAtlas.totalSkipped, (unsigned long long)shadowAtlas.totalPartial, (unsigned long long)shadowAtlas.totalFull, (unsigned long long)shadowAtlas.totalDeferred);
+                ImGui::Text("Shadow Atlas %.1f / %.1f MB", stats.shadowAtlas.memoryUsed / (1024.0f * 1024.0f), stats.shadowAtlas.memoryCap / (1024.0f * 1024.0f));
+                for (uint32_t tier = 0; tier < SHADOW_TIER_COUNT; tier++)
+                {
+                    ImGui::Text("  %u px: %u / %u cubes", shadowAtlas.tiers[tier].resolution, stats.shadowAtlas.tierCubesUsed[tier], stats.shadowAtlas.tierCubes[tier]);
+                }
+                ImGui::Text("Shadowed Lights %i (%i demoted), Unshadowed %i", stats.shadowAtlas.shadowedLights, stats.shadowAtlas.demotedLights, stats.shadowAtlas.unshadowedLights);
+                ImGui::Text("Geometry Arena: %i meshes", stats.geometry.allocationCount);
+                ImGui::Text("Vertices %u / %u, Indices %u / %u", stats.geometry.vertexUsed, stats.geometry.vertexCapacity, stats.geometry.indexUsed, stats.geometry.indexCapacity);
+                ImGui::Text("Free Blocks %u, Fragmentation %.1f%%", stats.geometry.freeBlocks, stats.geometry.fragmentation * 100.0f);
+                ImGui::Text("Uniform Data %i bytes", (int)stats.uniformBytesStreamed);
+                ImGui::Text("Descriptor Cache Hits %i Misses %i", stats.descriptorCacheHits, stats.descriptorCacheMisses);
+                ImGui::Text("Pipelines Built %.1f ms, %s", pipelineCache.stats.buildTime, pipelineCache.stats.loaded ? "warm cache" : "cold");
+                ImGui::Text("Material Variants %i", metalRoughMaterial.VariantCount());
+                if (pipelineCache.stats.loaded && pipelineCache.stats.coldBuildTime > 0.0f)
+                {
+                    ImGui::Text("Pipeline Cache Saved %.1f ms", pipelineCache.stats.coldBuildTime - pipelineCache.stats.buildTime);
+                }
+            }
+
+            if (ImGui::CollapsingHeader("Culling"))
+            {
+                ImGui::Text("SIMD Path: %s", FrustumCuller::SimdPath());
+                ImGui::Checkbox("CPU Frustum Culling", &engineSettings.cpuFrustumCulling);
+
+                if (ImGui::Button("Run Culling Benchmark"))
+                {
+                    cullBenchmarkRequested = true;
+                }
+
+                if (cullBenchmark.iterations > 0)
+                {
+                    ImGui::Text("%i objects, %i iterations", cullBenchmark.objectCount, cullBenchmark.iterations);
+                    ImGui::Text("IsVisible %f ms (%i visible)", cullBenchmark.isVisibleTime, cullBenchmark.isVisibleCount);
+                    ImGui::Text("Batched Scalar %f ms", cullBenchmark.scalarTime);
+                    ImGui::Text("Batched SIMD %f ms (%i visible)", cullBenchmark.simdTime, cullBenchmark.simdCount);
+                    ImGui::Text("Batched SIMD Threaded %f ms", cullBenchmark.parallelTime);
+                }
+            }
+
+            if (ImGui::CollapsingHeader("Transforms"))
+            {
+                if (ImGui::Button("Run Transform Benchmark (100k nodes)"))
+                {
+                    transformBenchmark = RunTransformBenchmark(100000, &jobSystem);
+                }
+
+                if (transformBenchmark.nodeCount > 0)
+                {
+                    ImGui::Text("Recursive shared_ptr %f ms", transformBenchmark.recursiveTime);
+                    ImGui::Text("Flat %f ms", transformBenchmark.flatTime);
+                    ImGui::Text("Flat Threaded %f ms", transformBenchmark.flatParallelTime);
+                    ImGui::Text("Flat 1%% Dirty %f ms", transformBenchmark.flatPartialTime);
+                    ImGui::Text("Flat Clean %f ms", transformBenchmark.flatCleanTime);
+                }
             }
 
             if (ImGui::CollapsingHeader("Scene Data"))
@@ -330,8 +518,125 @@ void VulkanEngine::Run()
             {
                 ImGui::InputFloat("Shadow Draw Distance", (float*)&sceneData.shadowFarPlane);
                 ImGui::InputFloat("Shadow Bias", (float*)&sceneData.shadowBias);
-                ImGui::InputInt("Shadow Anti-Aliasing Samples ", (int*)&sceneData.shadowAASamples);
+                // both are specialization constants, every material variant is rebuilt when they change
+                bool shadowsChanged = ImGui::Checkbox("Shadows", &engineSettings.shadows);
+                int shadowSamples = (int)engineSettings.shadowSamples;
+                if (ImGui::SliderInt("Shadow Anti-Aliasing Samples ", &shadowSamples, 1, 20))
+                {
+                    engineSettings.shadowSamples = (uint32_t)std::clamp(shadowSamples, 1, 20);
+                    shadowsChanged = true;
+                }
+                if (shadowsChanged)
+                {
+                    vkDeviceWaitIdle(device);
+                    metalRoughMaterial.RebuildPipelines(this);
+                }
                 ImGui::InputFloat("PCF Sampling Modifier", (float*)&sceneData.gridSamplingDiskModifier);
+
+                int faceBudget = (int)engineSettings.shadowAtlas.faceBudget;
+                if (ImGui::InputInt("Shadow Faces Per Frame", &faceBudget))
+                {
+                    engineSettings.shadowAtlas.faceBudget = (uint32_t)std::max(faceBudget, 0);
+                }
+            }
+
+            if (ImGui::CollapsingHeader("Point Lights"))
+            {
+                ImGui::Text("Lights %i / %i (light 0 is set under Lighting Data)", (int)pointLights.size(), MAX_POINT_LIGHTS);
+
+                // scattered around light 0 with its power and shadow radius
+                if (ImGui::Button("Add 8 Lights"))
+                {
+                    for (uint32_t i = 0; i < 8 && pointLights.size() < MAX_POINT_LIGHTS; i++)
+                    {
+                        auto random = []() { return (float)rand() / (float)RAND_MAX; };
+
+                        PointLight light;
+                        light.position = pointLights[0].position + glm::vec3(random() * 16.0f - 8.0f, random() * 3.0f, random() * 16.0f - 8.0f);
+                        light.power = pointLights[0].power * 0.5f;
+                        light.color = glm::vec3(0.5f + random() * 0.5f, 0.5f + random() * 0.5f, 0.5f + random() * 0.5f);
+                        light.radius = pointLights[0].radius * 0.5f;
+                        pointLights.push_back(light);
+                    }
+                }
+
+                ImGui::SameLine();
+
+                if (ImGui::Button("Remove Added Lights"))
+                {
+                    pointLights.resize(1);
+                }
+            }
+
+            if (ImGui::CollapsingHeader("Particles"))
+            {
+                ImGui::Checkbox("Draw Particles", &engineSettings.drawParticles);
+
+                int particleCount = (int)particleSystem.ParticleCount(smokeEmitter);
+                if (ImGui::InputInt("Particle Count", &particleCount, 1000, 100000))
+                {
+                    particleSystem.SetParticleCount(smokeEmitter, (uint32_t)std::max(particleCount, 1));
+                }
+
+                if (ImGui::Button("Spawn 64 Emitters"))
+                {
+                    SpawnParticleEmitters(64, 2000);
+                }
+                ImGui::SameLine();
+                if (ImGui::Button("Clear Emitters"))
+                {
+                    for (uint32_t emitter : spawnedEmitters)
+                    {
+                        particleSystem.DestroyEmitter(emitter);
+                    }
+                    spawnedEmitters.clear();
+                }
+
+                ImGui::Text("Emitters %i, live %i of %i", (int)particleSystem.emitterCount, (int)particleSystem.liveCount, (int)particleSystem.capacity);
+                ImGui::Checkbox("Sort Back To Front", &particleSystem.sortForCamera);
+                ImGui::Text("Largest Free Range %i", (int)particleSystem.largestFreeRange);
+
+                ImGui::Checkbox("Simulate On CPU", &engineSettings.cpuParticles);
+                ImGui::Checkbox("Sort CPU Particles", &cpuParticleEmitter.sortForCamera);
+                ImGui::Text("CPU Particles %i, SIMD Path: %s", (int)cpuParticleEmitter.particleCount, ParticleEmitter::SimdPath());
+                ImGui::Text("CPU Particle Memory: %s", cpuParticleBuffer.deviceLocal ? "Device Local" : "System");
+
+                if (ImGui::Button("Run Particle Benchmark"))
+                {
+                    particleBenchmark = RunParticleBenchmark(&jobSystem);
+                }
+
+                if (particleBenchmark.iterations > 0)
+                {
+                    for (uint32_t c = 0; c < 3; c++)
+                    {
+                        ImGui::Text("%i: Legacy %.2f ms, Scalar %.2f ms, SIMD %.2f ms, Threaded %.2f ms", (int)particleBenchmark.particleCounts[c],
+                            particleBenchmark.legacyTime[c], particleBenchmark.scalarTime[c], particleBenchmark.simdTime[c], particleBenchmark.parallelTime[c]);
+                    }
+                }
+            }
+
+            if (ImGui::CollapsingHeader("Clustered Lights"))
+            {
+                const ClusterStats& clusterStats = stats.clusters;
+                ImGui::Text("Lights %i / %i", (int)localLights.size(), (int)engineSettings.clusterGrid.lightCapacity);
+                ImGui::Text("Grid %i x %i x %i, %i lights per cluster", (int)engineSettings.clusterGrid.sizeX, (int)engineSettings.clusterGrid.sizeY, (int)engineSettings.clusterGrid.sizeZ, (int)engineSettings.clusterGrid.maxLightsPerCluster);
+                ImGui::Text("Occupied Clusters %i / %i", (int)clusterStats.occupiedClusters, (int)clusterStats.clusterCount);
+                ImGui::Text("Average Lights Per Occupied Cluster %f", clusterStats.occupiedClusters > 0 ? (float)clusterStats.lightReferences / clusterStats.occupiedClusters : 0.0f);
+                ImGui::Text("Most Lights In A Cluster %i", (int)clusterStats.maxLightsInCluster);
+                ImGui::Text("Overflowing Clusters %i", (int)clusterStats.overflowingClusters);
+
+                if (ImGui::Button("Stress Scene (4096 Lights)"))
+                {
+                    SpawnClusterStressLights(4096);
+                }
+
+                ImGui::SameLine();
+
+                if (ImGui::Button("Clear Lights"))
+                {
+                    localLights.clear();
+                }
             }
 
             ImGui::SetWindowPos(ImVec2(0, 0), true);
@@ -379,10 +684,20 @@ void VulkanEngine::InitVulkan()
     features12.descriptorIndexing = true;
     features12.shaderOutputViewportIndex = true;
     features12.shaderOutputLayer = true;
-
-    // vulkan features
+    features12.timelineSemaphore = true;
+    features12.drawIndirectCount = true;
+    features12.runtimeDescriptorArray = true;
+    features12.descriptorBindingPartiallyBound = true;
+    features12.descriptorBindingSampledImageUpdateAfterBind = true;
+    features12.descriptorBindingUpdateUnusedWhilePending = true;
+    features12.shaderSampledImageArrayNonUniformIndexing = true;
+
+    // vulkan features, the point light shadow writes gl_Layer from the vertex shader so geometry shaders are not required
     VkPhysicalDeviceFeatures features{};
-    features.geometryShader = true;
+    features.multiDrawIndirect = true;
+    features.drawIndirectFirstInstance = true;
+    features.imageCubeArray = true;
+    features.shaderSampledImageArrayDynamicIndexing = true; // shadow atlas tier picked per light
 
     // select gpu
     vkb::PhysicalDeviceSelector selector(vkbInst);
@@ -404,11 +719,29 @@ void VulkanEngine::InitVulkan()
     // grab the device
     device = vkbDevice.device; 
     physicalDevice = selectedPhysicalDevice.physical_device;
+    physicalDeviceProperties = selectedPhysicalDevice.properties;
 
     // get a graphics queue
     graphicsQueue = vkbDevice.get_queue(vkb::QueueType::graphics).value();
     graphicsQueueFamily = vkbDevice.get_queue_index(vkb::QueueType::graphics).value();
 
+    // uploads prefer a transfer only family, then any separate transfer capable family, then share the graphics queue
+    if (auto dedicatedTransfer = vkbDevice.get_dedicated_queue(vkb::QueueType::transfer))
+    {
+        transferQueue = dedicatedTransfer.value();
+        transferQueueFamily = vkbDevice.get_dedicated_queue_index(vkb::QueueType::transfer).value();
+    }
+    else if (auto separateTransfer = vkbDevice.get_queue(vkb::QueueType::transfer))
+    {
+        transferQueue = separateTransfer.value();
+        transferQueueFamily = vkbDevice.get_queue_index(vkb::QueueType::transfer).value();
+    }
+    else
+    {
+        transferQueue = graphicsQueue;
+        transferQueueFamily = graphicsQueueFamily;
+    }
+
    // initialize memory allocator 
     VmaAllocatorCreateInfo allocatorInfo = {};
     allocatorInfo.physicalDevice = physicalDevice;
@@ -463,20 +796,8 @@ void VulkanEngine::InitSwapchain()
     VkImageViewCreateInfo dviewInfo = vkinit::imageview_create_info(depthImage.imageFormat, depthImage.image, VK_IMAGE_ASPECT_DEPTH_BIT);
     VK_CHECK(vkCreateImageView(device, &dviewInfo, nullptr, &depthImage.imageView));
 
-    // depth cubemap (for shadow mapping)
-    VkExtent3D cubemapImageExtent =
-    {
-        depthCubemapSize,
-        depthCubemapSize,
-        1
-    };
-
-    depthCubemapImage.imageFormat = VK_FORMAT_D16_UNORM;
-    depthCubemapImage.imageExtent = cubemapImageExtent;
-    dimgInfo = vkinit::cubemap_create_info(depthCubemapImage.imageFormat, depthImageUsages, cubemapImageExtent, VK_SAMPLE_COUNT_1_BIT);
-    vmaCreateImage(allocator, &dimgInfo, &rimgAllocInfo, &depthCubemapImage.image, &depthCubemapImage.allocation, nullptr);
-    dviewInfo = vkinit::cubemap_imageview_create_info(depthCubemapImage.imageFormat, depthCubemapImage.image, VK_IMAGE_ASPECT_DEPTH_BIT);
-    VK_CHECK(vkCreateImageView(device, &dviewInfo, nullptr, &depthCubemapImage.imageView));
+    // point light shadow cube arrays (for shadow mapping)
+    shadowAtlas.Init(this, engineSettings.shadowAtlas);
 
     // setting draw format to 32 bit float
     colorImage.imageFormat = VK_FORMAT_R16G16B16A16_SFLOAT;
@@ -495,6 +816,32 @@ void VulkanEngine::InitSwapchain()
     VkImageViewCreateInfo colorViewInfo = vkinit::imageview_create_info(colorImage.imageFormat, colorImage.image, VK_IMAGE_ASPECT_COLOR_BIT);
     VK_CHECK(vkCreateImageView(device, &colorViewInfo, nullptr, &colorImage.imageView));
 
+    // weighted blended transparency targets, the multisampled pair is only written by the pass and resolved at its end
+    auto createTransparencyTarget = [&](AllocatedImage& image, VkFormat format, VkSampleCountFlagBits samples)
+    {
+        image.imageFormat = format;
+        image.imageExtent = drawImageExtent;
+
+        VkImageUsageFlags usages = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+        VkImageCreateInfo imageInfo = vkinit::image_create_info(format, usages, drawImageExtent, samples);
+        vmaCreateImage(allocator, &imageInfo, &colorImgAllocInfo, &image.image, &image.allocation, nullptr);
+        VkImageViewCreateInfo viewInfo = vkinit::imageview_create_info(format, image.image, VK_IMAGE_ASPECT_COLOR_BIT);
+        VK_CHECK(vkCreateImageView(device, &viewInfo, nullptr, &image.imageView));
+    };
+
+    createTransparencyTarget(accumulationImage, VK_FORMAT_R16G16B16A16_SFLOAT, engineSettings.msaaSamples);
+    createTransparencyTarget(revealageImage, VK_FORMAT_R16_SFLOAT, engineSettings.msaaSamples);
+    if (engineSettings.msaaSamples != VK_SAMPLE_COUNT_1_BIT)
+    {
+        createTransparencyTarget(accumulationResolveImage, VK_FORMAT_R16G16B16A16_SFLOAT, VK_SAMPLE_COUNT_1_BIT);
+        createTransparencyTarget(revealageResolveImage, VK_FORMAT_R16_SFLOAT, VK_SAMPLE_COUNT_1_BIT);
+    }
+    else
+    {
+        accumulationResolveImage = accumulationImage;
+        revealageResolveImage = revealageImage;
+    }
+
 
     mainDeletionQueue.PushFunction([=]() {
         vkDestroyImageView(device, drawImage.imageView, nullptr);
@@ -503,12 +850,24 @@ void VulkanEngine::InitSwapchain()
         vkDestroyImageView(device, depthImage.imageView, nullptr);
         vmaDestroyImage(allocator, depthImage.image, depthImage.allocation);
 
-        vkDestroyImageView(device, depthCubemapImage.imageView, nullptr);
-        vmaDestroyImage(allocator, depthCubemapImage.image, depthCubemapImage.allocation);
+        shadowAtlas.Destroy();
 
         vkDestroyImageView(device, colorImage.imageView, nullptr);
         vmaDestroyImage(allocator, colorImage.image, colorImage.allocation);
 
+        if (engineSettings.msaaSamples != VK_SAMPLE_COUNT_1_BIT)
+        {
+            vkDestroyImageView(device, accumulationResolveImage.imageView, nullptr);
+            vmaDestroyImage(allocator, accumulationResolveImage.image, accumulationResolveImage.allocation);
+            vkDestroyImageView(device, revealageResolveImage.imageView, nullptr);
+            vmaDestroyImage(allocator, revealageResolveImage.image, revealageResolveImage.allocation);
+        }
+
+        vkDestroyImageView(device, accumulationImage.imageView, nullptr);
+        vmaDestroyImage(allocator, accumulationImage.image, accumulationImage.allocation);
+        vkDestroyImageView(device, revealageImage.imageView, nullptr);
+        vmaDestroyImage(allocator, revealageImage.image, revealageImage.allocation);
+
     });
 
 }
@@ -537,6 +896,28 @@ void VulkanEngine::InitCommands()
         {
             vkDestroyCommandPool(device, immCommandPool, nullptr);
         });
+
+    uploadManager.Init(this, transferQueue, transferQueueFamily, engineSettings.stagingBufferSize);
+
+    gpuProfiler.Init(this, FRAME_OVERLAP);
+
+    mainDeletionQueue.PushFunction([&]()
+        {
+            gpuProfiler.Destroy();
+        });
+
+    mainDeletionQueue.PushFunction([&]()
+        {
+            uploadManager.Destroy();
+        });
+
+    // every mesh is sub-allocated from here, uploads go through the upload manager so it is created after it
+    geometryArena.Init(this, engineSettings.geometryVertexCapacity, engineSettings.geometryIndexCapacity);
+
+    mainDeletionQueue.PushFunction([&]()
+        {
+            geometryArena.Destroy();
+        });
 }
 
 void VulkanEngine::InitSyncStructures()
@@ -615,8 +996,11 @@ void VulkanEngine::InitDescriptors()
 
     {
         DescriptorLayoutBuilder builder;
-        builder.AddBinding(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
-        builder.AddBinding(1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+        builder.AddBinding(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC);
+        builder.AddBinding(1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, SHADOW_TIER_COUNT);
+        builder.AddBinding(2, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC);
+        builder.AddBinding(3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+        builder.AddBinding(4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
         gpuSceneDataDescriptorLayout = builder.Build(device, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT);
     }
 
@@ -627,6 +1011,28 @@ void VulkanEngine::InitDescriptors()
         vkDestroyDescriptorSetLayout(device, gpuSceneDataDescriptorLayout, nullptr);
         });
 
+    // sets whose inputs never change between frames (skybox, shadow atlas, per frame uniform buffers) live here
+    std::vector<DescriptorAllocatorGrowable::PoolSizeRatio> cacheSizes =
+    {
+        { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1 },
+        { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 2 },
+        { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1 + SHADOW_TIER_COUNT },
+        { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2 },
+    };
+
+    descriptorSetCache.Init(device, 32, cacheSizes, FRAME_OVERLAP);
+
+    mainDeletionQueue.PushFunction([&]() {
+        descriptorSetCache.Destroy(device);
+        });
+
+    // every material texture, sampler and constant block, bound once per pipeline in DrawGeometry
+    bindlessMaterials.Init(this, 4096, 256, 4096);
+
+    mainDeletionQueue.PushFunction([&]() {
+        bindlessMaterials.Destroy();
+        });
+
     for (int i = 0; i < FRAME_OVERLAP; i++)
     {
         std::vector<DescriptorAllocatorGrowable::PoolSizeRatio> frameSizes =
@@ -634,6 +1040,7 @@ void VulkanEngine::InitDescriptors()
             {VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 3},
             {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 3},
             {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 3},
+            {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 3},
             {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 4},
         };
 
@@ -644,16 +1051,68 @@ void VulkanEngine::InitDescriptors()
             {
                 frames[i].frameDescriptors.DestroyPools(device);
             });
+
+        // per frame uniform data is sub-allocated from one mapped buffer and bound with dynamic offsets
+        frames[i].uniformAllocator.Init(this, engineSettings.frameUniformBufferSize, physicalDeviceProperties.limits.minUniformBufferOffsetAlignment);
+
+        mainDeletionQueue.PushFunction([&, i]()
+            {
+                frames[i].uniformAllocator.Destroy(this);
+            });
+
+        // draw list and compacted draw commands for the gpu cull, regrown in DrawGeometry when the scene outgrows them
+        frames[i].indirectDraws.Init(this, 1024, 64);
+
+        mainDeletionQueue.PushFunction([&, i]()
+            {
+                frames[i].indirectDraws.Destroy();
+            });
+
+        // light lists for the froxel grid, rebuilt every frame by cluster.comp
+        frames[i].clusterLights.Init(this, engineSettings.clusterGrid);
+
+        mainDeletionQueue.PushFunction([&, i]()
+            {
+                frames[i].clusterLights.Destroy();
+            });
     }
 
+    // object records of every registered surface, only the slots the proxy registry rewrote are copied each frame
+    opaqueObjects.Init(this, 1024);
+    transparentObjects.Init(this, 256);
+
+    mainDeletionQueue.PushFunction([&]() {
+        opaqueObjects.Destroy();
+        transparentObjects.Destroy();
+        });
 }
 
 void VulkanEngine::InitPipelines()
 {
-    metalRoughMaterial.BuildPipelines(this);
-    InitSkyboxPipeline();
-    InitDepthMapPipeline();
-    InitParticlePipeline();
+    pipelineCache.Init(this, engineSettings.pipelineCachePath);
+
+    auto start = std::chrono::system_clock::now();
+
+    // every pipeline only writes its own members, so each is a job. the pipeline cache is synchronized by the driver
+    // and modules shared between pipelines are loaded once through shaderModules
+    JobCounter pipelineJobs;
+    metalRoughMaterial.BuildPipelines(this, pipelineJobs);
+    jobSystem.Submit([this]() { InitSkyboxPipeline(); }, &pipelineJobs);
+    jobSystem.Submit([this]() { InitDepthMapPipeline(); }, &pipelineJobs);
+    jobSystem.Submit([this]() { InitParticlePipeline(); }, &pipelineJobs);
+    jobSystem.Submit([this]() { InitParticleComputePipelines(); }, &pipelineJobs);
+    jobSystem.Submit([this]() { InitCullPipeline(); }, &pipelineJobs);
+    jobSystem.Submit([this]() { InitClusterPipeline(); }, &pipelineJobs);
+    jobSystem.Submit([this]() { InitTransparentCompositePipeline(); }, &pipelineJobs);
+    jobSystem.Wait(pipelineJobs);
+
+    auto end = std::chrono::system_clock::now();
+    pipelineCache.RecordBuildTime(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0f);
+    fmt::println("{} shader modules loaded, {} reused, on {} threads", shaderModules.loads, shaderModules.hits, jobSystem.WorkerCount() + 1);
+
+    // kept for pipelines built later, such as new material variants
+    mainDeletionQueue.PushFunction([&]() { shaderModules.Clear(device); });
+    mainDeletionQueue.PushFunction([&]() { metalRoughMaterial.ClearResources(device); });
 }
 
 void VulkanEngine::ImmediateSubmit(std::function<void(VkCommandBuffer cmd)>&& function)
@@ -720,6 +1179,7 @@ void VulkanEngine::InitImGui()
     initInfo.ColorAttachmentFormat = VK_FORMAT_B8G8R8A8_UNORM;
 
     initInfo.MSAASamples = VK_SAMPLE_COUNT_1_BIT;
+    initInfo.PipelineCache = pipelineCache.cache;
 
     ImGui_ImplVulkan_Init(&initInfo, VK_NULL_HANDLE);
 
@@ -756,134 +1216,204 @@ void VulkanEngine::DrawGeometry(VkCommandBuffer cmd)
 
     stats.drawcallCount = 0;
     stats.triangleCount = 0;
+    stats.pipelineBinds = 0;
+    stats.descriptorBinds = 0;
+    stats.indexBufferBinds = 0;
     auto start = std::chrono::system_clock::now();
 
+    frustumCuller.SetViewProjection(sceneData.viewproj);
+
+    if (cullBenchmarkRequested)
+    {
+        cullBenchmarkRequested = false;
+        RunCullBenchmark();
+    }
+
+    // coarse cpu cull so only objects near the view are written out for the gpu cull
+    auto cullStart = std::chrono::system_clock::now();
+
     std::vector<uint32_t> opaqueDraws;
     opaqueDraws.reserve(mainDrawContext.OpaqueSurfaces.size());
 
-    for (uint32_t i = 0; i < mainDrawContext.OpaqueSurfaces.size(); i++)
+    if (engineSettings.cpuFrustumCulling)
+    {
+        frustumCuller.Cull(mainDrawContext.OpaqueSurfaces.data(), (uint32_t)mainDrawContext.OpaqueSurfaces.size(), opaqueDraws, &jobSystem);
+    }
+    else
     {
-        /* (Causes fps reduciton) TODO: Work out why
-        if (IsVisible(mainDrawContext.OpaqueSurfaces[i], sceneData.viewproj))
+        for (uint32_t i = 0; i < mainDrawContext.OpaqueSurfaces.size(); i++)
         {
             opaqueDraws.push_back(i);
         }
-        */
-        opaqueDraws.push_back(i);
     }
 
-    /* (Causes fps reduciton) TODO: Work out why
-    std::sort(opaqueDraws.begin(), opaqueDraws.end(), [&](const auto& iA, const auto& iB) 
+    auto cullEnd = std::chrono::system_clock::now();
+    stats.cullTime = std::chrono::duration_cast<std::chrono::microseconds>(cullEnd - cullStart).count() / 1000.0f;
+
+    // order by the keys built in MeshNode::Draw, the batches below are created in this order so state changes are minimal
+    std::vector<uint32_t> transparentDraws;
+    transparentDraws.reserve(mainDrawContext.TransparentSurfaces.size());
+
+    for (uint32_t i = 0; i < mainDrawContext.TransparentSurfaces.size(); i++)
     {
-        const RenderObject& A = mainDrawContext.OpaqueSurfaces[iA];
-        const RenderObject& B = mainDrawContext.OpaqueSurfaces[iB];
-        if (A.material == B.material) 
-        {
-            return A.indexBuffer < B.indexBuffer;
-        }
-        else 
-        {
-            return A.material < B.material;
-        }
-    });
-    */
+        transparentDraws.push_back(i);
+    }
 
-    vkCmdBeginRendering(cmd, &renderingInfo);
+    opaqueSorter.Sort(mainDrawContext.OpaqueSurfaces.data(), opaqueDraws, renderProxies.Version(false));
+    transparentSorter.Sort(mainDrawContext.TransparentSurfaces.data(), transparentDraws, renderProxies.Version(true));
 
-    //allocate a new uniform buffer for the scene data
-    AllocatedBuffer gpuSceneDataBuffer = CreateBuffer(sizeof(GPUSceneData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+    auto sortEnd = std::chrono::system_clock::now();
+    stats.sortTime = std::chrono::duration_cast<std::chrono::microseconds>(sortEnd - cullEnd).count() / 1000.0f;
+    stats.sortSkipped = opaqueSorter.lastSortSkipped && transparentSorter.lastSortSkipped;
 
-    //add it to the deletion queue of this frame so it gets deleted once its been used
-    GetCurrentFrame().deletionQueue.PushFunction([=, this]() 
-        {
-            DestroyBuffer(gpuSceneDataBuffer);
-        });
+    // the listed opaque surfaces are culled against their object records and compacted into indirect commands on the gpu
+    IndirectDrawBuffers& indirectDraws = GetCurrentFrame().indirectDraws;
+    indirectDraws.Prepare(mainDrawContext, opaqueDraws, renderProxies.Version(false));
+    indirectDraws.RecordCull(cmd, cullPipeline, cullPipelineLayout, frustumCuller.frustum, opaqueObjects.address);
 
-    //write the buffer
-    GPUSceneData* sceneUniformData = (GPUSceneData*)gpuSceneDataBuffer.allocation->GetMappedData();
-    *sceneUniformData = sceneData;
+    stats.opaqueObjects = (uint32_t)mainDrawContext.OpaqueSurfaces.size();
+    stats.objectsSubmitted = indirectDraws.opaqueCount;
+    stats.objectsVisible = indirectDraws.lastVisibleCount;
+    stats.trianglesVisible = indirectDraws.lastVisibleTriangles;
 
-    //create a descriptor set that binds that buffer and update it
-    VkDescriptorSet globalDescriptor = GetCurrentFrame().frameDescriptors.Allocate(device, gpuSceneDataDescriptorLayout);
+    // bin the local lights into the froxels of this view before the opaque pass reads the lists
+    ClusteredLightBuffers& clusterLights = GetCurrentFrame().clusterLights;
+    clusterLights.Prepare(localLights, sceneData.view, sceneData.proj, nearPlane, farPlane, windowExtent);
+    clusterLights.RecordBuild(cmd, clusterPipeline, clusterPipelineLayout);
+
+    sceneData.clusterGrid = clusterLights.gridInfo;
+    sceneData.clusterParams = clusterLights.gridParams;
+    stats.clusters = clusterLights.lastStats;
+
+    vkCmdBeginRendering(cmd, &renderingInfo);
+
+    //write the scene data into this frame's uniform buffer
+    uint32_t sceneDataOffset = GetCurrentFrame().uniformAllocator.Push(sceneData);
 
+    // the light list with each light's atlas cube, after DrawDepthMap settled this frame's assignments
+    GPULightData lightData;
+    shadowAtlas.WriteLightData(pointLights, lightData);
+    uint32_t lightDataOffset = GetCurrentFrame().uniformAllocator.Push(lightData);
+    uint32_t dynamicOffsets[] = { sceneDataOffset, lightDataOffset };
+
+    //create a descriptor set that binds that buffer and update it
     DescriptorWriter writer;
-    writer.WriteBuffer(0, gpuSceneDataBuffer.buffer, sizeof(GPUSceneData), 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
-    writer.WriteImage(1, depthCubemapImage.imageView, defaultSamplerNearest, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
-    writer.UpdateSet(device, globalDescriptor);
+    writer.WriteBuffer(0, GetCurrentFrame().uniformAllocator.buffer.buffer, sizeof(GPUSceneData), 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC);
+    shadowAtlas.WriteDescriptor(writer, 1, defaultSamplerNearest);
+    writer.WriteBuffer(2, GetCurrentFrame().uniformAllocator.buffer.buffer, sizeof(GPULightData), 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC);
+    clusterLights.WriteDescriptors(writer, 3, 4);
+    VkDescriptorSet globalDescriptor = descriptorSetCache.Get(device, gpuSceneDataDescriptorLayout, writer);
+
+    GPUDrawObjectPushConstants pushConstants;
+    pushConstants.objectBuffer = opaqueObjects.address;
 
     MaterialPipeline* lastPipeline = nullptr;
-    MaterialInstance* lastMaterial = nullptr;
-    VkBuffer lastIndexBuffer = VK_NULL_HANDLE;
 
-    auto draw = [&](const RenderObject& r) 
+    // every mesh is in the geometry arena, one index buffer bind covers the whole pass
+    vkCmdBindIndexBuffer(cmd, geometryArena.indexBuffer.buffer, 0, VK_INDEX_TYPE_UINT32);
+    stats.indexBufferBinds += 1;
+
+    auto bind = [&](MaterialPipeline* pipeline) 
     {
-        if (r.material != lastMaterial) 
+        //materials are read from the bindless set, so only a pipeline change needs new bindings
+        if (pipeline != lastPipeline) 
         {
-            lastMaterial = r.material;
-            //rebind pipeline and descriptors if the material changed
-            if (r.material->pipeline != lastPipeline) 
-            {
+            lastPipeline = pipeline;
+            VkDescriptorSet sets[] = { globalDescriptor, bindlessMaterials.set };
+            vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->pipeline);
+            vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->layout, 0, 2, sets, 2, dynamicOffsets);
+            vkCmdPushConstants(cmd, pipeline->layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(GPUDrawObjectPushConstants), &pushConstants);
+            stats.pipelineBinds += 1;
+            stats.descriptorBinds += 1;
+
+            VkViewport viewport = {};
+            viewport.x = 0.0f;
+            viewport.y = 0.0f;
+            viewport.width = windowExtent.width;
+            viewport.height = windowExtent.height;
+            viewport.minDepth = 0.0f;
+            viewport.maxDepth = 1.0f;
+
+            vkCmdSetViewport(cmd, 0, 1, &viewport);
+
+            VkRect2D scissor = {};
+            scissor.offset.x = 0.0f;
+            scissor.offset.y = 0.0f;
+            scissor.extent.width = viewport.width;
+            scissor.extent.height = viewport.height;
+
+            vkCmdSetScissor(cmd, 0, 1, &scissor);
+        }
+    };
 
-                lastPipeline = r.material->pipeline;
-                vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, r.material->pipeline->pipeline);
-                vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, r.material->pipeline->layout, 0, 1, &globalDescriptor, 0, nullptr);
+    // one indirect count draw per pipeline, no matter how many objects, meshes or materials it holds
+    for (uint32_t i = 0; i < indirectDraws.batches.size(); i++)
+    {
+        const IndirectBatch& batch = indirectDraws.batches[i];
+        bind(batch.pipeline);
 
-                VkViewport viewport = {};
-                viewport.x = 0.0f;
-                viewport.y = 0.0f;
-                viewport.width = windowExtent.width;
-                viewport.height = windowExtent.height;
-                viewport.minDepth = 0.0f;
-                viewport.maxDepth = 1.0f;
+        indirectDraws.DrawBatch(cmd, i);
+        //stats (triangles submitted to the cull, the visible ones are read back)
+        stats.drawcallCount += 1;
+        stats.triangleCount += batch.triangleCount;
+    }
 
-                vkCmdSetViewport(cmd, 0, 1, &viewport);
+    vkCmdEndRendering(cmd);
 
-                VkRect2D scissor = {};
-                scissor.offset.x = 0.0f;
-                scissor.offset.y = 0.0f;
-                scissor.extent.width = viewport.width;
-                scissor.extent.height = viewport.height;
+    // transparent surfaces and particles accumulate in any order, testing against the opaque depth without writing it
+    VkClearValue accumulationClear{ .color = { 0.0f, 0.0f, 0.0f, 0.0f } };
+    VkClearValue revealageClear{ .color = { 1.0f, 0.0f, 0.0f, 0.0f } };
 
-                vkCmdSetScissor(cmd, 0, 1, &scissor);
-            }
+    VkRenderingAttachmentInfo transparentAttachments[2] =
+    {
+        vkinit::attachment_info(accumulationImage.imageView, &accumulationClear, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL),
+        vkinit::attachment_info(revealageImage.imageView, &revealageClear, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL)
+    };
 
-            vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, r.material->pipeline->layout, 1, 1, &r.material->materialSet, 0, nullptr);
-        }
-        //rebind index buffer if needed
-        if (r.indexBuffer != lastIndexBuffer) 
-        {
-            lastIndexBuffer = r.indexBuffer;
-            vkCmdBindIndexBuffer(cmd, r.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
-        }
+    if (engineSettings.msaaSamples != VK_SAMPLE_COUNT_1_BIT)
+    {
+        transparentAttachments[0].resolveMode = VK_RESOLVE_MODE_AVERAGE_BIT;
+        transparentAttachments[0].resolveImageView = accumulationResolveImage.imageView;
+        transparentAttachments[0].resolveImageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+        transparentAttachments[1].resolveMode = VK_RESOLVE_MODE_AVERAGE_BIT;
+        transparentAttachments[1].resolveImageView = revealageResolveImage.imageView;
+        transparentAttachments[1].resolveImageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+        // only the resolved pair is read afterwards
+        transparentAttachments[0].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        transparentAttachments[1].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    }
 
-        GPUDrawPushConstants pushConstants;
-        pushConstants.renderMatrix = r.transform;
-        pushConstants.vertexBuffer = r.vertexBufferAddress;
+    VkRenderingInfo transparentRenderingInfo = vkinit::rendering_info(drawExtent, transparentAttachments, &depthAttachment);
+    transparentRenderingInfo.colorAttachmentCount = 2;
+    depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+
+    vkCmdBeginRendering(cmd, &transparentRenderingInfo);
 
-        vkCmdPushConstants(cmd, r.material->pipeline->layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(GPUDrawPushConstants), &pushConstants);
+    // the pipeline and its bindings have to be set again inside the new pass, pushing the transparent records
+    lastPipeline = nullptr;
+    pushConstants.objectBuffer = transparentObjects.address;
 
-        vkCmdDrawIndexed(cmd, r.indexCount, 1, r.firstIndex, 0, 0);
+    // transparent surfaces stay on the cpu path, firstInstance indexes their object records
+    for (uint32_t i = 0; i < transparentDraws.size(); i++)
+    {
+        const RenderObject& r = mainDrawContext.TransparentSurfaces[transparentDraws[i]];
+        bind(r.material->pipeline);
+
+        vkCmdDrawIndexed(cmd, r.indexCount, 1, r.firstIndex, r.vertexOffset, transparentDraws[i]);
         //stats
         stats.drawcallCount += 1;
         stats.triangleCount += r.indexCount / 3;
-    };
-
-    for (auto& r : opaqueDraws) 
-    {
-        draw(mainDrawContext.OpaqueSurfaces[r]);
     }
 
-
-    for (auto& r : mainDrawContext.TransparentSurfaces)
+    if (engineSettings.drawParticles)
     {
-        draw(r);
+        GpuProfileScope scope(gpuProfiler, cmd, "Particles");
+        DrawParticles(cmd);
     }
 
     vkCmdEndRendering(cmd);
 
-    mainDrawContext.OpaqueSurfaces.clear();
-    mainDrawContext.TransparentSurfaces.clear();
-
     auto end = std::chrono::system_clock::now();
     auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
     stats.meshDrawTime = elapsed.count() / 1000.0f;
@@ -909,113 +1439,24 @@ AllocatedBuffer VulkanEngine::CreateBuffer(size_t allocSize, VkBufferUsageFlags
 
 void VulkanEngine::DestroyBuffer(const AllocatedBuffer& buffer)
 {
+    descriptorSetCache.InvalidateBuffer(buffer.buffer);
     vmaDestroyBuffer(allocator, buffer.buffer, buffer.allocation);
 }
 
 GPUMeshBuffers VulkanEngine::UploadMesh(std::span<uint32_t> indices, std::span<Vertex> vertices)
 {
-    const size_t vertexBufferSize = vertices.size() * sizeof(Vertex);
-    const size_t indexBufferSize = indices.size() * sizeof(uint32_t);
-
-    GPUMeshBuffers newSurface;
+    // recorded into the open upload batch, the first frame drawing with it waits on the batch
+    GPUMeshBuffers newSurface = geometryArena.Upload(indices, vertices);
+    newSurface.sortId = nextMeshId++;
 
-    newSurface.vertexBuffer = CreateBuffer(vertexBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
-
-    VkBufferDeviceAddressInfo deviceAdressInfo{ .sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,.buffer = newSurface.vertexBuffer.buffer };
-    newSurface.vertexBufferAddress = vkGetBufferDeviceAddress(device, &deviceAdressInfo);
-
-    newSurface.indexBuffer = CreateBuffer(indexBufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
-
-    AllocatedBuffer staging = CreateBuffer(vertexBufferSize + indexBufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
-
-    void* data = staging.allocation->GetMappedData();
-
-    // copy vertex buffer
-    memcpy(data, vertices.data(), vertexBufferSize);
-    // copy index buffer
-    memcpy((char*)data + vertexBufferSize, indices.data(), indexBufferSize);
-
-    ImmediateSubmit([&](VkCommandBuffer cmd) {
-        VkBufferCopy vertexCopy{ 0 };
-        vertexCopy.dstOffset = 0;
-        vertexCopy.srcOffset = 0;
-        vertexCopy.size = vertexBufferSize;
-
-        vkCmdCopyBuffer(cmd, staging.buffer, newSurface.vertexBuffer.buffer, 1, &vertexCopy);
-
-        VkBufferCopy indexCopy{ 0 };
-        indexCopy.dstOffset = 0;
-        indexCopy.srcOffset = vertexBufferSize;
-        indexCopy.size = indexBufferSize;
-
-        vkCmdCopyBuffer(cmd, staging.buffer, newSurface.indexBuffer.buffer, 1, &indexCopy);
-        });
-
-    DestroyBuffer(staging);
-        
     return newSurface;
 }
 
-GPUParticleBuffers VulkanEngine::UploadParticles(std::span<ParticleGPUData> particlesGPUData)
-{
-    const size_t bufferSize = particlesGPUData.size() * sizeof(ParticleGPUData);
+void VulkanEngine::InitDefaultData() {
 
-    GPUParticleBuffers newParticles;
-
-    newParticles.particleBuffer = CreateBuffer(bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
-
-    VkBufferDeviceAddressInfo deviceAdressInfo{ .sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,.buffer = newParticles.particleBuffer.buffer };
-    newParticles.particleBufferAddress = vkGetBufferDeviceAddress(device, &deviceAdressInfo);
-
-    AllocatedBuffer staging = CreateBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
-
-    void* data = staging.allocation->GetMappedData();
-    
-    // copy vertex buffer
-    memcpy(data, particlesGPUData.data(), bufferSize);
-
-    ImmediateSubmit([&](VkCommandBuffer cmd) {
-        VkBufferCopy particleCopy{ 0 };
-        particleCopy.dstOffset = 0;
-        particleCopy.srcOffset = 0;
-        particleCopy.size = bufferSize;
-
-        vkCmdCopyBuffer(cmd, staging.buffer, newParticles.particleBuffer.buffer, 1, &particleCopy);
-        });
-
-    DestroyBuffer(staging);
-
-    newParticles.bufferSize = bufferSize;
-
-    return newParticles;
-}
-
-void VulkanEngine::UpdateParticles(GPUParticleBuffers& buffer, std::span<ParticleGPUData> particlesGPUData)
-{
-    AllocatedBuffer staging = CreateBuffer(buffer.bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
-
-    void* data = staging.allocation->GetMappedData();
-
-    // copy vertex buffer
-    memcpy(data, particlesGPUData.data(), buffer.bufferSize);
-
-    ImmediateSubmit([&](VkCommandBuffer cmd) {
-        VkBufferCopy particleCopy{ 0 };
-        particleCopy.dstOffset = 0;
-        particleCopy.srcOffset = 0;
-        particleCopy.size = buffer.bufferSize;
-
-        vkCmdCopyBuffer(cmd, staging.buffer, buffer.particleBuffer.buffer, 1, &particleCopy);
-        });
-
-    DestroyBuffer(staging);
-}
-
-void VulkanEngine::InitDefaultData() {
-
-    uint32_t white = glm::packUnorm4x8(glm::vec4(1, 1, 1, 1));
-    whiteImage = CreateImage((void*)&white, VkExtent3D{ 1, 1, 1 }, VK_FORMAT_R8G8B8A8_UNORM,
-        VK_IMAGE_USAGE_SAMPLED_BIT);
+    uint32_t white = glm::packUnorm4x8(glm::vec4(1, 1, 1, 1));
+    whiteImage = CreateImage((void*)&white, VkExtent3D{ 1, 1, 1 }, VK_FORMAT_R8G8B8A8_UNORM,
+        VK_IMAGE_USAGE_SAMPLED_BIT);
 
     uint32_t grey = glm::packUnorm4x8(glm::vec4(0.66f, 0.66f, 0.66f, 1));
     greyImage = CreateImage((void*)&grey, VkExtent3D{ 1, 1, 1 }, VK_FORMAT_R8G8B8A8_UNORM,
@@ -1059,23 +1500,10 @@ void VulkanEngine::InitDefaultData() {
     materialResources.emissionImage = whiteImage;
     materialResources.emissionSampler = defaultSamplerLinear;
 
-    //set the uniform buffer for the material data
-    AllocatedBuffer materialConstants = CreateBuffer(sizeof(GLTFMetallicRoughness::MaterialConstants), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
-
-    //write the buffer
-    GLTFMetallicRoughness::MaterialConstants* sceneUniformData = (GLTFMetallicRoughness::MaterialConstants*)materialConstants.allocation->GetMappedData();
-    sceneUniformData->colorFactors = glm::vec4{ 1,1,1,1 };
-    sceneUniformData->metalRoughFactors = glm::vec4{ 1,0.5,0,0 };
-
-    mainDeletionQueue.PushFunction([=, this]() 
-        {
-            DestroyBuffer(materialConstants);
-        });
-
-    materialResources.dataBuffer = materialConstants.buffer;
-    materialResources.dataBufferOffset = 0;
+    materialResources.constants.colorFactors = glm::vec4{ 1,1,1,1 };
+    materialResources.constants.metalRoughFactors = glm::vec4{ 1,0.5,0,0 };
 
-    defaultData = metalRoughMaterial.WriteMaterial(device, MaterialPass::MainColor, materialResources, globalDescriptorAllocator);
+    defaultData = metalRoughMaterial.WriteMaterial(this, MaterialPass::MainColor, materialResources);
 
     sceneData.ambientColor = glm::vec4(0.01f);
     sceneData.lightColor = glm::vec4(0.94f, 0.75f, 0.44f, 1.0f);
@@ -1083,9 +1511,10 @@ void VulkanEngine::InitDefaultData() {
     sceneData.attenuationFallOff = 2.0f;
     sceneData.shadowFarPlane = 25.0f;
     sceneData.shadowBias = 0.15;
-    sceneData.shadowAASamples = 20;
     sceneData.gridSamplingDiskModifier = 1.0;
 
+    pointLights.push_back(PointLight{});
+
     std::array<Vertex, 36>  skyboxCubeVertices;
     skyboxCubeVertices[0].position =  { -0.5f, -0.5f, -0.5f };
     skyboxCubeVertices[1].position = { 0.5f, -0.5f, -0.5f };
@@ -1223,8 +1652,6 @@ void VulkanEngine::InitDefaultData() {
     mainDeletionQueue.PushFunction([=]() 
         {
             DestroyImage(skyboxImage);
-            DestroyBuffer(skyboxCube.vertexBuffer);
-            DestroyBuffer(skyboxCube.indexBuffer);
         });
 
     std::array<Vertex, 6>  particleVerticies;
@@ -1256,16 +1683,30 @@ void VulkanEngine::InitDefaultData() {
     };
 
     particleBillboard = UploadMesh(particleIndices, particleVerticies);
-    particleEmitter = new ParticleEmitter(this, glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.5f, 0.0f, 0.5f), 200, 6, 9);
+    particleSystem.Init(this, engineSettings.particleCapacity, engineSettings.maxParticleEmitters);
+
+    // the first 45 layers of the smoke sheet, growing linearly to full size
+    ParticleEmitterSettings smokeSettings;
+    smokeSettings.position = glm::vec3(0.0f, 0.0f, -1.0f);
+    smokeSettings.spawnDimensions = glm::vec3(0.5f, 0.0f, 0.5f);
+    smokeSettings.movement = glm::vec3(0.0f, 1.0f, 0.0f);
+    smokeSettings.lowerLife = 6.0f;
+    smokeSettings.upperLife = 9.0f;
+    smokeSettings.firstLayer = 0;
+    smokeSettings.layerCount = 45;
+    smokeEmitter = particleSystem.CreateEmitter(smokeSettings, 200);
+
+    cpuParticleEmitter.Init(engineSettings.cpuParticleCount, glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.5f, 0.0f, 0.5f), 6.0f, 9.0f);
+    cpuParticleEmitter.drawEmitter = smokeEmitter;
+    cpuParticleBuffer.Init(this, engineSettings.cpuParticleCount * sizeof(ParticleGPUData), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, FRAME_OVERLAP);
     particleSmokeImage = LoadTextureArray(this, "resources/textures/Cloud02_8x8.tga", 8, 8, 64).value();
 
 
     mainDeletionQueue.PushFunction([=]()
         {
             DestroyImage(particleSmokeImage);
-            DestroyBuffer(particleBillboard.vertexBuffer);
-            DestroyBuffer(particleBillboard.indexBuffer);
-            DestroyBuffer(particleEmitter->particleBuffers.particleBuffer);
+            particleSystem.Destroy();
+            cpuParticleBuffer.Destroy(this);
         });
 }
 
@@ -1320,42 +1761,22 @@ AllocatedImage VulkanEngine::CreateImage(VkExtent3D size, VkFormat format, VkIma
 AllocatedImage VulkanEngine::CreateImage(void* data, VkExtent3D size, VkFormat format, VkImageUsageFlags usage, bool mipmapped)
 {
     size_t dataSize = size.depth * size.width * size.height * 4;
-    AllocatedBuffer uploadbuffer = CreateBuffer(dataSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
-
-    memcpy(uploadbuffer.info.pMappedData, data, dataSize);
 
     AllocatedImage newImage = CreateImage(size, format, usage | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, mipmapped);
 
-    ImmediateSubmit([&](VkCommandBuffer cmd) 
-        {
-        vkutil::TransititionImage(cmd, newImage.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-
-        VkBufferImageCopy copyRegion = {};
-        copyRegion.bufferOffset = 0;
-        copyRegion.bufferRowLength = 0;
-        copyRegion.bufferImageHeight = 0;
-
-        copyRegion.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        copyRegion.imageSubresource.mipLevel = 0;
-        copyRegion.imageSubresource.baseArrayLayer = 0;
-        copyRegion.imageSubresource.layerCount = 1;
-        copyRegion.imageExtent = size;
+    VkBufferImageCopy copyRegion = {};
+    copyRegion.bufferOffset = 0;
+    copyRegion.bufferRowLength = 0;
+    copyRegion.bufferImageHeight = 0;
 
-        // copy the buffer into the image
-        vkCmdCopyBufferToImage(cmd, uploadbuffer.buffer, newImage.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1,
-            &copyRegion);
-
-        if (mipmapped)
-        {
-            vkutil::GenerateMipMaps(cmd, newImage.image, VkExtent2D{ newImage.imageExtent.width,newImage.imageExtent.height });
-        }
-        else
-        {
-            vkutil::TransititionImage(cmd, newImage.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-        }
-        });
+    copyRegion.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    copyRegion.imageSubresource.mipLevel = 0;
+    copyRegion.imageSubresource.baseArrayLayer = 0;
+    copyRegion.imageSubresource.layerCount = 1;
+    copyRegion.imageExtent = size;
 
-    DestroyBuffer(uploadbuffer);
+    // mip generation is recorded on the graphics queue once the copy has landed
+    uploadManager.UploadImage(newImage, data, dataSize, std::span(&copyRegion, 1), mipmapped);
 
     return newImage;
 }
@@ -1390,14 +1811,22 @@ AllocatedImage VulkanEngine::CreateImageArray(VkExtent3D size, VkFormat format,
 
 AllocatedImage VulkanEngine::CreateImageArray(void* data, VkExtent3D size, VkFormat format, VkImageUsageFlags usage, bool mipmapped, uint32_t columnNum, uint32_t rowNum, uint32_t layerAmount)
 {
-    size_t dataSize = size.depth * size.width * size.height * 4;
-    AllocatedBuffer uploadbuffer = CreateBuffer(dataSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+    if (columnNum == 0 || rowNum == 0 || size.width % columnNum != 0 || size.height % rowNum != 0)
+    {
+        fmt::println("Texture atlas {}x{} can't be split into {}x{} equal cells", size.width, size.height, columnNum, rowNum);
+        return {};
+    }
 
-    memcpy(uploadbuffer.info.pMappedData, data, dataSize);
+    if (layerAmount == 0 || layerAmount > columnNum * rowNum || layerAmount > physicalDeviceProperties.limits.maxImageArrayLayers)
+    {
+        fmt::println("Texture atlas with {}x{} cells can't provide {} layers", columnNum, rowNum, layerAmount);
+        return {};
+    }
 
+    size_t dataSize = size.depth * size.width * size.height * 4;
 
-    size_t layerWidth = size.width / columnNum;
-    size_t layerHeight = size.height / rowNum;
+    uint32_t layerWidth = size.width / columnNum;
+    uint32_t layerHeight = size.height / rowNum;
 
     VkExtent3D layerSize;
     layerSize.depth = size.depth;
@@ -1406,55 +1835,37 @@ AllocatedImage VulkanEngine::CreateImageArray(void* data, VkExtent3D size, VkFor
 
     AllocatedImage newImage = CreateImageArray(layerSize, format, usage | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, mipmapped, layerAmount);
 
+    // every cell of the atlas becomes one region of a single copy, the row length lets the copy step over the neighbouring cells
+    std::vector<VkBufferImageCopy> copyRegions(layerAmount);
+
     for (uint32_t layer = 0; layer < layerAmount; layer++)
     {
         size_t layerX = layer % columnNum;
         size_t layerY = layer / columnNum;
 
-        size_t x = layerX * layerWidth;
-        size_t y = layerY * layerHeight;
-
-        size_t offset = 4 * ((layerY * layerHeight * size.width) + (layerX * layerWidth)); // offset = (row × subImageHeight × width + column × subImageWidth) × bytesPerPixel
+        VkBufferImageCopy& copyRegion = copyRegions[layer];
+        copyRegion = {};
+        copyRegion.bufferOffset = 4 * ((layerY * layerHeight * size.width) + (layerX * layerWidth)); // offset = (row × subImageHeight × width + column × subImageWidth) × bytesPerPixel
+        copyRegion.bufferRowLength = size.width;
+        copyRegion.bufferImageHeight = size.height;
 
-        ImmediateSubmit([&](VkCommandBuffer cmd)
-            {
-                vkutil::TransititionImage(cmd, newImage.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-
-                VkBufferImageCopy copyRegion = {};
-                copyRegion.bufferOffset = offset;
-                copyRegion.bufferRowLength = size.width;
-                copyRegion.bufferImageHeight = size.height;
-
-                copyRegion.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-                copyRegion.imageSubresource.mipLevel = 0;
-                copyRegion.imageSubresource.baseArrayLayer = layer;
-                copyRegion.imageSubresource.layerCount = 1;
-                copyRegion.imageExtent.height = layerHeight;
-                copyRegion.imageExtent.width = layerWidth;
-                copyRegion.imageExtent.depth = 1;
-
-                // copy the buffer into the image
-                vkCmdCopyBufferToImage(cmd, uploadbuffer.buffer, newImage.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1,
-                    &copyRegion);
-
-                if (mipmapped)
-                {
-                    vkutil::GenerateMipMaps(cmd, newImage.image, VkExtent2D{ newImage.imageExtent.width,newImage.imageExtent.height });
-                }
-                else
-                {
-                    vkutil::TransititionImage(cmd, newImage.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-                }
-            });
+        copyRegion.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        copyRegion.imageSubresource.mipLevel = 0;
+        copyRegion.imageSubresource.baseArrayLayer = layer;
+        copyRegion.imageSubresource.layerCount = 1;
+        copyRegion.imageExtent.height = layerHeight;
+        copyRegion.imageExtent.width = layerWidth;
+        copyRegion.imageExtent.depth = 1;
     }
 
-    DestroyBuffer(uploadbuffer);
+    uploadManager.UploadImage(newImage, data, dataSize, copyRegions, mipmapped, layerAmount);
 
     return newImage;
 }
 
 void VulkanEngine::DestroyImage(const AllocatedImage& image)
 {
+    descriptorSetCache.InvalidateImageView(image.imageView);
     vkDestroyImageView(device, image.imageView, nullptr);
     vmaDestroyImage(allocator, image.image, image.allocation); 
 }
@@ -1476,33 +1887,27 @@ void VulkanEngine::UpdateScene()
     sceneData.viewproj = projection * view;
     sceneData.viewPosition = mainCamera.position;
 
-    loadedScenes["structure"]->Draw(glm::mat4{ 1.0f }, mainDrawContext);
+    glm::mat4 lightModel = glm::mat4(1.0f);
+    lightModel = glm::translate(lightModel, glm::vec3(sceneData.lightPosition.x, sceneData.lightPosition.y, sceneData.lightPosition.z));
+    lightModel = glm::scale(lightModel, glm::vec3(0.15, 0.15, 0.15));
+    renderProxies.SetSceneTransform(cubeScene, lightModel);
+
+    stats.proxiesUpdated = renderProxies.Update(&jobSystem);
+    stats.proxyCount = renderProxies.ProxyCount();
 
-    glm::mat4 shadowProj = glm::perspective(glm::radians(90.0f), (float)depthCubemapSize / (float)depthCubemapSize, nearPlane, sceneData.shadowFarPlane); // (swap near and far values)
-    glm::vec3 lightPos = glm::vec3(sceneData.lightPosition.x, sceneData.lightPosition.y, sceneData.lightPosition.z);
-    std::vector<glm::mat4> shadowMatricies;
-    depthMapGeometryData.shadowMatricies[0] = shadowProj * glm::lookAt(lightPos, lightPos + glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f)); //TODO: This is causing an issue(Memory Overflow)
-    depthMapGeometryData.shadowMatricies[1] = shadowProj * glm::lookAt(lightPos, lightPos + glm::vec3(-1.0f, 0.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f));
-    depthMapGeometryData.shadowMatricies[2] = shadowProj * glm::lookAt(lightPos, lightPos + glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f));
-    depthMapGeometryData.shadowMatricies[3] = shadowProj * glm::lookAt(lightPos, lightPos + glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, 0.0f, -1.0f));
-    depthMapGeometryData.shadowMatricies[4] = shadowProj * glm::lookAt(lightPos, lightPos + glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, -1.0f, 0.0f));
-    depthMapGeometryData.shadowMatricies[5] = shadowProj * glm::lookAt(lightPos, lightPos + glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, -1.0f, 0.0f));
+    // light 0 is the one edited in the lighting panel
+    pointLights[0].position = glm::vec3(sceneData.lightPosition);
+    pointLights[0].power = sceneData.lightPosition.w;
+    pointLights[0].color = glm::vec3(sceneData.lightColor);
+    pointLights[0].radius = sceneData.shadowFarPlane;
 
-    particleEmitter->Update(this, glm::vec3(0.0f, 1.0f, 0.0f), stats.frameTime, mainCamera);
+    shadowAtlas.AssignLights(pointLights, mainCamera.position, std::abs(projection[1][1]));
 
     auto end = std::chrono::system_clock::now();
     auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
     stats.sceneUpdateTime = elapsed.count() / 1000.0f;
 }
 
-void VulkanEngine::UpdateSceneNonShadow()
-{
-    glm::mat4 lightModel = glm::mat4(1.0f);
-    lightModel = glm::translate(lightModel, glm::vec3(sceneData.lightPosition.x, sceneData.lightPosition.y, sceneData.lightPosition.z));
-    lightModel = glm::scale(lightModel, glm::vec3(0.15, 0.15, 0.15));
-    loadedScenes["cube"]->Draw(lightModel, mainDrawContext);
-}
-
 bool VulkanEngine::IsVisible(const RenderObject& object, const glm::mat4& viewProjection)
 {
     std::array<glm::vec3, 8> corners
@@ -1542,19 +1947,58 @@ bool VulkanEngine::IsVisible(const RenderObject& object, const glm::mat4& viewPr
     }
 }
 
-void VulkanEngine::InitSkyboxPipeline()
+void VulkanEngine::RunCullBenchmark()
 {
-    VkShaderModule skyboxVertexShader;
-    if (!vkutil::LoadShaderModule("shaders/skyboxVert.spv", device, &skyboxVertexShader))
+    const std::vector<RenderObject>& objects = mainDrawContext.OpaqueSurfaces;
+    const uint32_t objectCount = (uint32_t)objects.size();
+    const uint32_t iterations = 100;
+
+    std::vector<uint8_t> visibility(objectCount);
+    std::vector<uint32_t> visible;
+
+    auto time = [&](const std::function<void()>& pass)
     {
-        fmt::println("Error when building the skybox vertex shader module");
-    }
+        auto start = std::chrono::system_clock::now();
+        for (uint32_t i = 0; i < iterations; i++)
+        {
+            pass();
+        }
+        auto end = std::chrono::system_clock::now();
+        return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0f / iterations;
+    };
 
-    VkShaderModule skyboxFragShader;
-    if (!vkutil::LoadShaderModule("shaders/skyboxFrag.spv", device, &skyboxFragShader))
+    auto countVisible = [&]()
     {
-        fmt::println("Error when building the skybox fragment shader module");
-    }
+        return (uint32_t)std::count(visibility.begin(), visibility.end(), 1);
+    };
+
+    cullBenchmark.objectCount = objectCount;
+    cullBenchmark.iterations = iterations;
+
+    cullBenchmark.isVisibleTime = time([&]()
+        {
+            for (uint32_t i = 0; i < objectCount; i++)
+            {
+                visibility[i] = IsVisible(objects[i], sceneData.viewproj) ? 1 : 0;
+            }
+        });
+    cullBenchmark.isVisibleCount = countVisible();
+
+    cullBenchmark.scalarTime = time([&]() { frustumCuller.CullRangeScalar(objects.data(), 0, objectCount, visibility.data()); });
+
+    cullBenchmark.simdTime = time([&]() { frustumCuller.CullRange(objects.data(), 0, objectCount, visibility.data()); });
+    cullBenchmark.simdCount = countVisible();
+
+    cullBenchmark.parallelTime = time([&]() { frustumCuller.Cull(objects.data(), objectCount, visible, &jobSystem); });
+
+    fmt::println("Culling {} objects: IsVisible {} ms, scalar {} ms, {} {} ms, threaded {} ms", objectCount,
+        cullBenchmark.isVisibleTime, cullBenchmark.scalarTime, FrustumCuller::SimdPath(), cullBenchmark.simdTime, cullBenchmark.parallelTime);
+}
+
+void VulkanEngine::InitSkyboxPipeline()
+{
+    VkShaderModule skyboxVertexShader = shaderModules.Get(device, "shaders/skyboxVert.spv");
+    VkShaderModule skyboxFragShader = shaderModules.Get(device, "shaders/skyboxFrag.spv");
 
     VkPushConstantRange bufferRange{};
     bufferRange.offset = 0;
@@ -1586,10 +2030,7 @@ void VulkanEngine::InitSkyboxPipeline()
     pipelineBuilder.SetColorAttachmentFormat(colorImage.imageFormat);
     pipelineBuilder.SetDepthFormat(depthImage.imageFormat);
 
-    skyboxPipeline = pipelineBuilder.BuildPipeline(device);
-
-    vkDestroyShaderModule(device, skyboxFragShader, nullptr);
-    vkDestroyShaderModule(device, skyboxVertexShader, nullptr);
+    skyboxPipeline = pipelineBuilder.BuildPipeline(device, pipelineCache.cache);
 
     mainDeletionQueue.PushFunction([=]() {
         vkDestroyPipelineLayout(device, skyboxPipelineLayout, nullptr);
@@ -1628,12 +2069,12 @@ void VulkanEngine::DrawSkybox(VkCommandBuffer cmd)
     vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, skyboxPipeline);
 
     //bind a texture
-    VkDescriptorSet imageSet = GetCurrentFrame().frameDescriptors.Allocate(device, skyboxDescriptorLayout);
+    VkDescriptorSet imageSet;
     {
         DescriptorWriter writer;
         writer.WriteImage(0, skyboxImage.imageView, defaultSamplerNearest, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
 
-        writer.UpdateSet(device, imageSet);
+        imageSet = descriptorSetCache.Get(device, skyboxDescriptorLayout, writer);
     }
 
     vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, skyboxPipelineLayout, 0, 1, &imageSet, 0, nullptr);
@@ -1649,42 +2090,26 @@ void VulkanEngine::DrawSkybox(VkCommandBuffer cmd)
     pushConstants.vertexBuffer = skyboxCube.vertexBufferAddress;
 
     vkCmdPushConstants(cmd, skyboxPipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(GPUDrawPushConstants), &pushConstants);
-    vkCmdBindIndexBuffer(cmd, skyboxCube.indexBuffer.buffer, 0, VK_INDEX_TYPE_UINT32);
+    vkCmdBindIndexBuffer(cmd, skyboxCube.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
 
     //vkCmdDrawIndexed(cmd, 36, 1, 0, 0, 0);
-    vkCmdDraw(cmd, 36, 1, 0, 0);
+    vkCmdDraw(cmd, 36, 1, skyboxCube.vertexOffset, 0); // the vertex buffer address is the arena's, firstVertex finds the cube
 
     vkCmdEndRendering(cmd);
 }
 
 void VulkanEngine::InitDepthMapPipeline()
 {
-    VkShaderModule depthMapVertexShader;
-    if (!vkutil::LoadShaderModule("shaders/depthMapVert.spv", device, &depthMapVertexShader))
-    {
-        fmt::println("Error when building the depth map vertex shader module");
-    }
-
-    VkShaderModule depthMapGeometryShader;
-    if (!vkutil::LoadShaderModule("shaders/depthMapGeom.spv", device, &depthMapGeometryShader))
-    {
-        fmt::println("Error when building the depth map geometry shader module");
-    }
-
-    VkShaderModule depthMapFragmentShader;
-    if (!vkutil::LoadShaderModule("shaders/depthMapFrag.spv", device, &depthMapFragmentShader))
-    {
-        fmt::println("Error when building the depth map fragment shader module");
-    }
+    VkShaderModule depthMapVertexShader = shaderModules.Get(device, "shaders/depthMapVert.spv");
 
     VkPushConstantRange bufferRange{};
     bufferRange.offset = 0;
     bufferRange.size = sizeof(GPUDrawPushDepthConstants);
-    bufferRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_GEOMETRY_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+    bufferRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 
     DescriptorLayoutBuilder builder;
-    builder.AddBinding(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
-    depthMapDescriptorLayout = builder.Build(device, VK_SHADER_STAGE_GEOMETRY_BIT);
+    builder.AddBinding(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC);
+    depthMapDescriptorLayout = builder.Build(device, VK_SHADER_STAGE_VERTEX_BIT);
 
     VkPipelineLayoutCreateInfo pipelineLayoutInfo = vkinit::pipeline_layout_create_info();
     pipelineLayoutInfo.pPushConstantRanges = &bufferRange;
@@ -1696,7 +2121,8 @@ void VulkanEngine::InitDepthMapPipeline()
     PipelineBuilder pipelineBuilder;
 
     pipelineBuilder.pipelineLayout = depthMapPipelineLayout;
-    pipelineBuilder.SetShaders(depthMapVertexShader, depthMapGeometryShader, depthMapFragmentShader);
+    // depth only, without a fragment shader nothing stops early depth testing
+    pipelineBuilder.SetVertexShader(depthMapVertexShader);
     pipelineBuilder.SetInputTopology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
     pipelineBuilder.SetPolygonMode(VK_POLYGON_MODE_FILL);
     pipelineBuilder.SetCullMode(VK_CULL_MODE_NONE, VK_FRONT_FACE_COUNTER_CLOCKWISE); // Revert to clockwise
@@ -1705,13 +2131,9 @@ void VulkanEngine::InitDepthMapPipeline()
     pipelineBuilder.EnableDepthtest(true, VK_COMPARE_OP_LESS); // revert to (Greater or equal to)
 
     pipelineBuilder.DisableColorAttachment();
-    pipelineBuilder.SetDepthFormat(depthCubemapImage.imageFormat);
-
-    depthMapPipeline = pipelineBuilder.BuildPipeline(device);
+    pipelineBuilder.SetDepthFormat(SHADOW_ATLAS_FORMAT);
 
-    vkDestroyShaderModule(device, depthMapVertexShader, nullptr);
-    vkDestroyShaderModule(device, depthMapGeometryShader, nullptr);
-    vkDestroyShaderModule(device, depthMapFragmentShader, nullptr);
+    depthMapPipeline = pipelineBuilder.BuildPipeline(device, pipelineCache.cache);
 
     mainDeletionQueue.PushFunction([=]() {
         vkDestroyPipelineLayout(device, depthMapPipelineLayout, nullptr);
@@ -1722,93 +2144,209 @@ void VulkanEngine::InitDepthMapPipeline()
 
 void VulkanEngine::DrawDepthMap(VkCommandBuffer cmd)
 {
+    const RenderObject* objects = mainDrawContext.OpaqueSurfaces.data();
+    uint32_t objectCount = (uint32_t)mainDrawContext.OpaqueSurfaces.size();
 
-    VkRenderingAttachmentInfo colorAttachment = vkinit::attachment_info(drawImage.imageView, nullptr, VK_IMAGE_LAYOUT_GENERAL);
-    VkRenderingAttachmentInfo depthAttachment = vkinit::depth_attachment_info(depthCubemapImage.imageView, true, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL);
+    // which cube faces each caster reaches for every light holding an atlas cube, casters outside the light radius get an empty mask
+    for (uint32_t i = 0; i < pointLights.size(); i++)
+    {
+        if (!shadowAtlas.HasCube(i))
+        {
+            continue;
+        }
 
-    VkExtent2D depthMapDrawExtent;
-    depthMapDrawExtent.height = depthCubemapSize;
-    depthMapDrawExtent.width = depthCubemapSize;
+        glm::mat4 faceMatrices[6];
+        BuildCubeFaceMatrices(pointLights[i].position, nearPlane, pointLights[i].radius, faceMatrices);
+        shadowCuller.SetLight(pointLights[i].position, pointLights[i].radius, faceMatrices);
+        shadowCuller.Cull(objects, objectCount, shadowAtlas.FaceMasks(i));
+    }
 
-    VkRenderingInfo renderingInfo = vkinit::rendering_info_depth_only(depthMapDrawExtent, &depthAttachment);
+    shadowAtlas.PlanRefreshes(pointLights, objects, objectCount, engineSettings.shadowAtlas.faceBudget, shadowRefreshes);
 
-    std::vector<uint32_t> opaqueDraws;
-    opaqueDraws.reserve(mainDrawContext.OpaqueSurfaces.size());
+    stats.shadowCasters = 0;
+    stats.shadowFaceDraws = 0;
+    stats.shadowAtlas = shadowAtlas.stats;
 
-    for (uint32_t i = 0; i < mainDrawContext.OpaqueSurfaces.size(); i++)
+    if (!shadowAtlas.layoutsInitialized)
     {
-        opaqueDraws.push_back(i);
+        shadowAtlas.RecordInitialLayouts(cmd);
     }
 
-    vkCmdBeginRendering(cmd, &renderingInfo);
+    // nothing changed since the last frame, the atlas is still valid and in read only layout
+    if (shadowRefreshes.empty())
+    {
+        return;
+    }
+
+    // bound once for every light, the matrices come in with the descriptor offset
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, depthMapPipeline);
+    vkCmdBindIndexBuffer(cmd, geometryArena.indexBuffer.buffer, 0, VK_INDEX_TYPE_UINT32);
 
-    //allocate a new uniform buffer for the scene data
-    AllocatedBuffer matrixDataBuffer = CreateBuffer(sizeof(DepthMapGeometryData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
-    //write the buffer
-    DepthMapGeometryData* matrixUniformData = (DepthMapGeometryData*)matrixDataBuffer.allocation->GetMappedData();
-    *matrixUniformData = depthMapGeometryData;
+    // the images are transitioned whole, a tier is only touched when one of its cubes is refreshed
+    for (uint32_t tierIndex = 0; tierIndex < SHADOW_TIER_COUNT; tierIndex++)
+    {
+        ShadowAtlas::Tier& tier = shadowAtlas.tiers[tierIndex];
 
-    //add it to the deletion queue of this frame so it gets deleted once its been used
-    GetCurrentFrame().deletionQueue.PushFunction([=, this]()
+        bool staticWork = false;
+        bool compositeWork = false;
+        bool dynamicWork = false;
+        for (const ShadowRefresh& refresh : shadowRefreshes)
         {
-            DestroyBuffer(matrixDataBuffer);
-        });
+            if (refresh.tier == tierIndex)
+            {
+                staticWork |= refresh.staticFaces != 0;
+                compositeWork |= refresh.compositeFaces != 0;
+                dynamicWork |= refresh.dynamicFaces != 0;
+            }
+        }
+
+        // static casters into the cache, only on the faces that changed
+        if (staticWork)
+        {
+            vkutil::TransititionDepthImage(cmd, tier.staticImage.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL);
+            for (const ShadowRefresh& refresh : shadowRefreshes)
+            {
+                if (refresh.tier == tierIndex && refresh.staticFaces != 0)
+                {
+                    DrawShadowCasters(cmd, refresh, tier.staticCubeViews[refresh.cube], refresh.staticFaces, false);
+                }
+            }
+            vkutil::TransititionDepthImage(cmd, tier.staticImage.image, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+        }
+
+        if (!compositeWork)
+        {
+            continue;
+        }
+
+        // rebuild the sampled faces from the cache and put the dynamic casters on top
+        vkutil::TransititionDepthImage(cmd, tier.shadowImage.image, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+        shadowAtlas.RecordComposite(cmd, tierIndex, shadowRefreshes);
+
+        if (dynamicWork)
+        {
+            vkutil::TransititionDepthImage(cmd, tier.shadowImage.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL);
+            for (const ShadowRefresh& refresh : shadowRefreshes)
+            {
+                if (refresh.tier == tierIndex && refresh.dynamicFaces != 0)
+                {
+                    DrawShadowCasters(cmd, refresh, tier.shadowCubeViews[refresh.cube], refresh.dynamicFaces, true);
+                }
+            }
+            vkutil::TransititionDepthImage(cmd, tier.shadowImage.image, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL);
+        }
+        else
+        {
+            vkutil::TransititionDepthImage(cmd, tier.shadowImage.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL);
+        }
+    }
+}
+
+void VulkanEngine::DrawShadowCasters(VkCommandBuffer cmd, const ShadowRefresh& refresh, VkImageView target, uint8_t faces, bool dynamicCasters)
+{
+    const PointLight& light = pointLights[refresh.light];
+    uint32_t resolution = shadowAtlas.tiers[refresh.tier].resolution;
 
-    VkDescriptorSet globalDescriptor = GetCurrentFrame().frameDescriptors.Allocate(device, depthMapDescriptorLayout);
+    // loaded so the faces outside the mask keep their depth
+    VkRenderingAttachmentInfo depthAttachment = vkinit::depth_attachment_info(target, false, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL);
+
+    VkExtent2D depthMapDrawExtent;
+    depthMapDrawExtent.height = resolution;
+    depthMapDrawExtent.width = resolution;
+
+    VkRenderingInfo renderingInfo = vkinit::rendering_info_depth_only(depthMapDrawExtent, &depthAttachment);
+
+    //write the light's shadow matrices into this frame's uniform buffer
+    DepthMapGeometryData depthMapGeometryData;
+    BuildCubeFaceMatrices(light.position, nearPlane, light.radius, depthMapGeometryData.shadowMatricies);
+    uint32_t matrixDataOffset = GetCurrentFrame().uniformAllocator.Push(depthMapGeometryData);
 
     DescriptorWriter writer;
-    writer.WriteBuffer(0, matrixDataBuffer.buffer, sizeof(DepthMapGeometryData), 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
-    writer.UpdateSet(device, globalDescriptor);
+    writer.WriteBuffer(0, GetCurrentFrame().uniformAllocator.buffer.buffer, sizeof(DepthMapGeometryData), 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC);
+    VkDescriptorSet globalDescriptor = descriptorSetCache.Get(device, depthMapDescriptorLayout, writer);
+
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, depthMapPipelineLayout, 0, 1, &globalDescriptor, 1, &matrixDataOffset);
+
+    VkViewport viewport = {};
+    viewport.x = 0.0f;
+    viewport.y = 0.0f;
+    viewport.width = (float)resolution;
+    viewport.height = (float)resolution;
+    viewport.minDepth = 0.0f;
+    viewport.maxDepth = 1.0f;
+
+    vkCmdSetViewport(cmd, 0, 1, &viewport);
 
-    VkBuffer lastIndexBuffer = VK_NULL_HANDLE;
+    VkRect2D scissor = {};
+    scissor.offset.x = 0;
+    scissor.offset.y = 0;
+    scissor.extent.width = resolution;
+    scissor.extent.height = resolution;
 
-    auto draw = [&](const RenderObject& r)
+    vkCmdSetScissor(cmd, 0, 1, &scissor);
+
+    vkCmdBeginRendering(cmd, &renderingInfo);
+
+    // the static faces being redrawn are cleared layer by layer, the dynamic pass draws over the copied static depth
+    if (!dynamicCasters)
     {
-        vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, depthMapPipeline);
-        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, depthMapPipelineLayout, 0, 1, &globalDescriptor, 0, nullptr);
+        VkClearAttachment clear = {};
+        clear.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+        clear.clearValue.depthStencil.depth = 1.0f;
+
+        VkClearRect clearRects[6];
+        uint32_t clearCount = 0;
+        for (uint32_t face = 0; face < 6; face++)
+        {
+            if (faces & (1 << face))
+            {
+                clearRects[clearCount++] = { { { 0, 0 }, depthMapDrawExtent }, face, 1 };
+            }
+        }
 
-        VkViewport viewport = {};
-        viewport.x = 0.0f;
-        viewport.y = 0.0f;
-        viewport.width = depthCubemapSize;
-        viewport.height = depthCubemapSize;
-        viewport.minDepth = 0.0f;
-        viewport.maxDepth = 1.0f;
+        vkCmdClearAttachments(cmd, 1, &clear, clearCount, clearRects);
+    }
+
+    GPUDrawPushDepthConstants pushConstants;
+    pushConstants.lightPosition = glm::vec4(light.position, light.power);
+    pushConstants.farPlane = light.radius;
 
-        vkCmdSetViewport(cmd, 0, 1, &viewport);
+    const std::vector<uint8_t>& faceMasks = shadowAtlas.FaceMasks(refresh.light);
 
-        VkRect2D scissor = {};
-        scissor.offset.x = 0.0f;
-        scissor.offset.y = 0.0f;
-        scissor.extent.width = depthCubemapSize;
-        scissor.extent.height = depthCubemapSize;
+    for (uint32_t i = 0; i < mainDrawContext.OpaqueSurfaces.size(); i++)
+    {
+        const RenderObject& r = mainDrawContext.OpaqueSurfaces[i];
+        uint8_t faceMask = faceMasks[i] & faces;
 
-        vkCmdSetScissor(cmd, 0, 1, &scissor);
+        if (!r.castsShadow || r.dynamicShadow != dynamicCasters || faceMask == 0)
+        {
+            continue;
+        }
 
-        //rebind index buffer if needed
-        if (r.indexBuffer != lastIndexBuffer)
+        // one instance per face the caster reaches, the vertex shader reads its face from 3 bits of the list and routes it with gl_Layer
+        uint32_t faceList = 0;
+        uint32_t faceCount = 0;
+        for (uint32_t face = 0; face < 6; face++)
         {
-            lastIndexBuffer = r.indexBuffer;
-            vkCmdBindIndexBuffer(cmd, r.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+            if (faceMask & (1 << face))
+            {
+                faceList |= face << (3 * faceCount);
+                faceCount++;
+            }
         }
 
-        GPUDrawPushDepthConstants pushConstants;
         pushConstants.renderMatrix = r.transform;
-        pushConstants.lightPosition = sceneData.lightPosition;
-        pushConstants.farPlane = sceneData.shadowFarPlane;
+        pushConstants.faces = faceList;
         pushConstants.vertexBuffer = r.vertexBufferAddress;
 
-        vkCmdPushConstants(cmd, depthMapPipelineLayout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_GEOMETRY_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(GPUDrawPushDepthConstants), &pushConstants);
+        vkCmdPushConstants(cmd, depthMapPipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(GPUDrawPushDepthConstants), &pushConstants);
 
-        vkCmdDrawIndexed(cmd, r.indexCount, 1, r.firstIndex, 0, 0);
+        vkCmdDrawIndexed(cmd, r.indexCount, faceCount, r.firstIndex, r.vertexOffset, 0);
         //stats
         stats.drawcallCount += 1;
-        stats.triangleCount += r.indexCount / 3;
-    };
-
-    for (auto& r : opaqueDraws)
-    {
-        draw(mainDrawContext.OpaqueSurfaces[r]);
+        stats.triangleCount += r.indexCount / 3 * faceCount;
+        stats.shadowCasters += 1;
+        stats.shadowFaceDraws += faceCount;
     }
 
     vkCmdEndRendering(cmd);
@@ -1816,17 +2354,8 @@ void VulkanEngine::DrawDepthMap(VkCommandBuffer cmd)
 
 void VulkanEngine::InitParticlePipeline()
 {
-    VkShaderModule particleVertexShader;
-    if (!vkutil::LoadShaderModule("shaders/particleVert.spv", device, &particleVertexShader))
-    {
-        fmt::println("Error when building the particle vertex shader module");
-    }
-
-    VkShaderModule particleFragShader;
-    if (!vkutil::LoadShaderModule("shaders/particleFrag.spv", device, &particleFragShader))
-    {
-        fmt::println("Error when building the particle fragment shader module");
-    }
+    VkShaderModule particleVertexShader = shaderModules.Get(device, "shaders/particleVert.spv");
+    VkShaderModule particleFragShader = shaderModules.Get(device, "shaders/particleFrag.spv");
 
     VkPushConstantRange bufferRange{};
     bufferRange.offset = 0;
@@ -1834,7 +2363,7 @@ void VulkanEngine::InitParticlePipeline()
     bufferRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 
     DescriptorLayoutBuilder builder;
-    builder.AddBinding(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
+    builder.AddBinding(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC);
     builder.AddBinding(1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
     particleDescriptorLayout = builder.Build(device, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT);
 
@@ -1853,16 +2382,12 @@ void VulkanEngine::InitParticlePipeline()
     pipelineBuilder.SetPolygonMode(VK_POLYGON_MODE_FILL);
     pipelineBuilder.SetCullMode(VK_CULL_MODE_NONE, VK_FRONT_FACE_COUNTER_CLOCKWISE); // Revert to clockwise
     pipelineBuilder.SetMultisampling(engineSettings.msaaSamples);
-    pipelineBuilder.EnableBlendingAlphaBlend();
     pipelineBuilder.EnableDepthtest(false, VK_COMPARE_OP_LESS);// revert to (Greater or equal to)
 
-    pipelineBuilder.SetColorAttachmentFormat(colorImage.imageFormat);
+    pipelineBuilder.SetWeightedBlendedAttachments(accumulationImage.imageFormat, revealageImage.imageFormat);
     pipelineBuilder.SetDepthFormat(depthImage.imageFormat);
 
-    particlePipeline = pipelineBuilder.BuildPipeline(device);
-
-    vkDestroyShaderModule(device, particleVertexShader, nullptr);
-    vkDestroyShaderModule(device, particleFragShader, nullptr);
+    particlePipeline = pipelineBuilder.BuildPipeline(device, pipelineCache.cache);
 
     mainDeletionQueue.PushFunction([=]() {
         vkDestroyPipelineLayout(device, particlePipelineLayout, nullptr);
@@ -1870,15 +2395,200 @@ void VulkanEngine::InitParticlePipeline()
         });
 }
 
-void VulkanEngine::DrawParticles(VkCommandBuffer cmd)
+void VulkanEngine::InitParticleComputePipelines()
 {
-    //begin a render pass  connected to our draw image
-    VkRenderingAttachmentInfo colorAttachment = vkinit::attachment_info(colorImage.imageView, nullptr, VK_IMAGE_LAYOUT_GENERAL);
-    VkRenderingAttachmentInfo depthAttachment = vkinit::depth_attachment_info(depthImage.imageView, false, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL);
+    VkShaderModule simShader = shaderModules.Get(device, "shaders/particleSimComp.spv");
+    VkShaderModule sortShader = shaderModules.Get(device, "shaders/particleSortComp.spv");
 
-    VkRenderingInfo renderInfo = vkinit::rendering_info(drawExtent, &colorAttachment, &depthAttachment);
-    vkCmdBeginRendering(cmd, &renderInfo);
+    // both passes only use push constants, the range covers the larger of the two blocks
+    VkPushConstantRange bufferRange{};
+    bufferRange.offset = 0;
+    bufferRange.size = std::max(sizeof(GPUParticleSimPushConstants), sizeof(GPUParticleSortPushConstants));
+    bufferRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo = vkinit::pipeline_layout_create_info();
+    pipelineLayoutInfo.pPushConstantRanges = &bufferRange;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    VK_CHECK(vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &particleComputeLayout));
+
+    VkComputePipelineCreateInfo pipelineInfo{ .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+    pipelineInfo.pNext = nullptr;
+    pipelineInfo.layout = particleComputeLayout;
+
+    pipelineInfo.stage = vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, simShader);
+    VK_CHECK(vkCreateComputePipelines(device, pipelineCache.cache, 1, &pipelineInfo, nullptr, &particleSimPipeline));
+
+    pipelineInfo.stage = vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, sortShader);
+    VK_CHECK(vkCreateComputePipelines(device, pipelineCache.cache, 1, &pipelineInfo, nullptr, &particleSortPipeline));
+
+    mainDeletionQueue.PushFunction([=]() {
+        vkDestroyPipelineLayout(device, particleComputeLayout, nullptr);
+        vkDestroyPipeline(device, particleSimPipeline, nullptr);
+        vkDestroyPipeline(device, particleSortPipeline, nullptr);
+        });
+}
+
+void VulkanEngine::InitCullPipeline()
+{
+    VkShaderModule cullShader = shaderModules.Get(device, "shaders/cullComp.spv");
+
+    // every buffer is reached through device addresses, so the layout is push constants only
+    VkPushConstantRange bufferRange{};
+    bufferRange.offset = 0;
+    bufferRange.size = sizeof(GPUCullPushConstants);
+    bufferRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo = vkinit::pipeline_layout_create_info();
+    pipelineLayoutInfo.pPushConstantRanges = &bufferRange;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    VK_CHECK(vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &cullPipelineLayout));
+
+    VkComputePipelineCreateInfo pipelineInfo{ .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+    pipelineInfo.pNext = nullptr;
+    pipelineInfo.layout = cullPipelineLayout;
+    pipelineInfo.stage = vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, cullShader);
+
+    VK_CHECK(vkCreateComputePipelines(device, pipelineCache.cache, 1, &pipelineInfo, nullptr, &cullPipeline));
+
+    mainDeletionQueue.PushFunction([=]() {
+        vkDestroyPipelineLayout(device, cullPipelineLayout, nullptr);
+        vkDestroyPipeline(device, cullPipeline, nullptr);
+        });
+}
+
+void VulkanEngine::InitClusterPipeline()
+{
+    VkShaderModule clusterShader = shaderModules.Get(device, "shaders/clusterComp.spv");
+
+    VkPushConstantRange bufferRange{};
+    bufferRange.offset = 0;
+    bufferRange.size = sizeof(GPUClusterPushConstants);
+    bufferRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo = vkinit::pipeline_layout_create_info();
+    pipelineLayoutInfo.pPushConstantRanges = &bufferRange;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    VK_CHECK(vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &clusterPipelineLayout));
+
+    VkComputePipelineCreateInfo pipelineInfo{ .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+    pipelineInfo.pNext = nullptr;
+    pipelineInfo.layout = clusterPipelineLayout;
+    pipelineInfo.stage = vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, clusterShader);
+
+    VK_CHECK(vkCreateComputePipelines(device, pipelineCache.cache, 1, &pipelineInfo, nullptr, &clusterPipeline));
+
+    mainDeletionQueue.PushFunction([=]() {
+        vkDestroyPipelineLayout(device, clusterPipelineLayout, nullptr);
+        vkDestroyPipeline(device, clusterPipeline, nullptr);
+        });
+}
+
+void VulkanEngine::InitTransparentCompositePipeline()
+{
+    VkShaderModule compositeVertexShader = shaderModules.Get(device, "shaders/transparentCompositeVert.spv");
+    VkShaderModule compositeFragShader = shaderModules.Get(device, "shaders/transparentCompositeFrag.spv");
+
+    DescriptorLayoutBuilder builder;
+    builder.AddBinding(0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+    builder.AddBinding(1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+    transparentCompositeDescriptorLayout = builder.Build(device, VK_SHADER_STAGE_FRAGMENT_BIT);
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo = vkinit::pipeline_layout_create_info();
+    pipelineLayoutInfo.pSetLayouts = &transparentCompositeDescriptorLayout;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    VK_CHECK(vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &transparentCompositeLayout));
+
+    // every sample of a pixel gets the resolved transparency, blended over by its coverage
+    PipelineBuilder pipelineBuilder;
+    pipelineBuilder.pipelineLayout = transparentCompositeLayout;
+    pipelineBuilder.SetShaders(compositeVertexShader, compositeFragShader);
+    pipelineBuilder.SetInputTopology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
+    pipelineBuilder.SetPolygonMode(VK_POLYGON_MODE_FILL);
+    pipelineBuilder.SetCullMode(VK_CULL_MODE_NONE, VK_FRONT_FACE_COUNTER_CLOCKWISE);
+    pipelineBuilder.SetMultisampling(engineSettings.msaaSamples);
+    pipelineBuilder.EnableBlendingAlphaBlend();
+    pipelineBuilder.DisableDepthtest();
+    pipelineBuilder.SetColorAttachmentFormat(colorImage.imageFormat);
+
+    transparentCompositePipeline = pipelineBuilder.BuildPipeline(device, pipelineCache.cache);
+
+    mainDeletionQueue.PushFunction([=]() {
+        vkDestroyPipelineLayout(device, transparentCompositeLayout, nullptr);
+        vkDestroyDescriptorSetLayout(device, transparentCompositeDescriptorLayout, nullptr);
+        vkDestroyPipeline(device, transparentCompositePipeline, nullptr);
+        });
+}
+
+void VulkanEngine::SpawnClusterStressLights(uint32_t count)
+{
+    // scatter the lights through the bounds of everything opaque in the scene
+    glm::vec3 sceneMin(FLT_MAX);
+    glm::vec3 sceneMax(-FLT_MAX);
+
+    for (const RenderObject& r : mainDrawContext.OpaqueSurfaces)
+    {
+        glm::vec3 center = glm::vec3(r.transform * glm::vec4(r.bounds.origin, 1.0f));
+        glm::mat3 absolute = glm::mat3(glm::abs(glm::vec3(r.transform[0])), glm::abs(glm::vec3(r.transform[1])), glm::abs(glm::vec3(r.transform[2])));
+        glm::vec3 extents = absolute * r.bounds.extents;
+
+        sceneMin = glm::min(sceneMin, center - extents);
+        sceneMax = glm::max(sceneMax, center + extents);
+    }
+
+    if (mainDrawContext.OpaqueSurfaces.empty())
+    {
+        sceneMin = mainCamera.position - glm::vec3(20.0f);
+        sceneMax = mainCamera.position + glm::vec3(20.0f);
+    }
+
+    auto random = []() { return (float)rand() / (float)RAND_MAX; };
+
+    localLights.clear();
+    localLights.reserve(count);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        ClusterLight light;
+        light.position = sceneMin + (sceneMax - sceneMin) * glm::vec3(random(), random(), random());
+        light.radius = 1.0f + random() * 3.0f;
+        light.color = glm::vec3(0.2f + random() * 0.8f, 0.2f + random() * 0.8f, 0.2f + random() * 0.8f);
+        light.intensity = 2.0f + random() * 6.0f;
+        localLights.push_back(light);
+    }
+}
+
+void VulkanEngine::SpawnParticleEmitters(uint32_t count, uint32_t particlesEach)
+{
+    auto random = []() { return (float)rand() / (float)RAND_MAX; };
+
+    // a ring around the camera, each emitter with its own slice of the smoke sheet, speed and size curve
+    for (uint32_t i = 0; i < count; i++)
+    {
+        float angle = glm::radians(360.0f) * (float)i / (float)count;
+
+        ParticleEmitterSettings settings;
+        settings.position = mainCamera.position + glm::vec3(std::cos(angle), -0.5f, std::sin(angle)) * glm::vec3(10.0f + 10.0f * random(), 1.0f, 10.0f + 10.0f * random());
+        settings.spawnDimensions = glm::vec3(0.5f + random(), 0.0f, 0.5f + random());
+        settings.movement = glm::vec3(random() - 0.5f, 0.5f + random(), random() - 0.5f);
+        settings.lowerLife = 2.0f + 2.0f * random();
+        settings.upperLife = settings.lowerLife + 3.0f * random();
+        settings.sizeStart = 0.2f * random();
+        settings.sizeEnd = 0.5f + random();
+        settings.sizeExponent = 0.5f + 1.5f * random();
+        settings.firstLayer = (uint32_t)(random() * 32.0f);
+        settings.layerCount = 8 + (uint32_t)(random() * 24.0f);
+
+        uint32_t emitter = particleSystem.CreateEmitter(settings, particlesEach);
+        if (emitter == INVALID_PARTICLE_EMITTER)
+        {
+            break;
+        }
+        spawnedEmitters.push_back(emitter);
+    }
+}
 
+void VulkanEngine::DrawParticles(VkCommandBuffer cmd)
+{
     //set dynamic viewport and scissor
     VkViewport viewport = {};
     viewport.x = 0;
@@ -1906,54 +2616,81 @@ void VulkanEngine::DrawParticles(VkCommandBuffer cmd)
 
     projection[1][1] *= -1;
 
-    glm::mat4 model;
-    glm::translate(model, particleEmitter->emitterPos);
-
     ParticleSceneData particleSceneData;
     particleSceneData.particleSize = 3.0f;
-    particleSceneData.textureArraySize = 45;
+    particleSceneData.textureArraySize = 64;
     particleSceneData.projection = projection;
     particleSceneData.view = view;
 
-    AllocatedBuffer particleDataBuffer = CreateBuffer(sizeof(ParticleSceneData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
-    //write the buffer
-    ParticleSceneData* particleUniformData = (ParticleSceneData*)particleDataBuffer.allocation->GetMappedData();
-    *particleUniformData = particleSceneData;
+    uint32_t particleDataOffset = GetCurrentFrame().uniformAllocator.Push(particleSceneData);
 
-    GetCurrentFrame().deletionQueue.PushFunction([=, this]()
-        {
-            DestroyBuffer(particleDataBuffer);
-        });
-
-    VkDescriptorSet globalDescriptor = GetCurrentFrame().frameDescriptors.Allocate(device, particleDescriptorLayout);
+    VkDescriptorSet globalDescriptor;
     {
         DescriptorWriter writer;
-        writer.WriteBuffer(0, particleDataBuffer.buffer, sizeof(ParticleSceneData), 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
+        writer.WriteBuffer(0, GetCurrentFrame().uniformAllocator.buffer.buffer, sizeof(ParticleSceneData), 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC);
         writer.WriteImage(1, particleSmokeImage.imageView, defaultSamplerNearest, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
-        // build uniform and bind it here
-        writer.UpdateSet(device, globalDescriptor);
+        globalDescriptor = descriptorSetCache.Get(device, particleDescriptorLayout, writer);
     }
 
-    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, particlePipelineLayout, 0, 1, &globalDescriptor, 0, nullptr);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, particlePipelineLayout, 0, 1, &globalDescriptor, 1, &particleDataOffset);
 
     GPUDrawPushParticleConstants pushParticleConstants;
     pushParticleConstants.renderMatrix = projection * view;
     pushParticleConstants.vertexBuffer = particleBillboard.vertexBufferAddress;
-    pushParticleConstants.particlePositionBuffer = particleEmitter->particleBuffers.particleBufferAddress;
+    pushParticleConstants.particlePositionBuffer = engineSettings.cpuParticles ? cpuParticleBuffer.DeviceAddress(frameNumber % FRAME_OVERLAP) : particleSystem.DrawBufferAddress();
+    pushParticleConstants.emitterBuffer = particleSystem.EmitterBufferAddress(frameNumber % FRAME_OVERLAP);
+    uint32_t particleCount = engineSettings.cpuParticles ? cpuParticleEmitter.particleCount : particleSystem.liveCount;
 
     vkCmdPushConstants(cmd, particlePipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(GPUDrawPushParticleConstants), &pushParticleConstants);
-    vkCmdBindIndexBuffer(cmd, particleBillboard.indexBuffer.buffer, 0, VK_INDEX_TYPE_UINT32);
+    vkCmdBindIndexBuffer(cmd, particleBillboard.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
 
-    vkCmdDraw(cmd, 6, particleEmitter->particles.size(), 0, 0);
+    vkCmdDraw(cmd, 6, particleCount, particleBillboard.vertexOffset, 0);
+}
+
+void VulkanEngine::DrawTransparentComposite(VkCommandBuffer cmd)
+{
+    vkutil::TransititionImage(cmd, accumulationResolveImage.image, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    vkutil::TransititionImage(cmd, revealageResolveImage.image, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+    VkRenderingAttachmentInfo colorAttachment = vkinit::attachment_info(colorImage.imageView, nullptr, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+    VkRenderingInfo renderInfo = vkinit::rendering_info(drawExtent, &colorAttachment, nullptr);
+    vkCmdBeginRendering(cmd, &renderInfo);
+
+    VkViewport viewport = {};
+    viewport.x = 0;
+    viewport.y = 0;
+    viewport.width = drawExtent.width;
+    viewport.height = drawExtent.height;
+    viewport.minDepth = 0.0f;
+    viewport.maxDepth = 1.0f;
+
+    vkCmdSetViewport(cmd, 0, 1, &viewport);
+
+    VkRect2D scissor = {};
+    scissor.offset.x = 0;
+    scissor.offset.y = 0;
+    scissor.extent.width = viewport.width;
+    scissor.extent.height = viewport.height;
+
+    vkCmdSetScissor(cmd, 0, 1, &scissor);
+
+    VkDescriptorSet compositeDescriptor;
+    {
+        DescriptorWriter writer;
+        writer.WriteImage(0, accumulationResolveImage.imageView, defaultSamplerNearest, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+        writer.WriteImage(1, revealageResolveImage.imageView, defaultSamplerNearest, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+        compositeDescriptor = descriptorSetCache.Get(device, transparentCompositeDescriptorLayout, writer);
+    }
+
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, transparentCompositePipeline);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, transparentCompositeLayout, 0, 1, &compositeDescriptor, 0, nullptr);
+    vkCmdDraw(cmd, 3, 1, 0, 0);
 
     vkCmdEndRendering(cmd);
 }
 
 VkSampleCountFlagBits VulkanEngine::GetMaxUsableSampleCount()
 {
-    VkPhysicalDeviceProperties physicalDeviceProperties;
-    vkGetPhysicalDeviceProperties(physicalDevice, &physicalDeviceProperties);
-
     VkSampleCountFlags counts = physicalDeviceProperties.limits.framebufferColorSampleCounts & physicalDeviceProperties.limits.framebufferDepthSampleCounts;
 
     if (counts & VK_SAMPLE_COUNT_64_BIT) { return VK_SAMPLE_COUNT_64_BIT; }
@@ -1966,36 +2703,14 @@ VkSampleCountFlagBits VulkanEngine::GetMaxUsableSampleCount()
     return VK_SAMPLE_COUNT_1_BIT;
 }
 
-void GLTFMetallicRoughness::BuildPipelines(VulkanEngine* engine)
+void GLTFMetallicRoughness::BuildPipelines(VulkanEngine* engine, JobCounter& counter)
 {
-    VkShaderModule meshVertexShader;
-    if (!vkutil::LoadShaderModule("shaders/meshVert.spv", engine->device, &meshVertexShader))
-    {
-        fmt::println("Error when building the triangle vertex shader module");
-    }
-
-    VkShaderModule meshFragShader;
-    if (!vkutil::LoadShaderModule("shaders/meshPBRFrag.spv", engine->device, &meshFragShader))
-    {
-        fmt::println("Error when building the triangle fragment shader module");
-    }
-
     VkPushConstantRange matrixRange{};
     matrixRange.offset = 0;
-    matrixRange.size = sizeof(GPUDrawPushConstants);
+    matrixRange.size = sizeof(GPUDrawObjectPushConstants);
     matrixRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 
-    DescriptorLayoutBuilder layoutBuilder;
-    layoutBuilder.AddBinding(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
-    layoutBuilder.AddBinding(1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
-    layoutBuilder.AddBinding(2, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
-    layoutBuilder.AddBinding(3, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
-    layoutBuilder.AddBinding(4, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
-    layoutBuilder.AddBinding(5, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
-
-    materialLayout = layoutBuilder.Build(engine->device, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT);
-
-    VkDescriptorSetLayout  layouts[] = { engine->gpuSceneDataDescriptorLayout, materialLayout };
+    VkDescriptorSetLayout  layouts[] = { engine->gpuSceneDataDescriptorLayout, engine->bindlessMaterials.layout };
 
     VkPipelineLayoutCreateInfo meshLayoutInfo = vkinit::pipeline_layout_create_info();
     meshLayoutInfo.setLayoutCount = 2;
@@ -2003,62 +2718,155 @@ void GLTFMetallicRoughness::BuildPipelines(VulkanEngine* engine)
     meshLayoutInfo.pPushConstantRanges = &matrixRange;
     meshLayoutInfo.pushConstantRangeCount = 1;
 
-    VkPipelineLayout newLayout;
-    VK_CHECK(vkCreatePipelineLayout(engine->device, &meshLayoutInfo, nullptr, &newLayout));
+    VK_CHECK(vkCreatePipelineLayout(engine->device, &meshLayoutInfo, nullptr, &layout));
 
-    opaquePipeline.layout = newLayout;
-    transparentPipeline.layout = newLayout;
+    // the variants the default material and most gltf materials use are built with the other startup pipelines,
+    // the rest wait for a material that needs them
+    std::lock_guard<std::mutex> lock(variantMutex);
+    for (MaterialPass pass : { MaterialPass::MainColor, MaterialPass::Transparent })
+    {
+        uint32_t key = VariantKey(pass, MATERIAL_FEATURE_ALL);
 
-    PipelineBuilder pipelineBuilder;
-    pipelineBuilder.SetShaders(meshVertexShader, meshFragShader);
-    pipelineBuilder.SetInputTopology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
-    pipelineBuilder.SetPolygonMode(VK_POLYGON_MODE_FILL);
-    pipelineBuilder.SetCullMode(VK_CULL_MODE_NONE, VK_FRONT_FACE_COUNTER_CLOCKWISE); // Revert to clockwise
-    pipelineBuilder.SetMultisampling(engine->engineSettings.msaaSamples);
-    pipelineBuilder.DisableBlending();
-    pipelineBuilder.EnableDepthtest(true, VK_COMPARE_OP_LESS); // revert to (Greater or equal to)
+        std::unique_ptr<MaterialPipeline>& variant = variants[key];
+        variant = std::make_unique<MaterialPipeline>();
+        variant->layout = layout;
+        variant->sortId = key;
 
-    pipelineBuilder.SetColorAttachmentFormat(engine->colorImage.imageFormat);
-    pipelineBuilder.SetDepthFormat(engine->depthImage.imageFormat);
+        MaterialPipeline* pipeline = variant.get();
+        engine->jobSystem.Submit([this, engine, pipeline, key]()
+            {
+                pipeline->pipeline = BuildVariant(engine, key);
+            }, &counter);
+    }
+}
 
-    pipelineBuilder.pipelineLayout = newLayout;
+void GLTFMetallicRoughness::ClearResources(VkDevice device)
+{
+    std::lock_guard<std::mutex> lock(variantMutex);
+    for (auto& [key, variant] : variants)
+    {
+        vkDestroyPipeline(device, variant->pipeline, nullptr);
+    }
+    variants.clear();
 
-    opaquePipeline.pipeline = pipelineBuilder.BuildPipeline(engine->device);
+    vkDestroyPipelineLayout(device, layout, nullptr);
+}
 
-    pipelineBuilder.EnableBlendingAdditive();
+uint32_t GLTFMetallicRoughness::VariantKey(MaterialPass pass, uint32_t features)
+{
+    return (features & MATERIAL_FEATURE_ALL) | (pass == MaterialPass::Transparent ? 1u << 2 : 0u);
+}
 
-    pipelineBuilder.EnableDepthtest(false, VK_COMPARE_OP_LESS);
+MaterialPipeline* GLTFMetallicRoughness::GetPipeline(VulkanEngine* engine, MaterialPass pass, uint32_t features)
+{
+    uint32_t key = VariantKey(pass, features);
 
-    transparentPipeline.pipeline = pipelineBuilder.BuildPipeline(engine->device);
+    std::lock_guard<std::mutex> lock(variantMutex);
+    std::unique_ptr<MaterialPipeline>& variant = variants[key];
+    if (!variant)
+    {
+        variant = std::make_unique<MaterialPipeline>();
+        variant->layout = layout;
+        variant->sortId = key;
+        variant->pipeline = BuildVariant(engine, key);
+    }
 
-    vkDestroyShaderModule(engine->device, meshFragShader, nullptr);
-    vkDestroyShaderModule(engine->device, meshVertexShader, nullptr);
+    return variant.get();
 }
 
-MaterialInstance GLTFMetallicRoughness::WriteMaterial(VkDevice device, MaterialPass pass, const MaterialResources& resources, DescriptorAllocatorGrowable& descriptorAllocator)
+void GLTFMetallicRoughness::RebuildPipelines(VulkanEngine* engine)
 {
-    MaterialInstance matData;
-    matData.passType = pass;
-    if (pass == MaterialPass::Transparent)
+    std::lock_guard<std::mutex> lock(variantMutex);
+
+    // materials and draw batches hold the MaterialPipeline pointers, so only the VkPipeline inside is replaced
+    JobCounter rebuildJobs;
+    for (auto& [key, variant] : variants)
+    {
+        MaterialPipeline* pipeline = variant.get();
+        uint32_t variantKey = key;
+        engine->jobSystem.Submit([this, engine, pipeline, variantKey]()
+            {
+                vkDestroyPipeline(engine->device, pipeline->pipeline, nullptr);
+                pipeline->pipeline = BuildVariant(engine, variantKey);
+            }, &rebuildJobs);
+    }
+    engine->jobSystem.Wait(rebuildJobs);
+}
+
+uint32_t GLTFMetallicRoughness::VariantCount()
+{
+    std::lock_guard<std::mutex> lock(variantMutex);
+    return (uint32_t)variants.size();
+}
+
+VkPipeline GLTFMetallicRoughness::BuildVariant(VulkanEngine* engine, uint32_t key)
+{
+    bool transparent = key & (1u << 2);
+
+    VkShaderModule meshVertexShader = engine->shaderModules.Get(engine->device, "shaders/meshVert.spv");
+
+    // matches the constant_id order in meshPBR.frag
+    uint32_t specialization[] =
+    {
+        std::clamp(engine->engineSettings.shadowSamples, 1u, 20u),
+        engine->engineSettings.shadows ? VK_TRUE : VK_FALSE,
+        (key & MATERIAL_FEATURE_NORMAL_MAP) ? VK_TRUE : VK_FALSE,
+        (key & MATERIAL_FEATURE_EMISSION) ? VK_TRUE : VK_FALSE,
+    };
+
+    // weighted blended is a separate compile, it changes the fragment outputs. both have to declare every constant above
+    const char* fragPath = transparent ? "shaders/meshPBRTransparentFrag.spv" : "shaders/meshPBRFrag.spv";
+    VkShaderModule meshFragShader = engine->shaderModules.Get(engine->device, fragPath, (1ull << std::size(specialization)) - 1);
+
+    PipelineBuilder pipelineBuilder;
+    pipelineBuilder.SetShaders(meshVertexShader, meshFragShader);
+    pipelineBuilder.SetSpecializationConstants(VK_SHADER_STAGE_FRAGMENT_BIT, specialization);
+    pipelineBuilder.SetInputTopology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
+    pipelineBuilder.SetPolygonMode(VK_POLYGON_MODE_FILL);
+    pipelineBuilder.SetCullMode(VK_CULL_MODE_NONE, VK_FRONT_FACE_COUNTER_CLOCKWISE); // Revert to clockwise
+    pipelineBuilder.SetMultisampling(engine->engineSettings.msaaSamples);
+    pipelineBuilder.DisableBlending();
+    pipelineBuilder.SetDepthFormat(engine->depthImage.imageFormat);
+    pipelineBuilder.pipelineLayout = layout;
+
+    if (transparent)
     {
-        matData.pipeline = &transparentPipeline;
+        // weighted blended, so the surfaces can be drawn in any order
+        pipelineBuilder.EnableDepthtest(false, VK_COMPARE_OP_LESS);
+        pipelineBuilder.SetWeightedBlendedAttachments(engine->accumulationImage.imageFormat, engine->revealageImage.imageFormat);
     }
     else
     {
-        matData.pipeline = &opaquePipeline;
+        pipelineBuilder.EnableDepthtest(true, VK_COMPARE_OP_LESS); // revert to (Greater or equal to)
+        pipelineBuilder.SetColorAttachmentFormat(engine->colorImage.imageFormat);
     }
 
-    matData.materialSet = descriptorAllocator.Allocate(device, materialLayout);
-
-    writer.clear();
-    writer.WriteBuffer(0, resources.dataBuffer, sizeof(MaterialConstants), resources.dataBufferOffset, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
-    writer.WriteImage(1, resources.colorImage.imageView, resources.colorSampler, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
-    writer.WriteImage(2, resources.metallicRoughnessImage.imageView, resources.metallicRoughnessSampler, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
-    writer.WriteImage(3, resources.normalImage.imageView, resources.normalSampler, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
-    writer.WriteImage(4, resources.occlusionImage.imageView, resources.occlusionSampler, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
-    writer.WriteImage(5, resources.emissionImage.imageView, resources.emissionSampler, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+    return pipelineBuilder.BuildPipeline(engine->device, engine->pipelineCache.cache);
+}
 
-    writer.UpdateSet(device, matData.materialSet);
+MaterialInstance GLTFMetallicRoughness::WriteMaterial(VulkanEngine* engine, MaterialPass pass, const MaterialResources& resources)
+{
+    MaterialInstance matData;
+    matData.passType = pass;
+    matData.sortId = nextMaterialId++;
+    matData.pipeline = GetPipeline(engine, pass, resources.features);
+
+    // slot order matches the *_TEXTURE defines in input_structures.glsl
+    BindlessMaterialDesc desc;
+    desc.colorFactors = resources.constants.colorFactors;
+    desc.metalRoughFactors = resources.constants.metalRoughFactors;
+    desc.images[0] = resources.colorImage.imageView;
+    desc.samplers[0] = resources.colorSampler;
+    desc.images[1] = resources.metallicRoughnessImage.imageView;
+    desc.samplers[1] = resources.metallicRoughnessSampler;
+    desc.images[2] = resources.normalImage.imageView;
+    desc.samplers[2] = resources.normalSampler;
+    desc.images[3] = resources.occlusionImage.imageView;
+    desc.samplers[3] = resources.occlusionSampler;
+    desc.images[4] = resources.emissionImage.imageView;
+    desc.samplers[4] = resources.emissionSampler;
+
+    matData.materialIndex = engine->bindlessMaterials.AddMaterial(desc);
 
     return matData;
 
@@ -2066,18 +2874,11 @@ MaterialInstance GLTFMetallicRoughness::WriteMaterial(VkDevice device, MaterialP
 
 void MeshNode::Draw(const glm::mat4& topMatrix, DrawContext& context)
 {
-    glm::mat4 nodeMatrix = topMatrix * worldTransform;
+    glm::mat4 nodeMatrix = topMatrix * GetWorldTransform();
 
     for (auto& s : mesh->surfaces)
     {
-        RenderObject def;
-        def.indexCount = s.count;
-        def.firstIndex = s.startIndex;
-        def.indexBuffer = mesh->meshBuffers.indexBuffer.buffer;
-        def.material = &s.material->data;
-        def.bounds = s.bounds;
-        def.transform = nodeMatrix;
-        def.vertexBufferAddress = mesh->meshBuffers.vertexBufferAddress;
+        RenderObject def = MakeRenderObject(*mesh, s, nodeMatrix);
 
         if (s.material->data.passType == MaterialPass::Transparent)
         {
@@ -2,21 +2,37 @@
 
 #include "vk_types.h"
 #include "vk_descriptors.h"
+#include "vk_bindless.h"
+#include "vk_geometry.h"
+#include "vk_buffers.h"
+#include "vk_upload.h"
+#include "vk_jobs.h"
+#include "vk_culling.h"
+#include "vk_shadows.h"
+#include "vk_clusters.h"
+#include "vk_sort.h"
+#include "vk_scene.h"
 #include "vk_loader.h"
 #include "vk_particles.h"
+#include "vk_pipelines.h"
+#include "vk_pipeline_cache.h"
+#include "vk_profiler.h"
 #include "camera.h"
 
 struct DeletionQueue
 {
 	std::deque<std::function<void()>> deletors;
+	std::mutex mutex; // pipelines are built on worker threads and push their deletors from there
 
 	void PushFunction(std::function<void()>&& function)
 	{
+		std::lock_guard<std::mutex> lock(mutex);
 		deletors.push_back(function);
 	}
 
 	void Flush()
 	{
+		std::lock_guard<std::mutex> lock(mutex);
 		// reverse iterate over queue
 		for (auto it = deletors.rbegin(); it != deletors.rend(); it++)
 		{
@@ -37,6 +53,9 @@ struct FrameData
 
 	DeletionQueue deletionQueue;
 	DescriptorAllocatorGrowable frameDescriptors;
+	UniformAllocator uniformAllocator;
+	IndirectDrawBuffers indirectDraws;
+	ClusteredLightBuffers clusterLights;
 };
 
 struct GPUSceneData
@@ -51,8 +70,10 @@ struct GPUSceneData
 	float shadowFarPlane;
 	float attenuationFallOff;
 	float shadowBias;
-	int shadowAASamples;
+	uint32_t padding;
 	float gridSamplingDiskModifier;
+	glm::uvec4 clusterGrid; // see ClusteredLightBuffers::gridInfo
+	glm::vec4 clusterParams;
 };
 
 struct DepthMapGeometryData
@@ -68,20 +89,19 @@ struct ParticleSceneData
 	int textureArraySize;
 };
 
+// optional inputs of meshPBR.frag, set from the textures a gltf material provides. missing ones are compiled out
+constexpr uint32_t MATERIAL_FEATURE_NORMAL_MAP = 1 << 0;
+constexpr uint32_t MATERIAL_FEATURE_EMISSION = 1 << 1;
+constexpr uint32_t MATERIAL_FEATURE_ALL = MATERIAL_FEATURE_NORMAL_MAP | MATERIAL_FEATURE_EMISSION;
+
 struct GLTFMetallicRoughness
 {
-	MaterialPipeline opaquePipeline;
-	MaterialPipeline transparentPipeline;
-	MaterialPipeline skyboxPipeline;
-
-	VkDescriptorSetLayout materialLayout;
+	VkPipelineLayout layout;
 
 	struct MaterialConstants
 	{
 		glm::vec4 colorFactors;
 		glm::vec4 metalRoughFactors;
-
-		glm::vec4 padding[14];
 	};
 
 	struct MaterialResources
@@ -96,17 +116,34 @@ struct GLTFMetallicRoughness
 		VkSampler occlusionSampler;
 		AllocatedImage emissionImage;
 		VkSampler emissionSampler;
-		VkBuffer dataBuffer;
-		uint32_t dataBufferOffset;
-
+		MaterialConstants constants;
+		uint32_t features{ MATERIAL_FEATURE_ALL };
 	};
 
-	DescriptorWriter writer;
+	uint32_t nextMaterialId{ 0 };
 
-	void BuildPipelines(VulkanEngine* engine);
+	// creates the layout and submits the full featured opaque and transparent variants as jobs counted by counter
+	void BuildPipelines(VulkanEngine* engine, JobCounter& counter);
 	void ClearResources(VkDevice device);
 
-	MaterialInstance WriteMaterial(VkDevice device, MaterialPass pass, const MaterialResources& resources, DescriptorAllocatorGrowable& descriptorAllocator);
+	// the variant for a pass and feature set, built on first use. the pointer stays valid until ClearResources
+	MaterialPipeline* GetPipeline(VulkanEngine* engine, MaterialPass pass, uint32_t features);
+
+	// rebuilds every variant in place after the shadow settings changed, the device must be idle
+	void RebuildPipelines(VulkanEngine* engine);
+
+	uint32_t VariantCount();
+
+	// adds the material to the bindless set, nothing is allocated per material
+	MaterialInstance WriteMaterial(VulkanEngine* engine, MaterialPass pass, const MaterialResources& resources);
+
+private:
+	// the key is the feature bits with the pass above them, also used as the pipeline's sort id
+	static uint32_t VariantKey(MaterialPass pass, uint32_t features);
+	VkPipeline BuildVariant(VulkanEngine* engine, uint32_t key);
+
+	std::mutex variantMutex;
+	std::unordered_map<uint32_t, std::unique_ptr<MaterialPipeline>> variants;
 };
 
 struct MeshNode : public Node
@@ -120,12 +157,15 @@ struct RenderObject
 {
 	uint32_t indexCount;
 	uint32_t firstIndex;
-	VkBuffer indexBuffer;
+	int32_t vertexOffset;
 
 	MaterialInstance* material;
 	Bounds bounds;
 	glm::mat4 transform;
 	VkDeviceAddress vertexBufferAddress;
+	uint64_t sortKey;
+	bool castsShadow;
+	bool dynamicShadow; // moves often, drawn every frame on top of the cached static shadow
 };
 
 struct DrawContext
@@ -138,17 +178,67 @@ struct EngineStats
 {
 	float frameTime;
 	float framesPerSecond;
-	int triangleCount;
+	int triangleCount; // submitted, opaque ones before the gpu cull
+	uint32_t trianglesVisible; // opaque ones left by the gpu cull, FRAME_OVERLAP frames behind
 	int drawcallCount;
 	float sceneUpdateTime;
 	float meshDrawTime;
 	float uptime;
+	size_t uniformBytesStreamed;
+	uint32_t descriptorCacheHits;
+	uint32_t descriptorCacheMisses;
+	uint32_t opaqueObjects;
+	uint32_t objectsSubmitted; // left after the cpu cull, sent to the gpu cull
+	uint32_t objectsVisible; // read back from the gpu cull, FRAME_OVERLAP frames behind
+	float cullTime;
+	float sortTime;
+	bool sortSkipped;
+	uint32_t pipelineBinds;
+	uint32_t descriptorBinds;
+	uint32_t indexBufferBinds;
+	uint32_t proxyCount;
+	uint32_t proxiesUpdated;
+	GeometryArenaStats geometry;
+	uint32_t shadowCasters;
+	uint32_t shadowFaceDraws; // instances over all casters, at most 6 per caster
+	ShadowAtlasStats shadowAtlas;
+	ClusterStats clusters; // FRAME_OVERLAP frames behind
+};
+
+// milliseconds per pass over the current opaque surfaces
+struct CullBenchmarkResults
+{
+	uint32_t objectCount;
+	uint32_t iterations;
+	float isVisibleTime;
+	float scalarTime;
+	float simdTime;
+	float parallelTime;
+	uint32_t isVisibleCount;
+	uint32_t simdCount;
 };
 
 struct EngineSettings
 {
 	bool hdrOn{ true };
 	VkSampleCountFlagBits msaaSamples{ VK_SAMPLE_COUNT_8_BIT };
+	size_t frameUniformBufferSize{ 1024 * 1024 };
+	size_t stagingBufferSize{ 64 * 1024 * 1024 };
+	size_t imageDecodeBudget{ 256 * 1024 * 1024 }; // decoded gltf pixels allowed in memory at once
+	bool cpuFrustumCulling{ true };
+	uint32_t geometryVertexCapacity{ 1024 * 1024 }; // 48 MB of vertices
+	uint32_t geometryIndexCapacity{ 4 * 1024 * 1024 };
+	ShadowAtlasSettings shadowAtlas;
+	ClusterGridSettings clusterGrid;
+	bool drawParticles{ false };
+	uint32_t particleCapacity{ 1024 * 1024 }; // the particle arena is sized for this many at init
+	uint32_t maxParticleEmitters{ 256 };
+	bool shadows{ true }; // point light shadows in the material pipelines
+	uint32_t shadowSamples{ 20 }; // pcf taps per shadowed light, 1 to 20, baked into the material pipelines
+	bool cpuParticles{ false }; // simulate with ParticleEmitter, for particles gameplay reads back
+	uint32_t cpuParticleCount{ 10 * 1000 };
+	std::string pipelineCachePath{ "pipeline_cache.bin" };
+	std::string gpuTimingsCsvPath{ "gpu_timings.csv" };
 };
 
 constexpr unsigned int FRAME_OVERLAP = 2;
@@ -172,6 +262,7 @@ public:
 	VkInstance instance;
 	VkDebugUtilsMessengerEXT debugMessenger;
 	VkPhysicalDevice physicalDevice;
+	VkPhysicalDeviceProperties physicalDeviceProperties;
 	VkDevice device;
 	VkSurfaceKHR surface;
 
@@ -188,8 +279,23 @@ public:
 	VkQueue graphicsQueue;
 	uint32_t graphicsQueueFamily;
 
+	VkQueue transferQueue;
+	uint32_t transferQueueFamily;
+
+	UploadManager uploadManager;
+	GeometryArena geometryArena;
+
+	JobSystem jobSystem;
+
 	DeletionQueue mainDeletionQueue;
 
+	// every pipeline is built through it, seeded from and saved to engineSettings.pipelineCachePath
+	PipelineCache pipelineCache;
+	ShaderModuleCache shaderModules;
+
+	// per pass gpu timings, see the Rendering Statistics header
+	GpuProfiler gpuProfiler;
+
 	VmaAllocator allocator;
 
 	// draw resources
@@ -197,9 +303,18 @@ public:
 	AllocatedImage depthImage;
 	AllocatedImage colorImage;
 	VkExtent2D drawExtent;
+
+	// weighted blended transparency targets, sharing the depth of the opaque pass. with msaa they are resolved into the
+	// single sample pair, which the composite reads
+	AllocatedImage accumulationImage;
+	AllocatedImage revealageImage;
+	AllocatedImage accumulationResolveImage;
+	AllocatedImage revealageResolveImage;
 	float renderScale = 1.0f;
 
 	DescriptorAllocatorGrowable globalDescriptorAllocator;
+	DescriptorSetCache descriptorSetCache;
+	BindlessMaterials bindlessMaterials;
 
 	VkFence immFence;
 	VkCommandBuffer immCommandBuffer;
@@ -221,6 +336,11 @@ public:
 	GLTFMetallicRoughness metalRoughMaterial;
 
 	DrawContext mainDrawContext;
+	RenderProxyRegistry renderProxies;
+	ObjectRecordBuffer opaqueObjects;
+	ObjectRecordBuffer transparentObjects;
+	SceneHandle structureScene;
+	SceneHandle cubeScene;
 	std::unordered_map<std::string, std::shared_ptr<Node>> loadedNodes;
 
 	std::unordered_map<std::string, std::shared_ptr<LoadedGLTF>> loadedScenes;
@@ -234,19 +354,53 @@ public:
 	VkPipeline depthMapPipeline;
 	VkPipelineLayout depthMapPipelineLayout;
 	VkDescriptorSetLayout depthMapDescriptorLayout;
-	AllocatedImage depthCubemapImage;
-	DepthMapGeometryData depthMapGeometryData;
-	float depthCubemapSize = 1920;
+	CubeShadowCuller shadowCuller;
+	ShadowAtlas shadowAtlas;
+	std::vector<ShadowRefresh> shadowRefreshes;
+
+	// light 0 follows the light in sceneData, the rest are added from the ui
+	std::vector<PointLight> pointLights;
+
+	// unshadowed lights binned into the froxel grid by cluster.comp
+	std::vector<ClusterLight> localLights;
 
 	VkPipeline particlePipeline;
 	VkPipelineLayout particlePipelineLayout;
 	VkDescriptorSetLayout particleDescriptorLayout;
 	GPUMeshBuffers particleBillboard;
 	AllocatedImage particleSmokeImage;
-	ParticleEmitter* particleEmitter;
+	ParticleSystem particleSystem;
+	uint32_t smokeEmitter{ INVALID_PARTICLE_EMITTER };
+	std::vector<uint32_t> spawnedEmitters; // from the particles panel
+	ParticleEmitter cpuParticleEmitter;
+	DynamicBuffer cpuParticleBuffer; // region per frame in flight, written straight by cpuParticleEmitter
+	ParticleBenchmarkResults particleBenchmark{};
+
+	// simulated and sorted on the gpu, see ParticleSystem
+	VkPipeline particleSimPipeline;
+	VkPipeline particleSortPipeline;
+	VkPipelineLayout particleComputeLayout;
+
+	VkPipeline cullPipeline;
+	VkPipelineLayout cullPipelineLayout;
+
+	VkPipeline clusterPipeline;
+	VkPipelineLayout clusterPipelineLayout;
+
+	VkPipeline transparentCompositePipeline;
+	VkPipelineLayout transparentCompositeLayout;
+	VkDescriptorSetLayout transparentCompositeDescriptorLayout;
 
 	EngineStats stats;
 
+	FrustumCuller frustumCuller;
+	DrawSorter opaqueSorter;
+	DrawSorter transparentSorter;
+	uint32_t nextMeshId{ 0 };
+	CullBenchmarkResults cullBenchmark{};
+	bool cullBenchmarkRequested{ false };
+	TransformBenchmarkResults transformBenchmark{};
+
 	EngineSettings engineSettings;
 
 	float nearPlane = 0.1f;
@@ -266,9 +420,6 @@ public:
 
 	GPUMeshBuffers UploadMesh(std::span<uint32_t> indices, std::span<Vertex> vertices);
 
-	GPUParticleBuffers UploadParticles(std::span<ParticleGPUData> particlesGPUData);
-	void UpdateParticles(GPUParticleBuffers& buffer, std::span<ParticleGPUData> particlesGPUData);
-
 	AllocatedBuffer CreateBuffer(size_t allocSize, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage);
 
 	AllocatedImage CreateImage(VkExtent3D size, VkFormat format, VkImageUsageFlags usage, bool mipmapped = false);
@@ -291,13 +442,19 @@ private:
 	void DestroySwapchain();
 
 	void DrawDepthMap(VkCommandBuffer cmd);
+	// draws the static or the dynamic shadow casters of a refreshed light into the listed faces of one of its atlas cubes
+	void DrawShadowCasters(VkCommandBuffer cmd, const ShadowRefresh& refresh, VkImageView target, uint8_t faces, bool dynamicCasters);
 
 	void DrawSkybox(VkCommandBuffer cmd);
 
 	void DrawGeometry(VkCommandBuffer cmd);
 
+	// recorded inside the weighted blended pass DrawGeometry begins
 	void DrawParticles(VkCommandBuffer cmd);
 
+	// lays the weighted blended targets over the color image
+	void DrawTransparentComposite(VkCommandBuffer cmd);
+
 	void InitDescriptors();
 
 	void InitPipelines();
@@ -308,6 +465,18 @@ private:
 
 	void InitParticlePipeline();
 
+	void InitParticleComputePipelines();
+
+	void InitCullPipeline();
+
+	void InitClusterPipeline();
+
+	void InitTransparentCompositePipeline();
+
+	// replaces the local lights with count random ones inside the bounds of the opaque surfaces
+	void SpawnClusterStressLights(uint32_t count);
+	void SpawnParticleEmitters(uint32_t count, uint32_t particlesEach);
+
 	void InitImGui();
 
 	void DrawImGui(VkCommandBuffer cmd, VkImageView targetImageView);
@@ -320,8 +489,7 @@ private:
 
 	void UpdateScene();
 
-	void UpdateSceneNonShadow();
-
 	VkSampleCountFlagBits GetMaxUsableSampleCount();
 	bool IsVisible(const RenderObject& object, const glm::mat4& viewProjection);
+	void RunCullBenchmark();
 };
@@ -0,0 +1,171 @@
+#include "vk_geometry.h"
+#include "vk_engine.h"
+
+#include <algorithm>
+
+void RangeAllocator::Init(uint32_t capacity)
+{
+	this->capacity = capacity;
+	used = 0;
+
+	freeBlocks.clear();
+	if (capacity > 0)
+	{
+		freeBlocks[0] = capacity;
+	}
+}
+
+bool RangeAllocator::Allocate(uint32_t size, uint32_t& outOffset)
+{
+	if (size == 0)
+	{
+		outOffset = 0;
+		return true;
+	}
+
+	for (auto it = freeBlocks.begin(); it != freeBlocks.end(); it++)
+	{
+		if (it->second < size)
+		{
+			continue;
+		}
+
+		outOffset = it->first;
+		uint32_t remaining = it->second - size;
+		freeBlocks.erase(it);
+
+		if (remaining > 0)
+		{
+			freeBlocks[outOffset + size] = remaining;
+		}
+
+		used += size;
+		return true;
+	}
+
+	return false;
+}
+
+void RangeAllocator::Free(uint32_t offset, uint32_t size)
+{
+	if (size == 0)
+	{
+		return;
+	}
+
+	used -= size;
+
+	auto next = freeBlocks.lower_bound(offset);
+
+	// merge with the block after
+	if (next != freeBlocks.end() && offset + size == next->first)
+	{
+		size += next->second;
+		next = freeBlocks.erase(next);
+	}
+
+	// merge with the block before
+	if (next != freeBlocks.begin())
+	{
+		auto previous = std::prev(next);
+		if (previous->first + previous->second == offset)
+		{
+			previous->second += size;
+			return;
+		}
+	}
+
+	freeBlocks.emplace_hint(next, offset, size);
+}
+
+uint32_t RangeAllocator::LargestFreeBlock() const
+{
+	uint32_t largest = 0;
+	for (auto& [offset, size] : freeBlocks)
+	{
+		largest = std::max(largest, size);
+	}
+
+	return largest;
+}
+
+float RangeAllocator::Fragmentation() const
+{
+	uint32_t freeSpace = capacity - used;
+	if (freeSpace == 0)
+	{
+		return 0.0f;
+	}
+
+	return 1.0f - (float)LargestFreeBlock() / (float)freeSpace;
+}
+
+void GeometryArena::Init(VulkanEngine* engine, uint32_t vertexCapacity, uint32_t indexCapacity)
+{
+	this->engine = engine;
+
+	vertexBuffer = engine->CreateBuffer(vertexCapacity * sizeof(Vertex), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+	indexBuffer = engine->CreateBuffer(indexCapacity * sizeof(uint32_t), VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+
+	VkBufferDeviceAddressInfo deviceAdressInfo{ .sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,.buffer = vertexBuffer.buffer };
+	vertexBufferAddress = vkGetBufferDeviceAddress(engine->device, &deviceAdressInfo);
+
+	vertexRanges.Init(vertexCapacity);
+	indexRanges.Init(indexCapacity);
+	allocationCount = 0;
+}
+
+void GeometryArena::Destroy()
+{
+	engine->DestroyBuffer(vertexBuffer);
+	engine->DestroyBuffer(indexBuffer);
+}
+
+GPUMeshBuffers GeometryArena::Upload(std::span<uint32_t> indices, std::span<Vertex> vertices)
+{
+	uint32_t vertexOffset;
+	uint32_t firstIndex;
+
+	if (!vertexRanges.Allocate((uint32_t)vertices.size(), vertexOffset) || !indexRanges.Allocate((uint32_t)indices.size(), firstIndex))
+	{
+		fmt::println("Geometry arena is out of space ({} vertices, {} indices requested)", vertices.size(), indices.size());
+		abort();
+	}
+
+	GPUMeshBuffers newSurface;
+	newSurface.indexBuffer = indexBuffer.buffer;
+	newSurface.vertexBufferAddress = vertexBufferAddress;
+	newSurface.firstIndex = firstIndex;
+	newSurface.indexCount = (uint32_t)indices.size();
+	newSurface.vertexOffset = (int32_t)vertexOffset;
+	newSurface.vertexCount = (uint32_t)vertices.size();
+
+	// the ranges are new to the graphics queue, so they can be written on the transfer queue like a fresh buffer
+	engine->uploadManager.UploadBuffer(vertexBuffer.buffer, vertices.data(), vertices.size() * sizeof(Vertex), vertexOffset * sizeof(Vertex));
+	engine->uploadManager.UploadBuffer(indexBuffer.buffer, indices.data(), indices.size() * sizeof(uint32_t), firstIndex * sizeof(uint32_t));
+
+	allocationCount++;
+
+	return newSurface;
+}
+
+void GeometryArena::Free(const GPUMeshBuffers& mesh)
+{
+	vertexRanges.Free((uint32_t)mesh.vertexOffset, mesh.vertexCount);
+	indexRanges.Free(mesh.firstIndex, mesh.indexCount);
+	allocationCount--;
+}
+
+GeometryArenaStats GeometryArena::GetStats() const
+{
+	GeometryArenaStats stats;
+	stats.vertexUsed = vertexRanges.Used();
+	stats.vertexCapacity = vertexRanges.Capacity();
+	stats.indexUsed = indexRanges.Used();
+	stats.indexCapacity = indexRanges.Capacity();
+	stats.allocationCount = allocationCount;
+	stats.freeBlocks = vertexRanges.FreeBlockCount() + indexRanges.FreeBlockCount();
+	stats.fragmentation = std::max(vertexRanges.Fragmentation(), indexRanges.Fragmentation());
+
+	return stats;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "vk_types.h"
+
+#include <map>
+
+class VulkanEngine;
+
+// first fit offset allocator over a fixed range, freed blocks are merged with their neighbours
+class RangeAllocator
+{
+public:
+	void Init(uint32_t capacity);
+
+	bool Allocate(uint32_t size, uint32_t& outOffset);
+	void Free(uint32_t offset, uint32_t size);
+
+	uint32_t Capacity() const { return capacity; }
+	uint32_t Used() const { return used; }
+	uint32_t LargestFreeBlock() const;
+	uint32_t FreeBlockCount() const { return (uint32_t)freeBlocks.size(); }
+
+	// 0 when all free space is one block, approaching 1 as it is split into small pieces
+	float Fragmentation() const;
+
+private:
+	std::map<uint32_t, uint32_t> freeBlocks; // offset to size
+	uint32_t capacity{ 0 };
+	uint32_t used{ 0 };
+};
+
+struct GeometryArenaStats
+{
+	uint32_t vertexUsed;
+	uint32_t vertexCapacity;
+	uint32_t indexUsed;
+	uint32_t indexCapacity;
+	uint32_t allocationCount;
+	uint32_t freeBlocks;
+	float fragmentation; // worst of the vertex and index ranges
+};
+
+// every mesh lives in one vertex buffer and one index buffer, so a pass binds the index buffer once and any set of surfaces
+// can go into the same multi draw indirect call. ranges are in vertices and indices, not bytes
+class GeometryArena
+{
+public:
+	void Init(VulkanEngine* engine, uint32_t vertexCapacity, uint32_t indexCapacity);
+	void Destroy();
+
+	// sub-allocates and uploads through the upload manager, indices stay relative to the mesh and are offset by vertexOffset when drawn
+	GPUMeshBuffers Upload(std::span<uint32_t> indices, std::span<Vertex> vertices);
+
+	// returns the ranges to the free lists, no frame still in flight may draw the mesh
+	void Free(const GPUMeshBuffers& mesh);
+
+	GeometryArenaStats GetStats() const;
+
+	AllocatedBuffer vertexBuffer;
+	AllocatedBuffer indexBuffer;
+	VkDeviceAddress vertexBufferAddress{ 0 };
+
+private:
+	VulkanEngine* engine{ nullptr };
+
+	RangeAllocator vertexRanges;
+	RangeAllocator indexRanges;
+	uint32_t allocationCount{ 0 };
+};
@@ -4,8 +4,10 @@
 
 namespace vkutil {
 	void TransititionImage(VkCommandBuffer cmd, VkImage image, VkImageLayout currentLayout, VkImageLayout newLayout);
+	// same as TransititionImage but always on the depth aspect, for depth images moving through transfer layouts
+	void TransititionDepthImage(VkCommandBuffer cmd, VkImage image, VkImageLayout currentLayout, VkImageLayout newLayout);
 	void CopyImageToImage(VkCommandBuffer cmd, VkImage source, VkImage destination, VkExtent2D srcSize, VkExtent2D dstSize);
 	void ResolveImage(VkCommandBuffer cmd, VkImage srcImg, VkImage destinaionImage, VkExtent3D resolveImageSize);
-	void GenerateMipMaps(VkCommandBuffer cmd, VkImage image, VkExtent2D imageSize);
+	void GenerateMipMaps(VkCommandBuffer cmd, VkImage image, VkExtent2D imageSize, uint32_t layerCount = 1);
 	void ClearImage(VkCommandBuffer cmd, VkImage image, VkImageLayout currentLayout, VkClearColorValue clearColorValue);
 };
\ No newline at end of file
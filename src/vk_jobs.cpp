@@ -0,0 +1,138 @@
+#include "vk_jobs.h"
+
+#include <algorithm>
+
+void JobSystem::Init(uint32_t workerCount)
+{
+	if (workerCount == 0)
+	{
+		uint32_t hardwareThreads = std::thread::hardware_concurrency();
+		workerCount = hardwareThreads > 1 ? hardwareThreads - 1 : 1;
+	}
+
+	stopping = false;
+
+	for (uint32_t i = 0; i < workerCount; i++)
+	{
+		workers.emplace_back([this]() { WorkerLoop(); });
+	}
+}
+
+void JobSystem::Shutdown()
+{
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		stopping = true;
+	}
+	queueCondition.notify_all();
+
+	for (std::thread& worker : workers)
+	{
+		worker.join();
+	}
+	workers.clear();
+	queue.clear();
+}
+
+void JobSystem::Submit(std::function<void()> job, JobCounter* counter)
+{
+	if (counter)
+	{
+		counter->pending.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		queue.push_back(Job{ std::move(job), counter });
+	}
+	queueCondition.notify_one();
+}
+
+void JobSystem::Wait(JobCounter& counter)
+{
+	while (!counter.IsDone())
+	{
+		if (!RunOne())
+		{
+			std::this_thread::yield();
+		}
+	}
+}
+
+bool JobSystem::RunOne()
+{
+	Job job;
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		if (queue.empty())
+		{
+			return false;
+		}
+
+		job = std::move(queue.front());
+		queue.pop_front();
+	}
+
+	Execute(job);
+	return true;
+}
+
+void JobSystem::ParallelFor(uint32_t count, uint32_t batchSize, const std::function<void(uint32_t start, uint32_t end)>& func)
+{
+	if (count == 0)
+	{
+		return;
+	}
+
+	batchSize = std::max(batchSize, 1u);
+
+	// not worth waking the workers for a single batch
+	if (count <= batchSize || workers.empty())
+	{
+		func(0, count);
+		return;
+	}
+
+	JobCounter counter;
+	for (uint32_t start = batchSize; start < count; start += batchSize)
+	{
+		uint32_t end = std::min(start + batchSize, count);
+		Submit([&func, start, end]() { func(start, end); }, &counter);
+	}
+
+	func(0, batchSize);
+
+	Wait(counter);
+}
+
+void JobSystem::WorkerLoop()
+{
+	while (true)
+	{
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock(queueMutex);
+			queueCondition.wait(lock, [this]() { return stopping || !queue.empty(); });
+
+			if (stopping && queue.empty())
+			{
+				return;
+			}
+
+			job = std::move(queue.front());
+			queue.pop_front();
+		}
+
+		Execute(job);
+	}
+}
+
+void JobSystem::Execute(Job& job)
+{
+	job.func();
+
+	if (job.counter)
+	{
+		job.counter->pending.fetch_sub(1, std::memory_order_release);
+	}
+}
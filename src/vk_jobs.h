@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// tracks the outstanding jobs of one group, shared between a submitter and JobSystem::Wait
+struct JobCounter
+{
+	std::atomic<uint32_t> pending{ 0 };
+
+	bool IsDone() const { return pending.load(std::memory_order_acquire) == 0; }
+};
+
+// fixed pool of worker threads pulling from one shared queue
+class JobSystem
+{
+public:
+	// 0 workers picks one per hardware thread, minus the main thread
+	void Init(uint32_t workerCount = 0);
+	void Shutdown();
+
+	void Submit(std::function<void()> job, JobCounter* counter = nullptr);
+
+	// runs queued jobs on the calling thread until the counter reaches zero
+	void Wait(JobCounter& counter);
+
+	// runs one queued job on the calling thread, returns false if the queue was empty
+	bool RunOne();
+
+	// splits [0, count) into ranges of batchSize and runs them across the workers and the calling thread
+	void ParallelFor(uint32_t count, uint32_t batchSize, const std::function<void(uint32_t start, uint32_t end)>& func);
+
+	uint32_t WorkerCount() const { return (uint32_t)workers.size(); }
+
+private:
+	struct Job
+	{
+		std::function<void()> func;
+		JobCounter* counter;
+	};
+
+	void WorkerLoop();
+	void Execute(Job& job);
+
+	std::vector<std::thread> workers;
+	std::deque<Job> queue;
+	std::mutex queueMutex;
+	std::condition_variable queueCondition;
+	bool stopping{ false };
+};
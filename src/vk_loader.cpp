@@ -11,6 +11,7 @@
 #include "vk_types.h"
 
 #include <iostream>
+#include <chrono>
 
 VkFilter ExtractFilter(fastgltf::Filter filter)
 {
@@ -44,11 +45,17 @@ VkSamplerMipmapMode ExtractMipmapMode(fastgltf::Filter filter)
 	}
 }
 
-std::optional<AllocatedImage> LoadImage(VulkanEngine* engine, fastgltf::Asset& asset, fastgltf::Image& image)
+// encoded bytes of a gltf image, either already in memory or a file on disk
+struct EncodedImage
 {
-	AllocatedImage newImage{};
+	const stbi_uc* bytes{ nullptr };
+	size_t size{ 0 };
+	std::string path;
+};
 
-	int width, height, nrChannels;
+EncodedImage GetEncodedImage(fastgltf::Asset& asset, fastgltf::Image& image)
+{
+	EncodedImage encoded;
 
 	std::visit(
 		fastgltf::visitor
@@ -59,35 +66,12 @@ std::optional<AllocatedImage> LoadImage(VulkanEngine* engine, fastgltf::Asset& a
 				assert(filePath.fileByteOffset == 0);
 				assert(filePath.uri.isLocalPath());
 
-				const std::string path(filePath.uri.path().begin(), filePath.uri.path().end());
-				unsigned char* data = stbi_load(path.c_str(), &width, &height, &nrChannels, 4);
-				if (data)
-				{
-					VkExtent3D imageSize;
-					imageSize.width = width;
-					imageSize.height = height;
-					imageSize.depth = 1;
-
-					newImage = engine->CreateImage(data, imageSize, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_USAGE_SAMPLED_BIT, true);
-
-					stbi_image_free(data);
-				}
+				encoded.path = std::string(filePath.uri.path().begin(), filePath.uri.path().end());
 			},
 			[&](fastgltf::sources::Vector& vector)
 			{
-				unsigned char* data = stbi_load_from_memory(vector.bytes.data(), static_cast<int>(vector.bytes.size()), &width, &height, &nrChannels, 4);
-				if (data)
-				{
-					VkExtent3D imageSize;
-					imageSize.width = width;
-					imageSize.height = height;
-					imageSize.depth = 1;
-
-					newImage = engine->CreateImage(data, imageSize, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_USAGE_SAMPLED_BIT, true);
-
-					stbi_image_free(data);
-
-				}
+				encoded.bytes = vector.bytes.data();
+				encoded.size = vector.bytes.size();
 			},
 			[&](fastgltf::sources::BufferView& view) 
 			{
@@ -99,19 +83,8 @@ std::optional<AllocatedImage> LoadImage(VulkanEngine* engine, fastgltf::Asset& a
 							   [](auto& arg) {},
 							   [&](fastgltf::sources::Vector& vector) 
 								{
-								   unsigned char* data = stbi_load_from_memory(vector.bytes.data() + bufferView.byteOffset, static_cast<int>(bufferView.byteLength), &width, &height, &nrChannels, 4);
-								   if (data) 
-								   {
-									   VkExtent3D imageSize;
-									   imageSize.width = width;
-									   imageSize.height = height;
-									   imageSize.depth = 1;
-
-									   newImage = engine->CreateImage(data, imageSize, VK_FORMAT_R8G8B8A8_UNORM,
-										   VK_IMAGE_USAGE_SAMPLED_BIT,true);
-
-									   stbi_image_free(data);
-								   }
+								   encoded.bytes = vector.bytes.data() + bufferView.byteOffset;
+								   encoded.size = bufferView.byteLength;
 							   } 
 				},
 				buffer.data);
@@ -119,20 +92,168 @@ std::optional<AllocatedImage> LoadImage(VulkanEngine* engine, fastgltf::Asset& a
 		},
 		image.data);
 
-	if (newImage.image == VK_NULL_HANDLE)
+	return encoded;
+}
+
+// decodes images on the job system and uploads them from the loading thread, keeping decoded pixels under a byte budget
+class ImageLoadQueue
+{
+public:
+	ImageLoadQueue(VulkanEngine* engine, std::vector<EncodedImage> sources, size_t byteBudget, std::function<void(size_t index, std::optional<AllocatedImage> image)> onLoaded)
+		: engine(engine), byteBudget(byteBudget), onLoaded(std::move(onLoaded))
 	{
-		return {};
-	} 
-	else
+		entries.resize(sources.size());
+		for (size_t i = 0; i < sources.size(); i++)
+		{
+			entries[i].source = std::move(sources[i]);
+		}
+	}
+
+	~ImageLoadQueue()
 	{
-		return newImage;
+		// decode jobs write into entries, they have to be gone before it is
+		engine->jobSystem.Wait(counter);
 	}
-}
+
+	// uploads whatever has finished decoding and starts new decodes, never blocks
+	bool Pump()
+	{
+		std::vector<size_t> finished;
+		{
+			std::lock_guard<std::mutex> lock(decodedMutex);
+			finished.swap(decoded);
+		}
+
+		for (size_t index : finished)
+		{
+			Entry& entry = entries[index];
+
+			if (entry.pixels)
+			{
+				VkExtent3D imageSize{ (uint32_t)entry.width, (uint32_t)entry.height, 1 };
+				AllocatedImage newImage = engine->CreateImage(entry.pixels, imageSize, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_USAGE_SAMPLED_BIT, true);
+
+				// the pixels now live in the staging ring
+				stbi_image_free(entry.pixels);
+				entry.pixels = nullptr;
+
+				Complete(index, newImage);
+			}
+			else
+			{
+				Complete(index, {});
+			}
+
+			bytesInFlight -= entry.bytes;
+		}
+
+		StartDecodes();
+
+		return completed == entries.size();
+	}
+
+	// pumps until every image has been handled, running decode jobs on this thread while waiting
+	void Finish()
+	{
+		while (!Pump())
+		{
+			if (!engine->jobSystem.RunOne())
+			{
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	size_t peakBytes{ 0 };
+
+private:
+	struct Entry
+	{
+		EncodedImage source;
+		int width{ 0 };
+		int height{ 0 };
+		size_t bytes{ 0 };
+		stbi_uc* pixels{ nullptr };
+	};
+
+	void Complete(size_t index, std::optional<AllocatedImage> image)
+	{
+		completed++;
+		onLoaded(index, image);
+	}
+
+	void StartDecodes()
+	{
+		while (nextDecode < entries.size())
+		{
+			size_t index = nextDecode;
+			Entry& entry = entries[index];
+
+			// the header gives the decoded size up front so the budget can be checked before decoding
+			int channels;
+			bool validHeader = entry.source.bytes
+				? stbi_info_from_memory(entry.source.bytes, (int)entry.source.size, &entry.width, &entry.height, &channels)
+				: !entry.source.path.empty() && stbi_info(entry.source.path.c_str(), &entry.width, &entry.height, &channels);
+
+			if (!validHeader)
+			{
+				nextDecode++;
+				Complete(index, {});
+				continue;
+			}
+
+			entry.bytes = (size_t)entry.width * entry.height * 4;
+
+			// a single image larger than the budget is still let through on its own
+			if (bytesInFlight > 0 && bytesInFlight + entry.bytes > byteBudget)
+			{
+				return;
+			}
+
+			bytesInFlight += entry.bytes;
+			peakBytes = std::max(peakBytes, bytesInFlight);
+			nextDecode++;
+
+			engine->jobSystem.Submit([this, index]()
+				{
+					Entry& entry = entries[index];
+					int width, height, channels;
+
+					if (entry.source.bytes)
+					{
+						entry.pixels = stbi_load_from_memory(entry.source.bytes, (int)entry.source.size, &width, &height, &channels, 4);
+					}
+					else
+					{
+						entry.pixels = stbi_load(entry.source.path.c_str(), &width, &height, &channels, 4);
+					}
+
+					std::lock_guard<std::mutex> lock(decodedMutex);
+					decoded.push_back(index);
+				}, &counter);
+		}
+	}
+
+	VulkanEngine* engine;
+	size_t byteBudget;
+	std::function<void(size_t index, std::optional<AllocatedImage> image)> onLoaded;
+
+	std::vector<Entry> entries;
+	size_t nextDecode{ 0 };
+	size_t completed{ 0 };
+	size_t bytesInFlight{ 0 };
+
+	std::mutex decodedMutex;
+	std::vector<size_t> decoded;
+	JobCounter counter;
+};
 
 std::optional<std::shared_ptr<LoadedGLTF>> LoadGltf(VulkanEngine* engine, std::string_view filePath)
 {
 	fmt::println("Loading GLTF file: {}", filePath);
 
+	auto loadStart = std::chrono::system_clock::now();
+
 	std::shared_ptr<LoadedGLTF> scene = std::make_shared<LoadedGLTF>();
 	scene->creator = engine;
 	LoadedGLTF& file = *scene.get();
@@ -182,14 +303,6 @@ std::optional<std::shared_ptr<LoadedGLTF>> LoadGltf(VulkanEngine* engine, std::s
 		return {};
 	}
 
-	std::vector<DescriptorAllocatorGrowable::PoolSizeRatio> sizes = { 
-		{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 3},
-		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 3},
-		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1}
-	};
-
-	file.descriptorPool.InitPools(engine->device, gltf.materials.size(), sizes);
-
 	for (fastgltf::Sampler sampler : gltf.samplers)
 	{
 		VkSamplerCreateInfo sample = { .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO, .pNext = nullptr };
@@ -209,31 +322,28 @@ std::optional<std::shared_ptr<LoadedGLTF>> LoadGltf(VulkanEngine* engine, std::s
 
 	std::vector<std::shared_ptr<MeshAsset>> meshes;
 	std::vector<std::shared_ptr<Node>> nodes;
-	std::vector<AllocatedImage> images;
+	std::vector<AllocatedImage> images(gltf.images.size(), engine->errorImage);
 	std::vector<std::shared_ptr<GLTFMaterial>> materials;
 
-	for (fastgltf::Image& image : gltf.images)
+	// a material is written once every image it samples has been uploaded, rather than after all of them
+	struct PendingMaterial
 	{
-		std::optional<AllocatedImage> allocatedImage = LoadImage(engine, gltf, image);
+		std::shared_ptr<GLTFMaterial> material;
+		MaterialPass passType;
+		GLTFMetallicRoughness::MaterialResources resources;
+		std::vector<std::pair<AllocatedImage*, size_t>> textures;
+		size_t remainingImages;
+	};
 
-		if (allocatedImage.has_value())
-		{
-			images.push_back(*allocatedImage);
-			file.images[image.name.c_str()] = *allocatedImage;
-		}
-		else
-		{
-			images.push_back(engine->errorImage);
-			std::cout << "gltf failed to load texture: " << image.name << std::endl;
-		}
-	}
+	std::vector<PendingMaterial> pendingMaterials;
+	pendingMaterials.reserve(gltf.materials.size());
 
-	file.materialDataBuffer = engine->CreateBuffer(sizeof(GLTFMetallicRoughness::MaterialConstants) * gltf.materials.size(), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
-	int dataIndex = 0;
-	GLTFMetallicRoughness::MaterialConstants* sceneMaterialConstants = (GLTFMetallicRoughness::MaterialConstants*)file.materialDataBuffer.info.pMappedData;
+	std::vector<std::vector<size_t>> imageUsers(gltf.images.size());
 
 	for (fastgltf::Material& material : gltf.materials) 
 	{
+		PendingMaterial& pending = pendingMaterials.emplace_back();
+
 		std::shared_ptr<GLTFMaterial> newMat = std::make_shared<GLTFMaterial>();
 		materials.push_back(newMat);
 		file.materials[material.name.c_str()] = newMat;
@@ -247,8 +357,6 @@ std::optional<std::shared_ptr<LoadedGLTF>> LoadGltf(VulkanEngine* engine, std::s
 		constants.metalRoughFactors.x = material.pbrData.metallicFactor;
 		constants.metalRoughFactors.y = material.pbrData.roughnessFactor;
 
-		sceneMaterialConstants[dataIndex] = constants;
-
 		MaterialPass passType = MaterialPass::MainColor;
 		if (material.alphaMode == fastgltf::AlphaMode::Blend) 
 		{
@@ -267,14 +375,14 @@ std::optional<std::shared_ptr<LoadedGLTF>> LoadGltf(VulkanEngine* engine, std::s
 		materialResources.emissionImage = engine->blackImage;
 		materialResources.emissionSampler = engine->defaultSamplerLinear;
 
-		materialResources.dataBuffer = file.materialDataBuffer.buffer;
-		materialResources.dataBufferOffset = dataIndex * sizeof(GLTFMetallicRoughness::MaterialConstants);
+		materialResources.constants = constants;
+		materialResources.features = 0; // picks the pipeline variant, only what the material provides is sampled
 		if (material.pbrData.baseColorTexture.has_value()) // base color texure
 		{
 			size_t img = gltf.textures[material.pbrData.baseColorTexture.value().textureIndex].imageIndex.value();
 			size_t sampler = gltf.textures[material.pbrData.baseColorTexture.value().textureIndex].samplerIndex.value();
 
-			materialResources.colorImage = images[img];
+			pending.textures.push_back({ &pending.resources.colorImage, img });
 			materialResources.colorSampler = file.samplers[sampler];
 		}
 
@@ -283,7 +391,7 @@ std::optional<std::shared_ptr<LoadedGLTF>> LoadGltf(VulkanEngine* engine, std::s
 			size_t img = gltf.textures[material.pbrData.metallicRoughnessTexture.value().textureIndex].imageIndex.value();
 			size_t sampler = gltf.textures[material.pbrData.metallicRoughnessTexture.value().textureIndex].samplerIndex.value();
 
-			materialResources.metallicRoughnessImage = images[img];
+			pending.textures.push_back({ &pending.resources.metallicRoughnessImage, img });
 			materialResources.metallicRoughnessSampler = file.samplers[sampler];
 		}
 
@@ -292,7 +400,7 @@ std::optional<std::shared_ptr<LoadedGLTF>> LoadGltf(VulkanEngine* engine, std::s
 			size_t img = gltf.textures[material.occlusionTexture.value().textureIndex].imageIndex.value();
 			size_t sampler = gltf.textures[material.occlusionTexture.value().textureIndex].samplerIndex.value();
 
-			materialResources.occlusionImage = images[img];
+			pending.textures.push_back({ &pending.resources.occlusionImage, img });
 			materialResources.occlusionSampler = file.samplers[sampler];
 		}
 
@@ -301,8 +409,9 @@ std::optional<std::shared_ptr<LoadedGLTF>> LoadGltf(VulkanEngine* engine, std::s
 			size_t img = gltf.textures[material.normalTexture.value().textureIndex].imageIndex.value();
 			size_t sampler = gltf.textures[material.normalTexture.value().textureIndex].samplerIndex.value();
 
-			materialResources.normalImage = images[img];
+			pending.textures.push_back({ &pending.resources.normalImage, img });
 			materialResources.normalSampler = file.samplers[sampler];
+			materialResources.features |= MATERIAL_FEATURE_NORMAL_MAP;
 		}
 
 		if (material.emissiveTexture.has_value())
@@ -310,15 +419,71 @@ std::optional<std::shared_ptr<LoadedGLTF>> LoadGltf(VulkanEngine* engine, std::s
 			size_t img = gltf.textures[material.emissiveTexture.value().textureIndex].imageIndex.value();
 			size_t sampler = gltf.textures[material.emissiveTexture.value().textureIndex].samplerIndex.value();
 
-			materialResources.emissionImage = images[img];
+			pending.textures.push_back({ &pending.resources.emissionImage, img });
 			materialResources.emissionSampler = file.samplers[sampler];
+			materialResources.features |= MATERIAL_FEATURE_EMISSION;
+		}
+
+		pending.material = newMat;
+		pending.passType = passType;
+		pending.resources = materialResources;
+		pending.remainingImages = pending.textures.size();
+
+		for (auto& [slot, img] : pending.textures)
+		{
+			imageUsers[img].push_back(pendingMaterials.size() - 1);
+		}
+	}
+
+	auto writeMaterial = [&](PendingMaterial& pending)
+	{
+		for (auto& [slot, img] : pending.textures)
+		{
+			*slot = images[img];
 		}
 
-		newMat->data = engine->metalRoughMaterial.WriteMaterial(engine->device, passType, materialResources, file.descriptorPool);
+		pending.material->data = engine->metalRoughMaterial.WriteMaterial(engine, pending.passType, pending.resources);
+		file.materialSlots.push_back(pending.material->data.materialIndex);
+	};
 
-		dataIndex++;
+	for (PendingMaterial& pending : pendingMaterials)
+	{
+		if (pending.remainingImages == 0)
+		{
+			writeMaterial(pending);
+		}
 	}
 
+	std::vector<EncodedImage> encodedImages;
+	for (fastgltf::Image& image : gltf.images)
+	{
+		encodedImages.push_back(GetEncodedImage(gltf, image));
+	}
+
+	// images decode on the job system while meshes are built below, this thread uploads them as they finish
+	ImageLoadQueue imageQueue(engine, std::move(encodedImages), engine->engineSettings.imageDecodeBudget, [&](size_t index, std::optional<AllocatedImage> image)
+		{
+			if (image.has_value())
+			{
+				images[index] = *image;
+				file.images[gltf.images[index].name.c_str()] = *image;
+			}
+			else
+			{
+				std::cout << "gltf failed to load texture: " << gltf.images[index].name << std::endl;
+			}
+
+			for (size_t user : imageUsers[index])
+			{
+				if (--pendingMaterials[user].remainingImages == 0)
+				{
+					writeMaterial(pendingMaterials[user]);
+				}
+			}
+		});
+
+	imageQueue.Pump();
+
 	std::vector<uint32_t> indices;
 	std::vector<Vertex> vertices;
 
@@ -431,11 +596,25 @@ std::optional<std::shared_ptr<LoadedGLTF>> LoadGltf(VulkanEngine* engine, std::s
 		}
 
 		newMesh->meshBuffers = engine->UploadMesh(indices, vertices);
+
+		// surfaces were built against the mesh's own arrays, move them to where the arena placed it
+		for (GeoSurface& surface : newMesh->surfaces)
+		{
+			surface.startIndex += newMesh->meshBuffers.firstIndex;
+			surface.vertexOffset = newMesh->meshBuffers.vertexOffset;
+		}
+
+		imageQueue.Pump();
 	}
 
+	imageQueue.Finish();
+
+	std::vector<glm::mat4> localTransforms;
+
 	for (fastgltf::Node& node : gltf.nodes) 
 	{
 		std::shared_ptr<Node> newNode;
+		glm::mat4 localTransform{ 1.0f };
 
 		if (node.meshIndex.has_value()) 
 		{
@@ -451,7 +630,7 @@ std::optional<std::shared_ptr<LoadedGLTF>> LoadGltf(VulkanEngine* engine, std::s
 		file.nodes[node.name.c_str()];
 
 		std::visit(fastgltf::visitor{ [&](fastgltf::Node::TransformMatrix matrix) {
-										  memcpy(&newNode->localTransform, matrix.data(), sizeof(matrix));
+										  memcpy(&localTransform, matrix.data(), sizeof(matrix));
 									  },
 					   [&](fastgltf::Node::TRS transform) {
 						   glm::vec3 tl(transform.translation[0], transform.translation[1],
@@ -464,9 +643,11 @@ std::optional<std::shared_ptr<LoadedGLTF>> LoadGltf(VulkanEngine* engine, std::s
 						   glm::mat4 rm = glm::toMat4(rot);
 						   glm::mat4 sm = glm::scale(glm::mat4(1.0f), sc);
 
-						   newNode->localTransform = tm * rm * sm;
+						   localTransform = tm * rm * sm;
 					   } },
 			node.transform);
+
+		localTransforms.push_back(localTransform);
 	}
 
 	for (int i = 0; i < gltf.nodes.size(); i++) 
@@ -482,14 +663,44 @@ std::optional<std::shared_ptr<LoadedGLTF>> LoadGltf(VulkanEngine* engine, std::s
 	}
 
 	// find nodes with no parents to assign them to top
-	for (auto& node : nodes) 
+	std::vector<uint32_t> flatOrder;
+	std::vector<uint32_t> flatParents;
+
+	for (uint32_t i = 0; i < nodes.size(); i++) 
 	{
-		if (node->parent.lock() == nullptr) 
+		if (nodes[i]->parent.lock() == nullptr) 
 		{
-			file.topNodes.push_back(node);
-			node->RefreshTransform(glm::mat4{ 1.0f });
+			file.topNodes.push_back(nodes[i]);
+			flatOrder.push_back(i);
+			flatParents.push_back(TransformHierarchy::NoParent);
 		}
 	}
+
+	// flatten breadth first from the top nodes, parents land before their children and every depth level is contiguous
+	for (uint32_t flatIndex = 0; flatIndex < flatOrder.size(); flatIndex++)
+	{
+		uint32_t gltfIndex = flatOrder[flatIndex];
+
+		nodes[gltfIndex]->transforms = &file.transforms;
+		nodes[gltfIndex]->transformIndex = file.transforms.Add(flatParents[flatIndex], localTransforms[gltfIndex]);
+
+		for (auto& c : gltf.nodes[gltfIndex].children)
+		{
+			flatOrder.push_back((uint32_t)c);
+			flatParents.push_back(flatIndex);
+		}
+	}
+
+	file.transforms.Update();
+
+	// start the transfer queue on this file's uploads while the caller carries on
+	engine->uploadManager.Flush();
+
+	auto loadEnd = std::chrono::system_clock::now();
+	auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(loadEnd - loadStart);
+
+	fmt::println("Loaded {} in {:.2f} ms, {} images, peak decoded image memory {:.2f} MB", filePath, elapsed.count() / 1000.0f, gltf.images.size(), imageQueue.peakBytes / (1024.0f * 1024.0f));
+
 	return scene;
 }
 
@@ -505,13 +716,14 @@ void LoadedGLTF::ClearAll()
 {
 	VkDevice device = creator->device;
 
-	descriptorPool.DestroyPools(device);
-	creator->DestroyBuffer(materialDataBuffer);
+	for (uint32_t materialSlot : materialSlots)
+	{
+		creator->bindlessMaterials.RemoveMaterial(materialSlot);
+	}
 
 	for (auto& [k, v] : meshes)
 	{
-		creator->DestroyBuffer(v->meshBuffers.indexBuffer);
-		creator->DestroyBuffer(v->meshBuffers.vertexBuffer);
+		creator->geometryArena.Free(v->meshBuffers);
 	}
 
 	for (auto& [k, v] : images)
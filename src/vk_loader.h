@@ -3,6 +3,7 @@
 #include "vk_types.h"
 
 #include "vk_descriptors.h"
+#include "vk_transforms.h"
 #include <unordered_map>
 #include <filesystem>
 
@@ -21,8 +22,9 @@ struct Bounds
 
 struct GeoSurface
 {
-	uint32_t startIndex;
+	uint32_t startIndex; // into the geometry arena's index buffer
 	uint32_t count;
+	int32_t vertexOffset;
 	Bounds bounds;
 	std::shared_ptr<GLTFMaterial> material;
 };
@@ -45,11 +47,12 @@ public:
 
 	std::vector<std::shared_ptr<Node>> topNodes;
 
-	std::vector<VkSampler> samplers;
+	TransformHierarchy transforms;
 
-	DescriptorAllocatorGrowable descriptorPool;
+	std::vector<VkSampler> samplers;
 
-	AllocatedBuffer materialDataBuffer;
+	// bindless material slots owned by this file, released in ClearAll
+	std::vector<uint32_t> materialSlots;
 
 	VulkanEngine* creator;
 
@@ -3,114 +3,820 @@
 #include "vk_particles.h"
 #include "vk_engine.h"
 
-// emmitter
-ParticleEmitter::ParticleEmitter(VulkanEngine* engine, glm::vec3 emitterPos, glm::vec3 spawnDimensions, uint32_t particleNum, uint32_t lowerLife, uint32_t upperLife)
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cstring>
+
+#if defined(__AVX__)
+#define PARTICLES_USE_AVX
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PARTICLES_USE_SSE
+#include <immintrin.h>
+#endif
+
+// whole batches are always updated, the arrays are padded to this
+constexpr uint32_t ParticleLanes = 8;
+
+// pcg32, seeded per chunk so the jobs never share a generator
+struct ParticleRandom
 {
+	uint64_t state;
+	uint64_t increment;
+
+	ParticleRandom(uint64_t seed, uint64_t stream)
+	{
+		state = 0;
+		increment = (stream << 1) | 1;
+		Next();
+		state += seed;
+		Next();
+	}
 
-	// set particle lifespan 
-	this->lowerLife = lowerLife; // was 22
-	this->upperLife = upperLife; // was 25
-	radius = 1.0f;
-	dimensions = spawnDimensions;
+	uint32_t Next()
+	{
+		uint64_t old = state;
+		state = old * 6364136223846793005ULL + increment;
+		uint32_t shifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+		uint32_t rotation = (uint32_t)(old >> 59);
+		return (shifted >> rotation) | (shifted << ((32 - rotation) & 31));
+	}
 
-	// set emitter location
+	// [0, 1)
+	float NextFloat()
+	{
+		return (Next() >> 8) * (1.0f / 16777216.0f);
+	}
+};
+
+// squared distances are positive, so their bits order like the floats. inverted so an ascending sort is back to front
+static uint32_t DistanceKey(float distanceSquared)
+{
+	uint32_t bits;
+	memcpy(&bits, &distanceSquared, sizeof(bits));
+	return ~bits;
+}
+
+void ParticleEmitter::Init(uint32_t particleCount, glm::vec3 emitterPos, glm::vec3 spawnDimensions, float lowerLife, float upperLife, uint64_t seed)
+{
+	this->particleCount = particleCount;
 	this->emitterPos = emitterPos;
+	this->dimensions = spawnDimensions;
+	this->lowerLife = lowerLife;
+	this->upperLife = upperLife;
+	this->seed = seed;
+	frame = 0;
+
+	uint32_t paddedCount = (particleCount + ParticleLanes - 1) / ParticleLanes * ParticleLanes;
+
+	positionX.Resize(paddedCount);
+	positionY.Resize(paddedCount);
+	positionZ.Resize(paddedCount);
+	lifetime.Resize(paddedCount);
+	aliveTime.Resize(paddedCount);
+	keys.Resize(paddedCount);
+	packed.Resize(particleCount);
+	order.resize(particleCount);
+	sortScratch.resize(particleCount * 2);
+
+	// the first lifetimes are spread from zero so the particles do not all respawn together
+	ParticleRandom random(seed, UINT32_MAX);
+	for (uint32_t i = 0; i < paddedCount; i++)
+	{
+		bool padding = i >= particleCount;
+
+		positionX[i] = emitterPos.x + random.NextFloat() * dimensions.x;
+		positionY[i] = emitterPos.y + random.NextFloat() * dimensions.y;
+		positionZ[i] = emitterPos.z + random.NextFloat() * dimensions.z;
+		lifetime[i] = padding ? FLT_MAX : random.NextFloat() * upperLife;
+		aliveTime[i] = 0.0f;
+	}
+}
+
+void ParticleEmitter::Reset()
+{
+	for (uint32_t i = 0; i < particleCount; i++)
+	{
+		aliveTime[i] = lifetime[i];
+	}
+}
+
+void ParticleEmitter::Update(glm::vec3 movement, float deltaTime, glm::vec3 cameraPosition, ParticleGPUData* outParticles, JobSystem* jobSystem)
+{
+	if (particleCount == 0)
+	{
+		return;
+	}
 
-	// create 400 particles
+	uint32_t paddedCount = (uint32_t)lifetime.Size();
+	uint32_t chunk = std::max(chunkSize / ParticleLanes * ParticleLanes, ParticleLanes);
+
+	auto update = [&](uint32_t start, uint32_t end)
+	{
+		UpdateRange(start, end, movement, deltaTime, cameraPosition);
+	};
 
-	this->particles.resize(particleNum);
-	for (int i = 0; i < this->particles.size(); ++i)
+	if (jobSystem)
 	{
-		// give every particle a random position within sphere
-		glm::vec3 partPos = GetSpawnPosition(spawnDimensions);
-		this->particles[i].startingPos = glm::vec3(emitterPos.x + (partPos.x * radius), emitterPos.y + (partPos.y * radius), emitterPos.z + (partPos.z * radius));
-		this->particles[i].position = glm::vec3(emitterPos.x + (partPos.x * radius), emitterPos.y + (partPos.y * radius), emitterPos.z + (partPos.z * radius));
-		this->particles[i].lifetime = RandomFloat(0, upperLife); // between 5 and 10 seconds lifetime 
-		this->particles[i].aliveTime = 0.0f;
+		jobSystem->ParallelFor(paddedCount, chunk, update);
+	}
+	else
+	{
+		update(0, paddedCount);
 	}
 
-	std::vector<ParticleGPUData> particlesGPUData;
-	particlesGPUData.reserve(particles.size());
+	frame++;
+
+	if (sortForCamera)
+	{
+		SortByKey();
+	}
+
+	if (!outParticles)
+	{
+		return;
+	}
+
+	auto parallel = [&](const std::function<void(uint32_t start, uint32_t end)>& pass)
+	{
+		if (jobSystem)
+		{
+			jobSystem->ParallelFor(particleCount, chunk, pass);
+		}
+		else
+		{
+			pass(0, particleCount);
+		}
+	};
 
-	std::transform(std::cbegin(particles), std::cend(particles),
-		std::back_inserter(particlesGPUData),
-		[](const auto& particle) {
-			ParticleGPUData particleData;
-			particleData.position = particle.position;
-			particleData.aliveTime = particle.aliveTime;
-			particleData.lifetime = particle.lifetime;
-			return particleData;
+	auto pack = [&](ParticleGPUData* destination, uint32_t start, uint32_t end)
+	{
+		for (uint32_t i = start; i < end; i++)
+		{
+			destination[i].position = glm::vec3(positionX[i], positionY[i], positionZ[i]);
+			destination[i].lifetime = lifetime[i];
+			destination[i].aliveTime = aliveTime[i];
+			destination[i].emitter = drawEmitter;
 		}
-	);
+	};
+
+	if (!sortForCamera)
+	{
+		parallel([&](uint32_t start, uint32_t end) { pack(outParticles, start, end); });
+		return;
+	}
 
-	particleBuffers = engine->UploadParticles(particlesGPUData);
+	// gathering straight from the five component arrays misses the cache five times per particle, packing them first
+	// in order leaves one miss
+	parallel([&](uint32_t start, uint32_t end) { pack(packed.Data(), start, end); });
+	parallel([&](uint32_t start, uint32_t end)
+		{
+			for (uint32_t i = start; i < end; i++)
+			{
+				outParticles[i] = packed[order[i]];
+			}
+		});
 }
 
-ParticleEmitter::~ParticleEmitter()
+void ParticleEmitter::UpdateRange(uint32_t start, uint32_t end, glm::vec3 movement, float deltaTime, glm::vec3 cameraPosition)
 {
+	// one generator per chunk and frame, only advanced for the particles that respawn
+	ParticleRandom random(seed + frame * 0x9E3779B97F4A7C15ULL, start);
+
+	float* px = positionX.Data();
+	float* py = positionY.Data();
+	float* pz = positionZ.Data();
+	float* life = lifetime.Data();
+	float* alive = aliveTime.Data();
+	uint32_t* key = keys.Data();
+
+	// fills the respawned lanes of a batch, the others are left for the blend to ignore
+	alignas(32) float spawnX[ParticleLanes];
+	alignas(32) float spawnY[ParticleLanes];
+	alignas(32) float spawnZ[ParticleLanes];
+	alignas(32) float spawnLife[ParticleLanes];
+
+	auto respawn = [&](uint32_t mask, uint32_t lanes)
+	{
+		for (uint32_t lane = 0; lane < lanes; lane++)
+		{
+			if (mask & (1u << lane))
+			{
+				spawnX[lane] = emitterPos.x + random.NextFloat() * dimensions.x;
+				spawnY[lane] = emitterPos.y + random.NextFloat() * dimensions.y;
+				spawnZ[lane] = emitterPos.z + random.NextFloat() * dimensions.z;
+				spawnLife[lane] = lowerLife + random.NextFloat() * (upperLife - lowerLife);
+			}
+			else
+			{
+				spawnX[lane] = spawnY[lane] = spawnZ[lane] = spawnLife[lane] = 0.0f;
+			}
+		}
+	};
 
+	uint32_t i = start;
+
+#if defined(PARTICLES_USE_AVX)
+	if (useSimd)
+	{
+		__m256 dt = _mm256_set1_ps(deltaTime);
+		__m256 moveX = _mm256_set1_ps(movement.x * deltaTime);
+		__m256 moveY = _mm256_set1_ps(movement.y * deltaTime);
+		__m256 moveZ = _mm256_set1_ps(movement.z * deltaTime);
+		__m256 cameraX = _mm256_set1_ps(cameraPosition.x);
+		__m256 cameraY = _mm256_set1_ps(cameraPosition.y);
+		__m256 cameraZ = _mm256_set1_ps(cameraPosition.z);
+		__m256 invert = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+
+		for (; i + 8 <= end; i += 8)
+		{
+			__m256 x = _mm256_add_ps(_mm256_load_ps(px + i), moveX);
+			__m256 y = _mm256_add_ps(_mm256_load_ps(py + i), moveY);
+			__m256 z = _mm256_add_ps(_mm256_load_ps(pz + i), moveZ);
+			__m256 l = _mm256_load_ps(life + i);
+			__m256 a = _mm256_add_ps(_mm256_load_ps(alive + i), dt);
+
+			__m256 expired = _mm256_cmp_ps(a, l, _CMP_GE_OQ);
+			uint32_t mask = (uint32_t)_mm256_movemask_ps(expired);
+
+			if (mask)
+			{
+				respawn(mask, 8);
+				x = _mm256_blendv_ps(x, _mm256_load_ps(spawnX), expired);
+				y = _mm256_blendv_ps(y, _mm256_load_ps(spawnY), expired);
+				z = _mm256_blendv_ps(z, _mm256_load_ps(spawnZ), expired);
+				l = _mm256_blendv_ps(l, _mm256_load_ps(spawnLife), expired);
+				a = _mm256_andnot_ps(expired, a);
+			}
+
+			_mm256_store_ps(px + i, x);
+			_mm256_store_ps(py + i, y);
+			_mm256_store_ps(pz + i, z);
+			_mm256_store_ps(life + i, l);
+			_mm256_store_ps(alive + i, a);
+
+			__m256 dx = _mm256_sub_ps(x, cameraX);
+			__m256 dy = _mm256_sub_ps(y, cameraY);
+			__m256 dz = _mm256_sub_ps(z, cameraZ);
+			__m256 distanceSquared = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+			_mm256_store_ps((float*)(key + i), _mm256_xor_ps(distanceSquared, invert));
+		}
+	}
+#elif defined(PARTICLES_USE_SSE)
+	if (useSimd)
+	{
+		__m128 dt = _mm_set1_ps(deltaTime);
+		__m128 moveX = _mm_set1_ps(movement.x * deltaTime);
+		__m128 moveY = _mm_set1_ps(movement.y * deltaTime);
+		__m128 moveZ = _mm_set1_ps(movement.z * deltaTime);
+		__m128 cameraX = _mm_set1_ps(cameraPosition.x);
+		__m128 cameraY = _mm_set1_ps(cameraPosition.y);
+		__m128 cameraZ = _mm_set1_ps(cameraPosition.z);
+		__m128 invert = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+		// sse2 has no blendv, the lanes are selected with and, andnot and or
+		auto blend = [](__m128 a, __m128 b, __m128 mask) { return _mm_or_ps(_mm_andnot_ps(mask, a), _mm_and_ps(mask, b)); };
+
+		for (; i + 4 <= end; i += 4)
+		{
+			__m128 x = _mm_add_ps(_mm_load_ps(px + i), moveX);
+			__m128 y = _mm_add_ps(_mm_load_ps(py + i), moveY);
+			__m128 z = _mm_add_ps(_mm_load_ps(pz + i), moveZ);
+			__m128 l = _mm_load_ps(life + i);
+			__m128 a = _mm_add_ps(_mm_load_ps(alive + i), dt);
+
+			__m128 expired = _mm_cmpge_ps(a, l);
+			uint32_t mask = (uint32_t)_mm_movemask_ps(expired);
+
+			if (mask)
+			{
+				respawn(mask, 4);
+				x = blend(x, _mm_load_ps(spawnX), expired);
+				y = blend(y, _mm_load_ps(spawnY), expired);
+				z = blend(z, _mm_load_ps(spawnZ), expired);
+				l = blend(l, _mm_load_ps(spawnLife), expired);
+				a = _mm_andnot_ps(expired, a);
+			}
+
+			_mm_store_ps(px + i, x);
+			_mm_store_ps(py + i, y);
+			_mm_store_ps(pz + i, z);
+			_mm_store_ps(life + i, l);
+			_mm_store_ps(alive + i, a);
+
+			__m128 dx = _mm_sub_ps(x, cameraX);
+			__m128 dy = _mm_sub_ps(y, cameraY);
+			__m128 dz = _mm_sub_ps(z, cameraZ);
+			__m128 distanceSquared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+			_mm_store_ps((float*)(key + i), _mm_xor_ps(distanceSquared, invert));
+		}
+	}
+#endif
+
+	// scalar path and whatever the vector loop left over
+	glm::vec3 step = movement * deltaTime;
+	for (; i < end; i++)
+	{
+		px[i] += step.x;
+		py[i] += step.y;
+		pz[i] += step.z;
+		alive[i] += deltaTime;
+
+		if (alive[i] >= life[i])
+		{
+			respawn(1, 1);
+			px[i] = spawnX[0];
+			py[i] = spawnY[0];
+			pz[i] = spawnZ[0];
+			life[i] = spawnLife[0];
+			alive[i] = 0.0f;
+		}
+
+		glm::vec3 offset = glm::vec3(px[i], py[i], pz[i]) - cameraPosition;
+		key[i] = DistanceKey(glm::dot(offset, offset));
+	}
+}
+
+// least significant digit radix sort, 11 bits a pass. the key travels with its index so every pass reads sequentially
+void ParticleEmitter::SortByKey()
+{
+	constexpr uint32_t DigitBits = 11;
+	constexpr uint32_t DigitCount = 3;
+	constexpr uint32_t BucketCount = 1 << DigitBits;
+
+	uint64_t* source = sortScratch.data();
+	uint64_t* destination = sortScratch.data() + particleCount;
+
+	// every digit's histogram is counted in the one pass that builds the pairs
+	std::vector<uint32_t> offsets(DigitCount * BucketCount, 0);
+	for (uint32_t i = 0; i < particleCount; i++)
+	{
+		source[i] = ((uint64_t)keys[i] << 32) | i;
+
+		for (uint32_t digit = 0; digit < DigitCount; digit++)
+		{
+			offsets[digit * BucketCount + ((keys[i] >> (digit * DigitBits)) & (BucketCount - 1))]++;
+		}
+	}
+
+	for (uint32_t digit = 0; digit < DigitCount; digit++)
+	{
+		uint32_t* digitOffsets = offsets.data() + digit * BucketCount;
+
+		uint32_t total = 0;
+		for (uint32_t bucket = 0; bucket < BucketCount; bucket++)
+		{
+			uint32_t count = digitOffsets[bucket];
+			digitOffsets[bucket] = total;
+			total += count;
+		}
+
+		uint32_t shift = 32 + digit * DigitBits;
+		for (uint32_t i = 0; i < particleCount; i++)
+		{
+			destination[digitOffsets[(source[i] >> shift) & (BucketCount - 1)]++] = source[i];
+		}
+
+		std::swap(source, destination);
+	}
+
+	for (uint32_t i = 0; i < particleCount; i++)
+	{
+		order[i] = (uint32_t)source[i];
+	}
+}
+
+const char* ParticleEmitter::SimdPath()
+{
+#if defined(PARTICLES_USE_AVX)
+	return "AVX";
+#elif defined(PARTICLES_USE_SSE)
+	return "SSE";
+#else
+	return "Scalar";
+#endif
+}
+
+// the array of structs particle ParticleEmitter used to store, kept for the benchmark
+struct LegacyParticle
+{
+	glm::vec3 position;
+	glm::vec3 startingPos;
+	float lifetime;
+	float aliveTime;
+	float textureNum;
+	float cameraDistance;
+};
+
+static float LegacyRandomFloat(float a, float b)
+{
+	float random = ((float)rand()) / (float)RAND_MAX;
+	return a + random * (b - a);
 }
 
-void ParticleEmitter::Update(VulkanEngine* engine, glm::vec3 movement, const float ft, Camera camera)
+ParticleBenchmarkResults RunParticleBenchmark(JobSystem* jobSystem)
 {
-	this->cameraDistance = glm::length(camera.position - this->emitterPos); // sets camera distance for emitter transparency sorting
+	ParticleBenchmarkResults results{};
+	results.iterations = 3;
+	results.particleCounts[0] = 10 * 1000;
+	results.particleCounts[1] = 100 * 1000;
+	results.particleCounts[2] = 1000 * 1000;
 
-	for (int i = 0; i < this->particles.size(); ++i)
+	const glm::vec3 emitterPos = glm::vec3(0.0f, 0.0f, -1.0f);
+	const glm::vec3 dimensions = glm::vec3(0.5f, 0.0f, 0.5f);
+	const glm::vec3 movement = glm::vec3(0.0f, 1.0f, 0.0f);
+	const glm::vec3 cameraPosition = glm::vec3(0.0f, 2.0f, 10.0f);
+	const float lowerLife = 6.0f;
+	const float upperLife = 9.0f;
+	const float frameTimeMs = 16.6f;
+
+	auto time = [&](auto&& pass)
 	{
-		float frameTime = ft / 1000.0f; // converting to seconds
+		auto start = std::chrono::system_clock::now();
+		for (uint32_t i = 0; i < results.iterations; i++)
+		{
+			pass();
+		}
+		auto end = std::chrono::system_clock::now();
+		return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0f / results.iterations;
+	};
 
-		this->particles[i].aliveTime += frameTime;
-		this->particles[i].position += (movement * frameTime); // move particle based on direction (need to respawn if goes out of bounds) 
+	for (uint32_t c = 0; c < 3; c++)
+	{
+		uint32_t count = results.particleCounts[c];
 
-		if (this->particles[i].aliveTime >= this->particles[i].lifetime)
+		// the old update, minus the upload
+		std::vector<LegacyParticle> particles(count);
+		for (LegacyParticle& particle : particles)
 		{
-			glm::vec3 partPos = GetSpawnPosition(dimensions);
-			this->particles[i].position = glm::vec3(emitterPos.x + (partPos.x), emitterPos.y + (partPos.y * radius), emitterPos.z + (partPos.z * radius));
-			this->particles[i].lifetime = RandomFloat(lowerLife, upperLife); // between 3 and 4 seconds lifetime 
-			this->particles[i].aliveTime = 0.0f;
+			particle.position = emitterPos + glm::vec3(LegacyRandomFloat(0.0f, dimensions.x), LegacyRandomFloat(0.0f, dimensions.y), LegacyRandomFloat(0.0f, dimensions.z));
+			particle.startingPos = particle.position;
+			particle.lifetime = LegacyRandomFloat(0.0f, upperLife);
+			particle.aliveTime = 0.0f;
 		}
 
-		// stores camera distance 
-		particles[i].cameraDistance = glm::length(camera.position - particles[i].position);
+		results.legacyTime[c] = time([&]()
+			{
+				for (int i = 0; i < particles.size(); ++i)
+				{
+					float frameTime = frameTimeMs / 1000.0f;
+
+					particles[i].aliveTime += frameTime;
+					particles[i].position += (movement * frameTime);
+
+					if (particles[i].aliveTime >= particles[i].lifetime)
+					{
+						particles[i].position = emitterPos + glm::vec3(LegacyRandomFloat(0.0f, dimensions.x), LegacyRandomFloat(0.0f, dimensions.y), LegacyRandomFloat(0.0f, dimensions.z));
+						particles[i].lifetime = LegacyRandomFloat(lowerLife, upperLife);
+						particles[i].aliveTime = 0.0f;
+					}
+
+					particles[i].cameraDistance = glm::length(cameraPosition - particles[i].position);
+				}
+
+				std::sort(particles.begin(), particles.end(), [](LegacyParticle a, LegacyParticle b) { return a.cameraDistance > b.cameraDistance; });
+
+				std::vector<ParticleGPUData> particlesGPUData;
+				particlesGPUData.reserve(particles.size());
+				for (const LegacyParticle& particle : particles)
+				{
+					ParticleGPUData data;
+					data.position = particle.position;
+					data.aliveTime = particle.aliveTime;
+					data.lifetime = particle.lifetime;
+					particlesGPUData.push_back(data);
+				}
+			});
+
+		// stands in for the mapped buffer the emitter normally writes into
+		std::vector<ParticleGPUData> output(count);
+
+		ParticleEmitter emitter;
+		emitter.Init(count, emitterPos, dimensions, lowerLife, upperLife);
+		emitter.sortForCamera = true; // the legacy update always sorted
+
+		emitter.useSimd = false;
+		results.scalarTime[c] = time([&]() { emitter.Update(movement, frameTimeMs / 1000.0f, cameraPosition, output.data()); });
+
+		emitter.useSimd = true;
+		results.simdTime[c] = time([&]() { emitter.Update(movement, frameTimeMs / 1000.0f, cameraPosition, output.data()); });
+		results.parallelTime[c] = time([&]() { emitter.Update(movement, frameTimeMs / 1000.0f, cameraPosition, output.data(), jobSystem); });
+
+		fmt::println("Particle benchmark, {} particles: legacy {} ms, scalar {} ms, {} {} ms, {} threaded {} ms", count,
+			results.legacyTime[c], results.scalarTime[c], ParticleEmitter::SimdPath(), results.simdTime[c], ParticleEmitter::SimdPath(), results.parallelTime[c]);
+	}
+
+	return results;
+}
+
+// particle_sort.comp sorts blocks of this many entries in shared memory, matches SORT_BLOCK there
+constexpr uint32_t PARTICLE_SORT_BLOCK = 1024;
+
+// particle_sort.comp passes
+constexpr uint32_t PARTICLE_SORT_LOCAL = 0; // sort every block on its own
+constexpr uint32_t PARTICLE_SORT_STEP = 1; // one compare and swap step with a distance past a block
+constexpr uint32_t PARTICLE_SORT_MERGE = 2; // the remaining steps of a merge, inside each block
+constexpr uint32_t PARTICLE_SORT_GATHER = 3; // write the particles out in sorted order
+
+void ParticleSystem::Init(VulkanEngine* engine, uint32_t capacity, uint32_t maxEmitters)
+{
+	this->engine = engine;
+	this->capacity = std::max(capacity, 1u);
+
+	uint32_t maxSortCount = PARTICLE_SORT_BLOCK;
+	while (maxSortCount < this->capacity)
+	{
+		maxSortCount *= 2;
+	}
+
+	stateBuffer = engine->CreateBuffer(this->capacity * sizeof(ParticleGPUData), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+	drawBuffer = engine->CreateBuffer(this->capacity * sizeof(ParticleGPUData), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+	sortBuffer = engine->CreateBuffer(maxSortCount * sizeof(glm::uvec2), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+
+	stateBufferAddress = vkutil::GetBufferAddress(engine->device, stateBuffer.buffer);
+	drawBufferAddress = vkutil::GetBufferAddress(engine->device, drawBuffer.buffer);
+	sortBufferAddress = vkutil::GetBufferAddress(engine->device, sortBuffer.buffer);
+
+	maxEmitters = std::max(maxEmitters, 1u);
+	emitterBuffer.Init(engine, maxEmitters * (sizeof(GPUParticleEmitterData) + sizeof(uint32_t)), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, FRAME_OVERLAP);
+
+	emitters.resize(maxEmitters);
+	freeEmitters.clear();
+	for (uint32_t i = maxEmitters; i > 0; i--)
+	{
+		freeEmitters.push_back(i - 1);
+	}
+
+	freeRanges.clear();
+	freeRanges.push_back(glm::uvec2(0, this->capacity));
+	largestFreeRange = this->capacity;
+
+	liveCount = 0;
+	emitterCount = 0;
+	activeCount = 0;
+	sortCount = PARTICLE_SORT_BLOCK;
+	frame = 0;
+}
+
+void ParticleSystem::Destroy()
+{
+	engine->DestroyBuffer(stateBuffer);
+	engine->DestroyBuffer(drawBuffer);
+	engine->DestroyBuffer(sortBuffer);
+	emitterBuffer.Destroy(engine);
+}
+
+uint32_t ParticleSystem::CreateEmitter(const ParticleEmitterSettings& settings, uint32_t particleCount)
+{
+	particleCount = std::max(particleCount, 1u);
+
+	uint32_t offset;
+	if (freeEmitters.empty() || !AllocateRange(particleCount, offset))
+	{
+		fmt::println("Particle system cannot fit an emitter of {} particles ({} emitters, largest free range {})", particleCount, emitterCount, largestFreeRange);
+		return INVALID_PARTICLE_EMITTER;
+	}
+
+	uint32_t index = freeEmitters.back();
+	freeEmitters.pop_back();
+
+	Emitter& emitter = emitters[index];
+	emitter.settings = settings;
+	emitter.offset = offset;
+	emitter.count = particleCount;
+	emitter.alive = true;
+	emitter.resetPending = true;
+
+	emitterCount++;
+	liveCount += particleCount;
+
+	return index;
+}
+
+void ParticleSystem::DestroyEmitter(uint32_t emitter)
+{
+	if (!IsAlive(emitter))
+	{
+		return;
 	}
 
-	std::sort(this->particles.begin(), this->particles.end(), [](Particle a, Particle b) {return a.cameraDistance > b.cameraDistance; }); // sorting for transparency (check this is needed)
+	// the slots are only simulated again after being handed to another emitter, which respawns them
+	Emitter& e = emitters[emitter];
+	FreeRange(e.offset, e.count);
+	liveCount -= e.count;
+	emitterCount--;
 
-	std::vector<ParticleGPUData> particlesGPUData;
-	particlesGPUData.reserve(particles.size());
+	e.alive = false;
+	e.count = 0;
+	freeEmitters.push_back(emitter);
+}
 
-	std::transform(std::cbegin(particles), std::cend(particles),
-		std::back_inserter(particlesGPUData),
-		[](const auto& particle) {
-			ParticleGPUData particleData;
-			particleData.position = particle.position;
-			particleData.aliveTime = particle.aliveTime;
-			particleData.lifetime = particle.lifetime;
-			return particleData;
+bool ParticleSystem::SetParticleCount(uint32_t emitter, uint32_t particleCount)
+{
+	if (!IsAlive(emitter))
+	{
+		return false;
+	}
+
+	Emitter& e = emitters[emitter];
+	particleCount = std::max(particleCount, 1u);
+	if (particleCount == e.count)
+	{
+		return true;
+	}
+
+	// freed first so the emitter can grow into the space after its own range
+	FreeRange(e.offset, e.count);
+
+	uint32_t offset;
+	if (!AllocateRange(particleCount, offset))
+	{
+		// the old range is always free again, though first fit may hand out an earlier one
+		AllocateRange(e.count, offset);
+		e.resetPending = e.resetPending || offset != e.offset;
+		e.offset = offset;
+		return false;
+	}
+
+	liveCount = liveCount - e.count + particleCount;
+	e.offset = offset;
+	e.count = particleCount;
+	e.resetPending = true;
+
+	return true;
+}
+
+bool ParticleSystem::AllocateRange(uint32_t count, uint32_t& outOffset)
+{
+	for (size_t i = 0; i < freeRanges.size(); i++)
+	{
+		if (freeRanges[i].y < count)
+		{
+			continue;
 		}
-	);
 
-	engine->UpdateParticles(particleBuffers, particlesGPUData);
+		outOffset = freeRanges[i].x;
+		freeRanges[i].x += count;
+		freeRanges[i].y -= count;
+
+		if (freeRanges[i].y == 0)
+		{
+			freeRanges.erase(freeRanges.begin() + i);
+		}
+
+		largestFreeRange = 0;
+		for (const glm::uvec2& range : freeRanges)
+		{
+			largestFreeRange = std::max(largestFreeRange, range.y);
+		}
+		return true;
+	}
+
+	return false;
 }
 
-glm::vec3 ParticleEmitter::GetSpawnPosition(glm::vec3 spawnDimensions) 
+void ParticleSystem::FreeRange(uint32_t offset, uint32_t count)
 {
-	glm::vec3 pos = glm::vec3(RandomFloat(0.0f, spawnDimensions.x), RandomFloat(0.0f, spawnDimensions.y), RandomFloat(0.0f, spawnDimensions.z));;
+	auto it = std::lower_bound(freeRanges.begin(), freeRanges.end(), offset, [](const glm::uvec2& range, uint32_t value) { return range.x < value; });
+	it = freeRanges.insert(it, glm::uvec2(offset, count));
 
-	return pos;
+	// merge with the following range, then with the preceding one
+	if (it + 1 != freeRanges.end() && it->x + it->y == (it + 1)->x)
+	{
+		it->y += (it + 1)->y;
+		freeRanges.erase(it + 1);
+	}
+	if (it != freeRanges.begin() && (it - 1)->x + (it - 1)->y == it->x)
+	{
+		(it - 1)->y += it->y;
+		freeRanges.erase(it);
+	}
+
+	largestFreeRange = 0;
+	for (const glm::uvec2& range : freeRanges)
+	{
+		largestFreeRange = std::max(largestFreeRange, range.y);
+	}
 }
 
-void ParticleEmitter::Reset()
+void ParticleSystem::Prepare(uint32_t frame)
 {
-	for (int i = 0; i < this->particles.size(); i++)
+	GPUParticleEmitterData* table = (GPUParticleEmitterData*)emitterBuffer.WritePointer(frame);
+	uint32_t* active = (uint32_t*)(table + emitters.size());
+
+	activeCount = 0;
+	uint32_t liveStart = 0;
+
+	for (uint32_t i = 0; i < emitters.size(); i++)
 	{
-		this->particles[i].aliveTime = this->particles[i].lifetime;
+		const Emitter& e = emitters[i];
+		if (!e.alive)
+		{
+			continue;
+		}
+
+		GPUParticleEmitterData& data = table[i];
+		data.positionLowerLife = glm::vec4(e.settings.position, e.settings.lowerLife);
+		data.dimensionsUpperLife = glm::vec4(e.settings.spawnDimensions, e.settings.upperLife);
+		data.movementSizeStart = glm::vec4(e.settings.movement, e.settings.sizeStart);
+		data.sizeEnd = e.settings.sizeEnd;
+		data.sizeExponent = e.settings.sizeExponent;
+		data.firstLayer = e.settings.firstLayer;
+		data.layerCount = std::max(e.settings.layerCount, 1u);
+		data.arenaOffset = e.offset;
+		data.liveStart = liveStart;
+		data.particleCount = e.count;
+		data.reset = e.resetPending ? 1 : 0;
+
+		active[activeCount++] = i;
+		liveStart += e.count;
+	}
+
+	emitterBuffer.Flush(engine, frame, emitters.size() * sizeof(GPUParticleEmitterData) + activeCount * sizeof(uint32_t));
+
+	sortCount = PARTICLE_SORT_BLOCK;
+	while (sortCount < liveCount)
+	{
+		sortCount *= 2;
 	}
 }
 
-float ParticleEmitter::RandomFloat(float a, float b) {
-	float random = ((float)rand()) / (float)RAND_MAX;
-	float diff = b - a;
-	float r = random * diff;
-	return a + r;
-}
\ No newline at end of file
+void ParticleSystem::RecordUpdate(VkCommandBuffer cmd, VkPipeline simPipeline, VkPipeline sortPipeline, VkPipelineLayout layout, uint32_t frame, float deltaTime, glm::vec3 cameraPosition)
+{
+	if (liveCount == 0)
+	{
+		return;
+	}
+
+	// the state is simulated in place and the draw buffer rewritten, the last frame's draw read both
+	vkutil::GlobalBarrier(cmd, VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT, VK_ACCESS_2_NONE,
+		VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+
+	GPUParticleSimPushConstants simConstants;
+	simConstants.stateBuffer = stateBufferAddress;
+	simConstants.sortBuffer = sortBufferAddress;
+	simConstants.emitterBuffer = emitterBuffer.DeviceAddress(frame);
+	simConstants.activeBuffer = emitterBuffer.DeviceAddress(frame) + emitters.size() * sizeof(GPUParticleEmitterData);
+	simConstants.cameraPosition = glm::vec4(cameraPosition, deltaTime);
+	simConstants.liveCount = liveCount;
+	simConstants.sortCount = sortCount;
+	simConstants.activeCount = activeCount;
+	simConstants.seed = this->frame++;
+
+	// the table written by Prepare carries the resets, they are done once simulated
+	for (Emitter& e : emitters)
+	{
+		e.resetPending = false;
+	}
+
+	// writes the keys of every sort slot, the ones past the live count sort to the end
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, simPipeline);
+	vkCmdPushConstants(cmd, layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(GPUParticleSimPushConstants), &simConstants);
+	vkCmdDispatch(cmd, (sortCount + 255) / 256, 1, 1);
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, sortPipeline);
+
+	// bitonic sort, merges up to a block's size run in shared memory and only the steps spanning blocks go through the buffer.
+	// without it the entries stay in live order and the gather only compacts
+	if (sortForCamera)
+	{
+		uint32_t blockCount = sortCount / PARTICLE_SORT_BLOCK;
+		RecordSort(cmd, layout, PARTICLE_SORT_LOCAL, 0, 0, blockCount);
+
+		for (uint32_t k = PARTICLE_SORT_BLOCK * 2; k <= sortCount; k *= 2)
+		{
+			for (uint32_t j = k / 2; j >= PARTICLE_SORT_BLOCK; j /= 2)
+			{
+				RecordSort(cmd, layout, PARTICLE_SORT_STEP, k, j, blockCount);
+			}
+
+			RecordSort(cmd, layout, PARTICLE_SORT_MERGE, k, PARTICLE_SORT_BLOCK / 2, blockCount);
+		}
+	}
+
+	RecordSort(cmd, layout, PARTICLE_SORT_GATHER, 0, 0, (liveCount + 511) / 512);
+
+	vkutil::GlobalBarrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+}
+
+void ParticleSystem::RecordSort(VkCommandBuffer cmd, VkPipelineLayout layout, uint32_t mode, uint32_t k, uint32_t j, uint32_t groupCount)
+{
+	vkutil::GlobalBarrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+
+	GPUParticleSortPushConstants sortConstants;
+	sortConstants.sortBuffer = sortBufferAddress;
+	sortConstants.stateBuffer = stateBufferAddress;
+	sortConstants.drawBuffer = drawBufferAddress;
+	sortConstants.sortCount = sortCount;
+	sortConstants.particleCount = liveCount;
+	sortConstants.k = k;
+	sortConstants.j = j;
+	sortConstants.mode = mode;
+	sortConstants.padding = 0;
+
+	vkCmdPushConstants(cmd, layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(GPUParticleSortPushConstants), &sortConstants);
+	vkCmdDispatch(cmd, groupCount, 1, 1);
+}
@@ -1,65 +1,256 @@
 #pragma once
 
-#include "camera.h"
-
 #include <string>
 #include <vector>
-#include <random>
 #include <functional>
-#include <iostream>
 #include <optional>
+#include <new>
 #include "vk_types.h"
+#include "vk_buffers.h"
 
 
 class VulkanEngine;
+class JobSystem;
 
-struct Particle
+struct ParticleGPUData
 {
 	glm::vec3 position;
-	glm::vec3 startingPos;
 	float lifetime;
 	float aliveTime;
-	float textureNum;
-	float cameraDistance;
-
-	bool operator<(Particle& comparisonParticle) { // comparison function used transparency sorting
-		return this->cameraDistance > comparisonParticle.cameraDistance;
-	}
+	uint32_t emitter; // slot in the ParticleSystem emitter table, for the draw settings
+	float padding[2];
 };
 
-struct ParticleGPUData
+// heap array aligned for 256 bit loads
+template<typename T>
+class AlignedArray
 {
-	glm::vec3 position;
-	float lifetime;
-	float aliveTime;
-	float padding[3];
+public:
+	AlignedArray() = default;
+	AlignedArray(const AlignedArray&) = delete;
+	AlignedArray& operator=(const AlignedArray&) = delete;
+	~AlignedArray() { Free(); }
+
+	void Resize(size_t count)
+	{
+		Free();
+		data = static_cast<T*>(::operator new(count * sizeof(T), std::align_val_t{ 32 }));
+		size = count;
+	}
+
+	T* Data() { return data; }
+	const T* Data() const { return data; }
+	T& operator[](size_t index) { return data[index]; }
+	const T& operator[](size_t index) const { return data[index]; }
+	size_t Size() const { return size; }
+
+private:
+	void Free()
+	{
+		if (data)
+		{
+			::operator delete(data, std::align_val_t{ 32 });
+		}
+		data = nullptr;
+		size = 0;
+	}
+
+	T* data{ nullptr };
+	size_t size{ 0 };
 };
 
+// cpu particle backend, for configurations that read particles back for gameplay. every component is its own aligned array
+// so the update moves 8 (AVX) or 4 (SSE) particles at a time and blends respawns in under the expired lanes. chunks are
+// spread across the job system, each seeding its own pcg generator from the frame and chunk, so no state is shared
 class ParticleEmitter
 {
 public:
+	void Init(uint32_t particleCount, glm::vec3 emitterPos, glm::vec3 spawnDimensions, float lowerLife, float upperLife, uint64_t seed = 1);
 
-	ParticleEmitter(VulkanEngine* engine, glm::vec3 emitterPos, glm::vec3 spawnDimensions, uint32_t particleNum, uint32_t lowerLife, uint32_t upperLife);
-	~ParticleEmitter();
+	// outParticles takes particleCount entries and is usually a mapped gpu buffer, nullptr skips the write.
+	// deltaTime is in seconds
+	void Update(glm::vec3 movement, float deltaTime, glm::vec3 cameraPosition, ParticleGPUData* outParticles, JobSystem* jobSystem = nullptr);
 
-	void Update(VulkanEngine* engine, glm::vec3 movement, const float ft, Camera camera);
+	// respawns every particle on the next update
 	void Reset();
 
+	// instruction set the update was compiled for
+	static const char* SimdPath();
+
 	glm::vec3 emitterPos;
-	float cameraDistance;
+	glm::vec3 dimensions;
+	float lowerLife;
+	float upperLife;
 
-	std::vector< Particle > particles;
-	GPUParticleBuffers particleBuffers;
+	uint32_t particleCount{ 0 };
+	uint32_t chunkSize{ 16 * 1024 }; // particles per job, a multiple of 8
+	bool sortForCamera{ false }; // write the particles back to front, only needed when not weighted blended
+	bool useSimd{ true };
+	uint32_t drawEmitter{ 0 }; // ParticleSystem emitter whose draw settings the particles use
+
+	// particle state, padded to whole batches of 8. the padding never expires
+	AlignedArray<float> positionX;
+	AlignedArray<float> positionY;
+	AlignedArray<float> positionZ;
+	AlignedArray<float> lifetime;
+	AlignedArray<float> aliveTime;
 
 private:
-	float lowerLife;
-	float upperLife;
-	float particleSize;
-	float radius;
+	void UpdateRange(uint32_t start, uint32_t end, glm::vec3 movement, float deltaTime, glm::vec3 cameraPosition);
+	void SortByKey();
 
-	glm::vec3 dimensions;
+	AlignedArray<uint32_t> keys; // inverted squared camera distance, ascending is back to front
+	std::vector<uint32_t> order;
+	AlignedArray<ParticleGPUData> packed; // the particles in update order, gathered from when sorting
+	std::vector<uint64_t> sortScratch; // key and index pairs, two halves ping ponged by the radix passes
 
-	glm::vec3 GetSpawnPosition(glm::vec3 spawnDimensions);
+	uint64_t seed{ 1 };
+	uint64_t frame{ 0 };
+};
+
+// milliseconds per update, each column is one particle count
+struct ParticleBenchmarkResults
+{
+	uint32_t iterations;
+	uint32_t particleCounts[3];
+	float legacyTime[3]; // array of structs, rand and a by value std::sort, the way ParticleEmitter::Update used to work
+	float scalarTime[3];
+	float simdTime[3];
+	float parallelTime[3];
+};
 
-	float RandomFloat(float a, float b);
-};
\ No newline at end of file
+ParticleBenchmarkResults RunParticleBenchmark(JobSystem* jobSystem);
+
+// matches ParticleEmitter in particle_sim.comp and particle.vert, one per emitter slot
+struct GPUParticleEmitterData
+{
+	glm::vec4 positionLowerLife; // spawn box corner, w lower lifetime
+	glm::vec4 dimensionsUpperLife; // spawn box size, w upper lifetime
+	glm::vec4 movementSizeStart; // velocity, w billboard size at spawn
+	float sizeEnd; // billboard size at the end of the lifetime
+	float sizeExponent; // shape of the size curve, 1 is linear
+	uint32_t firstLayer; // texture array layers played through over the lifetime
+	uint32_t layerCount;
+	uint32_t arenaOffset; // first slot of the emitter's range in the arena
+	uint32_t liveStart; // first of the emitter's particles when every live range is laid end to end
+	uint32_t particleCount;
+	uint32_t reset; // respawn every particle with a random age
+};
+
+struct GPUParticleSimPushConstants
+{
+	VkDeviceAddress stateBuffer;
+	VkDeviceAddress sortBuffer;
+	VkDeviceAddress emitterBuffer;
+	VkDeviceAddress activeBuffer;
+	glm::vec4 cameraPosition; // w delta time in seconds
+	uint32_t liveCount;
+	uint32_t sortCount;
+	uint32_t activeCount;
+	uint32_t seed;
+};
+
+struct GPUParticleSortPushConstants
+{
+	VkDeviceAddress sortBuffer;
+	VkDeviceAddress stateBuffer;
+	VkDeviceAddress drawBuffer;
+	uint32_t sortCount;
+	uint32_t particleCount;
+	uint32_t k;
+	uint32_t j;
+	uint32_t mode;
+	uint32_t padding;
+};
+
+constexpr uint32_t INVALID_PARTICLE_EMITTER = ~0u;
+
+// how one emitter spawns, moves and draws its particles
+struct ParticleEmitterSettings
+{
+	glm::vec3 position{ 0.0f };
+	glm::vec3 spawnDimensions{ 1.0f };
+	glm::vec3 movement{ 0.0f, 1.0f, 0.0f }; // units per second
+	float lowerLife{ 1.0f };
+	float upperLife{ 2.0f };
+	float sizeStart{ 0.0f }; // scaled by ParticleSceneData::particleSize
+	float sizeEnd{ 1.0f };
+	float sizeExponent{ 1.0f };
+	uint32_t firstLayer{ 0 };
+	uint32_t layerCount{ 1 };
+};
+
+// every gpu particle lives in one arena shared by all emitters. an emitter owns a fixed range of slots handed out from a free
+// list, so creating or destroying one only touches cpu bookkeeping and the emitter table streamed each frame. particle_sim.comp
+// runs over the live ranges laid end to end, finding each particle's emitter with a binary search, particle_sort.comp
+// gathers them into the draw buffer, which particle.vert draws in one instanced draw. sorting back to front before the
+// gather is optional, the particles are weighted blended
+class ParticleSystem
+{
+public:
+	void Init(VulkanEngine* engine, uint32_t capacity, uint32_t maxEmitters);
+	void Destroy();
+
+	// returns INVALID_PARTICLE_EMITTER when the emitter table is full or no free range is large enough
+	uint32_t CreateEmitter(const ParticleEmitterSettings& settings, uint32_t particleCount);
+	void DestroyEmitter(uint32_t emitter);
+
+	// moves the emitter to a new range, its particles are respawned. false and unchanged when no range fits
+	bool SetParticleCount(uint32_t emitter, uint32_t particleCount);
+
+	// changes apply from the next Prepare
+	ParticleEmitterSettings& Settings(uint32_t emitter) { return emitters[emitter].settings; }
+	uint32_t ParticleCount(uint32_t emitter) const { return emitters[emitter].count; }
+	bool IsAlive(uint32_t emitter) const { return emitter < emitters.size() && emitters[emitter].alive; }
+
+	// must be called after the frame fence, writes this frame's emitter table. the table is also read when drawing
+	void Prepare(uint32_t frame);
+
+	// simulates and sorts every live particle, the draw buffer can be read by vertex shaders afterwards
+	void RecordUpdate(VkCommandBuffer cmd, VkPipeline simPipeline, VkPipeline sortPipeline, VkPipelineLayout layout, uint32_t frame, float deltaTime, glm::vec3 cameraPosition);
+
+	VkDeviceAddress DrawBufferAddress() const { return drawBufferAddress; }
+	VkDeviceAddress EmitterBufferAddress(uint32_t frame) const { return emitterBuffer.DeviceAddress(frame); }
+
+	uint32_t capacity{ 0 };
+	uint32_t liveCount{ 0 }; // particles over every emitter, the instance count of the draw
+	uint32_t emitterCount{ 0 };
+	uint32_t sortCount{ 0 }; // live count rounded up to a power of two, at least one sort block
+	uint32_t largestFreeRange{ 0 };
+	bool sortForCamera{ false }; // weighted blended particles draw in any order, sorting is only kept for comparison
+
+private:
+	struct Emitter
+	{
+		ParticleEmitterSettings settings;
+		uint32_t offset{ 0 };
+		uint32_t count{ 0 };
+		bool alive{ false };
+		bool resetPending{ false };
+	};
+
+	// first fit over the free ranges, which are kept sorted by offset and merged with their neighbours when freed
+	bool AllocateRange(uint32_t count, uint32_t& outOffset);
+	void FreeRange(uint32_t offset, uint32_t count);
+
+	void RecordSort(VkCommandBuffer cmd, VkPipelineLayout layout, uint32_t mode, uint32_t k, uint32_t j, uint32_t groupCount);
+
+	VulkanEngine* engine{ nullptr };
+
+	std::vector<Emitter> emitters;
+	std::vector<uint32_t> freeEmitters;
+	std::vector<glm::uvec2> freeRanges; // offset and count
+
+	AllocatedBuffer stateBuffer; // simulated in place, every emitter's range
+	AllocatedBuffer drawBuffer; // live particles sorted back to front
+	AllocatedBuffer sortBuffer; // key and arena slot pairs
+	VkDeviceAddress stateBufferAddress{ 0 };
+	VkDeviceAddress drawBufferAddress{ 0 };
+	VkDeviceAddress sortBufferAddress{ 0 };
+
+	// per frame the table indexed by emitter slot, followed by the live slots in liveStart order
+	DynamicBuffer emitterBuffer;
+	uint32_t activeCount{ 0 };
+
+	uint32_t frame{ 0 };
+};
@@ -0,0 +1,192 @@
+#include "vk_pipeline_cache.h"
+#include "vk_engine.h"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+constexpr uint32_t PIPELINE_CACHE_MAGIC = 0x48435056; // "VPCH"
+constexpr uint32_t PIPELINE_CACHE_VERSION = 1;
+
+static uint64_t HashData(const uint8_t* data, size_t size)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash = (hash ^ data[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+void PipelineCache::Init(VulkanEngine* engine, const std::string& path)
+{
+	this->engine = engine;
+	this->path = path;
+	stats = {};
+
+	std::vector<uint8_t> data = ReadFile();
+
+	VkPipelineCacheCreateInfo info = { .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO };
+	info.initialDataSize = data.size();
+	info.pInitialData = data.empty() ? nullptr : data.data();
+
+	// the driver may still refuse data that passed the checks, then it starts empty like a cold run
+	if (vkCreatePipelineCache(engine->device, &info, nullptr, &cache) != VK_SUCCESS)
+	{
+		fmt::println("Pipeline cache {} rejected by the driver, starting empty", path);
+
+		info.initialDataSize = 0;
+		info.pInitialData = nullptr;
+		VK_CHECK(vkCreatePipelineCache(engine->device, &info, nullptr, &cache));
+		stats.coldBuildTime = 0.0f;
+		data.clear();
+	}
+
+	stats.loaded = !data.empty();
+	stats.loadedBytes = data.size();
+}
+
+void PipelineCache::Destroy()
+{
+	vkDestroyPipelineCache(engine->device, cache, nullptr);
+	cache = VK_NULL_HANDLE;
+}
+
+void PipelineCache::RecordBuildTime(float milliseconds)
+{
+	stats.buildTime = milliseconds;
+
+	if (!stats.loaded)
+	{
+		// everything was compiled, so this is the time later runs are compared against
+		stats.coldBuildTime = milliseconds;
+		fmt::println("Pipelines built in {:.1f} ms without a cache", milliseconds);
+		return;
+	}
+
+	fmt::println("Pipelines built in {:.1f} ms from a {} byte cache, {:.1f} ms saved against the cold build", milliseconds,
+		stats.loadedBytes, stats.coldBuildTime - milliseconds);
+}
+
+std::vector<uint8_t> PipelineCache::ReadFile()
+{
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if (!file.is_open())
+	{
+		return {};
+	}
+
+	size_t fileSize = (size_t)file.tellg();
+	if (fileSize < sizeof(PipelineCacheFileHeader))
+	{
+		fmt::println("Pipeline cache {} is truncated, discarding it", path);
+		return {};
+	}
+
+	PipelineCacheFileHeader header;
+	file.seekg(0);
+	file.read((char*)&header, sizeof(PipelineCacheFileHeader));
+
+	const VkPhysicalDeviceProperties& properties = engine->physicalDeviceProperties;
+
+	if (header.magic != PIPELINE_CACHE_MAGIC || header.version != PIPELINE_CACHE_VERSION)
+	{
+		fmt::println("Pipeline cache {} has an unknown format, discarding it", path);
+		return {};
+	}
+
+	if (header.vendorID != properties.vendorID || header.deviceID != properties.deviceID || header.driverVersion != properties.driverVersion
+		|| memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0)
+	{
+		fmt::println("Pipeline cache {} was written by another device or driver, discarding it", path);
+		return {};
+	}
+
+	if (header.dataSize != fileSize - sizeof(PipelineCacheFileHeader) || header.dataSize < sizeof(VkPipelineCacheHeaderVersionOne))
+	{
+		fmt::println("Pipeline cache {} is truncated, discarding it", path);
+		return {};
+	}
+
+	std::vector<uint8_t> data(header.dataSize);
+	file.read((char*)data.data(), data.size());
+
+	if (!file || HashData(data.data(), data.size()) != header.dataHash)
+	{
+		fmt::println("Pipeline cache {} is corrupt, discarding it", path);
+		return {};
+	}
+
+	// the same checks against the driver's own header, in case the blob came from somewhere else
+	VkPipelineCacheHeaderVersionOne driverHeader;
+	memcpy(&driverHeader, data.data(), sizeof(VkPipelineCacheHeaderVersionOne));
+
+	if (driverHeader.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE || driverHeader.headerSize < sizeof(VkPipelineCacheHeaderVersionOne)
+		|| driverHeader.headerSize > data.size() || driverHeader.vendorID != properties.vendorID || driverHeader.deviceID != properties.deviceID
+		|| memcmp(driverHeader.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0)
+	{
+		fmt::println("Pipeline cache {} does not match this driver, discarding it", path);
+		return {};
+	}
+
+	stats.coldBuildTime = header.coldBuildTime;
+	return data;
+}
+
+void PipelineCache::Save()
+{
+	size_t dataSize = 0;
+	VK_CHECK(vkGetPipelineCacheData(engine->device, cache, &dataSize, nullptr));
+
+	std::vector<uint8_t> data(dataSize);
+	VK_CHECK(vkGetPipelineCacheData(engine->device, cache, &dataSize, data.data()));
+	data.resize(dataSize);
+
+	const VkPhysicalDeviceProperties& properties = engine->physicalDeviceProperties;
+
+	PipelineCacheFileHeader header;
+	header.magic = PIPELINE_CACHE_MAGIC;
+	header.version = PIPELINE_CACHE_VERSION;
+	header.vendorID = properties.vendorID;
+	header.deviceID = properties.deviceID;
+	header.driverVersion = properties.driverVersion;
+	header.coldBuildTime = stats.coldBuildTime;
+	memcpy(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+	header.dataSize = data.size();
+	header.dataHash = HashData(data.data(), data.size());
+
+	// the old file stays in place until the new one is complete, rename replaces it in one step
+	std::string temporaryPath = path + ".tmp";
+	{
+		std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+		if (!file.is_open())
+		{
+			fmt::println("Failed to open {} for writing", temporaryPath);
+			return;
+		}
+
+		file.write((const char*)&header, sizeof(PipelineCacheFileHeader));
+		file.write((const char*)data.data(), data.size());
+		file.flush();
+
+		if (!file)
+		{
+			fmt::println("Failed to write {}", temporaryPath);
+			file.close();
+			std::error_code removeError;
+			std::filesystem::remove(temporaryPath, removeError);
+			return;
+		}
+	}
+
+	std::error_code error;
+	std::filesystem::rename(temporaryPath, path, error);
+	if (error)
+	{
+		fmt::println("Failed to replace {}: {}", path, error.message());
+		std::filesystem::remove(temporaryPath, error);
+		return;
+	}
+
+	stats.savedBytes = sizeof(PipelineCacheFileHeader) + data.size();
+}
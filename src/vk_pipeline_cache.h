@@ -0,0 +1,55 @@
+#pragma once
+
+#include "vk_types.h"
+
+class VulkanEngine;
+
+// written in front of the driver's blob. the driver checks its own header, but not the driver version, and a
+// truncated or bit flipped blob is only caught here
+struct PipelineCacheFileHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t vendorID;
+	uint32_t deviceID;
+	uint32_t driverVersion;
+	float coldBuildTime; // ms InitPipelines took when nothing came from the cache
+	uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+	uint64_t dataSize;
+	uint64_t dataHash;
+};
+
+struct PipelineCacheStats
+{
+	bool loaded; // the file was accepted and seeded the cache
+	size_t loadedBytes;
+	size_t savedBytes;
+	float buildTime; // ms InitPipelines took this run
+	float coldBuildTime; // ms it took without a cache, 0 when never measured
+};
+
+// engine owned VkPipelineCache every pipeline is built through. it is seeded from a file at startup when the file was
+// written by the same device and driver, otherwise the file is ignored and the cache starts empty. the file is
+// replaced on shutdown, through a temporary so an interrupted write never leaves a half written cache behind
+class PipelineCache
+{
+public:
+	void Init(VulkanEngine* engine, const std::string& path);
+	void Destroy();
+
+	// called once the startup pipelines are built, reports the time saved against the last cold build
+	void RecordBuildTime(float milliseconds);
+
+	// writes the driver's data back to the file, must be called before Destroy
+	void Save();
+
+	VkPipelineCache cache{ VK_NULL_HANDLE };
+	PipelineCacheStats stats{};
+
+private:
+	// returns the driver's blob when the file belongs to this device, empty otherwise
+	std::vector<uint8_t> ReadFile();
+
+	VulkanEngine* engine{ nullptr };
+	std::string path;
+};
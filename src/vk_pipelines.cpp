@@ -1,6 +1,34 @@
 ﻿#include "vk_pipelines.h"
 
-bool vkutil::LoadShaderModule(const char* filePath, VkDevice device, VkShaderModule* outShaderModule)
+// bit n for every OpDecorate SpecId n, instructions follow the five word header and lead with their word count and opcode
+static uint64_t ReadSpecConstantIds(const std::vector<uint32_t>& code)
+{
+	constexpr uint32_t OpDecorate = 71;
+	constexpr uint32_t DecorationSpecId = 1;
+
+	uint64_t ids = 0;
+	size_t i = 5;
+	while (i < code.size())
+	{
+		uint32_t wordCount = code[i] >> 16;
+		uint32_t opcode = code[i] & 0xFFFF;
+		if (wordCount == 0 || i + wordCount > code.size())
+		{
+			break;
+		}
+
+		if (opcode == OpDecorate && wordCount >= 4 && code[i + 2] == DecorationSpecId && code[i + 3] < 64)
+		{
+			ids |= 1ull << code[i + 3];
+		}
+
+		i += wordCount;
+	}
+
+	return ids;
+}
+
+bool vkutil::LoadShaderModule(const char* filePath, VkDevice device, VkShaderModule* outShaderModule, uint64_t* outSpecConstantIds)
 {
 	std::ifstream file(filePath, std::ios::ate | std::ios::binary);
 
@@ -10,6 +38,10 @@ bool vkutil::LoadShaderModule(const char* filePath, VkDevice device, VkShaderMod
 	}
 
 	size_t fileSize = (size_t)file.tellg();
+	if (fileSize == 0 || fileSize % sizeof(uint32_t) != 0)
+	{
+		return false;
+	}
 
 	std::vector<uint32_t> buffer(fileSize / sizeof(uint32_t));
 
@@ -32,9 +64,67 @@ bool vkutil::LoadShaderModule(const char* filePath, VkDevice device, VkShaderMod
 		return false;
 	}
 	*outShaderModule = shaderModule;
+	if (outSpecConstantIds)
+	{
+		*outSpecConstantIds = ReadSpecConstantIds(buffer);
+	}
 	return true;
 }
 
+VkShaderModule ShaderModuleCache::Get(VkDevice device, const std::string& path, uint64_t requiredSpecConstants)
+{
+	std::promise<LoadedModule> promise;
+	std::shared_future<LoadedModule> module;
+	bool load = false;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto [it, inserted] = modules.try_emplace(path);
+		if (inserted)
+		{
+			it->second = promise.get_future().share();
+			load = true;
+			loads++;
+		}
+		else
+		{
+			hits++;
+		}
+		module = it->second;
+	}
+
+	// the first caller loads outside the lock, later callers for the same path wait on its result
+	if (load)
+	{
+		LoadedModule loaded{ VK_NULL_HANDLE, 0 };
+		if (!vkutil::LoadShaderModule(path.c_str(), device, &loaded.module, &loaded.specConstantIds))
+		{
+			// a pipeline built without it would only fail later on the gpu, so stop here with the file that is missing
+			fmt::println("Failed to load shader module {}, the shaders are compiled by the project build", path);
+			abort();
+		}
+		promise.set_value(loaded);
+	}
+
+	const LoadedModule& loaded = module.get();
+	if ((loaded.specConstantIds & requiredSpecConstants) != requiredSpecConstants)
+	{
+		fmt::println("Shader module {} is missing specialization constants, it is older than its source", path);
+		abort();
+	}
+
+	return loaded.module;
+}
+
+void ShaderModuleCache::Clear(VkDevice device)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	for (auto& [path, module] : modules)
+	{
+		vkDestroyShaderModule(device, module.get().module, nullptr);
+	}
+	modules.clear();
+}
+
 void PipelineBuilder::Clear()
 {
 	// clear all structs back to 0
@@ -45,6 +135,9 @@ void PipelineBuilder::Clear()
 
 	colorBlendAttachment = {};
 
+	weightedBlendedAttachments[0] = {};
+	weightedBlendedAttachments[1] = {};
+
 	multisampling = { .sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO };
 
 	pipelineLayout = {};
@@ -54,9 +147,12 @@ void PipelineBuilder::Clear()
 	renderInfo = { .sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO };
 
 	shaderStages.clear();
+
+	specializationData.clear();
+	specializationStages = 0;
 }
 
-VkPipeline PipelineBuilder::BuildPipeline(VkDevice device)
+VkPipeline PipelineBuilder::BuildPipeline(VkDevice device, VkPipelineCache cache)
 {
 	VkPipelineViewportStateCreateInfo viewportState = {};
 	viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
@@ -74,14 +170,44 @@ VkPipeline PipelineBuilder::BuildPipeline(VkDevice device)
 	colorBlending.attachmentCount = 1;
 	colorBlending.pAttachments = &colorBlendAttachment;
 
+	if (renderInfo.pColorAttachmentFormats == weightedBlendedFormats)
+	{
+		colorBlending.attachmentCount = 2;
+		colorBlending.pAttachments = weightedBlendedAttachments;
+	}
+
 	// clear VertexInputStateCreateInfo as not being used
 	VkPipelineVertexInputStateCreateInfo vertexInputInfo = { .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO };
 
 	VkGraphicsPipelineCreateInfo pipelineInfo = { .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO };
 	pipelineInfo.pNext = &renderInfo;
 
-	pipelineInfo.stageCount = (uint32_t)shaderStages.size();
-	pipelineInfo.pStages = shaderStages.data();
+	// the constants are tightly packed, one entry per constant_id
+	std::vector<VkSpecializationMapEntry> specializationEntries(specializationData.size());
+	for (uint32_t i = 0; i < specializationEntries.size(); i++)
+	{
+		specializationEntries[i].constantID = i;
+		specializationEntries[i].offset = i * sizeof(uint32_t);
+		specializationEntries[i].size = sizeof(uint32_t);
+	}
+
+	VkSpecializationInfo specializationInfo = {};
+	specializationInfo.mapEntryCount = (uint32_t)specializationEntries.size();
+	specializationInfo.pMapEntries = specializationEntries.data();
+	specializationInfo.dataSize = specializationData.size() * sizeof(uint32_t);
+	specializationInfo.pData = specializationData.data();
+
+	std::vector<VkPipelineShaderStageCreateInfo> stages = shaderStages;
+	for (VkPipelineShaderStageCreateInfo& stage : stages)
+	{
+		if (!specializationData.empty() && (stage.stage & specializationStages))
+		{
+			stage.pSpecializationInfo = &specializationInfo;
+		}
+	}
+
+	pipelineInfo.stageCount = (uint32_t)stages.size();
+	pipelineInfo.pStages = stages.data();
 	pipelineInfo.pVertexInputState = &vertexInputInfo;
 	pipelineInfo.pInputAssemblyState = &inputAssembly;
 	pipelineInfo.pViewportState = &viewportState;
@@ -100,7 +226,7 @@ VkPipeline PipelineBuilder::BuildPipeline(VkDevice device)
 	pipelineInfo.pDynamicState = &dynamicInfo;
 
 	VkPipeline newPipeline;
-	if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &newPipeline) != VK_SUCCESS)
+	if (vkCreateGraphicsPipelines(device, cache, 1, &pipelineInfo, nullptr, &newPipeline) != VK_SUCCESS)
 	{
 		fmt::println("failed to create pipeline");
 		return VK_NULL_HANDLE;
@@ -120,6 +246,13 @@ void PipelineBuilder::SetShaders(VkShaderModule vertexShader, VkShaderModule fra
 	shaderStages.push_back(vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_FRAGMENT_BIT, fragmentShader));
 }
 
+void PipelineBuilder::SetVertexShader(VkShaderModule vertexShader)
+{
+	shaderStages.clear();
+
+	shaderStages.push_back(vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_VERTEX_BIT, vertexShader));
+}
+
 void PipelineBuilder::SetShaders(VkShaderModule vertexShader, VkShaderModule geometryShader, VkShaderModule fragmentShader)
 {
 	shaderStages.clear();
@@ -236,6 +369,43 @@ void PipelineBuilder::EnableBlendingAdditive() // adds colours
 	colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
 }
 
+void PipelineBuilder::SetSpecializationConstants(VkShaderStageFlags stages, std::span<const uint32_t> values)
+{
+	specializationStages = stages;
+	specializationData.assign(values.begin(), values.end());
+}
+
+void PipelineBuilder::SetWeightedBlendedAttachments(VkFormat accumulationFormat, VkFormat revealageFormat)
+{
+	weightedBlendedFormats[0] = accumulationFormat;
+	weightedBlendedFormats[1] = revealageFormat;
+
+	renderInfo.colorAttachmentCount = 2;
+	renderInfo.pColorAttachmentFormats = weightedBlendedFormats;
+
+	// sums the weighted premultiplied colors and weights
+	VkPipelineColorBlendAttachmentState& accumulation = weightedBlendedAttachments[0];
+	accumulation.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+	accumulation.blendEnable = VK_TRUE;
+	accumulation.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
+	accumulation.dstColorBlendFactor = VK_BLEND_FACTOR_ONE;
+	accumulation.colorBlendOp = VK_BLEND_OP_ADD;
+	accumulation.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+	accumulation.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+	accumulation.alphaBlendOp = VK_BLEND_OP_ADD;
+
+	// multiplies in (1 - alpha), the shader writes alpha to red
+	VkPipelineColorBlendAttachmentState& revealage = weightedBlendedAttachments[1];
+	revealage.colorWriteMask = VK_COLOR_COMPONENT_R_BIT;
+	revealage.blendEnable = VK_TRUE;
+	revealage.srcColorBlendFactor = VK_BLEND_FACTOR_ZERO;
+	revealage.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_COLOR;
+	revealage.colorBlendOp = VK_BLEND_OP_ADD;
+	revealage.srcAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+	revealage.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+	revealage.alphaBlendOp = VK_BLEND_OP_ADD;
+}
+
 void PipelineBuilder::EnableBlendingAlphaBlend() // mixes colours
 {
 	colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
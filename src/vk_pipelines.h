@@ -4,10 +4,41 @@
 #include "vk_initializers.h"
 
 #include <fstream>
+#include <future>
+#include <mutex>
+#include <unordered_map>
 
 namespace vkutil {
 
-	bool LoadShaderModule(const char* filePath, VkDevice device, VkShaderModule* outShaderModule);
+	// outSpecConstantIds gets bit n set for every constant_id n below 64 the module declares
+	bool LoadShaderModule(const char* filePath, VkDevice device, VkShaderModule* outShaderModule, uint64_t* outSpecConstantIds = nullptr);
+};
+
+// shader modules by path, shared by the pipelines built in parallel. a file asked for again, or while another thread
+// is still loading it, is only read and created once, so variants reusing a module get it for free
+class ShaderModuleCache
+{
+public:
+	// aborts when the file is missing or not valid spir-v, a pipeline is never built from a null module. bit n of
+	// requiredSpecConstants asks for constant_id n, a binary compiled before the constants were added fails here
+	// rather than ignoring the values it is specialized with
+	VkShaderModule Get(VkDevice device, const std::string& path, uint64_t requiredSpecConstants = 0);
+
+	// pipelines keep working without their modules, so this can run any time no pipeline is being built
+	void Clear(VkDevice device);
+
+	uint32_t loads{ 0 };
+	uint32_t hits{ 0 };
+
+private:
+	std::mutex mutex;
+	struct LoadedModule
+	{
+		VkShaderModule module;
+		uint64_t specConstantIds;
+	};
+
+	std::unordered_map<std::string, std::shared_future<LoadedModule>> modules;
 };
 
 class PipelineBuilder
@@ -23,14 +54,19 @@ public:
     VkPipelineDepthStencilStateCreateInfo depthStencil;
     VkPipelineRenderingCreateInfo renderInfo;
     VkFormat colorAttachmentformat;
+    VkPipelineColorBlendAttachmentState weightedBlendedAttachments[2];
+    VkFormat weightedBlendedFormats[2];
+    std::vector<uint32_t> specializationData; // constant_id i takes specializationData[i]
+    VkShaderStageFlags specializationStages;
 
     PipelineBuilder() { Clear(); }
 
     void Clear();
 
-    VkPipeline BuildPipeline(VkDevice device);
+    VkPipeline BuildPipeline(VkDevice device, VkPipelineCache cache);
     void SetShaders(VkShaderModule vertexShader, VkShaderModule fragmentShader);
     void SetShaders(VkShaderModule vertexShader, VkShaderModule geometryShader, VkShaderModule fragmentShader);
+    void SetVertexShader(VkShaderModule vertexShader); // depth only pipelines
     void SetInputTopology(VkPrimitiveTopology topology);
     void SetPolygonMode(VkPolygonMode mode);
     void SetCullMode(VkCullModeFlags cullMode, VkFrontFace frontFace);
@@ -44,5 +80,9 @@ public:
     void EnableDepthtest(bool depthWriteEnable, VkCompareOp op);
     void EnableBlendingAdditive();
     void EnableBlendingAlphaBlend();
+    // accumulation and revealage targets of the weighted blended transparency pass, replaces the single color attachment
+    void SetWeightedBlendedAttachments(VkFormat accumulationFormat, VkFormat revealageFormat);
+    // 32 bit specialization constants for the given stages, bools are passed as VK_TRUE or VK_FALSE
+    void SetSpecializationConstants(VkShaderStageFlags stages, std::span<const uint32_t> values);
 
 };
\ No newline at end of file
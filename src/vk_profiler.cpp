@@ -0,0 +1,214 @@
+#include "vk_profiler.h"
+#include "vk_engine.h"
+
+#include <algorithm>
+#include <cfloat>
+
+void GpuProfiler::Init(VulkanEngine* engine, uint32_t frameCount)
+{
+	this->engine = engine;
+
+	uint32_t familyCount = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(engine->physicalDevice, &familyCount, nullptr);
+	std::vector<VkQueueFamilyProperties> families(familyCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(engine->physicalDevice, &familyCount, families.data());
+
+	timestampValidBits = families[engine->graphicsQueueFamily].timestampValidBits;
+	timestampPeriod = engine->physicalDeviceProperties.limits.timestampPeriod;
+
+	frames.resize(frameCount);
+
+	if (!Supported())
+	{
+		fmt::println("The graphics queue has no timestamp support, gpu timings are disabled");
+		return;
+	}
+
+	VkQueryPoolCreateInfo poolInfo = { .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
+	poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+	poolInfo.queryCount = GPU_PROFILER_MAX_SCOPES * 2;
+
+	for (Frame& frame : frames)
+	{
+		VK_CHECK(vkCreateQueryPool(engine->device, &poolInfo, nullptr, &frame.pool));
+	}
+}
+
+void GpuProfiler::Destroy()
+{
+	StopCsv();
+
+	for (Frame& frame : frames)
+	{
+		if (frame.pool != VK_NULL_HANDLE)
+		{
+			vkDestroyQueryPool(engine->device, frame.pool, nullptr);
+		}
+	}
+	frames.clear();
+}
+
+void GpuProfiler::BeginFrame(VkCommandBuffer cmd, uint32_t frame, uint64_t frameNumber)
+{
+	if (!Supported())
+	{
+		return;
+	}
+
+	currentFrame = &frames[frame];
+
+	if (currentFrame->pending)
+	{
+		ReadBack(*currentFrame);
+	}
+
+	currentFrame->recorded.clear();
+	currentFrame->queryCount = 0;
+	currentFrame->frameNumber = frameNumber;
+
+	vkCmdResetQueryPool(cmd, currentFrame->pool, 0, GPU_PROFILER_MAX_SCOPES * 2);
+
+	frameQuery = BeginScope(cmd, "Frame");
+}
+
+void GpuProfiler::EndFrame(VkCommandBuffer cmd)
+{
+	if (!Supported())
+	{
+		return;
+	}
+
+	EndScope(cmd, frameQuery);
+	currentFrame->pending = true;
+}
+
+uint32_t GpuProfiler::BeginScope(VkCommandBuffer cmd, const char* name)
+{
+	if (!Supported() || currentFrame->queryCount + 2 > GPU_PROFILER_MAX_SCOPES * 2)
+	{
+		return UINT32_MAX;
+	}
+
+	uint32_t query = currentFrame->queryCount;
+	currentFrame->queryCount += 2;
+	currentFrame->recorded.push_back(RecordedScope{ FindScope(name), query });
+
+	// waits for the earlier commands, so a scope holds the work recorded inside it and not what overlaps it
+	vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, currentFrame->pool, query);
+	return query;
+}
+
+void GpuProfiler::EndScope(VkCommandBuffer cmd, uint32_t query)
+{
+	if (query == UINT32_MAX)
+	{
+		return;
+	}
+
+	vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, currentFrame->pool, query + 1);
+}
+
+uint32_t GpuProfiler::FindScope(const char* name)
+{
+	for (uint32_t i = 0; i < scopes.size(); i++)
+	{
+		if (scopes[i].name == name)
+		{
+			return i;
+		}
+	}
+
+	scopes.push_back(GpuScopeStats{ name, 0.0f, 0.0f, 0.0f, 0.0f });
+	history.emplace_back();
+	return (uint32_t)scopes.size() - 1;
+}
+
+void GpuProfiler::ReadBack(Frame& frame)
+{
+	frame.pending = false;
+	if (frame.queryCount == 0)
+	{
+		return;
+	}
+
+	// value and availability per query. the fence was waited on, so this does not block
+	std::vector<uint64_t> results(frame.queryCount * 2);
+	VkResult result = vkGetQueryPoolResults(engine->device, frame.pool, 0, frame.queryCount, results.size() * sizeof(uint64_t), results.data(),
+		2 * sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+	if (result != VK_SUCCESS && result != VK_NOT_READY)
+	{
+		return;
+	}
+
+	uint64_t mask = timestampValidBits >= 64 ? ~0ull : (1ull << timestampValidBits) - 1;
+
+	// a scope used several times in a frame adds up
+	std::vector<float> frameTimes(scopes.size(), -1.0f);
+	for (const RecordedScope& recorded : frame.recorded)
+	{
+		uint32_t begin = recorded.query;
+		if (results[begin * 2 + 1] == 0 || results[(begin + 1) * 2 + 1] == 0)
+		{
+			continue;
+		}
+
+		uint64_t ticks = (results[(begin + 1) * 2] - results[begin * 2]) & mask;
+		float milliseconds = (float)((double)ticks * timestampPeriod / 1000000.0);
+		frameTimes[recorded.scope] = std::max(frameTimes[recorded.scope], 0.0f) + milliseconds;
+	}
+
+	for (uint32_t i = 0; i < scopes.size(); i++)
+	{
+		if (frameTimes[i] < 0.0f)
+		{
+			continue;
+		}
+
+		ScopeHistory& scopeHistory = history[i];
+		scopeHistory.samples[scopeHistory.head] = frameTimes[i];
+		scopeHistory.head = (scopeHistory.head + 1) % GPU_PROFILER_HISTORY;
+		scopeHistory.count = std::min(scopeHistory.count + 1, GPU_PROFILER_HISTORY);
+
+		GpuScopeStats& stats = scopes[i];
+		stats.last = frameTimes[i];
+		stats.min = FLT_MAX;
+		stats.max = 0.0f;
+		float sum = 0.0f;
+		for (uint32_t sample = 0; sample < scopeHistory.count; sample++)
+		{
+			float value = scopeHistory.samples[sample];
+			sum += value;
+			stats.min = std::min(stats.min, value);
+			stats.max = std::max(stats.max, value);
+		}
+		stats.average = sum / scopeHistory.count;
+
+		if (csvFile.is_open())
+		{
+			csvFile << frame.frameNumber << ',' << stats.name << ',' << frameTimes[i] << '\n';
+		}
+	}
+}
+
+bool GpuProfiler::StartCsv(const std::string& path)
+{
+	StopCsv();
+
+	csvFile.open(path, std::ios::trunc);
+	if (!csvFile.is_open())
+	{
+		fmt::println("Failed to open {} for the gpu timings", path);
+		return false;
+	}
+
+	csvFile << "frame,pass,milliseconds\n";
+	return true;
+}
+
+void GpuProfiler::StopCsv()
+{
+	if (csvFile.is_open())
+	{
+		csvFile.close();
+	}
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "vk_types.h"
+
+#include <fstream>
+
+class VulkanEngine;
+
+constexpr uint32_t GPU_PROFILER_MAX_SCOPES = 32; // per frame, scopes past this are not timed
+constexpr uint32_t GPU_PROFILER_HISTORY = 120; // frames the averages and extremes are taken over
+
+struct GpuScopeStats
+{
+	std::string name;
+	float last; // ms, from the newest frame read back
+	float average;
+	float min;
+	float max;
+};
+
+// gpu time of the passes of a frame, from timestamps written into a query pool per frame in flight. a pool is only read
+// after its frame's fence was waited on, FRAME_OVERLAP frames after it was recorded, so reading never stalls. devices
+// whose graphics queue has no timestamp bits get no timings and every call does nothing
+class GpuProfiler
+{
+public:
+	void Init(VulkanEngine* engine, uint32_t frameCount);
+	void Destroy();
+
+	// right after the command buffer begins, once the frame's fence has signalled. reads back what the pool timed the
+	// last time this frame slot was used, then resets it and writes the frame's start timestamp
+	void BeginFrame(VkCommandBuffer cmd, uint32_t frame, uint64_t frameNumber);
+	// before the command buffer ends, closes the "Frame" scope covering everything recorded in between
+	void EndFrame(VkCommandBuffer cmd);
+
+	// scopes are identified by name, they can nest and may be inside or outside a rendering pass
+	uint32_t BeginScope(VkCommandBuffer cmd, const char* name);
+	void EndScope(VkCommandBuffer cmd, uint32_t query);
+
+	// one row per scope per frame read back, frame,pass,milliseconds
+	bool StartCsv(const std::string& path);
+	void StopCsv();
+	bool IsLoggingCsv() const { return csvFile.is_open(); }
+
+	bool Supported() const { return timestampValidBits != 0; }
+
+	// in order of first use, the frame total first
+	std::vector<GpuScopeStats> scopes;
+
+private:
+	struct RecordedScope
+	{
+		uint32_t scope;
+		uint32_t query; // begin, the end is the next query
+	};
+
+	struct Frame
+	{
+		VkQueryPool pool{ VK_NULL_HANDLE };
+		std::vector<RecordedScope> recorded;
+		uint32_t queryCount{ 0 };
+		uint64_t frameNumber{ 0 };
+		bool pending{ false }; // recorded and not read back yet
+	};
+
+	// ring buffer of ms, a scope missing from a frame adds nothing
+	struct ScopeHistory
+	{
+		std::array<float, GPU_PROFILER_HISTORY> samples;
+		uint32_t head{ 0 };
+		uint32_t count{ 0 };
+	};
+
+	uint32_t FindScope(const char* name);
+	void ReadBack(Frame& frame);
+
+	VulkanEngine* engine{ nullptr };
+	uint32_t timestampValidBits{ 0 };
+	float timestampPeriod{ 0.0f }; // ns per tick
+
+	std::vector<Frame> frames;
+	Frame* currentFrame{ nullptr };
+	uint32_t frameQuery{ 0 };
+
+	std::vector<ScopeHistory> history; // indexed like scopes
+
+	std::ofstream csvFile;
+};
+
+// times the commands recorded during its lifetime
+struct GpuProfileScope
+{
+	GpuProfileScope(GpuProfiler& profiler, VkCommandBuffer cmd, const char* name) : profiler(profiler), cmd(cmd), query(profiler.BeginScope(cmd, name)) {}
+	~GpuProfileScope() { profiler.EndScope(cmd, query); }
+
+	GpuProfiler& profiler;
+	VkCommandBuffer cmd;
+	uint32_t query;
+};
@@ -0,0 +1,278 @@
+#include "vk_scene.h"
+#include "vk_engine.h"
+
+#include <glm/glm.hpp>
+
+RenderObject MakeRenderObject(const MeshAsset& mesh, const GeoSurface& surface, const glm::mat4& transform)
+{
+	RenderObject def;
+	def.indexCount = surface.count;
+	def.firstIndex = surface.startIndex;
+	def.vertexOffset = surface.vertexOffset;
+	def.material = &surface.material->data;
+	def.bounds = surface.bounds;
+	def.transform = transform;
+	def.vertexBufferAddress = mesh.meshBuffers.vertexBufferAddress;
+	def.castsShadow = true;
+	def.dynamicShadow = false;
+	def.sortKey = BuildSortKey(def.material->passType, def.material->pipeline->sortId, def.material->sortId, mesh.meshBuffers.sortId);
+
+	return def;
+}
+
+void RenderProxyRegistry::Init(DrawContext* context)
+{
+	this->context = context;
+}
+
+void RenderProxyRegistry::Clear()
+{
+	scenes.clear();
+	dirtyNodes.clear();
+	locations.clear();
+	freeProxies.clear();
+	opaqueOwners.clear();
+	transparentOwners.clear();
+	ClearDirtySlots();
+	opaqueVersion++;
+	transparentVersion++;
+
+	context->OpaqueSurfaces.clear();
+	context->TransparentSurfaces.clear();
+}
+
+void RenderProxyRegistry::ClearDirtySlots()
+{
+	dirtyOpaqueSlots.clear();
+	dirtyTransparentSlots.clear();
+}
+
+SceneHandle RenderProxyRegistry::AddScene(std::shared_ptr<LoadedGLTF> scene, const glm::mat4& rootMatrix, bool castsShadows, bool dynamicShadows)
+{
+	SceneHandle handle = (SceneHandle)scenes.size();
+
+	RegisteredScene& registered = scenes.emplace_back(RegisteredScene{}).value();
+	registered.scene = scene;
+	registered.rootMatrix = rootMatrix;
+	registered.castsShadows = castsShadows;
+	registered.dynamicShadows = dynamicShadows;
+
+	// the tree is walked once here, from then on the nodes are addressed directly
+	for (auto& node : scene->topNodes)
+	{
+		CollectMeshNodes(*node, registered);
+	}
+
+	for (uint32_t i = 0; i < registered.nodes.size(); i++)
+	{
+		dirtyNodes.push_back({ handle, i });
+	}
+
+	return handle;
+}
+
+void RenderProxyRegistry::RemoveScene(SceneHandle handle)
+{
+	if (handle >= scenes.size() || !scenes[handle].has_value())
+	{
+		return;
+	}
+
+	for (RegisteredNode& node : scenes[handle]->nodes)
+	{
+		for (uint32_t proxy : node.proxies)
+		{
+			RemoveProxy(proxy);
+		}
+	}
+
+	std::erase_if(dirtyNodes, [&](const auto& dirty) { return dirty.first == handle; });
+	scenes[handle].reset();
+}
+
+void RenderProxyRegistry::SetSceneTransform(SceneHandle handle, const glm::mat4& rootMatrix)
+{
+	RegisteredScene& scene = scenes[handle].value();
+	if (scene.rootMatrix == rootMatrix)
+	{
+		return;
+	}
+
+	scene.rootMatrix = rootMatrix;
+
+	for (uint32_t i = 0; i < scene.nodes.size(); i++)
+	{
+		if (!scene.nodes[i].dirty)
+		{
+			scene.nodes[i].dirty = true;
+			dirtyNodes.push_back({ handle, i });
+		}
+	}
+}
+
+void RenderProxyRegistry::MarkDirty(SceneHandle handle, MeshNode* node)
+{
+	RegisteredScene& scene = scenes[handle].value();
+
+	auto it = scene.nodeLookup.find(node);
+	if (it == scene.nodeLookup.end() || scene.nodes[it->second].dirty)
+	{
+		return;
+	}
+
+	scene.nodes[it->second].dirty = true;
+	dirtyNodes.push_back({ handle, it->second });
+}
+
+uint32_t RenderProxyRegistry::Update(JobSystem* jobSystem)
+{
+	uint32_t written = 0;
+
+	// only scenes whose hierarchy actually changed are scanned for moved mesh nodes
+	for (SceneHandle handle = 0; handle < scenes.size(); handle++)
+	{
+		if (!scenes[handle].has_value() || scenes[handle]->scene->transforms.Update(jobSystem) == 0)
+		{
+			continue;
+		}
+
+		for (RegisteredNode& node : scenes[handle]->nodes)
+		{
+			if (node.node->transforms->WasUpdated(node.node->transformIndex))
+			{
+				MarkDirty(handle, node.node);
+			}
+		}
+	}
+
+	for (auto& [handle, nodeIndex] : dirtyNodes)
+	{
+		RegisteredScene& scene = scenes[handle].value();
+		written += WriteNode(scene, scene.nodes[nodeIndex]);
+	}
+	dirtyNodes.clear();
+
+	return written;
+}
+
+void RenderProxyRegistry::CollectMeshNodes(Node& node, RegisteredScene& scene)
+{
+	if (MeshNode* meshNode = dynamic_cast<MeshNode*>(&node))
+	{
+		scene.nodeLookup[meshNode] = (uint32_t)scene.nodes.size();
+		scene.nodes.push_back(RegisteredNode{ meshNode, {}, true });
+	}
+
+	for (auto& child : node.children)
+	{
+		CollectMeshNodes(*child, scene);
+	}
+}
+
+uint32_t RenderProxyRegistry::WriteNode(RegisteredScene& scene, RegisteredNode& node)
+{
+	const MeshAsset& mesh = *node.node->mesh;
+	glm::mat4 nodeMatrix = scene.rootMatrix * node.node->GetWorldTransform();
+
+	// surfaces removed from the mesh since the last write
+	while (node.proxies.size() > mesh.surfaces.size())
+	{
+		RemoveProxy(node.proxies.back());
+		node.proxies.pop_back();
+	}
+
+	for (uint32_t i = 0; i < mesh.surfaces.size(); i++)
+	{
+		RenderObject object = MakeRenderObject(mesh, mesh.surfaces[i], nodeMatrix);
+		object.castsShadow = scene.castsShadows;
+		object.dynamicShadow = scene.dynamicShadows;
+
+		bool transparent = object.material->passType == MaterialPass::Transparent;
+
+		if (i >= node.proxies.size())
+		{
+			node.proxies.push_back(AddProxy(object));
+			continue;
+		}
+
+		ProxyLocation location = locations[node.proxies[i]];
+		if (location.transparent == transparent)
+		{
+			std::vector<RenderObject>& surfaces = transparent ? context->TransparentSurfaces : context->OpaqueSurfaces;
+			surfaces[location.index] = object;
+			MarkSlotDirty(transparent, location.index);
+		}
+		else
+		{
+			// the material moved the surface to the other pass
+			RemoveProxy(node.proxies[i]);
+			node.proxies[i] = AddProxy(object);
+		}
+	}
+
+	node.dirty = false;
+
+	return (uint32_t)mesh.surfaces.size();
+}
+
+uint32_t RenderProxyRegistry::AddProxy(const RenderObject& object)
+{
+	bool transparent = object.material->passType == MaterialPass::Transparent;
+	std::vector<RenderObject>& surfaces = transparent ? context->TransparentSurfaces : context->OpaqueSurfaces;
+	std::vector<uint32_t>& owners = transparent ? transparentOwners : opaqueOwners;
+
+	uint32_t proxy;
+	if (!freeProxies.empty())
+	{
+		proxy = freeProxies.back();
+		freeProxies.pop_back();
+	}
+	else
+	{
+		proxy = (uint32_t)locations.size();
+		locations.emplace_back();
+	}
+
+	locations[proxy] = ProxyLocation{ transparent, (uint32_t)surfaces.size() };
+	MarkSlotDirty(transparent, (uint32_t)surfaces.size());
+	surfaces.push_back(object);
+	owners.push_back(proxy);
+
+	return proxy;
+}
+
+void RenderProxyRegistry::RemoveProxy(uint32_t proxy)
+{
+	ProxyLocation location = locations[proxy];
+	std::vector<RenderObject>& surfaces = location.transparent ? context->TransparentSurfaces : context->OpaqueSurfaces;
+	std::vector<uint32_t>& owners = location.transparent ? transparentOwners : opaqueOwners;
+
+	// swap the last proxy into the hole so the array stays dense
+	uint32_t last = (uint32_t)surfaces.size() - 1;
+	if (location.index != last)
+	{
+		surfaces[location.index] = surfaces[last];
+		owners[location.index] = owners[last];
+		locations[owners[location.index]].index = location.index;
+		MarkSlotDirty(location.transparent, location.index);
+	}
+	else
+	{
+		// nothing moved, but the pass lost a surface
+		uint64_t& version = location.transparent ? transparentVersion : opaqueVersion;
+		version++;
+	}
+
+	surfaces.pop_back();
+	owners.pop_back();
+	freeProxies.push_back(proxy);
+}
+
+void RenderProxyRegistry::MarkSlotDirty(bool transparent, uint32_t slot)
+{
+	std::vector<uint32_t>& dirtySlots = transparent ? dirtyTransparentSlots : dirtyOpaqueSlots;
+	uint64_t& version = transparent ? transparentVersion : opaqueVersion;
+
+	dirtySlots.push_back(slot);
+	version++;
+}
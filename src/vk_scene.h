@@ -0,0 +1,96 @@
+#pragma once
+
+#include "vk_types.h"
+
+#include <unordered_map>
+
+struct LoadedGLTF;
+struct MeshNode;
+struct MeshAsset;
+struct GeoSurface;
+struct RenderObject;
+struct DrawContext;
+class JobSystem;
+
+typedef uint32_t SceneHandle;
+
+// builds the draw data of one surface, shared by the proxy registry and MeshNode::Draw
+RenderObject MakeRenderObject(const MeshAsset& mesh, const GeoSurface& surface, const glm::mat4& transform);
+
+// retained render proxies for loaded scenes. every mesh surface is registered once and kept densely packed in the
+// draw context the passes iterate, only nodes flagged dirty are written again
+class RenderProxyRegistry
+{
+public:
+	void Init(DrawContext* context);
+	void Clear();
+
+	// registers the mesh nodes of the scene, their proxies are emitted by the next Update
+	// dynamic shadow scenes are redrawn into the shadow map every frame instead of being cached with the static casters
+	SceneHandle AddScene(std::shared_ptr<LoadedGLTF> scene, const glm::mat4& rootMatrix, bool castsShadows = true, bool dynamicShadows = false);
+	void RemoveScene(SceneHandle handle);
+
+	// marks every mesh node of the scene dirty if the matrix changed
+	void SetSceneTransform(SceneHandle handle, const glm::mat4& rootMatrix);
+	// call after changing the materials of a node's surfaces, transform changes are picked up from the hierarchy
+	void MarkDirty(SceneHandle handle, MeshNode* node);
+
+	// updates each scene's transform hierarchy and re-emits dirty nodes, returns the number of proxies rewritten
+	uint32_t Update(JobSystem* jobSystem = nullptr);
+
+	uint32_t ProxyCount() const { return (uint32_t)locations.size() - (uint32_t)freeProxies.size(); }
+
+	// slots of the opaque or transparent array written since the last ClearDirtySlots, for copies of the surfaces kept
+	// on the gpu. removals report the slot the last surface was swapped into, slots past the end can be ignored
+	std::span<const uint32_t> DirtySlots(bool transparent) const { return transparent ? dirtyTransparentSlots : dirtyOpaqueSlots; }
+	void ClearDirtySlots();
+
+	// bumped whenever a surface of the pass is written, added or removed
+	uint64_t Version(bool transparent) const { return transparent ? transparentVersion : opaqueVersion; }
+
+private:
+	struct ProxyLocation
+	{
+		bool transparent;
+		uint32_t index; // slot in the opaque or transparent array of the draw context
+	};
+
+	struct RegisteredNode
+	{
+		MeshNode* node;
+		std::vector<uint32_t> proxies; // one per mesh surface
+		bool dirty;
+	};
+
+	struct RegisteredScene
+	{
+		std::shared_ptr<LoadedGLTF> scene;
+		glm::mat4 rootMatrix;
+		bool castsShadows;
+		bool dynamicShadows;
+		std::vector<RegisteredNode> nodes;
+		std::unordered_map<MeshNode*, uint32_t> nodeLookup;
+	};
+
+	void CollectMeshNodes(Node& node, RegisteredScene& scene);
+	uint32_t WriteNode(RegisteredScene& scene, RegisteredNode& node);
+
+	uint32_t AddProxy(const RenderObject& object);
+	void RemoveProxy(uint32_t proxy);
+	void MarkSlotDirty(bool transparent, uint32_t slot);
+
+	DrawContext* context{ nullptr };
+
+	std::vector<ProxyLocation> locations; // indexed by proxy id
+	std::vector<uint32_t> freeProxies;
+	std::vector<uint32_t> opaqueOwners; // proxy id of each dense slot, used to patch locations on swap removal
+	std::vector<uint32_t> transparentOwners;
+
+	std::vector<uint32_t> dirtyOpaqueSlots;
+	std::vector<uint32_t> dirtyTransparentSlots;
+	uint64_t opaqueVersion{ 0 };
+	uint64_t transparentVersion{ 0 };
+
+	std::vector<std::optional<RegisteredScene>> scenes;
+	std::vector<std::pair<SceneHandle, uint32_t>> dirtyNodes;
+};
@@ -0,0 +1,577 @@
+#include "vk_shadows.h"
+#include "vk_engine.h"
+#include "vk_initializers.h"
+#include "vk_descriptors.h"
+#include "vk_images.h"
+
+#include <algorithm>
+#include <glm/gtc/matrix_transform.hpp>
+
+static_assert(sizeof(GPUPointLight) == 48, "GPUPointLight must match the std140 PointLight layout");
+
+// fnv-1a over the fields that decide what a caster writes into the depth map
+static uint64_t HashCaster(const RenderObject& object)
+{
+	uint64_t hash = 14695981039346656037ull;
+	auto mix = [&](const void* data, size_t size)
+	{
+		const uint8_t* bytes = (const uint8_t*)data;
+		for (size_t i = 0; i < size; i++)
+		{
+			hash = (hash ^ bytes[i]) * 1099511628211ull;
+		}
+	};
+
+	mix(&object.transform, sizeof(glm::mat4));
+	mix(&object.firstIndex, sizeof(uint32_t));
+	mix(&object.indexCount, sizeof(uint32_t));
+	mix(&object.vertexOffset, sizeof(int32_t));
+
+	return hash;
+}
+
+// fraction of the screen height the light's radius covers, above these a light asks for tier 0, 1, 2, below the last for tier 3
+static const float tierCoverage[SHADOW_TIER_COUNT - 1] = { 0.5f, 0.2f, 0.05f };
+
+static uint32_t TierForCoverage(float coverage)
+{
+	for (uint32_t tier = 0; tier < SHADOW_TIER_COUNT - 1; tier++)
+	{
+		if (coverage >= tierCoverage[tier])
+		{
+			return tier;
+		}
+	}
+
+	return SHADOW_TIER_COUNT - 1;
+}
+
+// a light only changes tier once its coverage is clearly past the threshold, otherwise lights near one keep re-rendering
+static uint32_t ChooseTier(float coverage, int32_t currentTier)
+{
+	uint32_t tier = TierForCoverage(coverage);
+	if (currentTier < 0 || tier == (uint32_t)currentTier)
+	{
+		return tier;
+	}
+
+	if (tier > (uint32_t)currentTier && TierForCoverage(coverage * 1.25f) <= (uint32_t)currentTier)
+	{
+		return currentTier;
+	}
+
+	if (tier < (uint32_t)currentTier && TierForCoverage(coverage * 0.8f) >= (uint32_t)currentTier)
+	{
+		return currentTier;
+	}
+
+	return tier;
+}
+
+// the static cache and the sampled cube, 16 bit depth
+static size_t CubeBytes(uint32_t resolution)
+{
+	return (size_t)resolution * resolution * 6 * 2 * 2;
+}
+
+void BuildCubeFaceMatrices(const glm::vec3& position, float nearPlane, float radius, glm::mat4 outMatrices[6])
+{
+	glm::mat4 projection = glm::perspective(glm::radians(90.0f), 1.0f, nearPlane, radius);
+
+	outMatrices[0] = projection * glm::lookAt(position, position + glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f));
+	outMatrices[1] = projection * glm::lookAt(position, position + glm::vec3(-1.0f, 0.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f));
+	outMatrices[2] = projection * glm::lookAt(position, position + glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f));
+	outMatrices[3] = projection * glm::lookAt(position, position + glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, 0.0f, -1.0f));
+	outMatrices[4] = projection * glm::lookAt(position, position + glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, -1.0f, 0.0f));
+	outMatrices[5] = projection * glm::lookAt(position, position + glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, -1.0f, 0.0f));
+}
+
+void ShadowAtlas::Init(VulkanEngine* engine, const ShadowAtlasSettings& settings)
+{
+	this->engine = engine;
+
+	uint32_t cubeCounts[SHADOW_TIER_COUNT];
+	size_t memoryUsed = 0;
+	for (uint32_t tier = 0; tier < SHADOW_TIER_COUNT; tier++)
+	{
+		cubeCounts[tier] = settings.tierCubes[tier];
+		memoryUsed += CubeBytes(settings.tierResolutions[tier]) * cubeCounts[tier];
+	}
+
+	// over the cap the sharpest tiers give up cubes first, their lights fall back to the cheaper tiers
+	for (uint32_t tier = 0; tier < SHADOW_TIER_COUNT && memoryUsed > settings.memoryCap; tier++)
+	{
+		while (cubeCounts[tier] > 0 && memoryUsed > settings.memoryCap)
+		{
+			cubeCounts[tier]--;
+			memoryUsed -= CubeBytes(settings.tierResolutions[tier]);
+		}
+	}
+
+	if (memoryUsed == 0)
+	{
+		fmt::println("Shadow atlas memory cap of {} bytes does not fit a single cube", settings.memoryCap);
+		abort();
+	}
+
+	VmaAllocationCreateInfo allocInfo = {};
+	allocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+	allocInfo.requiredFlags = VkMemoryPropertyFlags(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+	auto createImage = [&](AllocatedImage& image, uint32_t resolution, uint32_t cubeCount, VkImageUsageFlags usage)
+	{
+		image.imageFormat = SHADOW_ATLAS_FORMAT;
+		image.imageExtent = { resolution, resolution, 1 };
+
+		VkImageCreateInfo imageInfo = vkinit::cubemap_create_info(image.imageFormat, usage, image.imageExtent, VK_SAMPLE_COUNT_1_BIT);
+		imageInfo.arrayLayers = 6 * cubeCount;
+		VK_CHECK(vmaCreateImage(engine->allocator, &imageInfo, &allocInfo, &image.image, &image.allocation, nullptr));
+
+		image.imageView = VK_NULL_HANDLE;
+	};
+
+	auto createView = [&](VkImage image, VkImageViewType type, uint32_t baseLayer, uint32_t layerCount)
+	{
+		VkImageViewCreateInfo viewInfo = vkinit::cubemap_imageview_create_info(SHADOW_ATLAS_FORMAT, image, VK_IMAGE_ASPECT_DEPTH_BIT);
+		viewInfo.viewType = type;
+		viewInfo.subresourceRange.baseArrayLayer = baseLayer;
+		viewInfo.subresourceRange.layerCount = layerCount;
+
+		VkImageView view;
+		VK_CHECK(vkCreateImageView(engine->device, &viewInfo, nullptr, &view));
+		return view;
+	};
+
+	for (uint32_t tierIndex = 0; tierIndex < SHADOW_TIER_COUNT; tierIndex++)
+	{
+		Tier& tier = tiers[tierIndex];
+		tier.resolution = settings.tierResolutions[tierIndex];
+		tier.cubeCount = cubeCounts[tierIndex];
+		tier.shadowArrayView = VK_NULL_HANDLE;
+
+		faces[tierIndex].assign(tier.cubeCount * 6, FaceState{});
+		cubeOwners[tierIndex].assign(tier.cubeCount, -1);
+
+		if (tier.cubeCount == 0)
+		{
+			continue;
+		}
+
+		createImage(tier.staticImage, tier.resolution, tier.cubeCount, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
+		createImage(tier.shadowImage, tier.resolution, tier.cubeCount, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT);
+
+		tier.shadowArrayView = createView(tier.shadowImage.image, VK_IMAGE_VIEW_TYPE_CUBE_ARRAY, 0, 6 * tier.cubeCount);
+
+		for (uint32_t cube = 0; cube < tier.cubeCount; cube++)
+		{
+			tier.staticCubeViews.push_back(createView(tier.staticImage.image, VK_IMAGE_VIEW_TYPE_2D_ARRAY, cube * 6, 6));
+			tier.shadowCubeViews.push_back(createView(tier.shadowImage.image, VK_IMAGE_VIEW_TYPE_2D_ARRAY, cube * 6, 6));
+		}
+	}
+
+	stats = {};
+	stats.memoryUsed = memoryUsed;
+	stats.memoryCap = settings.memoryCap;
+	for (uint32_t tier = 0; tier < SHADOW_TIER_COUNT; tier++)
+	{
+		stats.tierCubes[tier] = cubeCounts[tier];
+	}
+
+	layoutsInitialized = false;
+}
+
+void ShadowAtlas::Destroy()
+{
+	for (Tier& tier : tiers)
+	{
+		if (tier.cubeCount == 0)
+		{
+			continue;
+		}
+
+		for (VkImageView view : tier.staticCubeViews)
+		{
+			vkDestroyImageView(engine->device, view, nullptr);
+		}
+		for (VkImageView view : tier.shadowCubeViews)
+		{
+			vkDestroyImageView(engine->device, view, nullptr);
+		}
+		vkDestroyImageView(engine->device, tier.shadowArrayView, nullptr);
+
+		vmaDestroyImage(engine->allocator, tier.staticImage.image, tier.staticImage.allocation);
+		vmaDestroyImage(engine->allocator, tier.shadowImage.image, tier.shadowImage.allocation);
+
+		tier.staticCubeViews.clear();
+		tier.shadowCubeViews.clear();
+	}
+
+	assignments.clear();
+}
+
+void ShadowAtlas::AssignLights(std::span<const PointLight> lights, const glm::vec3& viewPosition, float projectionScale)
+{
+	// cubes of lights that were removed
+	for (uint32_t tier = 0; tier < SHADOW_TIER_COUNT; tier++)
+	{
+		for (int32_t& owner : cubeOwners[tier])
+		{
+			if (owner >= (int32_t)lights.size())
+			{
+				owner = -1;
+			}
+		}
+	}
+	assignments.resize(lights.size());
+
+	struct Candidate
+	{
+		uint32_t light;
+		uint32_t wantedTier;
+		int32_t tier;
+	};
+
+	std::vector<Candidate> candidates;
+	for (uint32_t i = 0; i < lights.size(); i++)
+	{
+		const PointLight& light = lights[i];
+		Assignment& assignment = assignments[i];
+
+		if (!light.castsShadows || light.radius <= 0.0f)
+		{
+			assignment.importance = 0.0f;
+			if (assignment.tier >= 0)
+			{
+				cubeOwners[assignment.tier][assignment.cube] = -1;
+				assignment.tier = -1;
+			}
+			continue;
+		}
+
+		// the camera inside the radius sees the shadow all around it
+		float distance = glm::length(light.position - viewPosition);
+		float coverage = distance <= light.radius ? 1.0f : std::min(1.0f, light.radius * projectionScale / distance);
+		assignment.importance = coverage;
+
+		candidates.push_back({ i, ChooseTier(coverage, assignment.tier), -1 });
+	}
+
+	std::sort(candidates.begin(), candidates.end(), [&](const Candidate& a, const Candidate& b)
+	{
+		return assignments[a.light].importance > assignments[b.light].importance;
+	});
+
+	// tiers first, in order of importance. a full tier pushes the light down to the next one
+	uint32_t remaining[SHADOW_TIER_COUNT];
+	for (uint32_t tier = 0; tier < SHADOW_TIER_COUNT; tier++)
+	{
+		remaining[tier] = tiers[tier].cubeCount;
+	}
+
+	stats.shadowedLights = 0;
+	stats.demotedLights = 0;
+	stats.unshadowedLights = 0;
+
+	for (Candidate& candidate : candidates)
+	{
+		for (uint32_t tier = candidate.wantedTier; tier < SHADOW_TIER_COUNT; tier++)
+		{
+			if (remaining[tier] > 0)
+			{
+				remaining[tier]--;
+				candidate.tier = tier;
+				break;
+			}
+		}
+
+		if (candidate.tier < 0)
+		{
+			stats.unshadowedLights++;
+		}
+		else
+		{
+			stats.shadowedLights++;
+			if (candidate.tier != (int32_t)candidate.wantedTier)
+			{
+				stats.demotedLights++;
+			}
+		}
+	}
+
+	// then cubes. lights staying in their tier keep their cube and whatever is cached in it
+	for (const Candidate& candidate : candidates)
+	{
+		Assignment& assignment = assignments[candidate.light];
+		if (assignment.tier >= 0 && assignment.tier != candidate.tier)
+		{
+			cubeOwners[assignment.tier][assignment.cube] = -1;
+			assignment.tier = -1;
+		}
+	}
+
+	for (const Candidate& candidate : candidates)
+	{
+		Assignment& assignment = assignments[candidate.light];
+		if (candidate.tier < 0 || assignment.tier == candidate.tier)
+		{
+			continue;
+		}
+
+		std::vector<int32_t>& owners = cubeOwners[candidate.tier];
+		uint32_t cube = (uint32_t)(std::find(owners.begin(), owners.end(), -1) - owners.begin());
+
+		owners[cube] = (int32_t)candidate.light;
+		assignment.tier = candidate.tier;
+		assignment.cube = cube;
+
+		for (uint32_t face = 0; face < 6; face++)
+		{
+			Face(candidate.tier, cube, face) = FaceState{};
+		}
+	}
+
+	for (uint32_t tier = 0; tier < SHADOW_TIER_COUNT; tier++)
+	{
+		stats.tierCubesUsed[tier] = tiers[tier].cubeCount - remaining[tier];
+	}
+}
+
+void ShadowAtlas::PlanRefreshes(std::span<const PointLight> lights, const RenderObject* objects, uint32_t count, uint32_t faceBudget, std::vector<ShadowRefresh>& outRefreshes)
+{
+	outRefreshes.clear();
+
+	struct PendingFace
+	{
+		uint32_t light;
+		uint32_t face;
+		uint64_t staticHash;
+		bool staticDirty;
+		bool dynamic;
+		float priority;
+	};
+
+	std::vector<PendingFace> forced; // faces of new cubes, never rendered
+	std::vector<PendingFace> candidates;
+
+	stats.facesFull = 0;
+	stats.facesPartial = 0;
+	stats.facesSkipped = 0;
+	stats.facesDeferred = 0;
+
+	for (uint32_t lightIndex = 0; lightIndex < assignments.size(); lightIndex++)
+	{
+		const Assignment& assignment = assignments[lightIndex];
+		if (assignment.tier < 0)
+		{
+			continue;
+		}
+
+		const PointLight& light = lights[lightIndex];
+
+		// summed so the dense draw arrays reordering on removal does not look like a change
+		uint64_t hashes[6]{};
+		uint8_t dynamicFaces = 0;
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			const RenderObject& object = objects[i];
+			uint8_t faceMask = assignment.faceMasks[i];
+
+			if (!object.castsShadow || faceMask == 0)
+			{
+				continue;
+			}
+
+			if (object.dynamicShadow)
+			{
+				dynamicFaces |= faceMask;
+				continue;
+			}
+
+			uint64_t hash = HashCaster(object);
+			for (uint32_t face = 0; face < 6; face++)
+			{
+				if (faceMask & (1 << face))
+				{
+					hashes[face] += hash;
+				}
+			}
+		}
+
+		for (uint32_t face = 0; face < 6; face++)
+		{
+			FaceState& state = Face(assignment.tier, assignment.cube, face);
+
+			PendingFace pending;
+			pending.light = lightIndex;
+			pending.face = face;
+			pending.staticHash = hashes[face];
+			pending.staticDirty = !state.valid || state.lightPosition != light.position || state.radius != light.radius || state.staticHash != hashes[face];
+			pending.dynamic = (dynamicFaces & (1 << face)) != 0;
+			pending.priority = assignment.importance * (1.0f + state.staleness);
+
+			// a face that had a dynamic caster last frame is rebuilt once more to erase it
+			if (!pending.staticDirty && !pending.dynamic && !state.hadDynamic)
+			{
+				stats.facesSkipped++;
+				state.staleness = 0;
+				continue;
+			}
+
+			(state.valid ? candidates : forced).push_back(pending);
+		}
+	}
+
+	std::sort(candidates.begin(), candidates.end(), [](const PendingFace& a, const PendingFace& b) { return a.priority > b.priority; });
+
+	uint32_t selected = std::min(faceBudget, (uint32_t)candidates.size());
+	for (uint32_t i = selected; i < candidates.size(); i++)
+	{
+		Assignment& assignment = assignments[candidates[i].light];
+		Face(assignment.tier, assignment.cube, candidates[i].face).staleness++;
+		stats.facesDeferred++;
+	}
+	candidates.resize(selected);
+	candidates.insert(candidates.end(), forced.begin(), forced.end());
+
+	// one refresh per light, lights in the order they were first picked
+	std::vector<int32_t> refreshLookup(assignments.size(), -1);
+	for (const PendingFace& pending : candidates)
+	{
+		const Assignment& assignment = assignments[pending.light];
+		const PointLight& light = lights[pending.light];
+
+		if (refreshLookup[pending.light] < 0)
+		{
+			refreshLookup[pending.light] = (int32_t)outRefreshes.size();
+			outRefreshes.push_back({ pending.light, (uint32_t)assignment.tier, assignment.cube, 0, 0, 0 });
+		}
+
+		ShadowRefresh& refresh = outRefreshes[refreshLookup[pending.light]];
+		uint8_t bit = (uint8_t)(1 << pending.face);
+		refresh.compositeFaces |= bit;
+		if (pending.staticDirty)
+		{
+			refresh.staticFaces |= bit;
+			stats.facesFull++;
+		}
+		else
+		{
+			stats.facesPartial++;
+		}
+		if (pending.dynamic)
+		{
+			refresh.dynamicFaces |= bit;
+		}
+
+		FaceState& state = Face(assignment.tier, assignment.cube, pending.face);
+		state.valid = true;
+		state.lightPosition = light.position;
+		state.radius = light.radius;
+		state.staticHash = pending.staticHash;
+		state.hadDynamic = pending.dynamic;
+		state.staleness = 0;
+	}
+
+	totalFull += stats.facesFull;
+	totalPartial += stats.facesPartial;
+	totalSkipped += stats.facesSkipped;
+	totalDeferred += stats.facesDeferred;
+}
+
+void ShadowAtlas::RecordInitialLayouts(VkCommandBuffer cmd)
+{
+	for (Tier& tier : tiers)
+	{
+		if (tier.cubeCount == 0)
+		{
+			continue;
+		}
+
+		vkutil::TransititionDepthImage(cmd, tier.staticImage.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+		vkutil::TransititionDepthImage(cmd, tier.shadowImage.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL);
+	}
+
+	layoutsInitialized = true;
+}
+
+void ShadowAtlas::RecordComposite(VkCommandBuffer cmd, uint32_t tier, std::span<const ShadowRefresh> refreshes)
+{
+	std::vector<VkImageCopy2> regions;
+	uint32_t resolution = tiers[tier].resolution;
+
+	for (const ShadowRefresh& refresh : refreshes)
+	{
+		if (refresh.tier != tier)
+		{
+			continue;
+		}
+
+		for (uint32_t face = 0; face < 6; face++)
+		{
+			if (!(refresh.compositeFaces & (1 << face)))
+			{
+				continue;
+			}
+
+			uint32_t layer = refresh.cube * 6 + face;
+
+			VkImageCopy2 region{ .sType = VK_STRUCTURE_TYPE_IMAGE_COPY_2 };
+			region.srcSubresource = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, layer, 1 };
+			region.dstSubresource = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, layer, 1 };
+			region.extent = { resolution, resolution, 1 };
+			regions.push_back(region);
+		}
+	}
+
+	if (regions.empty())
+	{
+		return;
+	}
+
+	VkCopyImageInfo2 copyInfo{ .sType = VK_STRUCTURE_TYPE_COPY_IMAGE_INFO_2 };
+	copyInfo.srcImage = tiers[tier].staticImage.image;
+	copyInfo.srcImageLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+	copyInfo.dstImage = tiers[tier].shadowImage.image;
+	copyInfo.dstImageLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	copyInfo.regionCount = (uint32_t)regions.size();
+	copyInfo.pRegions = regions.data();
+
+	vkCmdCopyImage2(cmd, &copyInfo);
+}
+
+void ShadowAtlas::WriteLightData(std::span<const PointLight> lights, GPULightData& outData) const
+{
+	outData.lightCount = std::min((uint32_t)lights.size(), MAX_POINT_LIGHTS);
+
+	for (uint32_t i = 0; i < outData.lightCount; i++)
+	{
+		const PointLight& light = lights[i];
+		GPUPointLight& gpuLight = outData.lights[i];
+
+		gpuLight.positionPower = glm::vec4(light.position, light.power);
+		gpuLight.colorRadius = glm::vec4(light.color, light.radius);
+		gpuLight.shadowTier = i < assignments.size() ? assignments[i].tier : -1;
+		gpuLight.shadowCube = i < assignments.size() ? assignments[i].cube : 0;
+	}
+}
+
+void ShadowAtlas::WriteDescriptor(DescriptorWriter& writer, uint32_t binding, VkSampler sampler) const
+{
+	// tiers the cap left empty are never indexed, any valid view fills their slot
+	VkImageView fallback = VK_NULL_HANDLE;
+	for (const Tier& tier : tiers)
+	{
+		if (tier.cubeCount > 0)
+		{
+			fallback = tier.shadowArrayView;
+			break;
+		}
+	}
+
+	for (uint32_t tier = 0; tier < SHADOW_TIER_COUNT; tier++)
+	{
+		VkImageView view = tiers[tier].cubeCount > 0 ? tiers[tier].shadowArrayView : fallback;
+		writer.WriteImage(binding, view, sampler, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, tier);
+	}
+}
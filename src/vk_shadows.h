@@ -0,0 +1,154 @@
+#pragma once
+
+#include "vk_types.h"
+
+class VulkanEngine;
+struct RenderObject;
+struct DescriptorWriter;
+
+constexpr uint32_t SHADOW_TIER_COUNT = 4;
+constexpr uint32_t MAX_POINT_LIGHTS = 64;
+constexpr VkFormat SHADOW_ATLAS_FORMAT = VK_FORMAT_D16_UNORM;
+
+struct PointLight
+{
+	glm::vec3 position;
+	float power;
+	glm::vec3 color;
+	float radius; // shadow far plane, casters past it are ignored
+	bool castsShadows{ true };
+};
+
+// matches PointLight in input_structures.glsl
+struct GPUPointLight
+{
+	glm::vec4 positionPower; // xyz position, w power
+	glm::vec4 colorRadius; // rgb color, w shadow radius
+	int32_t shadowTier; // -1 when the light has no shadow this frame
+	uint32_t shadowCube; // cube index inside the tier's atlas
+	uint32_t padding[2];
+};
+
+// matches LightData in input_structures.glsl, pushed into the frame's uniform buffer
+struct GPULightData
+{
+	uint32_t lightCount;
+	uint32_t padding[3];
+	GPUPointLight lights[MAX_POINT_LIGHTS];
+};
+
+// a light's six face view projections, in the +x -x +y -y +z -z order of a cubemap
+void BuildCubeFaceMatrices(const glm::vec3& position, float nearPlane, float radius, glm::mat4 outMatrices[6]);
+
+struct ShadowAtlasSettings
+{
+	uint32_t tierResolutions[SHADOW_TIER_COUNT]{ 1024, 512, 256, 128 };
+	uint32_t tierCubes[SHADOW_TIER_COUNT]{ 4, 8, 16, 32 }; // wanted, cut from the top tier down when over the cap
+	size_t memoryCap{ 256 * 1024 * 1024 };
+	uint32_t faceBudget{ 24 }; // cube faces refreshed per frame, faces of newly assigned cubes do not count
+};
+
+struct ShadowAtlasStats
+{
+	size_t memoryUsed;
+	size_t memoryCap;
+	uint32_t tierCubes[SHADOW_TIER_COUNT];
+	uint32_t tierCubesUsed[SHADOW_TIER_COUNT];
+	uint32_t shadowedLights;
+	uint32_t demotedLights; // got a lower tier than their coverage asked for
+	uint32_t unshadowedLights; // no cube left in any tier
+	uint32_t facesFull; // static casters redrawn
+	uint32_t facesPartial; // static depth copied, dynamic casters redrawn
+	uint32_t facesSkipped; // nothing changed
+	uint32_t facesDeferred; // changed but over the budget, left stale
+};
+
+// faces of one light's cube picked for this frame
+struct ShadowRefresh
+{
+	uint32_t light;
+	uint32_t tier;
+	uint32_t cube;
+	uint8_t staticFaces; // static casters redrawn into the cache
+	uint8_t compositeFaces; // cache copied into the sampled cube and the dynamic casters drawn on top
+	uint8_t dynamicFaces;
+};
+
+// point light shadows for many lights. every tier is a pair of cube array images of one resolution, a cache holding the
+// static casters and the cube array the shaders sample, which is rebuilt per face from the cache plus the dynamic casters.
+// lights get a tier from their screen coverage and are handed cubes in order of importance, falling back to lower tiers
+// and then to no shadow once the cubes run out. faces are only redrawn when what they see changed, at most faceBudget a frame
+class ShadowAtlas
+{
+public:
+	void Init(VulkanEngine* engine, const ShadowAtlasSettings& settings);
+	void Destroy();
+
+	// ranks the lights by screen coverage and gives each shadow casting light a cube. projectionScale is proj[1][1]
+	void AssignLights(std::span<const PointLight> lights, const glm::vec3& viewPosition, float projectionScale);
+
+	// the faces each object reaches for an assigned light, filled by the caller before PlanRefreshes
+	std::vector<uint8_t>& FaceMasks(uint32_t light) { return assignments[light].faceMasks; }
+	bool HasCube(uint32_t light) const { return light < assignments.size() && assignments[light].tier >= 0; }
+
+	// compares every assigned face with what was last rendered into it and picks the faces to refresh, most important and stalest first
+	void PlanRefreshes(std::span<const PointLight> lights, const RenderObject* objects, uint32_t count, uint32_t faceBudget, std::vector<ShadowRefresh>& outRefreshes);
+
+	// moves every image from undefined into the layouts they rest in between frames, recorded once before the first refresh
+	void RecordInitialLayouts(VkCommandBuffer cmd);
+
+	// copies the static depth of the refreshed faces of one tier, the sampled image must be in transfer dst layout
+	void RecordComposite(VkCommandBuffer cmd, uint32_t tier, std::span<const ShadowRefresh> refreshes);
+
+	void WriteLightData(std::span<const PointLight> lights, GPULightData& outData) const;
+	void WriteDescriptor(DescriptorWriter& writer, uint32_t binding, VkSampler sampler) const;
+
+	struct Tier
+	{
+		uint32_t resolution;
+		uint32_t cubeCount;
+		AllocatedImage staticImage;
+		AllocatedImage shadowImage;
+		VkImageView shadowArrayView; // cube array view the shaders sample
+		std::vector<VkImageView> staticCubeViews; // 6 layer views rendered into, one per cube
+		std::vector<VkImageView> shadowCubeViews;
+	};
+
+	Tier tiers[SHADOW_TIER_COUNT];
+	bool layoutsInitialized{ false };
+	ShadowAtlasStats stats{};
+
+	// since init
+	uint64_t totalFull{ 0 };
+	uint64_t totalPartial{ 0 };
+	uint64_t totalSkipped{ 0 };
+	uint64_t totalDeferred{ 0 };
+
+private:
+	// what was last rendered into one face of a cube
+	struct FaceState
+	{
+		glm::vec3 lightPosition;
+		float radius;
+		uint64_t staticHash;
+		bool valid;
+		bool hadDynamic;
+		uint32_t staleness; // frames the face has waited for a refresh
+	};
+
+	struct Assignment
+	{
+		int32_t tier{ -1 };
+		uint32_t cube{ 0 };
+		float importance{ 0.0f };
+		std::vector<uint8_t> faceMasks;
+	};
+
+	FaceState& Face(uint32_t tier, uint32_t cube, uint32_t face) { return faces[tier][cube * 6 + face]; }
+
+	VulkanEngine* engine{ nullptr };
+
+	std::vector<Assignment> assignments; // indexed by light
+	std::vector<FaceState> faces[SHADOW_TIER_COUNT];
+	std::vector<int32_t> cubeOwners[SHADOW_TIER_COUNT]; // light using each cube or -1
+};
@@ -0,0 +1,99 @@
+#include "vk_sort.h"
+#include "vk_engine.h"
+
+#include <algorithm>
+
+uint64_t BuildSortKey(MaterialPass pass, uint32_t pipelineId, uint32_t materialId, uint32_t meshId)
+{
+	uint64_t passBits = (uint64_t)pass & 0x3;
+	uint64_t pipelineBits = pipelineId & 0xFF;
+	uint64_t materialBits = materialId & 0xFFFFF;
+	uint64_t meshBits = meshId & 0xFFFF;
+
+	return (passBits << 44) | (pipelineBits << 36) | (materialBits << 16) | meshBits;
+}
+
+void vkutil::RadixSort(std::vector<DrawSortEntry>& entries, std::vector<DrawSortEntry>& scratch)
+{
+	const size_t count = entries.size();
+	if (count < 2)
+	{
+		return;
+	}
+
+	scratch.resize(count);
+
+	// all eight histograms are built in a single read of the keys
+	uint32_t histograms[8][256] = {};
+	for (const DrawSortEntry& entry : entries)
+	{
+		for (int byte = 0; byte < 8; byte++)
+		{
+			histograms[byte][(entry.key >> (byte * 8)) & 0xFF]++;
+		}
+	}
+
+	DrawSortEntry* src = entries.data();
+	DrawSortEntry* dst = scratch.data();
+
+	for (int byte = 0; byte < 8; byte++)
+	{
+		uint32_t* histogram = histograms[byte];
+
+		// every key shares this byte, the pass would not move anything
+		if (histogram[(src[0].key >> (byte * 8)) & 0xFF] == count)
+		{
+			continue;
+		}
+
+		uint32_t offsets[256];
+		uint32_t sum = 0;
+		for (int bucket = 0; bucket < 256; bucket++)
+		{
+			offsets[bucket] = sum;
+			sum += histogram[bucket];
+		}
+
+		for (size_t i = 0; i < count; i++)
+		{
+			dst[offsets[(src[i].key >> (byte * 8)) & 0xFF]++] = src[i];
+		}
+
+		std::swap(src, dst);
+	}
+
+	if (src != entries.data())
+	{
+		std::copy(src, src + count, entries.data());
+	}
+}
+
+void DrawSorter::Sort(const RenderObject* objects, std::vector<uint32_t>& draws, uint64_t objectsVersion)
+{
+	// the keys can only have changed with the version, so an unchanged list is compared by index without reading them
+	if (objectsVersion == sortedVersion && draws == inputDraws)
+	{
+		draws = sortedDraws;
+		lastSortSkipped = true;
+		return;
+	}
+
+	inputDraws = draws;
+
+	entries.resize(draws.size());
+	for (size_t i = 0; i < draws.size(); i++)
+	{
+		entries[i] = DrawSortEntry{ objects[draws[i]].sortKey, draws[i] };
+	}
+
+	vkutil::RadixSort(entries, scratch);
+
+	for (size_t i = 0; i < draws.size(); i++)
+	{
+		draws[i] = entries[i].index;
+	}
+
+	sortedVersion = objectsVersion;
+	sortedDraws = draws;
+	lastSortSkipped = false;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "vk_types.h"
+
+struct RenderObject;
+
+// key bits, draws only group by state. there is no depth field: the gpu cull compacts a batch's visible draws in
+// whatever order its threads finish, and transparent draws are weighted blended, so no order inside a group survives
+//   | unused 18 | pass 2 | pipeline 8 | material 20 | mesh 16 |
+uint64_t BuildSortKey(MaterialPass pass, uint32_t pipelineId, uint32_t materialId, uint32_t meshId);
+
+struct DrawSortEntry
+{
+	uint64_t key;
+	uint32_t index;
+};
+
+namespace vkutil {
+
+	// stable LSD radix sort on the key, 8 bits per pass. passes where every key has the same byte are skipped
+	void RadixSort(std::vector<DrawSortEntry>& entries, std::vector<DrawSortEntry>& scratch);
+};
+
+// orders a list of draw indices by the objects' sort keys. objectsVersion has to change whenever any object's key
+// does, such as RenderProxyRegistry::Version, so the same list at the same version reuses the previous order
+class DrawSorter
+{
+public:
+	void Sort(const RenderObject* objects, std::vector<uint32_t>& draws, uint64_t objectsVersion);
+
+	bool lastSortSkipped{ false };
+
+private:
+	std::vector<DrawSortEntry> entries;
+	std::vector<DrawSortEntry> scratch;
+	std::vector<uint32_t> inputDraws;
+	std::vector<uint32_t> sortedDraws;
+	uint64_t sortedVersion{ UINT64_MAX };
+};
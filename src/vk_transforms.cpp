@@ -0,0 +1,229 @@
+#include "vk_transforms.h"
+#include "vk_types.h"
+#include "vk_jobs.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+uint32_t TransformHierarchy::Add(uint32_t parent, const glm::mat4& localTransform)
+{
+	uint32_t index = (uint32_t)parents.size();
+	uint32_t level = parent == NoParent ? 0 : levels[parent] + 1;
+
+	if (parent != NoParent && parent >= index)
+	{
+		fmt::println("Transform parent {} added after its child {}", parent, index);
+		abort();
+	}
+
+	if (!levels.empty() && level < levels.back())
+	{
+		levelOrdered = false;
+	}
+
+	while (levelStarts.size() <= level)
+	{
+		levelStarts.push_back(index);
+	}
+
+	parents.push_back(parent);
+	levels.push_back(level);
+	localTransforms.push_back(localTransform);
+	worldTransforms.push_back(localTransform);
+	dirty.push_back(1);
+	updated.push_back(0);
+
+	anyDirty = true;
+
+	return index;
+}
+
+void TransformHierarchy::Clear()
+{
+	parents.clear();
+	levels.clear();
+	localTransforms.clear();
+	worldTransforms.clear();
+	dirty.clear();
+	updated.clear();
+	levelStarts.clear();
+	levelOrdered = true;
+	anyDirty = false;
+	lastUpdatedCount = 0;
+}
+
+void TransformHierarchy::SetLocal(uint32_t index, const glm::mat4& localTransform)
+{
+	localTransforms[index] = localTransform;
+	dirty[index] = 1;
+	anyDirty = true;
+}
+
+void TransformHierarchy::UpdateRange(uint32_t start, uint32_t end)
+{
+	for (uint32_t i = start; i < end; i++)
+	{
+		uint32_t parent = parents[i];
+
+		// a rewritten parent dirties its children, parents are always earlier in the arrays
+		if (parent != NoParent && updated[parent])
+		{
+			dirty[i] = 1;
+		}
+
+		if (dirty[i])
+		{
+			worldTransforms[i] = parent == NoParent ? localTransforms[i] : worldTransforms[parent] * localTransforms[i];
+			dirty[i] = 0;
+			updated[i] = 1;
+		}
+		else
+		{
+			updated[i] = 0;
+		}
+	}
+}
+
+uint32_t TransformHierarchy::Update(JobSystem* jobSystem)
+{
+	// a static hierarchy costs nothing past this point
+	if (!anyDirty)
+	{
+		if (lastUpdatedCount > 0)
+		{
+			std::memset(updated.data(), 0, updated.size());
+			lastUpdatedCount = 0;
+		}
+		return 0;
+	}
+
+	uint32_t count = Size();
+
+	if (jobSystem && levelOrdered && count > parallelThreshold)
+	{
+		// every node in a level only reads the level above, so the nodes of one level can be split freely
+		for (size_t level = 0; level < levelStarts.size(); level++)
+		{
+			uint32_t start = levelStarts[level];
+			uint32_t end = level + 1 < levelStarts.size() ? levelStarts[level + 1] : count;
+
+			jobSystem->ParallelFor(end - start, parallelThreshold, [&](uint32_t rangeStart, uint32_t rangeEnd)
+				{
+					UpdateRange(start + rangeStart, start + rangeEnd);
+				});
+		}
+	}
+	else
+	{
+		UpdateRange(0, count);
+	}
+
+	anyDirty = false;
+	lastUpdatedCount = (uint32_t)std::count(updated.begin(), updated.end(), 1);
+
+	return lastUpdatedCount;
+}
+
+const glm::mat4& Node::GetLocalTransform() const
+{
+	return transforms->GetLocal(transformIndex);
+}
+
+const glm::mat4& Node::GetWorldTransform() const
+{
+	return transforms->GetWorld(transformIndex);
+}
+
+void Node::SetLocalTransform(const glm::mat4& matrix)
+{
+	transforms->SetLocal(transformIndex, matrix);
+}
+
+// the shape of the old Node, kept here only so the benchmark measures what the flat hierarchy replaced
+struct RecursiveNode
+{
+	std::vector<std::shared_ptr<RecursiveNode>> children;
+	glm::mat4 localTransform;
+	glm::mat4 worldTransform;
+
+	void RefreshTransform(const glm::mat4& parentMatrix)
+	{
+		worldTransform = parentMatrix * localTransform;
+		for (auto c : children)
+		{
+			c->RefreshTransform(worldTransform);
+		}
+	}
+};
+
+TransformBenchmarkResults RunTransformBenchmark(uint32_t nodeCount, JobSystem* jobSystem)
+{
+	TransformBenchmarkResults results{};
+	results.nodeCount = nodeCount;
+
+	if (nodeCount == 0)
+	{
+		return results;
+	}
+
+	// four children per node, built breadth first so the flat arrays are level ordered
+	std::vector<std::shared_ptr<RecursiveNode>> recursiveNodes(nodeCount);
+	TransformHierarchy hierarchy;
+
+	for (uint32_t i = 0; i < nodeCount; i++)
+	{
+		glm::mat4 local = glm::translate(glm::mat4(1.0f), glm::vec3((float)(i % 7), 1.0f, (float)(i % 3)));
+		local = glm::rotate(local, 0.01f * (float)i, glm::vec3(0.0f, 1.0f, 0.0f));
+
+		uint32_t parent = i == 0 ? TransformHierarchy::NoParent : (i - 1) / 4;
+
+		recursiveNodes[i] = std::make_shared<RecursiveNode>();
+		recursiveNodes[i]->localTransform = local;
+		if (parent != TransformHierarchy::NoParent)
+		{
+			recursiveNodes[parent]->children.push_back(recursiveNodes[i]);
+		}
+
+		hierarchy.Add(parent, local);
+	}
+
+	auto time = [](auto&& pass)
+	{
+		auto start = std::chrono::system_clock::now();
+		pass();
+		auto end = std::chrono::system_clock::now();
+		return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0f;
+	};
+
+	auto dirtyAll = [&]()
+	{
+		hierarchy.SetLocal(0, hierarchy.GetLocal(0));
+	};
+
+	results.recursiveTime = time([&]() { recursiveNodes[0]->RefreshTransform(glm::mat4{ 1.0f }); });
+
+	hierarchy.Update();
+
+	dirtyAll();
+	results.flatTime = time([&]() { hierarchy.Update(); });
+
+	dirtyAll();
+	results.flatParallelTime = time([&]() { hierarchy.Update(jobSystem); });
+
+	for (uint32_t i = 0; i < nodeCount; i += 100)
+	{
+		hierarchy.SetLocal(nodeCount - 1 - i, hierarchy.GetLocal(nodeCount - 1 - i));
+	}
+	results.flatPartialTime = time([&]() { hierarchy.Update(); });
+
+	hierarchy.Update();
+	results.flatCleanTime = time([&]() { hierarchy.Update(); });
+
+	fmt::println("Transform benchmark, {} nodes: recursive {} ms, flat {} ms, flat parallel {} ms, 1% dirty {} ms, clean {} ms", nodeCount,
+		results.recursiveTime, results.flatTime, results.flatParallelTime, results.flatPartialTime, results.flatCleanTime);
+
+	return results;
+}
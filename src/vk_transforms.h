@@ -0,0 +1,62 @@
+#pragma once
+
+#include <glm/mat4x4.hpp>
+
+#include <cstdint>
+#include <vector>
+
+class JobSystem;
+
+// flattened node transforms. nodes are stored in parent before child order with every depth level contiguous,
+// so one forward pass over the arrays can update the whole hierarchy
+class TransformHierarchy
+{
+public:
+	static constexpr uint32_t NoParent = UINT32_MAX;
+
+	// the parent must already have been added, and nodes should be added level by level for the parallel update
+	uint32_t Add(uint32_t parent, const glm::mat4& localTransform);
+	void Clear();
+
+	void SetLocal(uint32_t index, const glm::mat4& localTransform);
+	const glm::mat4& GetLocal(uint32_t index) const { return localTransforms[index]; }
+	const glm::mat4& GetWorld(uint32_t index) const { return worldTransforms[index]; }
+
+	// recomputes dirty nodes and their descendants, levels wider than parallelThreshold are split across the job system.
+	// returns the number of world matrices written
+	uint32_t Update(JobSystem* jobSystem = nullptr);
+	// true if the last Update rewrote this node's world matrix
+	bool WasUpdated(uint32_t index) const { return updated[index] != 0; }
+
+	uint32_t Size() const { return (uint32_t)parents.size(); }
+
+	uint32_t parallelThreshold{ 4096 };
+
+private:
+	void UpdateRange(uint32_t start, uint32_t end);
+
+	std::vector<uint32_t> parents;
+	std::vector<uint32_t> levels;
+	std::vector<glm::mat4> localTransforms;
+	std::vector<glm::mat4> worldTransforms;
+	std::vector<uint8_t> dirty;
+	std::vector<uint8_t> updated;
+
+	std::vector<uint32_t> levelStarts; // first node of each level, plus the end
+	bool levelOrdered{ true };
+	bool anyDirty{ false };
+	uint32_t lastUpdatedCount{ 0 };
+};
+
+// milliseconds for one update of a generated hierarchy
+struct TransformBenchmarkResults
+{
+	uint32_t nodeCount;
+	float recursiveTime; // shared_ptr tree walked the way Node::RefreshTransform used to
+	float flatTime;
+	float flatParallelTime;
+	float flatPartialTime; // one percent of the nodes dirty
+	float flatCleanTime; // nothing dirty
+};
+
+TransformBenchmarkResults RunTransformBenchmark(uint32_t nodeCount, JobSystem* jobSystem);
@@ -53,18 +53,16 @@ struct Vertex
     glm::vec4 color;
 };
 
+// a mesh's placement in the geometry arena, the buffers are shared by every mesh
 struct GPUMeshBuffers
 {
-    AllocatedBuffer indexBuffer;
-    AllocatedBuffer vertexBuffer;
+    VkBuffer indexBuffer;
     VkDeviceAddress vertexBufferAddress;
-};
-
-struct GPUParticleBuffers
-{
-    AllocatedBuffer particleBuffer;
-    VkDeviceAddress particleBufferAddress;
-    size_t bufferSize;
+    uint32_t firstIndex;
+    uint32_t indexCount;
+    int32_t vertexOffset;
+    uint32_t vertexCount;
+    uint32_t sortId;
 };
 
 struct GPUDrawPushConstants
@@ -73,11 +71,18 @@ struct GPUDrawPushConstants
     VkDeviceAddress vertexBuffer;
 };
 
+// mesh draws read their transform and vertex buffer from the per frame object buffer through gl_InstanceIndex
+struct GPUDrawObjectPushConstants
+{
+    VkDeviceAddress objectBuffer;
+};
+
 struct GPUDrawPushDepthConstants
 {
     glm::mat4 renderMatrix;
     glm::vec4 lightPosition;
     float farPlane;
+    uint32_t faces; // cube face of each instance, 3 bits apiece
     VkDeviceAddress vertexBuffer;
 };
 
@@ -86,6 +91,7 @@ struct GPUDrawPushParticleConstants
     glm::mat4 renderMatrix;
     VkDeviceAddress vertexBuffer;
     VkDeviceAddress particlePositionBuffer;
+    VkDeviceAddress emitterBuffer; // ParticleSystem emitter table for this frame
 };
 
 enum class MaterialPass : uint8_t
@@ -99,16 +105,19 @@ struct MaterialPipeline
 {
     VkPipeline pipeline;
     VkPipelineLayout layout;
+    uint32_t sortId;
 };
 
 struct MaterialInstance
 {
     MaterialPipeline* pipeline;
-    VkDescriptorSet materialSet;
+    uint32_t materialIndex; // slot in the bindless material buffer
     MaterialPass passType;
+    uint32_t sortId;
 };
 
 struct DrawContext;
+class TransformHierarchy;
 
 class IRenderable
 {
@@ -120,17 +129,14 @@ struct Node : public IRenderable
     std::weak_ptr<Node> parent;
     std::vector<std::shared_ptr<Node>> children;
 
-    glm::mat4 localTransform;
-    glm::mat4 worldTransform;
+    // matrices live in the owning file's TransformHierarchy, the node is a handle into it
+    TransformHierarchy* transforms{ nullptr };
+    uint32_t transformIndex{ 0 };
 
-    void RefreshTransform(const glm::mat4& parentMatrix)
-    {
-        worldTransform = parentMatrix * localTransform;
-        for (auto c : children)
-        {
-            c->RefreshTransform(worldTransform);
-        }
-    }
+    const glm::mat4& GetLocalTransform() const;
+    const glm::mat4& GetWorldTransform() const;
+    // the world matrix is refreshed by the next TransformHierarchy::Update
+    void SetLocalTransform(const glm::mat4& matrix);
 
     virtual void Draw(const glm::mat4& topMatrix, DrawContext& context)
     {
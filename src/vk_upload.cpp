@@ -0,0 +1,550 @@
+#include "vk_upload.h"
+#include "vk_engine.h"
+#include "vk_images.h"
+#include "vk_initializers.h"
+
+static size_t AlignUp(size_t value, size_t alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+static void PipelineBarrier(VkCommandBuffer cmd, std::span<VkBufferMemoryBarrier2> bufferBarriers, std::span<VkImageMemoryBarrier2> imageBarriers)
+{
+	VkDependencyInfo depInfo{ .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO, .pNext = nullptr };
+	depInfo.bufferMemoryBarrierCount = (uint32_t)bufferBarriers.size();
+	depInfo.pBufferMemoryBarriers = bufferBarriers.data();
+	depInfo.imageMemoryBarrierCount = (uint32_t)imageBarriers.size();
+	depInfo.pImageMemoryBarriers = imageBarriers.data();
+
+	vkCmdPipelineBarrier2(cmd, &depInfo);
+}
+
+void UploadManager::Init(VulkanEngine* engine, VkQueue queue, uint32_t queueFamily, size_t stagingSize)
+{
+	this->engine = engine;
+	transferQueue = queue;
+	transferQueueFamily = queueFamily;
+	graphicsQueueFamily = engine->graphicsQueueFamily;
+
+	VkCommandPoolCreateInfo poolInfo = vkinit::command_pool_create_info(transferQueueFamily, VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
+	VK_CHECK(vkCreateCommandPool(engine->device, &poolInfo, nullptr, &commandPool));
+
+	VkSemaphoreTypeCreateInfo timelineInfo{ .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO };
+	timelineInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+	timelineInfo.initialValue = 0;
+
+	VkSemaphoreCreateInfo semaphoreInfo = vkinit::semaphore_create_info();
+	semaphoreInfo.pNext = &timelineInfo;
+
+	VK_CHECK(vkCreateSemaphore(engine->device, &semaphoreInfo, nullptr, &uploadTimeline));
+	VK_CHECK(vkCreateSemaphore(engine->device, &semaphoreInfo, nullptr, &graphicsTimeline));
+
+	stagingBuffer = engine->CreateBuffer(stagingSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
+	stagingData = (uint8_t*)stagingBuffer.info.pMappedData;
+	stagingCapacity = stagingSize;
+	stagingAlignment = std::max<size_t>(16, engine->physicalDeviceProperties.limits.optimalBufferCopyOffsetAlignment);
+}
+
+void UploadManager::Destroy()
+{
+	// caller has waited for the device to go idle
+	if (openBatch)
+	{
+		VK_CHECK(vkEndCommandBuffer(openBatch->cmd));
+		inFlightBatches.push_back(std::move(*openBatch));
+		openBatch.reset();
+	}
+
+	for (Batch& batch : inFlightBatches)
+	{
+		for (AllocatedBuffer& buffer : batch.dedicatedBuffers)
+		{
+			engine->DestroyBuffer(buffer);
+		}
+	}
+	inFlightBatches.clear();
+	freeBatches.clear();
+
+	for (DedicatedRelease& release : graphicsDedicatedBuffers)
+	{
+		engine->DestroyBuffer(release.buffer);
+	}
+	graphicsDedicatedBuffers.clear();
+
+	pendingAcquires.clear();
+	pendingCopies.clear();
+	stagingRegions.clear();
+
+	engine->DestroyBuffer(stagingBuffer);
+
+	vkDestroyCommandPool(engine->device, commandPool, nullptr);
+	vkDestroySemaphore(engine->device, uploadTimeline, nullptr);
+	vkDestroySemaphore(engine->device, graphicsTimeline, nullptr);
+}
+
+UploadManager::Batch& UploadManager::GetOpenBatch()
+{
+	if (!openBatch)
+	{
+		RetireBatches();
+
+		Batch batch;
+		if (!freeBatches.empty())
+		{
+			batch = std::move(freeBatches.back());
+			freeBatches.pop_back();
+		}
+		else
+		{
+			VkCommandBufferAllocateInfo cmdAllocInfo = vkinit::command_buffer_allocate_info(commandPool, 1);
+			VK_CHECK(vkAllocateCommandBuffers(engine->device, &cmdAllocInfo, &batch.cmd));
+		}
+
+		VK_CHECK(vkResetCommandBuffer(batch.cmd, 0));
+
+		VkCommandBufferBeginInfo cmdBeginInfo = vkinit::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+		VK_CHECK(vkBeginCommandBuffer(batch.cmd, &cmdBeginInfo));
+
+		batch.value = nextValue;
+		openBatch = std::move(batch);
+	}
+
+	return *openBatch;
+}
+
+void UploadManager::RetireBatches()
+{
+	uint64_t completed;
+	VK_CHECK(vkGetSemaphoreCounterValue(engine->device, uploadTimeline, &completed));
+
+	while (!inFlightBatches.empty() && inFlightBatches.front().value <= completed)
+	{
+		Batch& batch = inFlightBatches.front();
+		for (AllocatedBuffer& buffer : batch.dedicatedBuffers)
+		{
+			engine->DestroyBuffer(buffer);
+		}
+		batch.dedicatedBuffers.clear();
+
+		freeBatches.push_back(std::move(batch));
+		inFlightBatches.pop_front();
+	}
+
+	uint64_t graphicsCompleted;
+	VK_CHECK(vkGetSemaphoreCounterValue(engine->device, graphicsTimeline, &graphicsCompleted));
+
+	std::erase_if(graphicsDedicatedBuffers, [&](DedicatedRelease& release)
+		{
+			if (release.graphicsValue > graphicsCompleted)
+			{
+				return false;
+			}
+			engine->DestroyBuffer(release.buffer);
+			return true;
+		});
+}
+
+bool UploadManager::IsRegionComplete(const StagingRegion& region)
+{
+	uint64_t completed;
+	if (region.graphics)
+	{
+		if (region.value > graphicsValue)
+		{
+			return false;
+		}
+		VK_CHECK(vkGetSemaphoreCounterValue(engine->device, graphicsTimeline, &completed));
+	}
+	else
+	{
+		if (region.value > lastSubmittedValue)
+		{
+			return false;
+		}
+		VK_CHECK(vkGetSemaphoreCounterValue(engine->device, uploadTimeline, &completed));
+	}
+
+	return completed >= region.value;
+}
+
+void UploadManager::RetireRegions()
+{
+	while (!stagingRegions.empty() && IsRegionComplete(stagingRegions.front()))
+	{
+		stagingRegions.pop_front();
+	}
+}
+
+bool UploadManager::TryAllocate(size_t size, size_t& outOffset)
+{
+	if (stagingRegions.empty())
+	{
+		head = 0;
+	}
+
+	size_t offset = AlignUp(head, stagingAlignment);
+	size_t tail = stagingRegions.empty() ? 0 : stagingRegions.front().offset;
+
+	// live regions sit between tail and head, so free space is head..end followed by 0..tail until the ring wraps
+	if (stagingRegions.empty() || head > tail)
+	{
+		if (offset + size <= stagingCapacity)
+		{
+			outOffset = offset;
+			head = offset + size;
+			return true;
+		}
+
+		if (!stagingRegions.empty() && size <= tail)
+		{
+			outOffset = 0;
+			head = size;
+			return true;
+		}
+
+		return false;
+	}
+
+	if (offset + size <= tail)
+	{
+		outOffset = offset;
+		head = offset + size;
+		return true;
+	}
+
+	return false;
+}
+
+VkBuffer UploadManager::Stage(const void* data, size_t size, bool graphics, size_t& outOffset)
+{
+	RetireRegions();
+
+	bool useRing = size <= stagingCapacity;
+	size_t offset = 0;
+
+	while (useRing && !TryAllocate(size, offset))
+	{
+		StagingRegion& oldest = stagingRegions.front();
+
+		if (oldest.graphics && oldest.value > graphicsValue)
+		{
+			// the frame that reads the oldest region hasn't been submitted yet, waiting on it would never finish
+			useRing = false;
+			break;
+		}
+
+		if (!oldest.graphics && oldest.value > lastSubmittedValue)
+		{
+			Flush();
+		}
+
+		VkSemaphoreWaitInfo waitInfo{ .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO };
+		waitInfo.semaphoreCount = 1;
+		waitInfo.pSemaphores = oldest.graphics ? &graphicsTimeline : &uploadTimeline;
+		waitInfo.pValues = &oldest.value;
+		VK_CHECK(vkWaitSemaphores(engine->device, &waitInfo, UINT64_MAX));
+
+		RetireRegions();
+	}
+
+	if (!useRing)
+	{
+		AllocatedBuffer dedicated = engine->CreateBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
+		memcpy(dedicated.info.pMappedData, data, size);
+
+		if (graphics)
+		{
+			graphicsDedicatedBuffers.push_back(DedicatedRelease{ dedicated, CopySubmitValue() });
+		}
+		else
+		{
+			GetOpenBatch().dedicatedBuffers.push_back(dedicated);
+		}
+
+		outOffset = 0;
+		return dedicated.buffer;
+	}
+
+	memcpy(stagingData + offset, data, size);
+	stagingRegions.push_back(StagingRegion{ offset, size, graphics, graphics ? CopySubmitValue() : nextValue });
+
+	outOffset = offset;
+	return stagingBuffer.buffer;
+}
+
+UploadToken UploadManager::UploadBuffer(VkBuffer dst, const void* data, size_t size, size_t dstOffset)
+{
+	if (size == 0)
+	{
+		return lastSubmittedValue;
+	}
+
+	size_t srcOffset;
+	VkBuffer src = Stage(data, size, false, srcOffset);
+
+	Batch& batch = GetOpenBatch();
+
+	VkBufferCopy copy{ .srcOffset = srcOffset, .dstOffset = dstOffset, .size = size };
+	vkCmdCopyBuffer(batch.cmd, src, dst, 1, &copy);
+
+	if (transferQueueFamily != graphicsQueueFamily)
+	{
+		// release half of the queue family ownership transfer, the graphics queue records the matching acquire
+		VkBufferMemoryBarrier2 release{ .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2 };
+		release.srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+		release.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+		release.dstStageMask = VK_PIPELINE_STAGE_2_NONE;
+		release.dstAccessMask = 0;
+		release.srcQueueFamilyIndex = transferQueueFamily;
+		release.dstQueueFamilyIndex = graphicsQueueFamily;
+		release.buffer = dst;
+		release.offset = dstOffset;
+		release.size = size;
+
+		PipelineBarrier(batch.cmd, std::span(&release, 1), {});
+
+		PendingAcquire acquire{};
+		acquire.value = batch.value;
+		acquire.isImage = false;
+		acquire.ownershipTransfer = true;
+		acquire.bufferBarrier = release;
+		acquire.bufferBarrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE;
+		acquire.bufferBarrier.srcAccessMask = 0;
+		acquire.bufferBarrier.dstStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+		acquire.bufferBarrier.dstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT;
+
+		pendingAcquires.push_back(acquire);
+	}
+
+	graphicsWaitValue = std::max(graphicsWaitValue, batch.value);
+	bytesUploaded += size;
+
+	return batch.value;
+}
+
+UploadToken UploadManager::UploadImage(const AllocatedImage& image, const void* data, size_t size, std::span<VkBufferImageCopy> copyRegions, bool mipmapped, uint32_t layerCount)
+{
+	size_t srcOffset;
+	VkBuffer src = Stage(data, size, false, srcOffset);
+
+	Batch& batch = GetOpenBatch();
+
+	VkImageMemoryBarrier2 toTransfer{ .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2 };
+	toTransfer.srcStageMask = VK_PIPELINE_STAGE_2_NONE;
+	toTransfer.srcAccessMask = 0;
+	toTransfer.dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+	toTransfer.dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+	toTransfer.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	toTransfer.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	toTransfer.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	toTransfer.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	toTransfer.image = image.image;
+	toTransfer.subresourceRange = vkinit::image_subresource_range(VK_IMAGE_ASPECT_COLOR_BIT);
+
+	PipelineBarrier(batch.cmd, {}, std::span(&toTransfer, 1));
+
+	std::vector<VkBufferImageCopy> copies(copyRegions.begin(), copyRegions.end());
+	for (VkBufferImageCopy& copy : copies)
+	{
+		copy.bufferOffset += srcOffset;
+	}
+
+	vkCmdCopyBufferToImage(batch.cmd, src, image.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, (uint32_t)copies.size(), copies.data());
+
+	bool ownershipTransfer = transferQueueFamily != graphicsQueueFamily;
+
+	// blits need a graphics queue, so mipmapped images stay in TRANSFER_DST until the graphics side generates the chain
+	VkImageMemoryBarrier2 release = toTransfer;
+	release.srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+	release.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+	release.dstStageMask = VK_PIPELINE_STAGE_2_NONE;
+	release.dstAccessMask = 0;
+	release.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	release.newLayout = mipmapped ? VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	release.srcQueueFamilyIndex = ownershipTransfer ? transferQueueFamily : VK_QUEUE_FAMILY_IGNORED;
+	release.dstQueueFamilyIndex = ownershipTransfer ? graphicsQueueFamily : VK_QUEUE_FAMILY_IGNORED;
+
+	PipelineBarrier(batch.cmd, {}, std::span(&release, 1));
+
+	if (ownershipTransfer || mipmapped)
+	{
+		PendingAcquire acquire{};
+		acquire.value = batch.value;
+		acquire.isImage = true;
+		acquire.ownershipTransfer = ownershipTransfer;
+		acquire.generateMips = mipmapped;
+		acquire.extent = VkExtent2D{ image.imageExtent.width, image.imageExtent.height };
+		acquire.layerCount = layerCount;
+		acquire.imageBarrier = release;
+		acquire.imageBarrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE;
+		acquire.imageBarrier.srcAccessMask = 0;
+		acquire.imageBarrier.dstStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+		acquire.imageBarrier.dstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT;
+
+		pendingAcquires.push_back(acquire);
+	}
+
+	graphicsWaitValue = std::max(graphicsWaitValue, batch.value);
+	bytesUploaded += size;
+
+	return batch.value;
+}
+
+void UploadManager::UpdateBuffer(VkBuffer dst, const void* data, size_t size, size_t dstOffset)
+{
+	if (size == 0)
+	{
+		return;
+	}
+
+	size_t srcOffset;
+	VkBuffer src = Stage(data, size, true, srcOffset);
+
+	pendingCopies.push_back(PendingCopy{ src, dst, VkBufferCopy{ .srcOffset = srcOffset, .dstOffset = dstOffset, .size = size } });
+	bytesUploaded += size;
+}
+
+UploadToken UploadManager::Flush()
+{
+	if (openBatch)
+	{
+		VK_CHECK(vkEndCommandBuffer(openBatch->cmd));
+
+		VkCommandBufferSubmitInfo cmdInfo = vkinit::command_buffer_submit_info(openBatch->cmd);
+
+		VkSemaphoreSubmitInfo signalInfo = vkinit::semaphore_submit_info(VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, uploadTimeline);
+		signalInfo.value = openBatch->value;
+
+		VkSubmitInfo2 submit = vkinit::submit_info(&cmdInfo, &signalInfo, nullptr);
+
+		VK_CHECK(vkQueueSubmit2(transferQueue, 1, &submit, VK_NULL_HANDLE));
+
+		lastSubmittedValue = openBatch->value;
+		nextValue++;
+		batchesSubmitted++;
+
+		inFlightBatches.push_back(std::move(*openBatch));
+		openBatch.reset();
+	}
+
+	return lastSubmittedValue;
+}
+
+bool UploadManager::IsComplete(UploadToken token)
+{
+	if (token > lastSubmittedValue)
+	{
+		return false;
+	}
+
+	uint64_t completed;
+	VK_CHECK(vkGetSemaphoreCounterValue(engine->device, uploadTimeline, &completed));
+
+	return completed >= token;
+}
+
+void UploadManager::Wait(UploadToken token)
+{
+	if (token > lastSubmittedValue)
+	{
+		Flush();
+	}
+
+	VkSemaphoreWaitInfo waitInfo{ .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO };
+	waitInfo.semaphoreCount = 1;
+	waitInfo.pSemaphores = &uploadTimeline;
+	waitInfo.pValues = &token;
+
+	VK_CHECK(vkWaitSemaphores(engine->device, &waitInfo, UINT64_MAX));
+}
+
+UploadToken UploadManager::RecordGraphicsWork(VkCommandBuffer cmd)
+{
+	Flush();
+	RetireBatches();
+
+	std::vector<VkBufferMemoryBarrier2> bufferBarriers;
+	std::vector<VkImageMemoryBarrier2> imageBarriers;
+
+	for (PendingAcquire& acquire : pendingAcquires)
+	{
+		if (!acquire.ownershipTransfer)
+		{
+			continue;
+		}
+
+		if (acquire.isImage)
+		{
+			imageBarriers.push_back(acquire.imageBarrier);
+		}
+		else
+		{
+			bufferBarriers.push_back(acquire.bufferBarrier);
+		}
+	}
+
+	if (!bufferBarriers.empty() || !imageBarriers.empty())
+	{
+		PipelineBarrier(cmd, bufferBarriers, imageBarriers);
+	}
+
+	for (PendingAcquire& acquire : pendingAcquires)
+	{
+		if (acquire.generateMips)
+		{
+			vkutil::GenerateMipMaps(cmd, acquire.imageBarrier.image, acquire.extent, acquire.layerCount);
+		}
+	}
+
+	pendingAcquires.clear();
+
+	if (!pendingCopies.empty())
+	{
+		// previous frames may still be reading the destinations
+		VkMemoryBarrier2 barrier{ .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2 };
+		barrier.srcStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+		barrier.srcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT;
+		barrier.dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+		barrier.dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+
+		VkDependencyInfo depInfo{ .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO, .pNext = nullptr };
+		depInfo.memoryBarrierCount = 1;
+		depInfo.pMemoryBarriers = &barrier;
+
+		vkCmdPipelineBarrier2(cmd, &depInfo);
+
+		for (PendingCopy& copy : pendingCopies)
+		{
+			vkCmdCopyBuffer(cmd, copy.src, copy.dst, 1, &copy.region);
+		}
+
+		barrier.srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+		barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+		barrier.dstStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+		barrier.dstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT;
+
+		vkCmdPipelineBarrier2(cmd, &depInfo);
+
+		pendingCopies.clear();
+	}
+
+	// the copies just recorded belong to the next frame submit, updates made from here on go into the frame after
+	recordedGraphicsValue = graphicsValue + 1;
+
+	UploadToken waitValue = graphicsWaitValue;
+	graphicsWaitValue = 0;
+
+	return waitValue;
+}
+
+uint64_t UploadManager::NextGraphicsValue()
+{
+	assert(recordedGraphicsValue == graphicsValue + 1 && "RecordGraphicsWork has to be recorded into every frame submit");
+	return ++graphicsValue;
+}
+
+uint64_t UploadManager::CopySubmitValue() const
+{
+	// between RecordGraphicsWork and the submit, the open frame has already taken its copies
+	return std::max(graphicsValue, recordedGraphicsValue) + 1;
+}
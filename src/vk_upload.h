@@ -0,0 +1,124 @@
+#pragma once
+
+#include "vk_types.h"
+
+class VulkanEngine;
+
+// value the upload timeline reaches once the batch containing an upload has finished executing
+typedef uint64_t UploadToken;
+
+// records staging copies into batched command buffers on the transfer queue, completion is tracked with a timeline semaphore
+class UploadManager
+{
+public:
+	void Init(VulkanEngine* engine, VkQueue queue, uint32_t queueFamily, size_t stagingSize);
+	void Destroy();
+
+	// copy into a device local buffer, or a range of one, that the graphics queue has not used yet
+	UploadToken UploadBuffer(VkBuffer dst, const void* data, size_t size, size_t dstOffset = 0);
+	// copy into an image in UNDEFINED layout, regions are relative to the start of data. mipmapped images are left in TRANSFER_DST for the graphics queue to blit
+	UploadToken UploadImage(const AllocatedImage& image, const void* data, size_t size, std::span<VkBufferImageCopy> copyRegions, bool mipmapped, uint32_t layerCount = 1);
+
+	// overwrite a buffer the graphics queue is already reading, the copy is recorded by the next RecordGraphicsWork. may be
+	// called anywhere in the frame, a call after this frame's RecordGraphicsWork lands in the following frame
+	void UpdateBuffer(VkBuffer dst, const void* data, size_t size, size_t dstOffset = 0);
+
+	// submit the open batch, returns the token of the last submitted batch
+	UploadToken Flush();
+	bool IsComplete(UploadToken token);
+	void Wait(UploadToken token);
+
+	// records ownership acquires, mip generation and pending buffer updates into the frame command buffer.
+	// returns the upload timeline value that frame's submit has to wait on, 0 if there is nothing to wait for
+	UploadToken RecordGraphicsWork(VkCommandBuffer cmd);
+	// the value the frame submit signals on graphicsTimeline, used to recycle staging memory read by graphics side copies.
+	// every submit signalling it has to contain this frame's RecordGraphicsWork
+	uint64_t NextGraphicsValue();
+
+	VkSemaphore uploadTimeline{ VK_NULL_HANDLE };
+	VkSemaphore graphicsTimeline{ VK_NULL_HANDLE };
+
+	VkQueue transferQueue{ VK_NULL_HANDLE };
+	uint32_t transferQueueFamily{ 0 };
+
+	size_t bytesUploaded{ 0 };
+	uint32_t batchesSubmitted{ 0 };
+
+private:
+	struct Batch
+	{
+		VkCommandBuffer cmd{ VK_NULL_HANDLE };
+		UploadToken value{ 0 };
+		std::vector<AllocatedBuffer> dedicatedBuffers;
+	};
+
+	struct StagingRegion
+	{
+		size_t offset;
+		size_t size;
+		bool graphics; // released by graphicsTimeline rather than uploadTimeline
+		uint64_t value;
+	};
+
+	struct PendingAcquire
+	{
+		UploadToken value;
+		VkBufferMemoryBarrier2 bufferBarrier;
+		VkImageMemoryBarrier2 imageBarrier;
+		bool isImage;
+		bool ownershipTransfer;
+		bool generateMips;
+		VkExtent2D extent;
+		uint32_t layerCount;
+	};
+
+	struct PendingCopy
+	{
+		VkBuffer src;
+		VkBuffer dst;
+		VkBufferCopy region;
+	};
+
+	struct DedicatedRelease
+	{
+		AllocatedBuffer buffer;
+		uint64_t graphicsValue;
+	};
+
+	Batch& GetOpenBatch();
+	void RetireBatches();
+	void RetireRegions();
+
+	// returns the staging buffer and offset the data was written to, falls back to a dedicated buffer when the ring can't fit it
+	VkBuffer Stage(const void* data, size_t size, bool graphics, size_t& outOffset);
+	bool TryAllocate(size_t size, size_t& outOffset);
+	bool IsRegionComplete(const StagingRegion& region);
+	// graphicsTimeline value of the submit that will contain a graphics side copy staged now
+	uint64_t CopySubmitValue() const;
+
+	VulkanEngine* engine{ nullptr };
+	uint32_t graphicsQueueFamily{ 0 };
+
+	VkCommandPool commandPool{ VK_NULL_HANDLE };
+
+	AllocatedBuffer stagingBuffer;
+	uint8_t* stagingData{ nullptr };
+	size_t stagingCapacity{ 0 };
+	size_t stagingAlignment{ 16 };
+	size_t head{ 0 };
+	std::deque<StagingRegion> stagingRegions;
+
+	std::optional<Batch> openBatch;
+	std::deque<Batch> inFlightBatches;
+	std::vector<Batch> freeBatches;
+
+	UploadToken nextValue{ 1 };
+	UploadToken lastSubmittedValue{ 0 };
+	uint64_t graphicsValue{ 0 }; // last value handed to a frame submit
+	uint64_t recordedGraphicsValue{ 0 }; // value of the frame whose graphics work is recorded, ahead of graphicsValue until it is submitted
+	UploadToken graphicsWaitValue{ 0 };
+
+	std::vector<PendingAcquire> pendingAcquires;
+	std::vector<PendingCopy> pendingCopies;
+	std::vector<DedicatedRelease> graphicsDedicatedBuffers;
+};